@@ -0,0 +1,315 @@
+#include "ufb_drv.h"
+
+#include <linux/debugfs.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+
+/*
+ *  Per process accounting of framebuffer use.  Anyone can mmap or write
+ *  /dev/fbN, so to find out who is generating the update traffic each
+ *  operation is charged to the process doing it.  Records are keyed by
+ *  tgid and outlive the process's open file, so short lived clients still
+ *  show up;  past UFB_MAX_CLIENTS the least recently active closed record
+ *  is recycled.
+ *
+ *  Updated from fbcon with interrupts off, hence the irqsave spinlock and
+ *  atomic allocations.
+ */
+struct ufb_client {
+	struct list_head list;
+	pid_t pid;
+	char comm[TASK_COMM_LEN];
+	unsigned int opens;
+	int reported;
+
+	u32 pans;
+	u32 vsync_waits;
+	u32 mmaps;
+	u64 write_bytes;
+	u64 damage;
+	u64 last_active;
+};
+
+/* <debugfs>/ufb, NULL without debugfs */
+struct dentry *ufb_debugfs_root;
+
+static struct ufb_client *ufb_client_evict(struct ufb_dev *dev)
+{
+	struct ufb_client *client, *victim = NULL;
+
+	list_for_each_entry(client, &dev->clients, list) {
+		if (client->opens)
+			continue;
+		if (!victim || client->last_active < victim->last_active)
+			victim = client;
+	}
+
+	if (victim) {
+		list_del(&victim->list);
+		memset(victim, 0, sizeof(*victim));
+	}
+
+	return victim;
+}
+
+/* called with client_lock held */
+static struct ufb_client *ufb_client_lookup(struct ufb_dev *dev)
+{
+	struct ufb_client *client;
+	pid_t pid = current->mm ? current->tgid : 0;
+
+	list_for_each_entry(client, &dev->clients, list) {
+		if (client->pid == pid)
+			return client;
+	}
+
+	if (dev->client_count < UFB_MAX_CLIENTS) {
+		client = kzalloc(sizeof(*client), GFP_ATOMIC);
+		if (!client)
+			return NULL;
+		dev->client_count++;
+	} else {
+		client = ufb_client_evict(dev);
+		if (!client)
+			return NULL;
+	}
+
+	client->pid = pid;
+	if (pid)
+		get_task_comm(client->comm, current->group_leader);
+	else
+		strcpy(client->comm, "[kernel]");
+
+	list_add(&client->list, &dev->clients);
+
+	return client;
+}
+
+static struct ufb_client *ufb_client_get(struct ufb_dev *dev,
+                                         unsigned long *flags)
+{
+	struct ufb_client *client;
+
+	spin_lock_irqsave(&dev->client_lock, *flags);
+
+	client = ufb_client_lookup(dev);
+	if (client) {
+		client->last_active = ktime_to_ns(ktime_get());
+		client->reported = 0;
+	}
+
+	return client;
+}
+
+static void ufb_client_put(struct ufb_dev *dev, unsigned long flags)
+{
+	spin_unlock_irqrestore(&dev->client_lock, flags);
+}
+
+void ufb_client_open(struct ufb_dev *dev)
+{
+	struct ufb_client *client;
+	unsigned long flags;
+
+	client = ufb_client_get(dev, &flags);
+	if (client)
+		client->opens++;
+	ufb_client_put(dev, flags);
+}
+
+void ufb_client_release(struct ufb_dev *dev)
+{
+	struct ufb_client *client;
+	unsigned long flags;
+
+	client = ufb_client_get(dev, &flags);
+	if (client && client->opens)
+		client->opens--;
+	ufb_client_put(dev, flags);
+}
+
+void ufb_client_write(struct ufb_dev *dev, size_t bytes, u32 pixels)
+{
+	struct ufb_client *client;
+	unsigned long flags;
+
+	client = ufb_client_get(dev, &flags);
+	if (client) {
+		client->write_bytes += bytes;
+		client->damage += pixels;
+	}
+	ufb_client_put(dev, flags);
+}
+
+void ufb_client_damage(struct ufb_dev *dev, u32 pixels)
+{
+	struct ufb_client *client;
+	unsigned long flags;
+
+	client = ufb_client_get(dev, &flags);
+	if (client)
+		client->damage += pixels;
+	ufb_client_put(dev, flags);
+}
+
+void ufb_client_pan(struct ufb_dev *dev)
+{
+	struct ufb_client *client;
+	unsigned long flags;
+
+	client = ufb_client_get(dev, &flags);
+	if (client)
+		client->pans++;
+	ufb_client_put(dev, flags);
+}
+
+void ufb_client_vsync_wait(struct ufb_dev *dev)
+{
+	struct ufb_client *client;
+	unsigned long flags;
+
+	client = ufb_client_get(dev, &flags);
+	if (client)
+		client->vsync_waits++;
+	ufb_client_put(dev, flags);
+}
+
+void ufb_client_mmap(struct ufb_dev *dev)
+{
+	struct ufb_client *client;
+	unsigned long flags;
+
+	client = ufb_client_get(dev, &flags);
+	if (client)
+		client->mmaps++;
+	ufb_client_put(dev, flags);
+}
+
+/*
+ *  Called at each daemon vblank.  Sends one UFB_EV_CLIENT per process
+ *  that was active since the last report, if reports are on and due.
+ */
+void ufb_client_report(struct ufb_dev *dev)
+{
+	struct ufb_client *client;
+	struct ufb_event event;
+	unsigned long flags;
+	u32 interval = ACCESS_ONCE(dev->client_event_interval);
+	u64 now;
+
+	if (!interval)
+		return;
+
+	now = ktime_to_ns(ktime_get());
+	if (now - dev->client_event_last < (u64)interval * NSEC_PER_MSEC)
+		return;
+	dev->client_event_last = now;
+
+	memset(&event, 0, sizeof(event));
+	event.type = UFB_EV_CLIENT;
+
+	spin_lock_irqsave(&dev->client_lock, flags);
+
+	list_for_each_entry(client, &dev->clients, list) {
+		if (client->reported)
+			continue;
+		client->reported = 1;
+
+		event.u.client.pid = client->pid;
+		event.u.client.pans = client->pans;
+		event.u.client.vsync_waits = client->vsync_waits;
+		event.u.client.mmaps = client->mmaps;
+		event.u.client.write_bytes = client->write_bytes;
+		event.u.client.damage = client->damage;
+		memcpy(event.u.client.comm, client->comm,
+		       sizeof(event.u.client.comm));
+
+		ufb_queue_event(dev, &event);
+	}
+
+	spin_unlock_irqrestore(&dev->client_lock, flags);
+}
+
+static int ufb_client_show(struct seq_file *m, void *unused)
+{
+	struct ufb_dev *dev = m->private;
+	struct ufb_client *client;
+	unsigned long flags;
+	u64 now = ktime_to_ns(ktime_get());
+
+	seq_printf(m, "%7s %-16s %5s %12s %12s %8s %8s %6s %10s\n",
+	           "pid", "comm", "open", "write_bytes", "damage", "pans",
+	           "vsyncs", "mmaps", "idle_ms");
+
+	spin_lock_irqsave(&dev->client_lock, flags);
+
+	list_for_each_entry(client, &dev->clients, list) {
+		seq_printf(m, "%7d %-16s %5u %12llu %12llu %8u %8u %6u %10llu\n",
+		           client->pid, client->comm, client->opens,
+		           client->write_bytes, client->damage, client->pans,
+		           client->vsync_waits, client->mmaps,
+		           div_u64(now - client->last_active, NSEC_PER_MSEC));
+	}
+
+	spin_unlock_irqrestore(&dev->client_lock, flags);
+
+	return 0;
+}
+
+static int ufb_client_debugfs_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ufb_client_show, inode->i_private);
+}
+
+static const struct file_operations ufb_client_fops = {
+	.owner   = THIS_MODULE,
+	.open    = ufb_client_debugfs_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+/* adds <debugfs>/ufb/fbN_clients once the framebuffer is registered */
+void ufb_client_debugfs_add(struct ufb_dev *dev)
+{
+	char name[32];
+
+	if (!ufb_debugfs_root || !dev->fb_info)
+		return;
+
+	snprintf(name, sizeof(name), "fb%d_clients", dev->fb_info->node);
+	dev->client_debugfs = debugfs_create_file(name, 0444, ufb_debugfs_root,
+	                                          dev, &ufb_client_fops);
+}
+
+void ufb_client_cleanup(struct ufb_dev *dev)
+{
+	struct ufb_client *client, *tmp;
+
+	debugfs_remove(dev->client_debugfs);
+	dev->client_debugfs = NULL;
+
+	list_for_each_entry_safe(client, tmp, &dev->clients, list) {
+		list_del(&client->list);
+		kfree(client);
+	}
+	dev->client_count = 0;
+}
+
+void ufb_client_init(void)
+{
+	/* accounting works without debugfs, there's just nowhere to look */
+	ufb_debugfs_root = debugfs_create_dir("ufb", NULL);
+	if (IS_ERR(ufb_debugfs_root))
+		ufb_debugfs_root = NULL;
+}
+
+void ufb_client_exit(void)
+{
+	debugfs_remove_recursive(ufb_debugfs_root);
+	ufb_debugfs_root = NULL;
+}
@@ -0,0 +1,60 @@
+#include "ufb_drv.h"
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+
+/*
+ *  The colormap as the daemon needs it to present pixels.  Entries are
+ *  kept as userspace set them (after the grayscale conversion), the
+ *  layout fields say how pixels index them.  The daemon is told with a
+ *  UFB_EV_CMAP once per FBIOPUTCMAP or mode change and fetches the whole
+ *  thing, which is small, rather than tracking ranges.
+ */
+void ufb_cmap_set_entry(struct ufb_dev *dev, u32 regno, u16 red, u16 green,
+                        u16 blue)
+{
+	unsigned long flags;
+
+	if (regno >= ARRAY_SIZE(dev->cmap.red))
+		return;
+
+	spin_lock_irqsave(&dev->cmap_lock, flags);
+	dev->cmap.red[regno] = red;
+	dev->cmap.green[regno] = green;
+	dev->cmap.blue[regno] = blue;
+	spin_unlock_irqrestore(&dev->cmap_lock, flags);
+}
+
+void ufb_cmap_changed(struct ufb_dev *dev, struct fb_info *info)
+{
+	struct ufb_event event;
+	unsigned long flags;
+
+	memset(&event, 0, sizeof(event));
+	event.type = UFB_EV_CMAP;
+
+	spin_lock_irqsave(&dev->cmap_lock, flags);
+
+	dev->cmap.seq++;
+	dev->cmap.visual = info->fix.visual;
+	dev->cmap.grayscale = info->var.grayscale;
+	dev->cmap.bits_per_pixel = info->var.bits_per_pixel;
+	dev->cmap.red_offset = info->var.red.offset;
+	dev->cmap.red_length = info->var.red.length;
+	dev->cmap.green_offset = info->var.green.offset;
+	dev->cmap.green_length = info->var.green.length;
+	dev->cmap.blue_offset = info->var.blue.offset;
+	dev->cmap.blue_length = info->var.blue.length;
+	event.u.cmap.seq = dev->cmap.seq;
+
+	spin_unlock_irqrestore(&dev->cmap_lock, flags);
+
+	ufb_queue_event(dev, &event);
+}
+
+void ufb_cmap_get(struct ufb_dev *dev, struct ufb_cmap *cmap)
+{
+	spin_lock_irq(&dev->cmap_lock);
+	*cmap = dev->cmap;
+	spin_unlock_irq(&dev->cmap_lock);
+}
@@ -0,0 +1,175 @@
+#include "ufb_drv.h"
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+
+/*
+ *  Hardware style cursor.  Without fb_cursor fbcon draws its cursor into
+ *  vmem with soft_cursor(), so every blink rewrites a character cell.  When
+ *  the daemon asks for it we keep the cursor as a separate plane instead
+ *  and just tell the daemon what changed;  it composites the plane when
+ *  presenting.  Returning an error from fb_cursor makes fbcon fall back to
+ *  soft_cursor(), which is what happens while the daemon hasn't opted in
+ *  or for cursors we can't represent.
+ */
+struct ufb_cursor {
+	int enable;
+	int x;
+	int y;
+	u32 hot_x;
+	u32 hot_y;
+	u32 width;
+	u32 height;
+	u32 image_seq;
+	u32 image[UFB_CURSOR_MAX * UFB_CURSOR_MAX];
+	u32 scratch[UFB_CURSOR_MAX * UFB_CURSOR_MAX];
+};
+
+/* called with cursor_lock held, renders into cursor->scratch */
+static void ufb_cursor_render(struct ufb_cursor *cursor, struct fb_info *info,
+                              const struct fb_cursor *fbc)
+{
+	const struct fb_image *image = &fbc->image;
+	u32 pitch = (image->width + 7) / 8;
+	u32 fg = ufb_fb_pixel(info, image->fg_color);
+	u32 bg = ufb_fb_pixel(info, image->bg_color);
+	u32 x, y;
+
+	for (y = 0; y < image->height; y++) {
+		for (x = 0; x < image->width; x++) {
+			u32 i = y * pitch + x / 8;
+			u8 bits = image->data[i];
+
+			/* same combination soft_cursor() would blit */
+			if (fbc->enable && fbc->mask) {
+				if (fbc->rop == ROP_XOR)
+					bits ^= fbc->mask[i];
+				else
+					bits &= fbc->mask[i];
+			}
+
+			cursor->scratch[y * image->width + x] =
+			    (bits & (0x80 >> (x & 7))) ? fg : bg;
+		}
+	}
+}
+
+int ufb_cursor_set(struct ufb_dev *dev, struct fb_info *info,
+                   const struct fb_cursor *fbc)
+{
+	struct ufb_cursor *cursor = dev->cursor;
+	struct ufb_event event;
+	unsigned long flags;
+	u32 size;
+
+	if (!cursor || !ACCESS_ONCE(dev->cursor_plane))
+		return -ENXIO;
+
+	if (fbc->image.width > UFB_CURSOR_MAX ||
+	    fbc->image.height > UFB_CURSOR_MAX ||
+	    fbc->image.depth != 1 || !fbc->image.data)
+		return -EINVAL;
+
+	spin_lock_irqsave(&dev->cursor_lock, flags);
+
+	cursor->enable = fbc->enable;
+	cursor->x = fbc->image.dx;
+	cursor->y = fbc->image.dy;
+	cursor->hot_x = fbc->hot.x;
+	cursor->hot_y = fbc->hot.y;
+
+	/* fbcon hands over the whole cursor each time, set only says what changed */
+	if (fbc->set & (FB_CUR_SETIMAGE | FB_CUR_SETSHAPE | FB_CUR_SETCMAP |
+	                FB_CUR_SETSIZE) ||
+	    fbc->image.width != cursor->width ||
+	    fbc->image.height != cursor->height) {
+		size = fbc->image.width * fbc->image.height * sizeof(u32);
+
+		ufb_cursor_render(cursor, info, fbc);
+
+		if (fbc->image.width != cursor->width ||
+		    fbc->image.height != cursor->height ||
+		    memcmp(cursor->image, cursor->scratch, size)) {
+			memcpy(cursor->image, cursor->scratch, size);
+			cursor->width = fbc->image.width;
+			cursor->height = fbc->image.height;
+			cursor->image_seq++;
+		}
+	}
+
+	memset(&event, 0, sizeof(event));
+	event.type = UFB_EV_CURSOR;
+	event.u.cursor.enable = cursor->enable;
+	event.u.cursor.x = cursor->x;
+	event.u.cursor.y = cursor->y;
+	event.u.cursor.hot_x = cursor->hot_x;
+	event.u.cursor.hot_y = cursor->hot_y;
+	event.u.cursor.width = cursor->width;
+	event.u.cursor.height = cursor->height;
+	event.u.cursor.image_seq = cursor->image_seq;
+
+	spin_unlock_irqrestore(&dev->cursor_lock, flags);
+
+	ufb_queue_event(dev, &event);
+
+	return 0;
+}
+
+int ufb_cursor_plane(struct ufb_dev *dev, u32 enable)
+{
+	struct ufb_cursor *cursor;
+
+	if (enable && !dev->cursor) {
+		cursor = kzalloc(sizeof(*cursor), GFP_KERNEL);
+		if (!cursor)
+			return -ENOMEM;
+
+		spin_lock_irq(&dev->cursor_lock);
+		dev->cursor = cursor;
+		spin_unlock_irq(&dev->cursor_lock);
+	}
+
+	dev->cursor_plane = !!enable;
+
+	return 0;
+}
+
+int ufb_cursor_get_image(struct ufb_dev *dev, struct ufb_cursor_image *req)
+{
+	struct ufb_cursor *cursor = dev->cursor;
+	u32 *image;
+	u32 size;
+	int err = 0;
+
+	if (!cursor)
+		return -ENXIO;
+
+	image = kmalloc(sizeof(cursor->image), GFP_KERNEL);
+	if (!image)
+		return -ENOMEM;
+
+	spin_lock_irq(&dev->cursor_lock);
+	req->width = cursor->width;
+	req->height = cursor->height;
+	req->image_seq = cursor->image_seq;
+	size = cursor->width * cursor->height * sizeof(u32);
+	memcpy(image, cursor->image, size);
+	spin_unlock_irq(&dev->cursor_lock);
+
+	if (req->len < size)
+		err = -ENOSPC;
+	else if (copy_to_user((void __user *)(unsigned long)req->buf, image, size))
+		err = -EFAULT;
+
+	kfree(image);
+
+	return err;
+}
+
+void ufb_cursor_free(struct ufb_dev *dev)
+{
+	dev->cursor_plane = 0;
+	kfree(dev->cursor);
+	dev->cursor = NULL;
+}
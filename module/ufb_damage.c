@@ -0,0 +1,212 @@
+#include "ufb_drv.h"
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+
+/*
+ *  Damage rectangles waiting for the daemon.  Each one added is merged
+ *  into whichever pending rectangle it wastes least area joining, if
+ *  that's none (they overlap or abut) or there's no room left, so the
+ *  list stays short and the daemon uploads little it doesn't need to.
+ *
+ *  The first addition after GET_DAMAGE takes the list queues a
+ *  UFB_EV_DAMAGE with its bounds;  the rest join the list quietly, so
+ *  a write() per row doesn't flood the event queue.
+ */
+
+static u64 ufb_damage_area(const struct ufb_damage_rect *r)
+{
+	return (u64)r->width * r->height;
+}
+
+static void ufb_damage_union(struct ufb_damage_rect *a,
+                             const struct ufb_damage_rect *b)
+{
+	u32 x2 = max(a->x + a->width, b->x + b->width);
+	u32 y2 = max(a->y + a->height, b->y + b->height);
+
+	a->x = min(a->x, b->x);
+	a->y = min(a->y, b->y);
+	a->width = x2 - a->x;
+	a->height = y2 - a->y;
+}
+
+/* area a would cover beyond a and b by taking b in;  negative if they overlap */
+static s64 ufb_damage_waste(const struct ufb_damage_rect *a,
+                            const struct ufb_damage_rect *b)
+{
+	struct ufb_damage_rect u = *a;
+
+	ufb_damage_union(&u, b);
+
+	return (s64)ufb_damage_area(&u) - ufb_damage_area(a) -
+	       ufb_damage_area(b);
+}
+
+/* called with damage_lock held */
+static void ufb_damage_merge(struct ufb_dev *dev,
+                             const struct ufb_damage_rect *r)
+{
+	s64 best_waste = S64_MAX;
+	int best = -1;
+	int i;
+
+	for (i = 0; i < dev->damage_count; i++) {
+		s64 waste = ufb_damage_waste(&dev->damage[i], r);
+
+		if (waste < best_waste) {
+			best_waste = waste;
+			best = i;
+		}
+	}
+
+	if (best >= 0 &&
+	    (best_waste <= 0 || dev->damage_count == UFB_DAMAGE_RECTS)) {
+		ufb_damage_union(&dev->damage[best], r);
+		return;
+	}
+
+	dev->damage[dev->damage_count++] = *r;
+}
+
+/* to within xres by yres;  returns 0 if nothing's left */
+static int ufb_damage_clip(struct ufb_damage_rect *r, u32 xres, u32 yres)
+{
+	if (r->x >= xres || r->y >= yres || !r->width || !r->height)
+		return 0;
+
+	r->width = min(r->width, xres - r->x);
+	r->height = min(r->height, yres - r->y);
+
+	return 1;
+}
+
+/*
+ *  Adds count rectangles, clipped to xres by yres, and tells the daemon.
+ *  Returns the pixels they cover, overlaps counted twice.
+ */
+u64 ufb_damage_add(struct ufb_dev *dev, struct ufb_damage_rect *rects,
+                   u32 count, u32 xres, u32 yres)
+{
+	struct ufb_damage_rect bounds;
+	struct ufb_event event;
+	unsigned long flags;
+	u64 pixels = 0;
+	int found = 0;
+	int notify;
+	u32 i;
+
+	spin_lock_irqsave(&dev->damage_lock, flags);
+
+	for (i = 0; i < count; i++) {
+		if (!ufb_damage_clip(&rects[i], xres, yres))
+			continue;
+
+		ufb_damage_merge(dev, &rects[i]);
+		pixels += ufb_damage_area(&rects[i]);
+
+		if (found++)
+			ufb_damage_union(&bounds, &rects[i]);
+		else
+			bounds = rects[i];
+	}
+
+	notify = found && !dev->damage_notified;
+	if (notify)
+		dev->damage_notified = 1;
+
+	spin_unlock_irqrestore(&dev->damage_lock, flags);
+
+	if (!notify)
+		return pixels;
+
+	memset(&event, 0, sizeof(event));
+	event.type = UFB_EV_DAMAGE;
+	event.u.damage.x = bounds.x;
+	event.u.damage.y = bounds.y;
+	event.u.damage.width = bounds.width;
+	event.u.damage.height = bounds.height;
+	ufb_queue_event(dev, &event);
+
+	return pixels;
+}
+
+void ufb_damage_take(struct ufb_dev *dev, struct ufb_damage *damage)
+{
+	memset(damage, 0, sizeof(*damage));
+
+	spin_lock_irq(&dev->damage_lock);
+	damage->count = dev->damage_count;
+	memcpy(damage->rects, dev->damage,
+	       dev->damage_count * sizeof(dev->damage[0]));
+	dev->damage_count = 0;
+	dev->damage_notified = 0;
+	spin_unlock_irq(&dev->damage_lock);
+}
+
+/* a new daemon knows of no damage, so the next has to be announced */
+void ufb_damage_reset(struct ufb_dev *dev)
+{
+	spin_lock_irq(&dev->damage_lock);
+	dev->damage_count = 0;
+	dev->damage_notified = 0;
+	spin_unlock_irq(&dev->damage_lock);
+}
+
+/*
+ *  UFB_FBIO_DAMAGE, with info locked.  The pan goes first, so a daemon
+ *  taking this damage finds the new scanout with it;  fb_pan_display()
+ *  checks the offsets like any other pan.
+ */
+int ufb_damage_ioctl(struct fb_info *info, struct ufb_fb_damage __user *arg)
+{
+	struct ufb_dev *dev = info->par;
+	struct ufb_damage_rect *rects = NULL;
+	struct ufb_fb_damage req;
+	u64 pixels;
+	int err = 0;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+
+	if (req.count > UFB_FB_DAMAGE_MAX_RECTS ||
+	    (req.flags & ~UFB_FB_DAMAGE_PAN))
+		return -EINVAL;
+
+	if (req.count) {
+		rects = kmalloc_array(req.count, sizeof(*rects), GFP_KERNEL);
+		if (!rects)
+			return -ENOMEM;
+
+		if (copy_from_user(rects, (void __user *)(unsigned long)req.rects,
+		                   req.count * sizeof(*rects))) {
+			err = -EFAULT;
+			goto out;
+		}
+	}
+
+	ufb_vmem_track(dev);
+
+	if (req.flags & UFB_FB_DAMAGE_PAN) {
+		struct fb_var_screeninfo var = info->var;
+
+		var.xoffset = req.xoffset;
+		var.yoffset = req.yoffset;
+		var.vmode = (var.vmode & ~FB_VMODE_YWRAP) |
+		            (req.vmode & FB_VMODE_YWRAP);
+
+		err = fb_pan_display(info, &var);
+		if (err)
+			goto out;
+	}
+
+	pixels = ufb_damage_add(dev, rects, req.count, info->var.xres_virtual,
+	                        info->var.yres_virtual);
+	ufb_client_damage(dev, min_t(u64, pixels, U32_MAX));
+
+out:
+	kfree(rects);
+	return err;
+}
@@ -4,9 +4,14 @@
 #include <linux/fs.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/numa.h>
+#include <linux/poll.h>
+#include <linux/ratelimit.h>
+#include <linux/sched.h>
 #include <linux/slab.h>
 
 #define DRIVER_AUTHOR "Tristan Miller"
@@ -16,6 +21,11 @@
 
 static int ufb_device_open(struct inode *inode, struct file *file);
 static int ufb_device_release(struct inode *inode, struct file *file);
+static ssize_t ufb_device_read(struct file *file, char __user *buf,
+                               size_t count, loff_t *ppos);
+static ssize_t ufb_device_write(struct file *file, const char __user *buf,
+                                size_t count, loff_t *ppos);
+static unsigned int ufb_device_poll(struct file *file, poll_table *wait);
 static long ufb_device_unlocked_ioctl(struct file *file, unsigned int cmd, 
                                       unsigned long arg);
 static int ufb_device_mmap(struct file *filp, struct vm_area_struct *vma);
@@ -26,82 +36,192 @@ static struct file_operations ufb_device_operations = {
 	.open = ufb_device_open,
 	.release = ufb_device_release,
 
+	.read = ufb_device_read,
+	.write = ufb_device_write,
+	.poll = ufb_device_poll,
 	.unlocked_ioctl = ufb_device_unlocked_ioctl,
 	.mmap = ufb_device_mmap,
 };
 
+static void _ufb_soft_vblank(unsigned long data);
+
 static struct miscdevice ufb_miscdevice = {
 	.minor = MISC_DYNAMIC_MINOR,
 	.name  = DEVICE_NAME,
 	.fops = &ufb_device_operations,
 };
 
-static int ufb_device_open(struct inode *inode, struct file *file)
+/* a fresh instance with no vmem or framebuffer yet */
+struct ufb_dev *ufb_dev_alloc(void)
 {
 	struct ufb_dev *dev;
-	int err = 0;
-
-	printk(KERN_INFO "ufb:  ufb_device_open( inode=%p, file=%p )\n", inode, file );
 
 	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
 	if( !dev ) {
-		err = -ENOMEM;
-		goto out;
+		return NULL;
 	}
 
+	kref_init(&dev->ref);
+
 	dev->dev = ufb_miscdevice.this_device;
+	dev->node = NUMA_NO_NODE;
+
+	mutex_init(&dev->setup_lock);
+
+	spin_lock_init(&dev->pages_lock);
+	spin_lock_init(&dev->scanout_lock);
+	mutex_init(&dev->mappings_lock);
+	INIT_LIST_HEAD(&dev->mappings);
+	atomic_set(&dev->faults, 0);
+	init_waitqueue_head(&dev->fault_wait);
+	init_rwsem(&dev->resize_sem);
 
 	init_waitqueue_head(&dev->vblank_wait);
+	setup_timer(&dev->vblank_timer, _ufb_soft_vblank, (unsigned long)dev);
 
-	file->private_data = dev;
+	spin_lock_init(&dev->event_lock);
+	init_waitqueue_head(&dev->event_wait);
 
-out:
-	return err;
+	spin_lock_init(&dev->trace_lock);
+	mutex_init(&dev->trace_mutex);
+
+	spin_lock_init(&dev->client_lock);
+	INIT_LIST_HEAD(&dev->clients);
+
+	spin_lock_init(&dev->cursor_lock);
+
+	spin_lock_init(&dev->damage_lock);
+
+	spin_lock_init(&dev->present_lock);
+	init_waitqueue_head(&dev->present_wait);
+
+	mutex_init(&dev->snapshot_lock);
+
+	ufb_reclaim_dev_init(dev);
+
+	spin_lock_init(&dev->cmap_lock);
+
+	INIT_LIST_HEAD(&dev->instance);
+
+	/* last, so nobody finds it half made */
+	if( ufb_instance_register(dev) ) {
+		kfree(dev);
+		return NULL;
+	}
+
+	return dev;
 }
 
-static int ufb_device_release(struct inode *inode, struct file *file)
+/* unregisters the framebuffer and frees vmem;  mappings keep dev itself */
+void ufb_dev_teardown(struct ufb_dev *dev)
 {
-	struct ufb_dev *dev;
-	int i;
+	mutex_lock(&dev->setup_lock);
+	dev->dead = 1;
 
-	printk(KERN_INFO "ufb:  ufb_device_release( inode=%p, file=%p )\n", inode, file );
+	ufb_reclaim_free(dev);
 
-	dev = file->private_data;
+	ufb_trace_stop(dev);
 
 	ufb_fb_deinit(dev);
 
-	/* unreserve the pages */
-	for (i = 0; i < dev->vmem_size; i+= PAGE_SIZE) {
-		ClearPageReserved(vmalloc_to_page((void *)(((unsigned long)dev->vmem) + i)));
+	ufb_client_cleanup(dev);
+
+	ufb_cursor_free(dev);
+
+	dev->soft_vblank = 0;
+	del_timer_sync(&dev->vblank_timer);
+
+	ufb_vmem_free(dev);
+
+	mutex_unlock(&dev->setup_lock);
+}
+
+/*
+ * The instance file's operations go to:  its own, or the one it ATTACHed
+ * to.  Both are held until the file is released, so no reference is
+ * needed meanwhile.
+ */
+static struct ufb_dev *ufb_file_dev(struct file *file)
+{
+	struct ufb_dev *dev = file->private_data;
+	struct ufb_dev *attached = ACCESS_ONCE(dev->attached);
+
+	if (attached) {
+		smp_read_barrier_depends();
+		return attached;
 	}
 
-	vfree(dev->vmem);
+	return dev;
+}
 
-	kfree(dev);
+/*
+ * For setting up or resizing vmem and the framebuffer.  Fails if dev was
+ * torn down meanwhile, by an ATTACH on another thread.
+ */
+static int ufb_setup_lock(struct ufb_dev *dev)
+{
+	mutex_lock(&dev->setup_lock);
+
+	if (dev->dead) {
+		mutex_unlock(&dev->setup_lock);
+		return -ENODEV;
+	}
 
 	return 0;
 }
 
-static int _ufb_alloc_vmem(struct ufb_dev *dev, size_t vmem_size)
+static int ufb_device_open(struct inode *inode, struct file *file)
 {
-	int err = 0;
-	int i;
-
-	dev->vmem_size = vmem_size;
+	struct ufb_dev *dev;
 
-	if ((dev->vmem = (int *)vmalloc(dev->vmem_size)) == NULL) {
-		err = -ENOMEM;
-		goto out;
+	dev = ufb_dev_alloc();
+	if( !dev ) {
+		return -ENOMEM;
 	}
 
-	memset(dev->vmem, 0, dev->vmem_size);
+	pr_debug("ufb%d:  ufb_device_open( inode=%p, file=%p )\n",
+	         dev->id, inode, file );
+
+	file->private_data = dev;
+
+	return 0;
+}
+
+/* persistent instances stay as they are for the next daemon to attach */
+static int ufb_device_release(struct inode *inode, struct file *file)
+{
+	struct ufb_dev *own = file->private_data;
+	struct ufb_dev *dev = ufb_file_dev(file);
+
+	pr_debug("ufb%d:  ufb_device_release( inode=%p, file=%p )\n",
+	         dev->id, inode, file );
 
-	for (i = 0; i < dev->vmem_size; i+= PAGE_SIZE) {
-		SetPageReserved(vmalloc_to_page((void *)(((unsigned long)dev->vmem) + i)));
+	if( !ufb_instance_detach(dev) ) {
+		ufb_dev_teardown(dev);
 	}
 
-out:
-	return err;
+	/* the one it came with was torn down at ATTACH */
+	if( dev != own ) {
+		ufb_dev_put(own);
+	}
+
+	ufb_dev_put(dev);
+
+	return 0;
+}
+
+static void _ufb_dev_free(struct kref *ref)
+{
+	struct ufb_dev *dev = container_of(ref, struct ufb_dev, ref);
+
+	cancel_delayed_work_sync(&dev->reclaim_work);
+	ufb_instance_unregister(dev);
+	kfree(dev);
+}
+
+void ufb_dev_put(struct ufb_dev *dev)
+{
+	kref_put(&dev->ref, _ufb_dev_free);
 }
 
 static int _ufb_signal_vblank(struct ufb_dev *dev)
@@ -113,6 +233,160 @@ static int _ufb_signal_vblank(struct ufb_dev *dev)
 	return 0;
 }
 
+static void _ufb_soft_vblank(unsigned long data)
+{
+	struct ufb_dev *dev = (struct ufb_dev *)data;
+
+	/* nothing is being shown, but client frames move on */
+	ufb_present_vblank(dev, UFB_PRESENT_SKIPPED);
+
+	_ufb_signal_vblank(dev);
+
+	if (dev->soft_vblank) {
+		mod_timer(&dev->vblank_timer, jiffies + max(HZ / 60, 1));
+	}
+}
+
+void ufb_soft_vblank_start(struct ufb_dev *dev)
+{
+	if (!dev->soft_vblank) {
+		dev->soft_vblank = 1;
+		mod_timer(&dev->vblank_timer, jiffies + max(HZ / 60, 1));
+	}
+}
+
+void ufb_soft_vblank_stop(struct ufb_dev *dev)
+{
+	dev->soft_vblank = 0;
+	del_timer(&dev->vblank_timer);
+}
+
+/*
+ * Queue an event for the daemon.  May be called from atomic context (fbcon
+ * draws with interrupts off).  When the daemon falls behind the oldest
+ * event is dropped, so the latest state always gets through.
+ */
+void ufb_queue_event(struct ufb_dev *dev, struct ufb_event *event)
+{
+	unsigned long flags;
+
+	event->timestamp = ktime_to_ns(ktime_get());
+
+	spin_lock_irqsave(&dev->event_lock, flags);
+
+	if (dev->event_head - dev->event_tail == UFB_EVENT_QUEUE_LEN) {
+		dev->event_tail++;
+	}
+
+	dev->events[dev->event_head & (UFB_EVENT_QUEUE_LEN - 1)] = *event;
+	dev->event_head++;
+
+	spin_unlock_irqrestore(&dev->event_lock, flags);
+
+	wake_up_interruptible(&dev->event_wait);
+}
+
+static int _ufb_dequeue_event(struct ufb_dev *dev, struct ufb_event *event)
+{
+	unsigned long flags;
+	int found = 0;
+
+	spin_lock_irqsave(&dev->event_lock, flags);
+
+	if (dev->event_head != dev->event_tail) {
+		*event = dev->events[dev->event_tail & (UFB_EVENT_QUEUE_LEN - 1)];
+		dev->event_tail++;
+		found = 1;
+	}
+
+	spin_unlock_irqrestore(&dev->event_lock, flags);
+
+	return found;
+}
+
+static int _ufb_event_pending(struct ufb_dev *dev)
+{
+	return ACCESS_ONCE(dev->event_head) != ACCESS_ONCE(dev->event_tail);
+}
+
+static ssize_t ufb_device_read(struct file *file, char __user *buf,
+                               size_t count, loff_t *ppos)
+{
+	struct ufb_dev *dev = ufb_file_dev(file);
+	struct ufb_event event;
+	ssize_t copied = 0;
+	int err;
+
+	if (count < sizeof(event)) {
+		return -EINVAL;
+	}
+
+	if (!(file->f_flags & O_NONBLOCK)) {
+		err = wait_event_interruptible(dev->event_wait,
+		                               _ufb_event_pending(dev));
+		if (err) {
+			return err;
+		}
+	}
+
+	while (count - copied >= sizeof(event) &&
+	       _ufb_dequeue_event(dev, &event)) {
+		if (copy_to_user(buf + copied, &event, sizeof(event))) {
+			return copied ? copied : -EFAULT;
+		}
+		copied += sizeof(event);
+	}
+
+	return copied ? copied : -EAGAIN;
+}
+
+/* the daemon presented a frame */
+static int _ufb_daemon_vblank(struct ufb_dev *dev)
+{
+	if (ufb_tracing(dev)) {
+		down_read(&dev->resize_sem);
+		ufb_trace_frame(dev);
+		up_read(&dev->resize_sem);
+	}
+
+	ufb_client_report(dev);
+	ufb_snapshot_vblank(dev);
+	ufb_present_vblank(dev, UFB_PRESENT_INEXACT);
+
+	return _ufb_signal_vblank(dev);
+}
+
+/*
+ * A write() of anything is the same as SIGNAL_VBLANK, so a daemon can
+ * queue it on an io_uring along with the rest of its per frame I/O.
+ */
+static ssize_t ufb_device_write(struct file *file, const char __user *buf,
+                                size_t count, loff_t *ppos)
+{
+	struct ufb_dev *dev = ufb_file_dev(file);
+	int err;
+
+	err = _ufb_daemon_vblank(dev);
+	if (err) {
+		return err;
+	}
+
+	return count;
+}
+
+static unsigned int ufb_device_poll(struct file *file, poll_table *wait)
+{
+	struct ufb_dev *dev = ufb_file_dev(file);
+
+	poll_wait(file, &dev->event_wait, wait);
+
+	if (_ufb_event_pending(dev)) {
+		return POLLIN | POLLRDNORM;
+	}
+
+	return 0;
+}
+
 static long ufb_device_unlocked_ioctl(struct file *file, unsigned int cmd, 
                                  unsigned long arg)
 {
@@ -121,37 +395,365 @@ static long ufb_device_unlocked_ioctl(struct file *file, unsigned int cmd,
 	int nr;
 
 	nr = _IOC_NR(cmd);
-	dev = file->private_data;
+	dev = ufb_file_dev(file);
 
 	err = -EINVAL;
 	switch(nr) {
-		case 0: {
+		case UFB_IOCTL_NR_ALLOC_VMEM: {
 			u32 new_vmem_size;
 
-			copy_from_user(&new_vmem_size, (void*)arg, sizeof(new_vmem_size));
+			if (copy_from_user(&new_vmem_size, (void*)arg, sizeof(new_vmem_size))) {
+				err = -EFAULT;
+				break;
+			}
+
+			pr_debug("ufb%d:  alloc_vmem:  0x%x\n", dev->id, new_vmem_size );
+
+			err = ufb_setup_lock(dev);
+			if (err) {
+				break;
+			}
+
+			err = ufb_vmem_alloc(dev, new_vmem_size, NUMA_NO_NODE);
+
+			mutex_unlock(&dev->setup_lock);
+		}
+		break;
+
+		case UFB_IOCTL_NR_ALLOC_VMEM_NODE: {
+			struct ufb_alloc_vmem req;
+
+			if (copy_from_user(&req, (void __user *)arg, sizeof(req))) {
+				err = -EFAULT;
+				break;
+			}
+
+			pr_debug("ufb%d:  alloc_vmem:  0x%x on node %d\n",
+			         dev->id, req.size, req.node );
+
+			err = ufb_setup_lock(dev);
+			if (err) {
+				break;
+			}
+
+			err = ufb_vmem_alloc(dev, req.size, req.node);
+			req.node = dev->node;
+
+			mutex_unlock(&dev->setup_lock);
 
-			printk(KERN_INFO "ufb:  alloc_vmem:  0x%x\n", new_vmem_size );
+			if (err) {
+				break;
+			}
 
-			dev->vmem_size = new_vmem_size;
+			if (copy_to_user((void __user *)arg, &req, sizeof(req))) {
+				err = -EFAULT;
+			}
+		}
+		break;
 
-			err = _ufb_alloc_vmem(dev, new_vmem_size);
+		case UFB_IOCTL_NR_GET_INFO: {
+			struct ufb_info info;
+
+			memset(&info, 0, sizeof(info));
+			info.id = dev->id;
+			info.fb_node = -1;
+
+			mutex_lock(&dev->setup_lock);
+			info.vmem_size = dev->vmem ? dev->vmem_size : 0;
+			info.node = dev->node;
+			info.vmem_capacity = ufb_vmem_capacity(dev);
+			if (dev->fb_info) {
+				info.flags |= UFB_INFO_FB;
+				info.fb_node = dev->fb_info->node;
+			}
+			if (dev->persistent) {
+				info.flags |= UFB_INFO_PERSISTENT;
+			}
+			if (dev->snapshot) {
+				info.flags |= UFB_INFO_SNAPSHOT;
+			}
+			mutex_unlock(&dev->setup_lock);
+
+			err = 0;
+			if (copy_to_user((void __user *)arg, &info, sizeof(info))) {
+				err = -EFAULT;
+			}
 		}
 		break;
 
-		case 1: {
-			printk(KERN_INFO "ufb:  create_fb\n");
+		case UFB_IOCTL_NR_CREATE_FB: {
+			pr_debug("ufb%d:  create_fb\n", dev->id);
+
+			err = ufb_setup_lock(dev);
+			if (err) {
+				break;
+			}
 
 			err = ufb_fb_init(dev);
+			if (!err) {
+				ufb_client_debugfs_add(dev);
+				ufb_reclaim_debugfs_add(dev);
+			}
+
+			mutex_unlock(&dev->setup_lock);
+		}
+		break;
+
+		case UFB_IOCTL_NR_SIGNAL_VBLANK: {
+			err = _ufb_daemon_vblank(dev);
+		}
+		break;
+
+		case UFB_IOCTL_NR_ALLOC_VMEM_MEMFD: {
+			struct ufb_memfd req;
+
+			if (copy_from_user(&req, (void __user *)arg, sizeof(req))) {
+				err = -EFAULT;
+				break;
+			}
+
+			pr_debug("ufb%d:  alloc_vmem_memfd:  fd=%d size=0x%x\n",
+			         dev->id, req.fd, req.size );
+
+			err = ufb_setup_lock(dev);
+			if (err) {
+				break;
+			}
+
+			err = ufb_vmem_alloc_memfd(dev, &req);
+
+			mutex_unlock(&dev->setup_lock);
+		}
+		break;
+
+		case UFB_IOCTL_NR_GET_SCANOUT: {
+			struct ufb_scanout scanout;
+
+			err = ufb_fb_get_scanout(dev, &scanout);
+			if (err) {
+				break;
+			}
+
+			if (copy_to_user((void __user *)arg, &scanout,
+			                 min_t(size_t, _IOC_SIZE(cmd), sizeof(scanout)))) {
+				err = -EFAULT;
+			}
+		}
+		break;
+
+		case UFB_IOCTL_NR_TRACE_START: {
+			u32 size;
+
+			if (copy_from_user(&size, (void __user *)arg, sizeof(size))) {
+				err = -EFAULT;
+				break;
+			}
+
+			err = ufb_setup_lock(dev);
+			if (err) {
+				break;
+			}
+
+			err = ufb_trace_start(dev, size);
+
+			mutex_unlock(&dev->setup_lock);
+		}
+		break;
+
+		case UFB_IOCTL_NR_TRACE_STOP: {
+			ufb_trace_stop(dev);
+			err = 0;
+		}
+		break;
+
+		case UFB_IOCTL_NR_TRACE_READ: {
+			struct ufb_trace_read req;
+
+			if (copy_from_user(&req, (void __user *)arg, sizeof(req))) {
+				err = -EFAULT;
+				break;
+			}
+
+			err = ufb_trace_read(dev, &req);
+			if (err < 0) {
+				break;
+			}
+
+			if (copy_to_user((void __user *)arg, &req, sizeof(req))) {
+				err = -EFAULT;
+			}
+		}
+		break;
+
+		case UFB_IOCTL_NR_CLIENT_EVENTS: {
+			u32 interval;
+
+			if (copy_from_user(&interval, (void __user *)arg, sizeof(interval))) {
+				err = -EFAULT;
+				break;
+			}
+
+			dev->client_event_interval = interval;
+			err = 0;
+		}
+		break;
+
+		case UFB_IOCTL_NR_CURSOR_PLANE: {
+			u32 enable;
+
+			if (copy_from_user(&enable, (void __user *)arg, sizeof(enable))) {
+				err = -EFAULT;
+				break;
+			}
+
+			err = ufb_setup_lock(dev);
+			if (err) {
+				break;
+			}
+
+			err = ufb_cursor_plane(dev, enable);
+
+			mutex_unlock(&dev->setup_lock);
+		}
+		break;
+
+		case UFB_IOCTL_NR_GET_CURSOR: {
+			struct ufb_cursor_image req;
+
+			if (copy_from_user(&req, (void __user *)arg, sizeof(req))) {
+				err = -EFAULT;
+				break;
+			}
+
+			/* the size goes back even when buf is too small for it */
+			err = ufb_cursor_get_image(dev, &req);
+			if (err && err != -ENOSPC) {
+				break;
+			}
+
+			if (copy_to_user((void __user *)arg, &req, sizeof(req))) {
+				err = -EFAULT;
+			}
+		}
+		break;
+
+		case UFB_IOCTL_NR_GET_CMAP: {
+			struct ufb_cmap *cmap;
+
+			cmap = kmalloc(sizeof(*cmap), GFP_KERNEL);
+			if (!cmap) {
+				err = -ENOMEM;
+				break;
+			}
+
+			ufb_cmap_get(dev, cmap);
+
+			err = 0;
+			if (copy_to_user((void __user *)arg, cmap, sizeof(*cmap))) {
+				err = -EFAULT;
+			}
+
+			kfree(cmap);
+		}
+		break;
+
+		case UFB_IOCTL_NR_SNAPSHOT: {
+			u32 enable;
+
+			if (copy_from_user(&enable, (void __user *)arg, sizeof(enable))) {
+				err = -EFAULT;
+				break;
+			}
+
+			err = ufb_setup_lock(dev);
+			if (err) {
+				break;
+			}
+
+			err = ufb_snapshot_enable(dev, enable);
+
+			mutex_unlock(&dev->setup_lock);
+		}
+		break;
+
+		case UFB_IOCTL_NR_PRESENT_LATCH: {
+			struct ufb_present req;
+
+			ufb_present_latch(dev, &req);
+
+			err = 0;
+			if (copy_to_user((void __user *)arg, &req, sizeof(req))) {
+				err = -EFAULT;
+			}
 		}
 		break;
 
-		case 2: {
-			err = _ufb_signal_vblank(dev);
+		case UFB_IOCTL_NR_PRESENT_ACK: {
+			struct ufb_present req;
+
+			if (copy_from_user(&req, (void __user *)arg, sizeof(req))) {
+				err = -EFAULT;
+				break;
+			}
+
+			ufb_present_ack(dev, &req);
+			err = 0;
+		}
+		break;
+
+		case UFB_IOCTL_NR_GET_DAMAGE: {
+			struct ufb_damage damage;
+
+			ufb_damage_take(dev, &damage);
+
+			err = 0;
+			if (copy_to_user((void __user *)arg, &damage, sizeof(damage))) {
+				err = -EFAULT;
+			}
+		}
+		break;
+
+		case UFB_IOCTL_NR_RESIZE: {
+			struct ufb_resize req;
+
+			if (copy_from_user(&req, (void __user *)arg, sizeof(req))) {
+				err = -EFAULT;
+				break;
+			}
+
+			pr_debug("ufb%d:  resize:  0x%x %ux%u %ubpp\n", dev->id,
+			         req.vmem_size, req.xres, req.yres, req.bits_per_pixel );
+
+			err = ufb_setup_lock(dev);
+			if (err) {
+				break;
+			}
+
+			err = ufb_vmem_resize(dev, &req);
+
+			mutex_unlock(&dev->setup_lock);
+		}
+		break;
+
+		case UFB_IOCTL_NR_ATTACH: {
+			struct ufb_attach req;
+
+			if (copy_from_user(&req, (void __user *)arg, sizeof(req))) {
+				err = -EFAULT;
+				break;
+			}
+
+			err = ufb_instance_attach(file->private_data, &req);
+		}
+		break;
+
+		case UFB_IOCTL_NR_DESTROY: {
+			err = ufb_instance_destroy(dev);
 		}
 		break;
 
 		default: {
-			printk(KERN_INFO "ufb:  unknown nr:  %d\n", nr);
+			printk_ratelimited(KERN_INFO "ufb:  unknown nr:  %d\n", nr);
 			err = -EINVAL;
 		}
 		break;
@@ -160,41 +762,17 @@ static long ufb_device_unlocked_ioctl(struct file *file, unsigned int cmd,
 	return err;
 }
 
+/* the whole capacity can be mapped, so the mapping survives resizes */
 static int ufb_device_mmap(struct file *file, struct vm_area_struct *vma)
 {
 	struct ufb_dev *dev;
-	int ret;
-	long length = vma->vm_end - vma->vm_start;
-	unsigned long start = vma->vm_start;
-	char *vmalloc_area_ptr;
-	unsigned long pfn;
-
-	printk(KERN_INFO "ufb:  ufb_device_mmap( file=%p, vma=%p )\n", file, vma );
-
-	dev = file->private_data;
-
-	if( dev->vmem == NULL ) {
-		return -EINVAL;
-	}
 
-	vmalloc_area_ptr = (char*)dev->vmem;
+	dev = ufb_file_dev(file);
 
-	if (length > dev->vmem_size) {
-		return -EIO;
-	}
+	pr_debug("ufb%d:  ufb_device_mmap( file=%p, vma=%p )\n",
+	         dev->id, file, vma );
 
-	while (length > 0) {
-		pfn = vmalloc_to_pfn(vmalloc_area_ptr);
-		if ((ret = remap_pfn_range(vma, start, pfn, PAGE_SIZE,
-		                           PAGE_SHARED)) < 0) {
-			return ret;
-		}
-		start += PAGE_SIZE;
-		vmalloc_area_ptr += PAGE_SIZE;
-		length -= PAGE_SIZE;
-	}
-
-	return 0;
+	return ufb_vmem_mmap(dev, vma, 1);
 }
 
 static int __init ufb_init(void)
@@ -207,6 +785,11 @@ static int __init ufb_init(void)
 		return err;
 	}
 
+	ufb_client_init();
+	ufb_reclaim_init();
+
+	ufb_instance_init();
+
 	return 0;
 }
 
@@ -216,7 +799,11 @@ static void __exit ufb_exit(void)
 {
 	printk(KERN_INFO "ufb:  ufb_exit()\n" );
 
+	ufb_instance_exit();
+
 	misc_deregister(&ufb_miscdevice);
+
+	ufb_client_exit();
 }
 
 module_exit(ufb_exit);
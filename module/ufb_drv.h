@@ -1,23 +1,388 @@
 #ifndef UFB_DRV_H
 #define UFB_DRV_H
 
+#include <linux/atomic.h>
 #include <linux/fb.h>
 #include <linux/device.h>
+#include <linux/jiffies.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/spinlock.h>
+#include <linux/timer.h>
 #include <linux/types.h>
 #include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#include "ufb_ioctl.h"
+
+/* must be a power of two */
+#define UFB_EVENT_QUEUE_LEN 32
+
+/* processes tracked per framebuffer, see ufb_client.c */
+#define UFB_MAX_CLIENTS 64
+
+struct ufb_trace;
+struct ufb_cursor;
+struct ufb_zpage;
+
+/* counters for <debugfs>/ufb/fbN_reclaim */
+struct ufb_reclaim_stats {
+	u64 bytes;
+	u64 same;
+	u64 reclaimed;
+	u64 restored;
+	u64 incompressible;
+	u64 passes;
+	u64 dropped;
+};
 
 struct ufb_dev {
+	/* held by the daemon's open file and by each vma mapping vmem */
+	struct kref ref;
+
+	/* the instance's number, see ufb_instance.c */
+	int id;
+
+	/*
+	 * Held while vmem or the framebuffer is set up, resized or torn
+	 * down, so a daemon's threads can't do it twice at once.  dead
+	 * once torn down, after which nothing more can be set up.
+	 */
+	struct mutex setup_lock;
+	int dead;
+
 	struct device *dev;
 	int *vmem;
 	size_t vmem_size;
+	int node;
 	struct fb_info *fb_info;
 
+	/*
+	 * what GET_SCANOUT reports, kept up by set_par and pan_display so
+	 * the daemon can read it without locking info, which vsync and
+	 * present waiters hold.  flags only has YWRAP.  has_scanout while
+	 * the framebuffer is registered.
+	 */
+	spinlock_t scanout_lock;
+	struct ufb_scanout scanout;
+	int has_scanout;
+
+	/*
+	 * vmem's pages, see ufb_vmem.c.  Either our own, up to max_pages of
+	 * them, or pinned from a daemon memfd.  vmem is the kernel's vmap()
+	 * of them, moved when they change;  unmapped while some of them are
+	 * compressed, see ufb_reclaim.c.
+	 */
+	int unmapped;
+	struct file *memfd;
+	struct page **pages;
+	unsigned int npages;
+	unsigned int max_pages;
+	spinlock_t pages_lock;
+
+	/*
+	 * userspace mappings of vmem, zapped when it shrinks.  untracked
+	 * counts clients' vmas whose drawing GET_DAMAGE doesn't cover.
+	 */
+	struct mutex mappings_lock;
+	struct list_head mappings;
+	unsigned int untracked;
+	atomic_t faults;
+	wait_queue_head_t fault_wait;
+
+	/* held for write while resizing, for read to access vmem by size */
+	struct rw_semaphore resize_sem;
+
 	unsigned int vblank_count;
 	wait_queue_head_t vblank_wait;
+
+	/*
+	 * While blanked the daemon stops presenting, so vblanks come from
+	 * a timer instead to keep FBIO_WAITFORVSYNC callers paced.
+	 */
+	int blank;
+	int soft_vblank;
+	struct timer_list vblank_timer;
+
+	spinlock_t event_lock;
+	unsigned int event_head;
+	unsigned int event_tail;
+	struct ufb_event events[UFB_EVENT_QUEUE_LEN];
+	wait_queue_head_t event_wait;
+
+	/* client activity trace, see ufb_trace.c */
+	spinlock_t trace_lock;
+	struct mutex trace_mutex;
+	struct ufb_trace *trace;
+
+	/* per process activity accounting, see ufb_client.c */
+	spinlock_t client_lock;
+	struct list_head clients;
+	unsigned int client_count;
+	u32 client_event_interval;
+	u64 client_event_last;
+	struct dentry *client_debugfs;
+
+	/* cursor plane composited by the daemon, see ufb_cursor.c */
+	spinlock_t cursor_lock;
+	int cursor_plane;
+	struct ufb_cursor *cursor;
+
+	/* client damage waiting for the daemon, see ufb_damage.c */
+	spinlock_t damage_lock;
+	struct ufb_damage_rect damage[UFB_DAMAGE_RECTS];
+	int damage_count;
+	int damage_notified;
+
+	/* client frames and when they were shown, see ufb_present.c */
+	spinlock_t present_lock;
+	u64 present_marked;
+	u64 present_mark_time;
+	u64 present_latched;
+	u64 present_done;
+	u64 present_time;
+	u32 present_flags;
+	int present_notified;
+	int present_daemon;
+	int present_gone;
+	int present_waiters;
+	wait_queue_head_t present_wait;
+
+	/*
+	 * copy on write frames for the daemon, see ufb_snapshot.c.  armed
+	 * for the next frame, kept while the current one is being kept.
+	 */
+	struct mutex snapshot_lock;
+	int snapshot;
+	int snapshot_armed;
+	int snapshot_kept;
+	struct page **snapshot_pages;
+	unsigned long *snapshot_copied;
+	unsigned int snapshot_npages;
+
+	/*
+	 * vmem compressed while idle, see ufb_reclaim.c.  reclaim_active
+	 * is when vmem was last used, in jiffies.
+	 */
+	struct mutex reclaim_lock;
+	struct delayed_work reclaim_work;
+	struct ufb_zpage **reclaim_store;
+	void *reclaim_wrkmem;
+	u8 *reclaim_buf;
+	unsigned long reclaim_active;
+	atomic_t reclaim_users;
+	int reclaim_busy;
+	int reclaim_stale;
+	int reclaim_off;
+	unsigned int reclaimed;
+	struct ufb_reclaim_stats reclaim_stats;
+	struct dentry *reclaim_debugfs;
+
+	/* colormap for the daemon to present with, see ufb_cmap.c */
+	spinlock_t cmap_lock;
+	struct ufb_cmap cmap;
+
+	/*
+	 * Named instances outliving the daemon's fd, see ufb_instance.c.
+	 * detached while no daemon has one open.  attached is the instance
+	 * an fd's own dev was swapped for by ATTACH.
+	 */
+	struct list_head instance;
+	char name[UFB_NAME_LEN];
+	int persistent;
+	int detached;
+	struct ufb_dev *attached;
 };
 
+extern struct ufb_dev *ufb_dev_alloc(void);
+extern void ufb_dev_teardown(struct ufb_dev *dev);
+extern void ufb_dev_put(struct ufb_dev *dev);
+extern void ufb_queue_event(struct ufb_dev *dev, struct ufb_event *event);
+extern void ufb_soft_vblank_start(struct ufb_dev *dev);
+extern void ufb_soft_vblank_stop(struct ufb_dev *dev);
+
+/* a palette index as it would be stored in vmem */
+static inline u32 ufb_fb_pixel(struct fb_info *info, u32 color)
+{
+	if (info->fix.visual == FB_VISUAL_TRUECOLOR ||
+	    info->fix.visual == FB_VISUAL_DIRECTCOLOR)
+		return ((u32 *)info->pseudo_palette)[color];
+
+	return color;
+}
+
+/* something used vmem, so it isn't idle */
+static inline void ufb_reclaim_touch(struct ufb_dev *dev)
+{
+	if (ACCESS_ONCE(dev->reclaim_active) != jiffies)
+		dev->reclaim_active = jiffies;
+}
+
+extern void ufb_reclaim_dropped(struct ufb_dev *dev);
+
+/*
+ *  Counts a user in before it looks at vmem's state.  Whoever changes
+ *  that state sets it first and then waits for the count to drop, so
+ *  either the user sees the change or it is waited for.
+ */
+static inline void ufb_count_in(atomic_t *users)
+{
+	atomic_inc(users);
+	smp_mb__after_atomic();
+}
+
+/* counts in a user of vmem if it's mapped and nothing is being compressed */
+static inline int ufb_reclaim_enter(struct ufb_dev *dev)
+{
+	ufb_count_in(&dev->reclaim_users);
+
+	if (likely(!ACCESS_ONCE(dev->reclaim_busy) &&
+	           !ACCESS_ONCE(dev->unmapped))) {
+		/* and sees where it was mapped, see ufb_vmem_remap() */
+		smp_rmb();
+		return 1;
+	}
+
+	atomic_dec(&dev->reclaim_users);
+	return 0;
+}
+
+/*
+ *  For drawing through screen_base where we may not sleep.  Returns 0 if
+ *  some of vmem is compressed, and the drawing has to be dropped.
+ */
+static inline int ufb_reclaim_draw(struct ufb_dev *dev)
+{
+	ufb_reclaim_touch(dev);
+
+	if (ufb_reclaim_enter(dev))
+		return 1;
+
+	ufb_reclaim_dropped(dev);
+	return 0;
+}
+
+static inline void ufb_reclaim_release(struct ufb_dev *dev)
+{
+	atomic_dec(&dev->reclaim_users);
+}
+
+static inline int ufb_tracing(struct ufb_dev *dev)
+{
+	return ACCESS_ONCE(dev->trace) != NULL;
+}
+
+extern int ufb_trace_start(struct ufb_dev *dev, u32 size);
+extern void ufb_trace_stop(struct ufb_dev *dev);
+extern int ufb_trace_read(struct ufb_dev *dev, struct ufb_trace_read *req);
+extern void ufb_trace_frame(struct ufb_dev *dev);
+extern void ufb_trace_var(struct ufb_dev *dev, u16 type, struct fb_info *info);
+extern void ufb_trace_write(struct ufb_dev *dev, size_t offset, size_t len);
+extern void ufb_trace_pan(struct ufb_dev *dev, struct fb_var_screeninfo *var);
+extern void ufb_trace_event(struct ufb_dev *dev, u16 type);
+extern void ufb_trace_fillrect(struct ufb_dev *dev, struct fb_info *info,
+                               const struct fb_fillrect *rect);
+extern void ufb_trace_copyarea(struct ufb_dev *dev, struct fb_info *info,
+                               const struct fb_copyarea *area);
+extern void ufb_trace_imageblit(struct ufb_dev *dev, struct fb_info *info,
+                                const struct fb_image *image);
+
+extern void ufb_client_init(void);
+extern void ufb_client_exit(void);
+extern void ufb_client_debugfs_add(struct ufb_dev *dev);
+extern void ufb_client_cleanup(struct ufb_dev *dev);
+extern void ufb_client_open(struct ufb_dev *dev);
+extern void ufb_client_release(struct ufb_dev *dev);
+extern void ufb_client_write(struct ufb_dev *dev, size_t bytes, u32 pixels);
+extern void ufb_client_damage(struct ufb_dev *dev, u32 pixels);
+extern void ufb_client_pan(struct ufb_dev *dev);
+extern void ufb_client_vsync_wait(struct ufb_dev *dev);
+extern void ufb_client_mmap(struct ufb_dev *dev);
+extern void ufb_client_report(struct ufb_dev *dev);
+
+extern int ufb_cursor_set(struct ufb_dev *dev, struct fb_info *info,
+                          const struct fb_cursor *fbc);
+extern int ufb_cursor_plane(struct ufb_dev *dev, u32 enable);
+extern int ufb_cursor_get_image(struct ufb_dev *dev,
+                                struct ufb_cursor_image *req);
+extern void ufb_cursor_free(struct ufb_dev *dev);
+
+extern void ufb_cmap_set_entry(struct ufb_dev *dev, u32 regno, u16 red,
+                               u16 green, u16 blue);
+extern void ufb_cmap_changed(struct ufb_dev *dev, struct fb_info *info);
+extern void ufb_cmap_get(struct ufb_dev *dev, struct ufb_cmap *cmap);
+
+extern u64 ufb_damage_add(struct ufb_dev *dev, struct ufb_damage_rect *rects,
+                          u32 count, u32 xres, u32 yres);
+extern void ufb_damage_take(struct ufb_dev *dev, struct ufb_damage *damage);
+extern void ufb_damage_reset(struct ufb_dev *dev);
+extern int ufb_damage_ioctl(struct fb_info *info,
+                            struct ufb_fb_damage __user *arg);
+
+extern int ufb_present_mark(struct ufb_dev *dev,
+                            struct ufb_fb_present __user *arg);
+extern int ufb_present_wait(struct fb_info *info,
+                            struct ufb_fb_present __user *arg);
+extern void ufb_present_latch(struct ufb_dev *dev, struct ufb_present *req);
+extern void ufb_present_ack(struct ufb_dev *dev, const struct ufb_present *req);
+extern void ufb_present_vblank(struct ufb_dev *dev, u32 flags);
+extern void ufb_present_reset(struct ufb_dev *dev);
+extern void ufb_present_shutdown(struct ufb_dev *dev);
+
+extern int ufb_vmem_alloc(struct ufb_dev *dev, size_t vmem_size, int node);
+extern int ufb_vmem_alloc_memfd(struct ufb_dev *dev, struct ufb_memfd *req);
+extern void ufb_vmem_free(struct ufb_dev *dev);
+extern size_t ufb_vmem_capacity(struct ufb_dev *dev);
+extern int ufb_vmem_mmap(struct ufb_dev *dev, struct vm_area_struct *vma,
+                         int daemon);
+extern int ufb_vmem_insert(struct vm_area_struct *vma, unsigned long addr,
+                           unsigned long pfn);
+extern void ufb_vmem_zap(struct ufb_dev *dev, int daemon, unsigned int first,
+                         unsigned int count);
+extern void ufb_vmem_track(struct ufb_dev *dev);
+
+extern int ufb_snapshot_enable(struct ufb_dev *dev, u32 enable);
+extern int ufb_snapshot_fault(struct ufb_dev *dev, struct vm_area_struct *vma,
+                              unsigned long addr, unsigned int pgoff,
+                              struct page *live, int daemon);
+extern void ufb_snapshot_touch(struct ufb_dev *dev, size_t offset, size_t len);
+extern void ufb_snapshot_vblank(struct ufb_dev *dev);
+extern void ufb_snapshot_free(struct ufb_dev *dev);
+extern int ufb_vmem_resize(struct ufb_dev *dev, struct ufb_resize *req);
+extern int ufb_vmem_remap(struct ufb_dev *dev);
+extern void ufb_vmem_unmap(struct ufb_dev *dev);
+
+extern struct dentry *ufb_debugfs_root;
+
+extern void ufb_reclaim_init(void);
+extern void ufb_reclaim_dev_init(struct ufb_dev *dev);
+extern void ufb_reclaim_debugfs_add(struct ufb_dev *dev);
+extern int ufb_reclaim_restore(struct ufb_dev *dev, unsigned int first,
+                               unsigned int count);
+extern int ufb_reclaim_hold(struct ufb_dev *dev);
+extern void ufb_reclaim_kick(struct ufb_dev *dev);
+extern void ufb_reclaim_free(struct ufb_dev *dev);
+
+extern int ufb_instance_register(struct ufb_dev *dev);
+extern void ufb_instance_unregister(struct ufb_dev *dev);
+extern void ufb_instance_init(void);
+extern void ufb_instance_exit(void);
+extern int ufb_instance_attach(struct ufb_dev *dev, struct ufb_attach *req);
+extern int ufb_instance_detach(struct ufb_dev *dev);
+extern int ufb_instance_destroy(struct ufb_dev *dev);
+
 extern int ufb_fb_init(struct ufb_dev *dev);
 extern void ufb_fb_deinit(struct ufb_dev *dev);
+extern int ufb_fb_get_scanout(struct ufb_dev *dev,
+                              struct ufb_scanout *scanout);
+extern int ufb_fb_resize(struct ufb_dev *dev, size_t size, u32 xres, u32 yres,
+                         u32 bits_per_pixel);
+extern void ufb_fb_get_mode(struct ufb_dev *dev, u32 *xres, u32 *yres,
+                            u32 *bits_per_pixel);
+extern void ufb_fb_repaint(struct ufb_dev *dev);
+extern void ufb_fb_set_base(struct ufb_dev *dev, void *vmem);
 
 #endif //UFB_DRV_H
 
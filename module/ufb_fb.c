@@ -1,6 +1,14 @@
 #include "ufb_drv.h"
 
+#include <linux/console.h>
 #include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+
+static bool directcolor;
+module_param(directcolor, bool, 0444);
+MODULE_PARM_DESC(directcolor, "Use DIRECTCOLOR instead of TRUECOLOR above 8bpp, "
+                 "so clients can load gamma ramps");
 
 static struct fb_var_screeninfo ufb_fb_var_default =
 {
@@ -26,27 +34,48 @@ static struct fb_var_screeninfo ufb_fb_var_default =
 	.vmode          = FB_VMODE_NONINTERLACED,
 };
 
+static int ufb_fb_open(struct fb_info *info, int user);
+static int ufb_fb_release(struct fb_info *info, int user);
 static int ufb_fb_check_var(struct fb_var_screeninfo *var,
                             struct fb_info *info);
 static int ufb_fb_set_par(struct fb_info *info);
 static int ufb_fb_setcolreg(u_int regno, u_int red, u_int green, u_int blue,
                             u_int transp, struct fb_info *info);
+static int ufb_fb_setcmap(struct fb_cmap *cmap, struct fb_info *info);
 static int ufb_fb_pan_display(struct fb_var_screeninfo *var,
                               struct fb_info *info);
+static int ufb_fb_blank(int blank, struct fb_info *info);
+static ssize_t ufb_fb_read(struct fb_info *info, char __user *buf,
+                           size_t count, loff_t *ppos);
+static ssize_t ufb_fb_write(struct fb_info *info, const char __user *buf,
+                            size_t count, loff_t *ppos);
+static void ufb_fb_fillrect(struct fb_info *info,
+                            const struct fb_fillrect *rect);
+static void ufb_fb_copyarea(struct fb_info *info,
+                            const struct fb_copyarea *area);
+static void ufb_fb_imageblit(struct fb_info *info,
+                             const struct fb_image *image);
+static int ufb_fb_cursor(struct fb_info *info, struct fb_cursor *cursor);
 static int ufb_fb_mmap(struct fb_info *info,
                        struct vm_area_struct *vma);
 static int ufb_fb_ioctl(struct fb_info *info, u_int cmd, u_long arg);
 
 static struct fb_ops ufb_ops = {
-	.fb_read        = fb_sys_read,
-	.fb_write       = fb_sys_write,
+	.owner          = THIS_MODULE,
+	.fb_open        = ufb_fb_open,
+	.fb_release     = ufb_fb_release,
+	.fb_read        = ufb_fb_read,
+	.fb_write       = ufb_fb_write,
 	.fb_check_var   = ufb_fb_check_var,
 	.fb_set_par     = ufb_fb_set_par,
 	.fb_setcolreg   = ufb_fb_setcolreg,
+	.fb_setcmap     = ufb_fb_setcmap,
 	.fb_pan_display = ufb_fb_pan_display,
-	.fb_fillrect    = sys_fillrect,
-	.fb_copyarea    = sys_copyarea,
-	.fb_imageblit   = sys_imageblit,
+	.fb_blank       = ufb_fb_blank,
+	.fb_fillrect    = ufb_fb_fillrect,
+	.fb_copyarea    = ufb_fb_copyarea,
+	.fb_imageblit   = ufb_fb_imageblit,
+	.fb_cursor      = ufb_fb_cursor,
 	.fb_mmap        = ufb_fb_mmap,
 	.fb_ioctl       = ufb_fb_ioctl,
 };
@@ -64,6 +93,114 @@ static u_long get_line_length(int xres_virtual, int bpp)
 	return (length);
 }
 
+static int ufb_fb_is_fourcc(const struct fb_var_screeninfo *var)
+{
+	return var->grayscale > 1;
+}
+
+/*
+ *  FOURCC modes keep the luma pitch in line_length, see ufb_ioctl.h.
+ *  It's kept even so I420's half pitch chroma lines are whole.
+ */
+static u_long ufb_fb_fourcc_line_length(const struct fb_var_screeninfo *var)
+{
+	if (var->grayscale == UFB_FOURCC_YUYV)
+		return get_line_length(var->xres_virtual, 16);
+
+	return ALIGN(var->xres_virtual, 4);
+}
+
+static u_long ufb_fb_fourcc_size(const struct fb_var_screeninfo *var)
+{
+	u_long size = ufb_fb_fourcc_line_length(var) * var->yres_virtual;
+
+	if (var->grayscale == UFB_FOURCC_YUYV)
+		return size;
+
+	return size + size / 2;
+}
+
+static int ufb_fb_check_fourcc(struct fb_var_screeninfo *var,
+                               struct fb_info *info)
+{
+	switch (var->grayscale) {
+	case UFB_FOURCC_YUYV:
+		var->bits_per_pixel = 16;
+		break;
+	case UFB_FOURCC_NV12:
+	case UFB_FOURCC_I420:
+		var->bits_per_pixel = 12;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	/* chroma is subsampled by two, so sizes are kept even */
+	var->xres = ALIGN(max(var->xres, 1U), 2);
+	var->yres = ALIGN(max(var->yres, 1U), 2);
+
+	if (var->bits_per_pixel == 12) {
+		var->xres_virtual = var->xres;
+		var->yres_virtual = var->yres;
+		var->xoffset = 0;
+		var->yoffset = 0;
+		var->vmode &= ~FB_VMODE_YWRAP;
+	} else {
+		var->xoffset &= ~1;
+		if (var->xres_virtual < var->xoffset + var->xres)
+			var->xres_virtual = var->xoffset + var->xres;
+		if (var->yres_virtual < var->yoffset + var->yres)
+			var->yres_virtual = var->yoffset + var->yres;
+		var->xres_virtual = ALIGN(var->xres_virtual, 2);
+		var->yres_virtual = ALIGN(var->yres_virtual, 2);
+	}
+
+	if (ufb_fb_fourcc_size(var) > info->fix.smem_len)
+		return -ENOMEM;
+
+	memset(&var->red, 0, sizeof(var->red));
+	memset(&var->green, 0, sizeof(var->green));
+	memset(&var->blue, 0, sizeof(var->blue));
+	memset(&var->transp, 0, sizeof(var->transp));
+
+	return 0;
+}
+
+static void ufb_fb_update_visual(struct fb_info *info)
+{
+	if (ufb_fb_is_fourcc(&info->var)) {
+		info->fix.type = FB_TYPE_FOURCC;
+		info->fix.visual = FB_VISUAL_FOURCC;
+		return;
+	}
+
+	info->fix.type = FB_TYPE_PACKED_PIXELS;
+	if (info->var.bits_per_pixel <= 8)
+		info->fix.visual = FB_VISUAL_PSEUDOCOLOR;
+	else if (directcolor)
+		info->fix.visual = FB_VISUAL_DIRECTCOLOR;
+	else
+		info->fix.visual = FB_VISUAL_TRUECOLOR;
+}
+
+/*
+ *  Opens and closes only matter for the per process accounting;  fbcon
+ *  opens with user == 0.
+ */
+static int ufb_fb_open(struct fb_info *info, int user)
+{
+	if (user)
+		ufb_client_open(info->par);
+	return 0;
+}
+
+static int ufb_fb_release(struct fb_info *info, int user)
+{
+	if (user)
+		ufb_client_release(info->par);
+	return 0;
+}
+
 /*
  *  Setting the video mode has been split into two parts.
  *  First part, xxxfb_check_var, must not write anything
@@ -76,7 +213,7 @@ static int ufb_fb_check_var(struct fb_var_screeninfo *var,
 {
 	u_long line_length;
 
-	printk(KERN_INFO "usrfb_check_var( var=%p, info=%p )\n", var, info);
+	pr_debug("usrfb_check_var( var=%p, info=%p )\n", var, info);
 
 	/*
 	 *  FB_VMODE_CONUPDATE and FB_VMODE_SMOOTH_XPAN are equal!
@@ -88,6 +225,9 @@ static int ufb_fb_check_var(struct fb_var_screeninfo *var,
 		var->yoffset = info->var.yoffset;
 	}
 
+	if (ufb_fb_is_fourcc(var))
+		return ufb_fb_check_fourcc(var, info);
+
 	/*
 	 *  Some very basic checks
 	 */
@@ -122,7 +262,7 @@ static int ufb_fb_check_var(struct fb_var_screeninfo *var,
 	 */
 	line_length =
 	    get_line_length(var->xres_virtual, var->bits_per_pixel);
-	if (line_length * var->yres_virtual > info->fix.smem_start)
+	if (line_length * var->yres_virtual > info->fix.smem_len)
 		return -ENOMEM;
 
 	/*
@@ -192,6 +332,34 @@ static int ufb_fb_check_var(struct fb_var_screeninfo *var,
 	return 0;
 }
 
+/* called with info locked, or before it's registered */
+static void ufb_fb_update_scanout(struct fb_info *info)
+{
+	struct ufb_dev *dev = info->par;
+	struct ufb_scanout scanout;
+	unsigned long flags;
+
+	scanout.xres           = info->var.xres;
+	scanout.yres           = info->var.yres;
+	scanout.xres_virtual   = info->var.xres_virtual;
+	scanout.yres_virtual   = info->var.yres_virtual;
+	scanout.xoffset        = info->var.xoffset;
+	scanout.yoffset        = info->var.yoffset;
+	scanout.line_length    = info->fix.line_length;
+	scanout.bits_per_pixel = info->var.bits_per_pixel;
+	scanout.flags          = 0;
+	if (info->var.vmode & FB_VMODE_YWRAP)
+		scanout.flags |= UFB_SCANOUT_YWRAP;
+	scanout.fourcc         = 0;
+	if (ufb_fb_is_fourcc(&info->var))
+		scanout.fourcc = info->var.grayscale;
+
+	spin_lock_irqsave(&dev->scanout_lock, flags);
+	dev->scanout = scanout;
+	dev->has_scanout = 1;
+	spin_unlock_irqrestore(&dev->scanout_lock, flags);
+}
+
 /* 
  * This routine actually sets the video mode. It's in here where we
  * the hardware state info->par and fix which can be affected by the 
@@ -199,9 +367,16 @@ static int ufb_fb_check_var(struct fb_var_screeninfo *var,
  */
 static int ufb_fb_set_par(struct fb_info *info)
 {
-	printk(KERN_INFO "usrfb_set_par( info=%p )\n", info);
-	info->fix.line_length = get_line_length(info->var.xres_virtual,
-						info->var.bits_per_pixel);
+	pr_debug("usrfb_set_par( info=%p )\n", info);
+	if (ufb_fb_is_fourcc(&info->var))
+		info->fix.line_length = ufb_fb_fourcc_line_length(&info->var);
+	else
+		info->fix.line_length = get_line_length(info->var.xres_virtual,
+							info->var.bits_per_pixel);
+	ufb_fb_update_visual(info);
+	ufb_fb_update_scanout(info);
+	ufb_trace_var(info->par, UFB_TRACE_SET_VAR, info);
+	ufb_cmap_changed(info->par, info);
 	return 0;
 }
 
@@ -226,6 +401,9 @@ static int ufb_fb_setcolreg(u_int regno, u_int red, u_int green, u_int blue,
 		    (red * 77 + green * 151 + blue * 28) >> 8;
 	}
 
+	/* the daemon applies the colormap itself when presenting */
+	ufb_cmap_set_entry(info->par, regno, red, green, blue);
+
 	/* Directcolor:
 	 *   var->{color}.offset contains start of bitfield
 	 *   var->{color}.length contains length of bitfield
@@ -292,9 +470,50 @@ static int ufb_fb_setcolreg(u_int regno, u_int red, u_int green, u_int blue,
 		}
 		return 0;
 	}
+	/* Directcolor pixels index the RAMDAC, which the daemon emulates */
+	if (info->fix.visual == FB_VISUAL_DIRECTCOLOR) {
+		if (regno >= 16)
+			return 0;
+
+		((u32 *) (info->pseudo_palette))[regno] =
+		    (regno << info->var.red.offset) |
+		    (regno << info->var.green.offset) |
+		    (regno << info->var.blue.offset);
+		return 0;
+	}
 	return 0;
 }
 
+/*
+ *  Same as the fb core's loop over setcolreg, but lets the daemon know
+ *  once for the whole update rather than once per register.
+ */
+static int ufb_fb_setcmap(struct fb_cmap *cmap, struct fb_info *info)
+{
+	u16 *red = cmap->red;
+	u16 *green = cmap->green;
+	u16 *blue = cmap->blue;
+	u16 *transp = cmap->transp;
+	u16 trans = 0xffff;
+	int start = cmap->start;
+	int err = 0;
+	int i;
+
+	for (i = 0; i < cmap->len; i++) {
+		if (transp)
+			trans = *transp++;
+		if (ufb_fb_setcolreg(start++, *red++, *green++, *blue++, trans,
+		                     info)) {
+			err = -EINVAL;
+			break;
+		}
+	}
+
+	ufb_cmap_changed(info->par, info);
+
+	return err;
+}
+
 /*
  *  Pan or Wrap the Display
  *
@@ -303,6 +522,15 @@ static int ufb_fb_setcolreg(u_int regno, u_int red, u_int green, u_int blue,
 static int ufb_fb_pan_display(struct fb_var_screeninfo *var,
                               struct fb_info *info)
 {
+	/* the chroma planes sit below the luma, which leaves nowhere to pan */
+	if (info->var.bits_per_pixel == 12 &&
+	    (var->xoffset || var->yoffset || (var->vmode & FB_VMODE_YWRAP)))
+		return -EINVAL;
+
+	/* nor to split a YUYV pair */
+	if (info->var.grayscale == UFB_FOURCC_YUYV && (var->xoffset & 1))
+		return -EINVAL;
+
 	if (var->vmode & FB_VMODE_YWRAP) {
 		if (var->yoffset >= info->var.yres_virtual ||
 		    var->xoffset)
@@ -318,52 +546,295 @@ static int ufb_fb_pan_display(struct fb_var_screeninfo *var,
 		info->var.vmode |= FB_VMODE_YWRAP;
 	else
 		info->var.vmode &= ~FB_VMODE_YWRAP;
+	ufb_fb_update_scanout(info);
+	ufb_trace_pan(info->par, var);
+	ufb_client_pan(info->par);
 	return 0;
 }
 
 /*
- *  Most drivers don't need their own mmap function 
+ *  Blank the display.  The daemon does the actual work (it stops
+ *  presenting), we only track the state, tell it and keep vblank
+ *  waiters running off a timer while it sleeps.
  */
-static int ufb_fb_mmap(struct fb_info *info,
-                       struct vm_area_struct *vma)
+static int ufb_fb_blank(int blank, struct fb_info *info)
 {
-	unsigned long start = vma->vm_start;
-	unsigned long size = vma->vm_end - vma->vm_start;
-	unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
-	unsigned long page, pos;
+	struct ufb_dev *dev = info->par;
+	struct ufb_event event;
 
-	if (vma->vm_pgoff > (~0UL >> PAGE_SHIFT))
-		return -EINVAL;
-	if (size > info->fix.smem_len)
-		return -EINVAL;
-	if (offset > info->fix.smem_len - size)
-		return -EINVAL;
+	if (blank == dev->blank)
+		return 0;
 
-	pos = (unsigned long)info->fix.smem_start + offset;
+	dev->blank = blank;
 
-	while (size > 0) {
-		page = vmalloc_to_pfn((void *)pos);
-		if (remap_pfn_range(vma, start, page, PAGE_SIZE, PAGE_SHARED)) {
-			return -EAGAIN;
+	/* with no daemon attached the timer keeps running regardless */
+	if (blank)
+		ufb_soft_vblank_start(dev);
+	else if (!dev->detached)
+		ufb_soft_vblank_stop(dev);
+
+	ufb_reclaim_kick(dev);
+
+	memset(&event, 0, sizeof(event));
+	event.type = UFB_EV_BLANK;
+	event.u.blank.level = blank;
+	ufb_queue_event(dev, &event);
+
+	return 0;
+}
+
+/*
+ *  Drawing goes to system memory through the generic helpers, wrapped so
+ *  the operations can be traced and charged to whoever caused them.  The
+ *  helpers only know packed RGB, so FOURCC modes are left to the client.
+ *
+ *  read() and write() are our own:  one copy straight between the user
+ *  buffer and vmem, and a write reports what it covered as damage, so
+ *  the daemon needn't look at the rest.  They go by smem_len, so they
+ *  keep out of a resize.  pwritev() of several rows comes here once per
+ *  row, but the rows merge into one rectangle and the daemon is told
+ *  once, see ufb_damage.c.
+ *
+ *  Idle vmem may be compressed, see ufb_reclaim.c:  read() and write()
+ *  bring back what they need, drawing is dropped until fbcon repaints.
+ */
+static size_t ufb_fb_rw_size(struct fb_info *info)
+{
+	return info->screen_size ? info->screen_size : info->fix.smem_len;
+}
+
+static ssize_t ufb_fb_read(struct fb_info *info, char __user *buf,
+                           size_t count, loff_t *ppos)
+{
+	struct ufb_dev *dev = info->par;
+	unsigned long p = *ppos;
+	size_t total;
+	ssize_t ret;
+
+	if (info->state != FBINFO_STATE_RUNNING)
+		return -EPERM;
+
+	down_read(&dev->resize_sem);
+
+	total = ufb_fb_rw_size(info);
+	if (p >= total) {
+		ret = 0;
+		goto out;
+	}
+
+	count = min_t(size_t, count, total - p);
+
+	ret = ufb_reclaim_hold(dev);
+	if (ret)
+		goto out;
+
+	if (copy_to_user(buf, (u8 __force *)info->screen_base + p, count)) {
+		ufb_reclaim_release(dev);
+		ret = -EFAULT;
+		goto out;
+	}
+	ufb_reclaim_release(dev);
+
+	*ppos += count;
+	ret = count;
+
+out:
+	up_read(&dev->resize_sem);
+	return ret;
+}
+
+/*
+ *  What len bytes at offset cover on screen:  part of one line, or
+ *  whole lines.  Planar YUV keeps its chroma below the virtual screen,
+ *  so a write there damages all of it.
+ */
+static void ufb_fb_write_damage(struct fb_info *info, size_t offset,
+                                size_t len)
+{
+	u32 pitch = info->fix.line_length;
+	u32 bpp = info->var.bits_per_pixel;
+	u32 yres = info->var.yres_virtual;
+	struct ufb_damage_rect rect;
+	size_t first, last;
+
+	if (!pitch || !len)
+		return;
+
+	first = offset / pitch;
+	last = (offset + len - 1) / pitch;
+
+	rect.x = 0;
+	rect.width = info->var.xres_virtual;
+
+	if (last >= yres && info->fix.visual == FB_VISUAL_FOURCC) {
+		rect.y = 0;
+		rect.height = yres;
+	} else if (first >= yres) {
+		return;
+	} else {
+		rect.y = first;
+		rect.height = min_t(size_t, last, yres - 1) - first + 1;
+
+		if (first == last && bpp >= 8 && !(bpp & 7)) {
+			rect.x = (offset - first * pitch) / (bpp / 8);
+			rect.width = DIV_ROUND_UP(offset + len - first * pitch,
+			                          bpp / 8) - rect.x;
 		}
-		start += PAGE_SIZE;
-		pos += PAGE_SIZE;
-		if (size > PAGE_SIZE)
-			size -= PAGE_SIZE;
-		else
-			size = 0;
 	}
 
-	return 0;
+	ufb_damage_add(info->par, &rect, 1, info->var.xres_virtual, yres);
+}
+
+static ssize_t ufb_fb_write(struct fb_info *info, const char __user *buf,
+                            size_t count, loff_t *ppos)
+{
+	struct ufb_dev *dev = info->par;
+	unsigned long p = *ppos;
+	size_t total;
+	ssize_t err = 0;
+
+	if (info->state != FBINFO_STATE_RUNNING)
+		return -EPERM;
+
+	down_read(&dev->resize_sem);
+
+	/* short writes at the end, as fb_sys_write() does them */
+	total = ufb_fb_rw_size(info);
+	if (p > total) {
+		err = -EFBIG;
+		goto out;
+	}
+	if (count > total) {
+		err = -EFBIG;
+		count = total;
+	}
+	if (count + p > total) {
+		if (!err)
+			err = -ENOSPC;
+		count = total - p;
+	}
+	if (!count)
+		goto out;
+
+	err = ufb_reclaim_hold(dev);
+	if (err)
+		goto out;
+
+	ufb_snapshot_touch(dev, p, count);
+
+	if (copy_from_user((u8 __force *)info->screen_base + p, buf, count)) {
+		ufb_reclaim_release(dev);
+		err = -EFAULT;
+		goto out;
+	}
+	ufb_reclaim_release(dev);
+
+	*ppos += count;
+	err = count;
+
+	ufb_fb_write_damage(info, p, count);
+	ufb_trace_write(dev, p, count);
+	ufb_client_write(dev, count,
+	                 count * 8 / max(info->var.bits_per_pixel, 1U));
 
+out:
+	up_read(&dev->resize_sem);
+	return err;
 }
 
-static int ufb_fb_ioctl(struct fb_info *info, u_int cmd, u_long arg)
+/* fbcon drew, for the daemon to present */
+static void ufb_fb_draw_damage(struct fb_info *info, u32 x, u32 y,
+                               u32 width, u32 height)
+{
+	struct ufb_damage_rect rect;
+
+	rect.x = x;
+	rect.y = y;
+	rect.width = width;
+	rect.height = height;
+
+	ufb_damage_add(info->par, &rect, 1, info->var.xres_virtual,
+	               info->var.yres_virtual);
+}
+
+static void ufb_fb_fillrect(struct fb_info *info,
+                            const struct fb_fillrect *rect)
+{
+	if (info->fix.visual == FB_VISUAL_FOURCC ||
+	    !ufb_reclaim_draw(info->par))
+		return;
+
+	sys_fillrect(info, rect);
+	ufb_trace_fillrect(info->par, info, rect);
+	ufb_client_damage(info->par, rect->width * rect->height);
+	ufb_fb_draw_damage(info, rect->dx, rect->dy, rect->width, rect->height);
+
+	ufb_reclaim_release(info->par);
+}
+
+static void ufb_fb_copyarea(struct fb_info *info,
+                            const struct fb_copyarea *area)
+{
+	if (info->fix.visual == FB_VISUAL_FOURCC ||
+	    !ufb_reclaim_draw(info->par))
+		return;
+
+	sys_copyarea(info, area);
+	ufb_trace_copyarea(info->par, info, area);
+	ufb_client_damage(info->par, area->width * area->height);
+	ufb_fb_draw_damage(info, area->dx, area->dy, area->width, area->height);
+
+	ufb_reclaim_release(info->par);
+}
+
+static void ufb_fb_imageblit(struct fb_info *info,
+                             const struct fb_image *image)
+{
+	if (info->fix.visual == FB_VISUAL_FOURCC ||
+	    !ufb_reclaim_draw(info->par))
+		return;
+
+	sys_imageblit(info, image);
+	ufb_trace_imageblit(info->par, info, image);
+	ufb_client_damage(info->par, image->width * image->height);
+	ufb_fb_draw_damage(info, image->dx, image->dy, image->width,
+	                   image->height);
+
+	ufb_reclaim_release(info->par);
+}
+
+static int ufb_fb_cursor(struct fb_info *info, struct fb_cursor *cursor)
+{
+	return ufb_cursor_set(info->par, info, cursor);
+}
+
+/*
+ *  Same fault based mapping as the daemon's, see ufb_vmem.c.  Clients may
+ *  map up to the capacity vmem can grow to, not just smem_len.
+ */
+static int ufb_fb_mmap(struct fb_info *info,
+                       struct vm_area_struct *vma)
 {
 	struct ufb_dev *dev = info->par;
+	int err;
+
+	err = ufb_vmem_mmap(dev, vma, 0);
+	if (err)
+		return err;
+
+	ufb_client_mmap(dev);
+
+	return 0;
+}
+
+static int ufb_fb_wait_for_vsync(struct ufb_dev *dev)
+{
 	unsigned int count;
 	int ret;
 
+	ufb_trace_event(dev, UFB_TRACE_VSYNC_WAIT);
+	ufb_client_vsync_wait(dev);
+
 	count = dev->vblank_count;
 	ret = wait_event_interruptible_timeout(dev->vblank_wait, count != dev->vblank_count, HZ/10);
 
@@ -378,6 +849,46 @@ static int ufb_fb_ioctl(struct fb_info *info, u_int cmd, u_long arg)
 	}
 }
 
+static int ufb_fb_ioctl(struct fb_info *info, u_int cmd, u_long arg)
+{
+	struct ufb_dev *dev = info->par;
+
+	switch (cmd) {
+	case FBIO_WAITFORVSYNC:
+		return ufb_fb_wait_for_vsync(dev);
+	case UFB_FBIO_DAMAGE:
+		return ufb_damage_ioctl(info, (void __user *)arg);
+	case UFB_FBIO_PRESENT_MARK:
+		return ufb_present_mark(dev, (void __user *)arg);
+	case UFB_FBIO_PRESENT_WAIT:
+		return ufb_present_wait(info, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/*
+ *  fbcon only pans or wraps within a virtual screen taller than the
+ *  visible one, by a whole number of font lines, so the default mode
+ *  gets up to twice the height in vmem, kept to a multiple of 16 lines.
+ */
+static void ufb_fb_init_virtual(struct fb_info *info)
+{
+	struct fb_var_screeninfo *var = &info->var;
+	u_long line_length = get_line_length(var->xres_virtual,
+	                                     var->bits_per_pixel);
+	u32 yres_virtual = 2 * var->yres;
+
+	if (line_length && yres_virtual > info->fix.smem_len / line_length)
+		yres_virtual = info->fix.smem_len / line_length;
+	yres_virtual -= yres_virtual % 16;
+
+	if (yres_virtual > var->yres_virtual)
+		var->yres_virtual = yres_virtual;
+
+	info->fix.line_length = line_length;
+}
+
 int ufb_fb_init(struct ufb_dev *dev)
 {
 	int retval = 0;
@@ -408,12 +919,14 @@ int ufb_fb_init(struct ufb_dev *dev)
 	dev->fb_info->fix.smem_len   = dev->vmem_size;
 	strcpy(dev->fb_info->fix.id, "User FB");
 	dev->fb_info->fix.type       = FB_TYPE_PACKED_PIXELS;
-	dev->fb_info->fix.visual     = FB_VISUAL_PSEUDOCOLOR;
-	dev->fb_info->fix.xpanstep   = 1,
-	dev->fb_info->fix.ypanstep   = 1,
-	dev->fb_info->fix.ywrapstep  = 1,
-	dev->fb_info->fix.line_length = 640 * sizeof(u32);
-	dev->fb_info->fix.accel      = FB_ACCEL_NONE,
+	ufb_fb_update_visual(dev->fb_info);
+	dev->fb_info->fix.xpanstep   = 1;
+	dev->fb_info->fix.ypanstep   = 1;
+	dev->fb_info->fix.ywrapstep  = 1;
+	dev->fb_info->fix.accel      = FB_ACCEL_NONE;
+	/* the YUV modes of ufb_fb_check_fourcc(), for clients to find */
+	dev->fb_info->fix.capabilities |= FB_CAP_FOURCC;
+	ufb_fb_init_virtual(dev->fb_info);
 
 	dev->fb_info->pseudo_palette = kzalloc(sizeof(u32) * 256, GFP_KERNEL);
 	if (!dev->fb_info->pseudo_palette) {
@@ -423,13 +936,23 @@ int ufb_fb_init(struct ufb_dev *dev)
 
 	dev->fb_info->par = dev;
 
-	dev->fb_info->flags = FBINFO_FLAG_DEFAULT;
+	/*
+	 * fbcon scrolls by wrapping (SCROLL_WRAP_MOVE) only if it's told
+	 * panning and wrapping are accelerated;  then a scroll is a pan and
+	 * a line of glyphs, instead of copying the whole screen up.
+	 * READS_FAST has it move what little it still moves by copying.
+	 */
+	dev->fb_info->flags = FBINFO_FLAG_DEFAULT | FBINFO_READS_FAST |
+	                      FBINFO_HWACCEL_YWRAP | FBINFO_HWACCEL_YPAN;
 
 	retval = fb_alloc_cmap(&dev->fb_info->cmap, 256, 0);
 	if (retval < 0 ) {
 		goto err3;
 	}
 
+	ufb_cmap_changed(dev, dev->fb_info);
+	ufb_fb_update_scanout(dev->fb_info);
+
 	retval = register_framebuffer(dev->fb_info);
 	if (retval < 0) {
 		goto err4;
@@ -438,6 +961,9 @@ int ufb_fb_init(struct ufb_dev *dev)
 	return 0;
 
 err4:
+	spin_lock_irq(&dev->scanout_lock);
+	dev->has_scanout = 0;
+	spin_unlock_irq(&dev->scanout_lock);
 	fb_dealloc_cmap(&dev->fb_info->cmap);
 err3:
 	kfree(dev->fb_info->pseudo_palette);
@@ -449,9 +975,149 @@ err1:
 }
 
 
+/*
+ *  The daemon asks every frame, while clients may sleep in ioctls with
+ *  info locked, so this only reads what set_par and pan_display left.
+ */
+int ufb_fb_get_scanout(struct ufb_dev *dev, struct ufb_scanout *scanout)
+{
+	int ret = 0;
+
+	spin_lock_irq(&dev->scanout_lock);
+	if (dev->has_scanout)
+		*scanout = dev->scanout;
+	else
+		ret = -EINVAL;
+	spin_unlock_irq(&dev->scanout_lock);
+
+	if (ret)
+		return ret;
+
+	if (ACCESS_ONCE(dev->untracked))
+		scanout->flags |= UFB_SCANOUT_UNTRACKED;
+
+	return 0;
+}
+
+/*
+ *  Sets a mode to fit a resized vmem of size bytes, the way
+ *  FBIOPUT_VSCREENINFO would, so fbcon follows along.  check_var measures
+ *  the mode against the new smem_len, which is put back if it doesn't fit.
+ *  Called with vmem covering both the old and new size.
+ */
+int ufb_fb_resize(struct ufb_dev *dev, size_t size, u32 xres, u32 yres,
+                  u32 bits_per_pixel)
+{
+	struct fb_info *info = dev->fb_info;
+	struct fb_var_screeninfo var;
+	u32 old_len;
+	int err;
+
+	if (!info)
+		return (xres || bits_per_pixel) ? -EINVAL : 0;
+
+	if (!lock_fb_info(info))
+		return -ENODEV;
+
+	var = info->var;
+	if (xres) {
+		var.xres = var.xres_virtual = xres;
+		var.yres = var.yres_virtual = yres;
+		var.xoffset = var.yoffset = 0;
+	}
+	if (bits_per_pixel)
+		var.bits_per_pixel = bits_per_pixel;
+	var.activate = FB_ACTIVATE_NOW | FB_ACTIVATE_FORCE;
+
+	old_len = info->fix.smem_len;
+	info->fix.smem_len = size;
+
+	console_lock();
+	info->flags |= FBINFO_MISC_USEREVENT;
+	err = fb_set_var(info, &var);
+	info->flags &= ~FBINFO_MISC_USEREVENT;
+	console_unlock();
+
+	if (err)
+		info->fix.smem_len = old_len;
+
+	unlock_fb_info(info);
+
+	return err;
+}
+
+void ufb_fb_get_mode(struct ufb_dev *dev, u32 *xres, u32 *yres,
+                     u32 *bits_per_pixel)
+{
+	struct fb_info *info = dev->fb_info;
+
+	*xres = *yres = *bits_per_pixel = 0;
+
+	if (!info || !lock_fb_info(info))
+		return;
+
+	*xres = info->var.xres;
+	*yres = info->var.yres;
+	*bits_per_pixel = info->var.bits_per_pixel;
+
+	unlock_fb_info(info);
+}
+
+/*
+ *  Has fbcon draw the whole console again, after its drawing was dropped
+ *  while vmem was compressed.  A forced set_var is what makes it repaint.
+ */
+void ufb_fb_repaint(struct ufb_dev *dev)
+{
+	struct fb_info *info = dev->fb_info;
+	struct fb_var_screeninfo var;
+
+	if (!info || !lock_fb_info(info))
+		return;
+
+	var = info->var;
+	var.activate = FB_ACTIVATE_NOW | FB_ACTIVATE_FORCE;
+
+	console_lock();
+	info->flags |= FBINFO_MISC_USEREVENT;
+	fb_set_var(info, &var);
+	info->flags &= ~FBINFO_MISC_USEREVENT;
+	console_unlock();
+
+	unlock_fb_info(info);
+}
+
+/*
+ *  vmem was mapped somewhere else, see ufb_vmem.c.  fbcon only draws with
+ *  the console locked, so it's moved with it locked too.
+ */
+void ufb_fb_set_base(struct ufb_dev *dev, void *vmem)
+{
+	struct fb_info *info = dev->fb_info;
+
+	if (!info || !lock_fb_info(info)) {
+		dev->vmem = vmem;
+		return;
+	}
+
+	console_lock();
+	info->screen_base = (char __iomem *)vmem;
+	info->fix.smem_start = (unsigned long)vmem;
+	dev->vmem = vmem;
+	console_unlock();
+
+	unlock_fb_info(info);
+}
+
 void ufb_fb_deinit(struct ufb_dev *dev)
 {
 	if (dev->fb_info) {
+		spin_lock_irq(&dev->scanout_lock);
+		dev->has_scanout = 0;
+		spin_unlock_irq(&dev->scanout_lock);
+
+		/* before info goes, which present waiters let go of */
+		ufb_present_shutdown(dev);
 		unregister_framebuffer(dev->fb_info);
 		fb_dealloc_cmap(&dev->fb_info->cmap);
 		kfree(dev->fb_info->pseudo_palette);
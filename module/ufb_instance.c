@@ -0,0 +1,385 @@
+#include "ufb_drv.h"
+
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/idr.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/ratelimit.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+
+#define UFB_MAX_PARAM_INSTANCES 16
+
+static char *instances[UFB_MAX_PARAM_INSTANCES];
+static int ninstances;
+module_param_array(instances, charp, &ninstances, 0444);
+MODULE_PARM_DESC(instances, "Names of persistent instances to create at load, "
+                 "for daemons to ATTACH to");
+
+/*
+ *  Persistent instances.  Normally a ufb_dev lives and dies with the
+ *  daemon's open file, and with it /dev/fbN, so a daemon crash or
+ *  upgrade makes fbcon rebind and clients lose their mappings.  Named
+ *  instances are kept on a list instead, which holds a reference of its
+ *  own:  when the daemon's fd goes away only what belongs to the daemon
+ *  (its trace, the cursor plane, client events) is dropped, and vmem and
+ *  the framebuffer carry on until another daemon ATTACHes.
+ *
+ *  While detached nobody presents, so vblank waiters are paced by the
+ *  soft vblank timer as they are while blanked.
+ */
+static LIST_HEAD(ufb_instances);
+static DEFINE_MUTEX(ufb_instances_lock);
+
+/*
+ *  Every instance, named or not, is numbered in ufb_ids as it's made, so
+ *  the hundreds a busy host runs can be told apart:  in the log, in
+ *  GET_INFO and in <debugfs>/ufb/instances.  Numbers go round rather
+ *  than being reused straight away, so an old log line doesn't point at
+ *  a newer instance.  Everything else an instance does is under locks of
+ *  its own;  ufb_ids_lock is only taken as one comes or goes, and
+ *  ufb_instances_lock as a daemon attaches or detaches.
+ */
+static DEFINE_IDR(ufb_ids);
+static DEFINE_SPINLOCK(ufb_ids_lock);
+
+int ufb_instance_register(struct ufb_dev *dev)
+{
+	int id;
+
+	idr_preload(GFP_KERNEL);
+	spin_lock(&ufb_ids_lock);
+	id = idr_alloc_cyclic(&ufb_ids, dev, 1, 0, GFP_NOWAIT);
+	spin_unlock(&ufb_ids_lock);
+	idr_preload_end();
+
+	if (id < 0)
+		return id;
+
+	dev->id = id;
+	return 0;
+}
+
+/* as the last reference goes */
+void ufb_instance_unregister(struct ufb_dev *dev)
+{
+	spin_lock(&ufb_ids_lock);
+	idr_remove(&ufb_ids, dev->id);
+	spin_unlock(&ufb_ids_lock);
+}
+
+/* the first instance numbered id or above still alive, with a reference */
+static struct ufb_dev *ufb_instance_next(int *id)
+{
+	struct ufb_dev *dev;
+
+	spin_lock(&ufb_ids_lock);
+	while ((dev = idr_get_next(&ufb_ids, id)) &&
+	       !kref_get_unless_zero(&dev->ref))
+		(*id)++;
+	spin_unlock(&ufb_ids_lock);
+
+	return dev;
+}
+
+static int ufb_instance_name_valid(const char *name)
+{
+	size_t len = strnlen(name, UFB_NAME_LEN);
+
+	return len && len < UFB_NAME_LEN;
+}
+
+/* called with ufb_instances_lock held */
+static struct ufb_dev *ufb_instance_find(const char *name)
+{
+	struct ufb_dev *dev;
+
+	list_for_each_entry(dev, &ufb_instances, instance) {
+		if (!strcmp(dev->name, name))
+			return dev;
+	}
+
+	return NULL;
+}
+
+/* called with ufb_instances_lock held;  the list takes a reference */
+static void ufb_instance_add(struct ufb_dev *dev, const char *name)
+{
+	strlcpy(dev->name, name, sizeof(dev->name));
+	dev->persistent = 1;
+	kref_get(&dev->ref);
+	list_add_tail(&dev->instance, &ufb_instances);
+}
+
+/*
+ *  The new daemon knows nothing of what's on screen, so it's told to
+ *  present all of it, and whether it's blanked.
+ */
+static void ufb_instance_resume(struct ufb_dev *dev)
+{
+	struct ufb_damage_rect all;
+	struct ufb_scanout scanout;
+	struct ufb_event event;
+
+	if (!dev->blank)
+		ufb_soft_vblank_stop(dev);
+
+	if (dev->blank) {
+		memset(&event, 0, sizeof(event));
+		event.type = UFB_EV_BLANK;
+		event.u.blank.level = dev->blank;
+		ufb_queue_event(dev, &event);
+	}
+
+	ufb_present_reset(dev);
+
+	if (ufb_fb_get_scanout(dev, &scanout))
+		return;
+
+	ufb_damage_reset(dev);
+
+	all.x = 0;
+	all.y = 0;
+	all.width = scanout.xres_virtual;
+	all.height = scanout.yres_virtual;
+	ufb_damage_add(dev, &all, 1, scanout.xres_virtual, scanout.yres_virtual);
+
+	/* it's about to read all of vmem, see ufb_reclaim.c */
+	ufb_reclaim_kick(dev);
+}
+
+/*
+ *  Either names dev, an fd's own instance, or has the fd go to the named
+ *  one instead.  Only a fresh fd can take over an instance;  the one it
+ *  came with is torn down, and freed with the fd.
+ */
+int ufb_instance_attach(struct ufb_dev *dev, struct ufb_attach *req)
+{
+	struct ufb_dev *instance;
+	int err = 0;
+
+	req->name[UFB_NAME_LEN - 1] = '\0';
+	if (!ufb_instance_name_valid(req->name))
+		return -EINVAL;
+
+	mutex_lock(&ufb_instances_lock);
+	mutex_lock(&dev->setup_lock);
+
+	if (dev->persistent || dev->attached || dev->dead) {
+		err = -EBUSY;
+		goto out;
+	}
+
+	instance = ufb_instance_find(req->name);
+	if (!instance) {
+		if (req->flags & UFB_ATTACH_CREATE)
+			ufb_instance_add(dev, req->name);
+		else
+			err = -ENOENT;
+		goto out;
+	}
+
+	if (!instance->detached || dev->vmem || dev->fb_info) {
+		err = -EBUSY;
+		goto out;
+	}
+
+	instance->detached = 0;
+	kref_get(&instance->ref);
+
+	/* the fd's operations go to instance from here on */
+	smp_wmb();
+	ACCESS_ONCE(dev->attached) = instance;
+
+	ufb_instance_resume(instance);
+
+	mutex_unlock(&dev->setup_lock);
+	mutex_unlock(&ufb_instances_lock);
+
+	/* a daemon restarting in a loop on a host with hundreds shouldn't flood */
+	printk_ratelimited(KERN_INFO "ufb%d:  attached to instance %s\n",
+	                   instance->id, instance->name);
+
+	ufb_dev_teardown(dev);
+
+	return 0;
+
+out:
+	mutex_unlock(&dev->setup_lock);
+	mutex_unlock(&ufb_instances_lock);
+	return err;
+}
+
+/*
+ *  The daemon's fd is going away.  Returns 1 if dev is persistent and
+ *  was left for the next daemon, 0 if it should be torn down.
+ */
+int ufb_instance_detach(struct ufb_dev *dev)
+{
+	int persistent;
+
+	mutex_lock(&ufb_instances_lock);
+
+	persistent = dev->persistent;
+	if (persistent) {
+		/* what a daemon sets up is changed under it, as ATTACH does */
+		mutex_lock(&dev->setup_lock);
+
+		ufb_trace_stop(dev);
+		ufb_cursor_plane(dev, 0);
+		dev->client_event_interval = 0;
+
+		if (dev->fb_info)
+			ufb_soft_vblank_start(dev);
+
+		dev->detached = 1;
+		ufb_reclaim_kick(dev);
+
+		mutex_unlock(&dev->setup_lock);
+	}
+
+	mutex_unlock(&ufb_instances_lock);
+
+	return persistent;
+}
+
+int ufb_instance_destroy(struct ufb_dev *dev)
+{
+	mutex_lock(&ufb_instances_lock);
+
+	if (!dev->persistent) {
+		mutex_unlock(&ufb_instances_lock);
+		return -EINVAL;
+	}
+
+	list_del_init(&dev->instance);
+	dev->persistent = 0;
+	dev->name[0] = '\0';
+
+	mutex_unlock(&ufb_instances_lock);
+
+	/* the list's reference;  the fd still has its own */
+	ufb_dev_put(dev);
+
+	return 0;
+}
+
+static const char *ufb_instance_state(struct ufb_dev *dev)
+{
+	if (dev->dead)
+		return "dead";
+	if (dev->detached)
+		return "detached";
+	if (!dev->fb_info)
+		return "setup";
+
+	return dev->blank ? "blanked" : "running";
+}
+
+/*
+ *  <debugfs>/ufb/instances, a line per instance alive.  Each is looked at
+ *  in turn, with a reference, so the listing doesn't hold up instances
+ *  coming and going, nor them it.
+ */
+static int ufb_instances_show(struct seq_file *m, void *unused)
+{
+	struct ufb_dev *dev;
+	int id;
+
+	seq_printf(m, "%-6s %-6s %10s %10s %7s %-8s %s\n", "id", "fb",
+	           "vmem_size", "capacity", "clients", "state", "name");
+
+	for (id = 1; (dev = ufb_instance_next(&id)); id++) {
+		char fb[8] = "-";
+
+		mutex_lock(&ufb_instances_lock);
+		mutex_lock(&dev->setup_lock);
+
+		if (dev->fb_info)
+			snprintf(fb, sizeof(fb), "fb%d", dev->fb_info->node);
+
+		seq_printf(m, "%-6d %-6s %10zu %10zu %7u %-8s %s\n", dev->id, fb,
+		           dev->vmem ? dev->vmem_size : 0,
+		           ufb_vmem_capacity(dev), ACCESS_ONCE(dev->client_count),
+		           ufb_instance_state(dev),
+		           dev->persistent ? dev->name : "-");
+
+		mutex_unlock(&dev->setup_lock);
+		mutex_unlock(&ufb_instances_lock);
+
+		ufb_dev_put(dev);
+	}
+
+	return 0;
+}
+
+static int ufb_instances_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ufb_instances_show, NULL);
+}
+
+static const struct file_operations ufb_instances_fops = {
+	.owner   = THIS_MODULE,
+	.open    = ufb_instances_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+/* instances named on the command line, waiting for a daemon */
+void ufb_instance_init(void)
+{
+	struct ufb_dev *dev;
+	int i;
+
+	/* goes with the directory */
+	if (ufb_debugfs_root)
+		debugfs_create_file("instances", 0444, ufb_debugfs_root, NULL,
+		                    &ufb_instances_fops);
+
+	mutex_lock(&ufb_instances_lock);
+
+	for (i = 0; i < ninstances; i++) {
+		if (!ufb_instance_name_valid(instances[i]) ||
+		    ufb_instance_find(instances[i])) {
+			printk(KERN_WARNING "ufb:  bad instance name %s\n",
+			       instances[i]);
+			continue;
+		}
+
+		dev = ufb_dev_alloc();
+		if (!dev)
+			break;
+
+		ufb_instance_add(dev, instances[i]);
+		dev->detached = 1;
+
+		/* the list's reference is the one it was allocated with */
+		ufb_dev_put(dev);
+	}
+
+	mutex_unlock(&ufb_instances_lock);
+}
+
+/* no daemon can have any open now;  clients' mappings keep dev itself */
+void ufb_instance_exit(void)
+{
+	struct ufb_dev *dev, *tmp;
+
+	mutex_lock(&ufb_instances_lock);
+
+	list_for_each_entry_safe(dev, tmp, &ufb_instances, instance) {
+		list_del_init(&dev->instance);
+		dev->persistent = 0;
+
+		ufb_dev_teardown(dev);
+		ufb_dev_put(dev);
+	}
+
+	mutex_unlock(&ufb_instances_lock);
+}
@@ -0,0 +1,526 @@
+#ifndef UFB_IOCTL_H
+#define UFB_IOCTL_H
+
+/*
+ * Interface between the ufb module and its userspace daemon (libufb).
+ * Included from both sides, so only use types from <linux/types.h>.
+ */
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define UFB_IOCTL_NR_ALLOC_VMEM       0
+#define UFB_IOCTL_NR_CREATE_FB        1
+#define UFB_IOCTL_NR_SIGNAL_VBLANK    2
+#define UFB_IOCTL_NR_ALLOC_VMEM_MEMFD 3
+#define UFB_IOCTL_NR_GET_SCANOUT      4
+#define UFB_IOCTL_NR_TRACE_START      5
+#define UFB_IOCTL_NR_TRACE_STOP       6
+#define UFB_IOCTL_NR_TRACE_READ       7
+#define UFB_IOCTL_NR_CLIENT_EVENTS    8
+#define UFB_IOCTL_NR_CURSOR_PLANE     9
+#define UFB_IOCTL_NR_GET_CURSOR       10
+#define UFB_IOCTL_NR_GET_CMAP         11
+#define UFB_IOCTL_NR_ALLOC_VMEM_NODE  12
+#define UFB_IOCTL_NR_GET_INFO         13
+#define UFB_IOCTL_NR_RESIZE           14
+#define UFB_IOCTL_NR_ATTACH           15
+#define UFB_IOCTL_NR_DESTROY          16
+#define UFB_IOCTL_NR_GET_DAMAGE       17
+#define UFB_IOCTL_NR_SNAPSHOT         18
+#define UFB_IOCTL_NR_PRESENT_LATCH    19
+#define UFB_IOCTL_NR_PRESENT_ACK      20
+
+/*
+ * ALLOC_VMEM on a given NUMA node;  node -1 means the caller's node.  The
+ * node actually used is written back.
+ */
+struct ufb_alloc_vmem {
+	__u32 size;
+	__s32 node;
+};
+
+/*
+ * Backs vmem with pages of a memfd owned by the daemon instead of driver
+ * allocated memory.  addr must be a MAP_SHARED mapping of fd at offset 0
+ * in the caller, covering at least size bytes.  The daemon is expected to
+ * have sealed the memfd against shrinking.
+ */
+struct ufb_memfd {
+	__s32 fd;
+	__u32 size;
+	__u64 addr;
+};
+
+/*
+ * node is where most of vmem lives, -1 if it isn't allocated yet.
+ * vmem_capacity is how far RESIZE can grow vmem;  mapping that much of
+ * /dev/ufb up front keeps the mapping valid across resizes.  id numbers
+ * the instance among those alive, from 1, as <debugfs>/ufb/instances
+ * lists them;  fb_node is the N of its /dev/fbN, -1 before CREATE_FB.
+ * Unused fields are zero;  later versions may fill them in.
+ */
+#define UFB_INFO_FB         (1 << 0)  /* CREATE_FB was done */
+#define UFB_INFO_PERSISTENT (1 << 1)
+#define UFB_INFO_SNAPSHOT   (1 << 2)  /* SNAPSHOT is on */
+
+struct ufb_info {
+	__u32 vmem_size;
+	__s32 node;
+	__u32 vmem_capacity;
+	__u32 flags;
+	__u32 id;
+	__s32 fb_node;
+	__u32 reserved[10];
+};
+
+/*
+ * Persistent instances outlive the daemon's fd:  vmem and /dev/fbN stay
+ * as they are when it's closed, so clients and fbcon don't notice the
+ * daemon going away, and the next daemon to ATTACH by name carries on
+ * with them.  They're made by ATTACH with UFB_ATTACH_CREATE, which names
+ * the fd's own instance when there's none by that name yet, or by the
+ * module's instances parameter.
+ *
+ * ATTACH on a fresh fd takes over the named instance if no other daemon
+ * has it (EBUSY otherwise, ENOENT if there's none) and queues a
+ * UFB_EV_DAMAGE for the whole screen.  GET_INFO then says how far it
+ * was set up.  DESTROY makes the fd's instance anonymous again, to go
+ * away when the fd is closed.
+ */
+#define UFB_NAME_LEN 32
+
+#define UFB_ATTACH_CREATE (1 << 0)
+
+struct ufb_attach {
+	char name[UFB_NAME_LEN];
+	__u32 flags;
+	__u32 reserved;
+};
+
+/*
+ * Resizes vmem in place and sets a new mode to go with it, as one step.
+ * Existing mappings of /dev/ufb and /dev/fbN stay valid;  pages past a
+ * shrunk vmem raise SIGBUS until it grows again.  xres 0 keeps the
+ * current mode and bits_per_pixel 0 the current depth.  Fails with
+ * ENOSPC past vmem_capacity.  Sends UFB_EV_RESIZE when done.
+ */
+struct ufb_resize {
+	__u32 vmem_size;
+	__u32 xres;
+	__u32 yres;
+	__u32 bits_per_pixel;
+};
+
+/* yoffset wraps around yres_virtual (FB_VMODE_YWRAP) */
+#define UFB_SCANOUT_YWRAP (1 << 0)
+
+/*
+ * Some client maps /dev/fbN without having reported damage with
+ * UFB_FBIO_DAMAGE, so what it draws there isn't in GET_DAMAGE:  present
+ * the whole screen.
+ */
+#define UFB_SCANOUT_UNTRACKED (1 << 1)
+
+/*
+ * YUV modes clients can set with FBIOPUT_VSCREENINFO, var.grayscale
+ * holding the code (FB_VISUAL_FOURCC), for the daemon to convert when
+ * presenting.  Codes are V4L2's.  line_length is the pitch of the luma
+ * plane, which is yres_virtual lines tall;  the chroma follows it at
+ * half the height:  NV12 as one plane of interleaved U and V at the same
+ * pitch, I420 as a U plane then a V plane at half the pitch.  Planar
+ * modes don't pan.  YUYV is packed, two bytes per pixel.
+ */
+#define UFB_FOURCC(a, b, c, d) \
+	((__u32)(a) | ((__u32)(b) << 8) | ((__u32)(c) << 16) | ((__u32)(d) << 24))
+
+#define UFB_FOURCC_NV12 UFB_FOURCC('N', 'V', '1', '2')
+#define UFB_FOURCC_I420 UFB_FOURCC('Y', 'U', '1', '2')
+#define UFB_FOURCC_YUYV UFB_FOURCC('Y', 'U', 'Y', 'V')
+
+/*
+ * The part of vmem currently being scanned out, as last set by
+ * FBIOPUT_VSCREENINFO or FBIOPAN_DISPLAY.  fourcc is 0 for RGB modes.
+ * Older callers may pass the struct without fourcc;  only as much as
+ * the ioctl's size says is written.
+ */
+struct ufb_scanout {
+	__u32 xres;
+	__u32 yres;
+	__u32 xres_virtual;
+	__u32 yres_virtual;
+	__u32 xoffset;
+	__u32 yoffset;
+	__u32 line_length;
+	__u32 bits_per_pixel;
+	__u32 flags;
+	__u32 fourcc;
+};
+
+/*
+ * Stable frames for the daemon.  SNAPSHOT UFB_SNAPSHOT_ARM asks for the
+ * frame at the next SIGNAL_VBLANK:  until the vblank after it, the
+ * daemon's mapping of vmem shows vmem as it was then, however clients
+ * draw meanwhile.  Pages they touch are copied on their first fault
+ * after the vblank, and the daemon sees the copies.  The console isn't
+ * covered.
+ *
+ * The cost falls on clients, and only in armed frames:  at the vblank
+ * every client mapping is zapped, so they take a fault on each page they
+ * touch in the frame (reads too, as pfn mappings can't be write
+ * protected), plus a page copy the first time.  A daemon arming every
+ * frame, to save single buffered clients from tearing, pays that every
+ * frame.  Frames nobody armed cost nothing.
+ *
+ * UFB_SNAPSHOT_ON only sets aside what it takes, UFB_SNAPSHOT_ARM does
+ * that too if needed, and UFB_SNAPSHOT_OFF frees it.
+ */
+#define UFB_SNAPSHOT_OFF 0
+#define UFB_SNAPSHOT_ON  1
+#define UFB_SNAPSHOT_ARM 2
+
+/*
+ * Damage reported by clients that know what they drew, on /dev/fbN
+ * rather than /dev/ufb (write() to /dev/fbN reports its own).  Saves the
+ * daemon from finding out by comparing or from uploading whole pages for
+ * a one pixel wide line.  Rectangles are in virtual screen pixels and
+ * are clipped to it.  It also marks the calling process's mappings of
+ * /dev/fbN as reporting their damage, see UFB_SCANOUT_UNTRACKED.
+ *
+ * UFB_FB_DAMAGE_PAN pans to xoffset, yoffset (and FB_VMODE_YWRAP in
+ * vmode) as FBIOPAN_DISPLAY would, in the same call:  the daemon never
+ * sees the new offsets without the damage that goes with them.  Offsets
+ * FBIOPAN_DISPLAY would refuse fail with EINVAL, and nothing is added.
+ */
+#define UFB_FB_DAMAGE_MAX_RECTS 256
+
+#define UFB_FB_DAMAGE_PAN (1 << 0)
+
+struct ufb_damage_rect {
+	__u32 x;
+	__u32 y;
+	__u32 width;
+	__u32 height;
+};
+
+struct ufb_fb_damage {
+	__u64 rects;       /* struct ufb_damage_rect *, count of them */
+	__u32 count;
+	__u32 flags;
+	__u32 xoffset;
+	__u32 yoffset;
+	__u32 vmode;
+	__u32 reserved;
+};
+
+/*
+ * The damage pending since the last GET_DAMAGE, which clears it.  Client
+ * rectangles are merged into at most UFB_DAMAGE_RECTS, overlapping ones
+ * first, so some may cover more than was damaged.
+ */
+#define UFB_DAMAGE_RECTS 16
+
+struct ufb_damage {
+	__u32 count;
+	__u32 reserved;
+	struct ufb_damage_rect rects[UFB_DAMAGE_RECTS];
+};
+
+/*
+ * Present feedback, for clients keeping exactly one frame ahead.  Once a
+ * frame is drawn (and flipped to, with FBIOPAN_DISPLAY or UFB_FBIO_DAMAGE)
+ * UFB_FBIO_PRESENT_MARK on /dev/fbN numbers it, and UFB_FBIO_PRESENT_WAIT
+ * waits until that frame, or a later one, is on screen and says when.
+ * WAIT with timeout_ms 0 only looks (EAGAIN if it isn't shown yet), for
+ * clients polling from their own loop;  it fails with ETIMEDOUT once
+ * timeout_ms, at most a second, has passed, and with ENODEV once the
+ * framebuffer is going away.
+ *
+ * The daemon takes the latest mark with PRESENT_LATCH before it reads
+ * vmem for a frame and hands it back with PRESENT_ACK once that frame is
+ * shown, timestamp when that was (0 for now).  A mark is announced with
+ * UFB_EV_PRESENT, once until the next LATCH, so an idle daemon knows to
+ * present.  Until a daemon has latched, its SIGNAL_VBLANK completes the
+ * marks before it with UFB_PRESENT_INEXACT.  While blanked or detached
+ * nothing is shown:  the vblank timer completes them with
+ * UFB_PRESENT_SKIPPED, so clients keep their pace.
+ */
+#define UFB_PRESENT_SKIPPED (1 << 0)
+#define UFB_PRESENT_INEXACT (1 << 1)
+
+struct ufb_fb_present {
+	__u64 seq;        /* MARK: the new frame's;  WAIT: the one to wait for */
+	__u64 timestamp;  /* WAIT: when shown, ns CLOCK_MONOTONIC */
+	__u64 presented;  /* WAIT: the latest frame shown */
+	__u32 timeout_ms; /* WAIT */
+	__u32 flags;      /* WAIT: UFB_PRESENT_* */
+};
+
+/* LATCH:  seq is the latest mark, timestamp when it was made */
+struct ufb_present {
+	__u64 seq;
+	__u64 timestamp;
+};
+
+/*
+ * Events are read() from the /dev/ufb fd, which also supports poll().
+ * Each read returns a whole number of struct ufb_event.  Writing to the
+ * fd, whatever the data, signals a vblank like SIGNAL_VBLANK.
+ */
+#define UFB_EV_BLANK   1
+#define UFB_EV_CLIENT  2
+#define UFB_EV_CURSOR  3
+#define UFB_EV_CMAP    4
+#define UFB_EV_RESIZE  5
+#define UFB_EV_DAMAGE  6
+#define UFB_EV_PRESENT 7
+
+struct ufb_ev_blank {
+	__s32 level;   /* FB_BLANK_*, FB_BLANK_UNBLANK (0) when shown */
+};
+
+/*
+ * Activity of one process using the framebuffer, sent for each process
+ * that did something since the last report, at most every n ms as set
+ * with CLIENT_EVENTS (0, the default, turns them off).  Counters are
+ * totals since the process first used the device;  pid 0 collects work
+ * done from kernel threads (fbcon cursor blinking).
+ */
+struct ufb_ev_client {
+	__s32 pid;
+	__u32 pans;
+	__u32 vsync_waits;
+	__u32 mmaps;
+	__u64 write_bytes;  /* through write() */
+	__u64 damage;       /* pixels drawn by write() and fbcon blits */
+	char comm[16];
+};
+
+/*
+ * Console cursor, sent on every change once the daemon took over cursor
+ * drawing with CURSOR_PLANE.  x and y are the top left of the image in
+ * virtual screen coordinates, like the rest of vmem.  The image itself is
+ * fetched with GET_CURSOR whenever image_seq changes.
+ */
+#define UFB_CURSOR_MAX 64
+
+struct ufb_ev_cursor {
+	__u32 enable;
+	__s32 x;
+	__s32 y;
+	__u32 hot_x;
+	__u32 hot_y;
+	__u32 width;
+	__u32 height;
+	__u32 image_seq;
+};
+
+/*
+ * buf receives width * height __u32 pixels, each the value the cursor
+ * would have stored in vmem at the current bits_per_pixel.  The cursor
+ * cell is opaque:  it already has the character under it drawn in.
+ */
+struct ufb_cursor_image {
+	__u64 buf;
+	__u32 len;
+	__u32 width;
+	__u32 height;
+	__u32 image_seq;
+};
+
+/*
+ * The colormap or how pixels index it changed;  fetch it with GET_CMAP.
+ * Only PSEUDOCOLOR and DIRECTCOLOR visuals, and grayscale, need the
+ * daemon to translate pixels when presenting.
+ */
+struct ufb_ev_cmap {
+	__u32 seq;
+};
+
+struct ufb_cmap {
+	__u32 seq;
+	__u32 visual;          /* FB_VISUAL_* */
+	__u32 grayscale;
+	__u32 bits_per_pixel;
+	__u32 red_offset;
+	__u32 red_length;
+	__u32 green_offset;
+	__u32 green_length;
+	__u32 blue_offset;
+	__u32 blue_length;
+	__u16 red[256];        /* as set by FBIOPUTCMAP, grayscale applied */
+	__u16 green[256];
+	__u16 blue[256];
+};
+
+/* vmem or the mode was changed by RESIZE */
+struct ufb_ev_resize {
+	__u32 vmem_size;
+	__u32 xres;
+	__u32 yres;
+	__u32 bits_per_pixel;
+};
+
+/*
+ * Part of the virtual screen has to be presented again, though the
+ * daemon may not have seen it change:  all of it after ATTACH, or what
+ * a client wrote or reported with UFB_FBIO_DAMAGE, or the console drew.
+ * Sent once, with the bounds of the first damage, until GET_DAMAGE takes
+ * what's pending.
+ */
+struct ufb_ev_damage {
+	__u32 x;
+	__u32 y;
+	__u32 width;
+	__u32 height;
+};
+
+/* a client marked frame seq, see PRESENT_LATCH */
+struct ufb_ev_present {
+	__u64 seq;
+};
+
+struct ufb_event {
+	__u32 type;
+	__u32 reserved;
+	__u64 timestamp;  /* ns, CLOCK_MONOTONIC */
+	union {
+		struct ufb_ev_blank blank;
+		struct ufb_ev_client client;
+		struct ufb_ev_cursor cursor;
+		struct ufb_ev_cmap cmap;
+		struct ufb_ev_resize resize;
+		struct ufb_ev_damage damage;
+		struct ufb_ev_present present;
+		__u8 pad[48];
+	} u;
+};
+
+/*
+ * Client activity trace.  TRACE_READ returns a stream of records, each a
+ * struct ufb_trace_record followed by size bytes of payload and padding
+ * up to the next UFB_TRACE_ALIGN boundary.  Trace files are a struct
+ * ufb_trace_file_header followed by the same stream.
+ */
+#define UFB_TRACE_MAGIC   0x54424655 /* "UFBT" */
+#define UFB_TRACE_VERSION 1
+#define UFB_TRACE_ALIGN   8
+
+enum {
+	UFB_TRACE_MODE = 1,    /* ufb_trace_mode, mode when tracing started */
+	UFB_TRACE_SET_VAR,     /* ufb_trace_mode */
+	UFB_TRACE_WRITE,       /* ufb_trace_write + data, via write() */
+	UFB_TRACE_MMAP_WRITE,  /* ufb_trace_write + data, seen changed at vblank */
+	UFB_TRACE_PAN,         /* ufb_trace_pan */
+	UFB_TRACE_VSYNC_WAIT,  /* no payload */
+	UFB_TRACE_FILLRECT,    /* ufb_trace_fillrect */
+	UFB_TRACE_COPYAREA,    /* ufb_trace_copyarea */
+	UFB_TRACE_IMAGEBLIT,   /* ufb_trace_imageblit + image data */
+	UFB_TRACE_VBLANK,      /* no payload, daemon presented a frame */
+};
+
+struct ufb_trace_file_header {
+	__u32 magic;
+	__u32 version;
+};
+
+struct ufb_trace_record {
+	__u16 type;
+	__u16 reserved;
+	__u32 size;
+	__u64 timestamp;  /* ns, CLOCK_MONOTONIC */
+};
+
+struct ufb_trace_mode {
+	__u32 xres;
+	__u32 yres;
+	__u32 xres_virtual;
+	__u32 yres_virtual;
+	__u32 xoffset;
+	__u32 yoffset;
+	__u32 bits_per_pixel;
+	__u32 grayscale;
+	__u32 vmode;
+	__u32 line_length;
+};
+
+struct ufb_trace_write {
+	__u32 offset;
+	__u32 length;
+};
+
+struct ufb_trace_pan {
+	__u32 xoffset;
+	__u32 yoffset;
+	__u32 vmode;
+};
+
+/* colors are already resolved to pixel values */
+struct ufb_trace_fillrect {
+	__u32 dx;
+	__u32 dy;
+	__u32 width;
+	__u32 height;
+	__u32 color;
+	__u32 rop;
+};
+
+struct ufb_trace_copyarea {
+	__u32 dx;
+	__u32 dy;
+	__u32 width;
+	__u32 height;
+	__u32 sx;
+	__u32 sy;
+};
+
+/*
+ * depth 1 images are followed by a bitmap, (width + 7) / 8 bytes per
+ * line, expanded with fg/bg;  others (the logo) by the raw image data,
+ * width * depth / 8 bytes per line.
+ */
+struct ufb_trace_imageblit {
+	__u32 dx;
+	__u32 dy;
+	__u32 width;
+	__u32 height;
+	__u32 fg_color;
+	__u32 bg_color;
+	__u32 depth;
+	__u32 length;
+};
+
+struct ufb_trace_read {
+	__u64 buf;
+	__u32 len;
+	__u32 lost;  /* records dropped because the trace buffer was full */
+};
+
+#define UFB_IOCTL_ALLOC_VMEM       (_IOW('U', UFB_IOCTL_NR_ALLOC_VMEM, __u32 *))
+#define UFB_IOCTL_CREATE_FB        (_IO('U', UFB_IOCTL_NR_CREATE_FB))
+#define UFB_IOCTL_SIGNAL_VBLANK    (_IO('U', UFB_IOCTL_NR_SIGNAL_VBLANK))
+#define UFB_IOCTL_ALLOC_VMEM_MEMFD (_IOW('U', UFB_IOCTL_NR_ALLOC_VMEM_MEMFD, struct ufb_memfd))
+#define UFB_IOCTL_GET_SCANOUT      (_IOR('U', UFB_IOCTL_NR_GET_SCANOUT, struct ufb_scanout))
+#define UFB_IOCTL_TRACE_START      (_IOW('U', UFB_IOCTL_NR_TRACE_START, __u32))
+#define UFB_IOCTL_TRACE_STOP       (_IO('U', UFB_IOCTL_NR_TRACE_STOP))
+#define UFB_IOCTL_TRACE_READ       (_IOWR('U', UFB_IOCTL_NR_TRACE_READ, struct ufb_trace_read))
+#define UFB_IOCTL_CLIENT_EVENTS    (_IOW('U', UFB_IOCTL_NR_CLIENT_EVENTS, __u32))
+#define UFB_IOCTL_CURSOR_PLANE     (_IOW('U', UFB_IOCTL_NR_CURSOR_PLANE, __u32))
+#define UFB_IOCTL_GET_CURSOR       (_IOWR('U', UFB_IOCTL_NR_GET_CURSOR, struct ufb_cursor_image))
+#define UFB_IOCTL_ALLOC_VMEM_NODE  (_IOWR('U', UFB_IOCTL_NR_ALLOC_VMEM_NODE, struct ufb_alloc_vmem))
+#define UFB_IOCTL_GET_INFO         (_IOR('U', UFB_IOCTL_NR_GET_INFO, struct ufb_info))
+#define UFB_IOCTL_GET_CMAP         (_IOR('U', UFB_IOCTL_NR_GET_CMAP, struct ufb_cmap))
+#define UFB_IOCTL_RESIZE           (_IOW('U', UFB_IOCTL_NR_RESIZE, struct ufb_resize))
+#define UFB_IOCTL_ATTACH           (_IOW('U', UFB_IOCTL_NR_ATTACH, struct ufb_attach))
+#define UFB_IOCTL_DESTROY          (_IO('U', UFB_IOCTL_NR_DESTROY))
+#define UFB_IOCTL_GET_DAMAGE       (_IOR('U', UFB_IOCTL_NR_GET_DAMAGE, struct ufb_damage))
+#define UFB_IOCTL_SNAPSHOT         (_IOW('U', UFB_IOCTL_NR_SNAPSHOT, __u32))
+#define UFB_IOCTL_PRESENT_LATCH    (_IOR('U', UFB_IOCTL_NR_PRESENT_LATCH, struct ufb_present))
+#define UFB_IOCTL_PRESENT_ACK      (_IOW('U', UFB_IOCTL_NR_PRESENT_ACK, struct ufb_present))
+
+/* on /dev/fbN */
+#define UFB_FBIO_DAMAGE            (_IOW('U', 0x80, struct ufb_fb_damage))
+#define UFB_FBIO_PRESENT_MARK      (_IOR('U', 0x81, struct ufb_fb_present))
+#define UFB_FBIO_PRESENT_WAIT      (_IOWR('U', 0x82, struct ufb_fb_present))
+
+#endif //UFB_IOCTL_H
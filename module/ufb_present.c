@@ -0,0 +1,232 @@
+#include "ufb_drv.h"
+
+#include <linux/jiffies.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+
+/*
+ *  Frames marked by clients and when the daemon showed them.  Marks are
+ *  numbered from 1;  present_latched is the latest the daemon has taken
+ *  into a frame it's presenting, present_done the latest it has shown,
+ *  so done <= latched <= marked.  Waiters only ever wait for done, or
+ *  for present_gone once the framebuffer is going away.
+ */
+
+/* how long one WAIT may sleep with info locked */
+#define UFB_PRESENT_WAIT_MAX_MS 1000
+
+static u64 ufb_present_now(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+/* called with present_lock held */
+static void ufb_present_complete(struct ufb_dev *dev, u64 seq, u64 timestamp,
+                                 u32 flags)
+{
+	if (seq <= dev->present_done)
+		return;
+
+	dev->present_done = seq;
+	dev->present_time = timestamp;
+	dev->present_flags = flags;
+}
+
+static int ufb_present_shown(struct ufb_dev *dev, u64 seq)
+{
+	unsigned long flags;
+	int shown;
+
+	spin_lock_irqsave(&dev->present_lock, flags);
+	shown = dev->present_done >= seq || dev->present_gone;
+	spin_unlock_irqrestore(&dev->present_lock, flags);
+
+	return shown;
+}
+
+int ufb_present_mark(struct ufb_dev *dev, struct ufb_fb_present __user *arg)
+{
+	struct ufb_fb_present req;
+	struct ufb_event event;
+	int notify;
+
+	memset(&req, 0, sizeof(req));
+
+	spin_lock_irq(&dev->present_lock);
+	req.seq = ++dev->present_marked;
+	dev->present_mark_time = ufb_present_now();
+	notify = !dev->present_notified;
+	dev->present_notified = 1;
+	spin_unlock_irq(&dev->present_lock);
+
+	if (notify) {
+		memset(&event, 0, sizeof(event));
+		event.type = UFB_EV_PRESENT;
+		event.u.present.seq = req.seq;
+		ufb_queue_event(dev, &event);
+	}
+
+	if (copy_to_user(arg, &req, sizeof(req)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/*
+ *  Called with info locked, as fb_ioctl() does.  The lock is let go
+ *  while waiting, so the client's other threads can go on panning and
+ *  marking, and the daemon isn't held up on its way to the ack.  dev is
+ *  pinned meanwhile, and counting in present_waiters keeps teardown
+ *  from freeing info until we have it locked again.
+ */
+int ufb_present_wait(struct fb_info *info, struct ufb_fb_present __user *arg)
+{
+	struct ufb_dev *dev = info->par;
+	struct ufb_fb_present req;
+	int gone;
+	long ret = 0;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+
+	spin_lock_irq(&dev->present_lock);
+	if (dev->present_gone)
+		ret = -ENODEV;
+	else if (req.seq > dev->present_marked)
+		ret = -EINVAL;
+	else if (req.timeout_ms)
+		dev->present_waiters++;
+	spin_unlock_irq(&dev->present_lock);
+
+	if (ret)
+		return ret;
+
+	if (req.timeout_ms) {
+		kref_get(&dev->ref);
+		mutex_unlock(&info->lock);
+		ret = wait_event_interruptible_timeout(dev->present_wait,
+		                                       ufb_present_shown(dev, req.seq),
+		                                       msecs_to_jiffies(min_t(u32, req.timeout_ms,
+		                                                              UFB_PRESENT_WAIT_MAX_MS)));
+		mutex_lock(&info->lock);
+
+		spin_lock_irq(&dev->present_lock);
+		dev->present_waiters--;
+		spin_unlock_irq(&dev->present_lock);
+		wake_up_all(&dev->present_wait);
+
+		/* never the last:  teardown comes before that, and waits for us */
+		ufb_dev_put(dev);
+
+		if (ret < 0)
+			return ret;
+	}
+
+	spin_lock_irq(&dev->present_lock);
+	gone = dev->present_gone;
+	req.presented = dev->present_done;
+	req.timestamp = dev->present_time;
+	req.flags = dev->present_flags;
+	spin_unlock_irq(&dev->present_lock);
+
+	if (gone)
+		return -ENODEV;
+
+	if (req.presented < req.seq)
+		return req.timeout_ms ? -ETIMEDOUT : -EAGAIN;
+
+	if (copy_to_user(arg, &req, sizeof(req)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/* the daemon is about to read vmem for a frame */
+void ufb_present_latch(struct ufb_dev *dev, struct ufb_present *req)
+{
+	spin_lock_irq(&dev->present_lock);
+	dev->present_latched = dev->present_marked;
+	dev->present_notified = 0;
+	dev->present_daemon = 1;
+	req->seq = dev->present_latched;
+	req->timestamp = dev->present_mark_time;
+	spin_unlock_irq(&dev->present_lock);
+}
+
+/* and has shown it;  it can't own up to more than it latched */
+void ufb_present_ack(struct ufb_dev *dev, const struct ufb_present *req)
+{
+	u64 timestamp = req->timestamp ? req->timestamp : ufb_present_now();
+
+	spin_lock_irq(&dev->present_lock);
+	ufb_present_complete(dev, min(req->seq, dev->present_latched),
+	                     timestamp, 0);
+	spin_unlock_irq(&dev->present_lock);
+
+	wake_up_interruptible_all(&dev->present_wait);
+}
+
+/*
+ *  A vblank with no daemon telling us what it showed:  the soft vblank
+ *  while nothing is shown, or SIGNAL_VBLANK from a daemon that doesn't
+ *  latch.  Completes every mark so far with flags.  May be called from
+ *  the timer.
+ */
+void ufb_present_vblank(struct ufb_dev *dev, u32 flags)
+{
+	unsigned long irqflags;
+	int woken;
+
+	spin_lock_irqsave(&dev->present_lock, irqflags);
+	woken = dev->present_marked > dev->present_done;
+	if ((flags & UFB_PRESENT_INEXACT) && dev->present_daemon)
+		woken = 0;
+	if (woken) {
+		dev->present_latched = dev->present_marked;
+		ufb_present_complete(dev, dev->present_marked, ufb_present_now(),
+		                     flags);
+	}
+	spin_unlock_irqrestore(&dev->present_lock, irqflags);
+
+	if (woken)
+		wake_up_interruptible_all(&dev->present_wait);
+}
+
+static int ufb_present_idle(struct ufb_dev *dev)
+{
+	int idle;
+
+	spin_lock_irq(&dev->present_lock);
+	idle = !dev->present_waiters;
+	spin_unlock_irq(&dev->present_lock);
+
+	return idle;
+}
+
+/*
+ *  The framebuffer is going away:  waiters give up with ENODEV, and are
+ *  back in fb_ioctl() with info locked by the time this returns, so
+ *  unregistering waits for them to be done with it.
+ */
+void ufb_present_shutdown(struct ufb_dev *dev)
+{
+	spin_lock_irq(&dev->present_lock);
+	dev->present_gone = 1;
+	spin_unlock_irq(&dev->present_lock);
+
+	wake_up_interruptible_all(&dev->present_wait);
+	wait_event(dev->present_wait, ufb_present_idle(dev));
+}
+
+/* a new daemon:  it has to latch before its acks count */
+void ufb_present_reset(struct ufb_dev *dev)
+{
+	spin_lock_irq(&dev->present_lock);
+	dev->present_latched = dev->present_done;
+	dev->present_notified = 0;
+	dev->present_daemon = 0;
+	spin_unlock_irq(&dev->present_lock);
+}
@@ -0,0 +1,546 @@
+#include "ufb_drv.h"
+
+#include <linux/debugfs.h>
+#include <linux/highmem.h>
+#include <linux/kernel.h>
+#include <linux/lzo.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+static unsigned int reclaim_delay;
+module_param(reclaim_delay, uint, 0644);
+MODULE_PARM_DESC(reclaim_delay, "Seconds a blanked or detached framebuffer "
+                 "has to go untouched before its vmem is compressed, "
+                 "0 to never compress");
+
+static unsigned int reclaim_ratio = 50;
+module_param(reclaim_ratio, uint, 0644);
+MODULE_PARM_DESC(reclaim_ratio, "Pages compressing to more than this percentage "
+                 "of their size stay as they are");
+
+/*
+ *  Compressing vmem nobody is looking at.  A host running hundreds of
+ *  consoles holds a screenful of pages for each, blanked or with no
+ *  daemon for most of them, and mostly a flat background with a little
+ *  text, which compresses very well.
+ *
+ *  Once a framebuffer is blanked or detached and vmem has gone untouched
+ *  for reclaim_delay seconds, each page is zapped from every userspace
+ *  mapping and from the kernel's, compressed with LZO (or, all one value,
+ *  kept as that value) and freed.  A fault, read() or write() brings back
+ *  the pages it needs;  unblanking or a daemon attaching brings back all
+ *  of them.
+ *
+ *  fbcon draws through screen_base from wherever the console happens to
+ *  be, often where we can't sleep to bring pages back.  While anything
+ *  is compressed its drawing is dropped instead, and once everything has
+ *  been brought back fbcon is made to repaint.  Only our own pages are
+ *  compressed:  a daemon memfd's are shmem's to reclaim.
+ *
+ *  Needs the kernel built with LZO_COMPRESS and LZO_DECOMPRESS, as it is
+ *  for zram and most filesystems.
+ */
+
+struct ufb_zpage {
+	/* 0 if every word of the page is fill */
+	size_t len;
+	unsigned long fill;
+	u8 data[];
+};
+
+/* all framebuffers, for <debugfs>/ufb/reclaim */
+static atomic_long_t ufb_reclaim_pages;
+static atomic_long_t ufb_reclaim_bytes;
+
+static int ufb_reclaim_wanted(struct ufb_dev *dev)
+{
+	return reclaim_delay && !dev->reclaim_off && dev->vmem && !dev->memfd &&
+	       (dev->blank || dev->detached);
+}
+
+/* NULL if the page isn't worth keeping compressed */
+static struct ufb_zpage *ufb_reclaim_compress(struct ufb_dev *dev,
+                                              struct page *page)
+{
+	unsigned long *src = kmap(page);
+	size_t len = lzo1x_worst_compress(PAGE_SIZE);
+	struct ufb_zpage *zp = NULL;
+	unsigned int i;
+
+	for (i = 1; i < PAGE_SIZE / sizeof(*src); i++) {
+		if (src[i] != src[0])
+			break;
+	}
+
+	if (i == PAGE_SIZE / sizeof(*src)) {
+		zp = kmalloc(sizeof(*zp), GFP_KERNEL | __GFP_NOWARN);
+		if (zp) {
+			zp->len = 0;
+			zp->fill = src[0];
+		}
+		goto out;
+	}
+
+	if (lzo1x_1_compress((u8 *)src, PAGE_SIZE, dev->reclaim_buf, &len,
+	                     dev->reclaim_wrkmem) != LZO_E_OK ||
+	    len > PAGE_SIZE * min(reclaim_ratio, 100U) / 100)
+		goto out;
+
+	zp = kmalloc(sizeof(*zp) + len, GFP_KERNEL | __GFP_NOWARN);
+	if (zp) {
+		zp->len = len;
+		memcpy(zp->data, dev->reclaim_buf, len);
+	}
+
+out:
+	kunmap(page);
+	return zp;
+}
+
+static int ufb_reclaim_decompress(struct ufb_zpage *zp, struct page *page)
+{
+	unsigned long *dst = kmap(page);
+	size_t len = PAGE_SIZE;
+	unsigned int i;
+	int err = 0;
+
+	if (!zp->len) {
+		for (i = 0; i < PAGE_SIZE / sizeof(*dst); i++)
+			dst[i] = zp->fill;
+	} else if (lzo1x_decompress_safe(zp->data, zp->len, (u8 *)dst,
+	                                 &len) != LZO_E_OK || len != PAGE_SIZE) {
+		err = -EIO;
+	}
+
+	kunmap(page);
+	return err;
+}
+
+static void ufb_reclaim_forget(struct ufb_dev *dev, unsigned int i)
+{
+	struct ufb_zpage *zp = dev->reclaim_store[i];
+
+	dev->reclaim_store[i] = NULL;
+	dev->reclaimed--;
+	dev->reclaim_stats.bytes -= zp->len;
+	if (!zp->len)
+		dev->reclaim_stats.same--;
+
+	atomic_long_dec(&ufb_reclaim_pages);
+	atomic_long_sub(zp->len, &ufb_reclaim_bytes);
+
+	kfree(zp);
+}
+
+/* called with reclaim_lock held */
+static int ufb_reclaim_restore_page(struct ufb_dev *dev, unsigned int i,
+                                    gfp_t gfp)
+{
+	struct page *page;
+
+	page = alloc_pages_node(dev->node, gfp, 0);
+	if (!page)
+		return -ENOMEM;
+
+	/* it's our own data;  a blank page is better than none at all */
+	if (WARN_ON_ONCE(ufb_reclaim_decompress(dev->reclaim_store[i], page)))
+		clear_highpage(page);
+
+	spin_lock(&dev->pages_lock);
+	dev->pages[i] = page;
+	spin_unlock(&dev->pages_lock);
+
+	ufb_reclaim_forget(dev, i);
+	dev->reclaim_stats.restored++;
+
+	return 0;
+}
+
+/* called with reclaim_lock held */
+static int ufb_reclaim_restore_locked(struct ufb_dev *dev, unsigned int first,
+                                      unsigned int count)
+{
+	unsigned int i, end;
+	int err;
+
+	end = first + min(count, dev->npages - min(first, dev->npages));
+
+	for (i = first; i < end; i++) {
+		if (dev->pages[i])
+			continue;
+
+		/* nothing to bring it back from */
+		if (!dev->reclaim_store || !dev->reclaim_store[i])
+			return -EFAULT;
+
+		err = ufb_reclaim_restore_page(dev, i, GFP_KERNEL);
+		if (err)
+			return err;
+	}
+
+	/* the kernel only maps vmem whole */
+	if (!dev->reclaimed)
+		return ufb_vmem_remap(dev);
+
+	return 0;
+}
+
+/*
+ *  Brings back count pages from first.  0 if they are all there, unless
+ *  they're past the end of vmem.  Sleeps.
+ */
+int ufb_reclaim_restore(struct ufb_dev *dev, unsigned int first,
+                        unsigned int count)
+{
+	unsigned int before;
+	int err;
+
+	if (!ACCESS_ONCE(dev->reclaimed) && !ACCESS_ONCE(dev->reclaim_busy) &&
+	    !ACCESS_ONCE(dev->reclaim_off) && !ACCESS_ONCE(dev->unmapped))
+		return 0;
+
+	mutex_lock(&dev->reclaim_lock);
+	before = dev->reclaimed;
+	err = ufb_reclaim_restore_locked(dev, first, count);
+	mutex_unlock(&dev->reclaim_lock);
+
+	/* still idle, they can go again later */
+	if (dev->reclaimed != before)
+		ufb_reclaim_kick(dev);
+
+	return err;
+}
+
+/*
+ *  For the kernel to use screen_base where it can sleep:  brings back all
+ *  of vmem, as the kernel only maps it whole, and keeps it until
+ *  ufb_reclaim_release().
+ */
+int ufb_reclaim_hold(struct ufb_dev *dev)
+{
+	int err;
+
+	ufb_reclaim_touch(dev);
+
+	if (ufb_reclaim_enter(dev))
+		return 0;
+
+	/* a pass only starts with the lock held and nobody using vmem */
+	mutex_lock(&dev->reclaim_lock);
+	err = ufb_reclaim_restore_locked(dev, 0, UINT_MAX);
+	if (!err)
+		atomic_inc(&dev->reclaim_users);
+	mutex_unlock(&dev->reclaim_lock);
+
+	return err;
+}
+
+/* fbcon drew nothing;  bring everything back and have it draw again */
+void ufb_reclaim_dropped(struct ufb_dev *dev)
+{
+	dev->reclaim_stale = 1;
+	dev->reclaim_stats.dropped++;
+	ufb_reclaim_kick(dev);
+}
+
+/*
+ *  Called with reclaim_lock held and the pass running.  Once the page
+ *  is out of pages[], faults that still found it are let finish and its
+ *  mappings zapped, so nothing uses it but us.  Then the kernel's mapping
+ *  of vmem goes, which waits until no other CPU can reach it either.
+ */
+static void ufb_reclaim_page(struct ufb_dev *dev, unsigned int i)
+{
+	struct page *page = dev->pages[i];
+	struct ufb_zpage *zp;
+
+	spin_lock(&dev->pages_lock);
+	dev->pages[i] = NULL;
+	spin_unlock(&dev->pages_lock);
+
+	smp_mb();
+	wait_event(dev->fault_wait, atomic_read(&dev->faults) == 0);
+
+	ufb_vmem_zap(dev, 0, i, 1);
+	ufb_vmem_zap(dev, 1, i, 1);
+
+	zp = ufb_reclaim_compress(dev, page);
+	if (!zp) {
+		spin_lock(&dev->pages_lock);
+		dev->pages[i] = page;
+		spin_unlock(&dev->pages_lock);
+
+		dev->reclaim_stats.incompressible++;
+		return;
+	}
+
+	ufb_vmem_unmap(dev);
+	__free_page(page);
+
+	dev->reclaim_store[i] = zp;
+	dev->reclaimed++;
+	dev->reclaim_stats.reclaimed++;
+	dev->reclaim_stats.bytes += zp->len;
+	if (!zp->len)
+		dev->reclaim_stats.same++;
+
+	atomic_long_inc(&ufb_reclaim_pages);
+	atomic_long_add(zp->len, &ufb_reclaim_bytes);
+}
+
+/* called with reclaim_lock held;  the compressor's scratch is only kept for a pass */
+static int ufb_reclaim_alloc(struct ufb_dev *dev)
+{
+	if (!dev->reclaim_store)
+		dev->reclaim_store = vzalloc(dev->max_pages *
+		                             sizeof(*dev->reclaim_store));
+
+	dev->reclaim_wrkmem = kmalloc(LZO1X_1_MEM_COMPRESS, GFP_KERNEL);
+	dev->reclaim_buf = kmalloc(lzo1x_worst_compress(PAGE_SIZE), GFP_KERNEL);
+
+	return dev->reclaim_store && dev->reclaim_wrkmem && dev->reclaim_buf;
+}
+
+static void ufb_reclaim_free_scratch(struct ufb_dev *dev)
+{
+	kfree(dev->reclaim_wrkmem);
+	kfree(dev->reclaim_buf);
+	dev->reclaim_wrkmem = NULL;
+	dev->reclaim_buf = NULL;
+}
+
+/*
+ *  Compresses whatever of vmem is resident, stopping as soon as anything
+ *  uses it.  -EAGAIN if it couldn't start.
+ */
+static int ufb_reclaim_pass(struct ufb_dev *dev)
+{
+	unsigned long active = ACCESS_ONCE(dev->reclaim_active);
+	unsigned int i;
+	int err = 0;
+
+	/* a resize is as good as a use */
+	if (!down_read_trylock(&dev->resize_sem))
+		return -EAGAIN;
+
+	mutex_lock(&dev->reclaim_lock);
+
+	/* the trace keeps comparing against vmem */
+	if (!ufb_reclaim_wanted(dev) || ufb_tracing(dev))
+		goto out;
+
+	if (!ufb_reclaim_alloc(dev)) {
+		err = -EAGAIN;
+		goto out_free;
+	}
+
+	dev->reclaim_busy = 1;
+	smp_mb();
+
+	if (atomic_read(&dev->reclaim_users)) {
+		err = -EAGAIN;
+		goto out_busy;
+	}
+
+	for (i = 0; i < dev->npages; i++) {
+		if (ACCESS_ONCE(dev->reclaim_active) != active ||
+		    !ufb_reclaim_wanted(dev))
+			break;
+
+		if (dev->pages[i])
+			ufb_reclaim_page(dev, i);
+
+		cond_resched();
+	}
+
+	dev->reclaim_stats.passes++;
+
+out_busy:
+	dev->reclaim_busy = 0;
+out_free:
+	ufb_reclaim_free_scratch(dev);
+out:
+	mutex_unlock(&dev->reclaim_lock);
+	up_read(&dev->resize_sem);
+	return err;
+}
+
+static void ufb_reclaim_work(struct work_struct *work)
+{
+	struct ufb_dev *dev = container_of(to_delayed_work(work),
+	                                   struct ufb_dev, reclaim_work);
+	unsigned long delay = reclaim_delay * HZ;
+	unsigned long idle;
+
+	if (dev->reclaim_off)
+		return;
+
+	if (!ufb_reclaim_wanted(dev) || ACCESS_ONCE(dev->reclaim_stale)) {
+		if (ufb_reclaim_restore(dev, 0, UINT_MAX)) {
+			schedule_delayed_work(&dev->reclaim_work, HZ);
+			return;
+		}
+
+		if (xchg(&dev->reclaim_stale, 0))
+			ufb_fb_repaint(dev);
+	}
+
+	if (!ufb_reclaim_wanted(dev))
+		return;
+
+	idle = jiffies - ACCESS_ONCE(dev->reclaim_active);
+	if (idle < delay) {
+		schedule_delayed_work(&dev->reclaim_work, delay - idle);
+		return;
+	}
+
+	if (ufb_reclaim_pass(dev) == -EAGAIN)
+		schedule_delayed_work(&dev->reclaim_work, delay);
+}
+
+/*
+ *  Blanking, detaching or anything changing what should be compressed;
+ *  the work sorts out what to do.  Safe from anywhere.
+ */
+void ufb_reclaim_kick(struct ufb_dev *dev)
+{
+	if (ACCESS_ONCE(dev->reclaim_off))
+		return;
+
+	if ((reclaim_delay && dev->vmem && !dev->memfd) ||
+	    ACCESS_ONCE(dev->reclaimed))
+		mod_delayed_work(system_wq, &dev->reclaim_work, 0);
+}
+
+void ufb_reclaim_dev_init(struct ufb_dev *dev)
+{
+	mutex_init(&dev->reclaim_lock);
+	INIT_DELAYED_WORK(&dev->reclaim_work, ufb_reclaim_work);
+	atomic_set(&dev->reclaim_users, 0);
+	dev->reclaim_active = jiffies;
+}
+
+/*
+ *  Before the framebuffer goes:  everything is brought back, so nobody is
+ *  left dropping drawing, and nothing is compressed again.  If vmem can't
+ *  be mapped for the kernel again, fbcon's drawing stays dropped until
+ *  the framebuffer is gone.
+ */
+void ufb_reclaim_free(struct ufb_dev *dev)
+{
+	unsigned int i;
+
+	mutex_lock(&dev->reclaim_lock);
+	dev->reclaim_off = 1;
+	mutex_unlock(&dev->reclaim_lock);
+
+	cancel_delayed_work_sync(&dev->reclaim_work);
+
+	debugfs_remove(dev->reclaim_debugfs);
+	dev->reclaim_debugfs = NULL;
+
+	mutex_lock(&dev->reclaim_lock);
+
+	if (dev->reclaim_store) {
+		for (i = 0; i < dev->npages && dev->reclaimed; i++) {
+			if (dev->reclaim_store[i])
+				ufb_reclaim_restore_page(dev, i,
+				                         GFP_KERNEL | __GFP_NOFAIL);
+		}
+	}
+
+	ufb_vmem_remap(dev);
+
+	vfree(dev->reclaim_store);
+	dev->reclaim_store = NULL;
+
+	mutex_unlock(&dev->reclaim_lock);
+}
+
+static int ufb_reclaim_show(struct seq_file *m, void *unused)
+{
+	struct ufb_dev *dev = m->private;
+	struct ufb_reclaim_stats stats;
+	unsigned int npages, reclaimed;
+
+	mutex_lock(&dev->reclaim_lock);
+	stats = dev->reclaim_stats;
+	npages = dev->npages;
+	reclaimed = dev->reclaimed;
+	mutex_unlock(&dev->reclaim_lock);
+
+	seq_printf(m, "pages %u\n", npages);
+	seq_printf(m, "compressed %u\n", reclaimed);
+	seq_printf(m, "same_filled %llu\n", stats.same);
+	seq_printf(m, "compressed_bytes %llu\n", stats.bytes);
+	seq_printf(m, "reclaimed_total %llu\n", stats.reclaimed);
+	seq_printf(m, "restored_total %llu\n", stats.restored);
+	seq_printf(m, "incompressible %llu\n", stats.incompressible);
+	seq_printf(m, "passes %llu\n", stats.passes);
+	seq_printf(m, "dropped_draws %llu\n", stats.dropped);
+
+	return 0;
+}
+
+static int ufb_reclaim_debugfs_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ufb_reclaim_show, inode->i_private);
+}
+
+static const struct file_operations ufb_reclaim_fops = {
+	.owner   = THIS_MODULE,
+	.open    = ufb_reclaim_debugfs_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+/* adds <debugfs>/ufb/fbN_reclaim once the framebuffer is registered */
+void ufb_reclaim_debugfs_add(struct ufb_dev *dev)
+{
+	char name[32];
+
+	if (!ufb_debugfs_root || !dev->fb_info)
+		return;
+
+	snprintf(name, sizeof(name), "fb%d_reclaim", dev->fb_info->node);
+	dev->reclaim_debugfs = debugfs_create_file(name, 0444, ufb_debugfs_root,
+	                                           dev, &ufb_reclaim_fops);
+}
+
+static int ufb_reclaim_total_show(struct seq_file *m, void *unused)
+{
+	seq_printf(m, "compressed %ld\n", atomic_long_read(&ufb_reclaim_pages));
+	seq_printf(m, "compressed_bytes %ld\n",
+	           atomic_long_read(&ufb_reclaim_bytes));
+	seq_printf(m, "saved_bytes %ld\n",
+	           atomic_long_read(&ufb_reclaim_pages) * (long)PAGE_SIZE -
+	           atomic_long_read(&ufb_reclaim_bytes));
+
+	return 0;
+}
+
+static int ufb_reclaim_total_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ufb_reclaim_total_show, NULL);
+}
+
+static const struct file_operations ufb_reclaim_total_fops = {
+	.owner   = THIS_MODULE,
+	.open    = ufb_reclaim_total_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+/* <debugfs>/ufb/reclaim, the totals;  goes with the directory */
+void ufb_reclaim_init(void)
+{
+	if (ufb_debugfs_root)
+		debugfs_create_file("reclaim", 0444, ufb_debugfs_root, NULL,
+		                    &ufb_reclaim_total_fops);
+}
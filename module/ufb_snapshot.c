@@ -0,0 +1,240 @@
+#include "ufb_drv.h"
+
+#include <linux/bitmap.h>
+#include <linux/highmem.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+
+/*
+ *  Copy on write frames, so the daemon presents what vmem held at the
+ *  last vblank however busy clients are drawing into it meanwhile.
+ *
+ *  Only frames the daemon armed are kept, as keeping one costs clients
+ *  a fault per page they touch.  At the vblank starting one every client
+ *  mapping is zapped, so the next touch of any page faults.  The first
+ *  client fault on a page since the vblank copies it aside and zaps the
+ *  daemon's mapping of it;  the daemon then faults the copy in, clients
+ *  go on with the live page.  Only pages clients touch are copied, once
+ *  per frame.  The next vblank points the daemon back at the live pages
+ *  for the ones that were copied, and unless it's armed again, client
+ *  faults from then on just map live pages.
+ *
+ *  pfn mappings can't be write protected and told about the first write,
+ *  which is why any fault counts, reads included.  write() to /dev/fbN
+ *  copies the pages it's about to change the same way.  fbcon draws from
+ *  wherever the console happens to be, often where we can't sleep, so
+ *  the console isn't covered:  it may tear.
+ */
+
+static void ufb_snapshot_free_pages(struct ufb_dev *dev)
+{
+	unsigned int i;
+
+	for (i = 0; i < dev->snapshot_npages; i++) {
+		if (dev->snapshot_pages[i])
+			__free_page(dev->snapshot_pages[i]);
+	}
+
+	vfree(dev->snapshot_pages);
+	vfree(dev->snapshot_copied);
+	dev->snapshot_pages = NULL;
+	dev->snapshot_copied = NULL;
+	dev->snapshot_npages = 0;
+}
+
+/* called with snapshot_lock held;  sends the daemon back to live pages */
+static void ufb_snapshot_release(struct ufb_dev *dev)
+{
+	unsigned int start, end = 0;
+
+	for (;;) {
+		start = find_next_bit(dev->snapshot_copied, dev->snapshot_npages,
+		                      end);
+		if (start >= dev->snapshot_npages)
+			break;
+
+		end = find_next_zero_bit(dev->snapshot_copied,
+		                         dev->snapshot_npages, start);
+		ufb_vmem_zap(dev, 1, start, end - start);
+	}
+
+	bitmap_zero(dev->snapshot_copied, dev->snapshot_npages);
+}
+
+/* called with snapshot_lock held */
+static int ufb_snapshot_copy(struct ufb_dev *dev, unsigned int pgoff,
+                             struct page *live)
+{
+	struct page *copy;
+
+	if (pgoff >= dev->snapshot_npages ||
+	    test_bit(pgoff, dev->snapshot_copied))
+		return 0;
+
+	copy = dev->snapshot_pages[pgoff];
+	if (!copy) {
+		copy = alloc_pages_node(dev->node, GFP_KERNEL, 0);
+		if (!copy)
+			return -ENOMEM;
+		dev->snapshot_pages[pgoff] = copy;
+	}
+
+	copy_highpage(copy, live);
+	set_bit(pgoff, dev->snapshot_copied);
+
+	ufb_vmem_zap(dev, 1, pgoff, 1);
+
+	return 0;
+}
+
+/*
+ *  A fault on pgoff, with live the vmem page there.  The daemon gets the
+ *  copy if there is one, clients get live after it's been copied.
+ */
+int ufb_snapshot_fault(struct ufb_dev *dev, struct vm_area_struct *vma,
+                       unsigned long addr, unsigned int pgoff,
+                       struct page *live, int daemon)
+{
+	struct page *page = live;
+	int ret;
+
+	mutex_lock(&dev->snapshot_lock);
+
+	if (!dev->snapshot_kept) {
+		/* the frame ended since the fault looked */
+	} else if (daemon) {
+		if (pgoff < dev->snapshot_npages &&
+		    test_bit(pgoff, dev->snapshot_copied))
+			page = dev->snapshot_pages[pgoff];
+	} else if (ufb_snapshot_copy(dev, pgoff, live)) {
+		mutex_unlock(&dev->snapshot_lock);
+		return VM_FAULT_OOM;
+	}
+
+	/* under the lock, so a vblank can't slip in before it's mapped */
+	ret = ufb_vmem_insert(vma, addr, page_to_pfn(page));
+
+	mutex_unlock(&dev->snapshot_lock);
+
+	return ret;
+}
+
+/* the kernel's about to write len bytes at offset into vmem */
+void ufb_snapshot_touch(struct ufb_dev *dev, size_t offset, size_t len)
+{
+	unsigned int first, last, i;
+
+	if (!ACCESS_ONCE(dev->snapshot_kept) || !len)
+		return;
+
+	first = offset >> PAGE_SHIFT;
+	last = (offset + len - 1) >> PAGE_SHIFT;
+
+	mutex_lock(&dev->snapshot_lock);
+
+	for (i = first; i <= last && dev->snapshot_kept &&
+	                i < dev->snapshot_npages; i++) {
+		if (i >= dev->npages ||
+		    ufb_snapshot_copy(dev, i, dev->pages[i]))
+			break;
+	}
+
+	mutex_unlock(&dev->snapshot_lock);
+}
+
+/* called with snapshot_lock held */
+static void ufb_snapshot_end(struct ufb_dev *dev)
+{
+	if (!dev->snapshot_kept)
+		return;
+
+	dev->snapshot_kept = 0;
+	ufb_snapshot_release(dev);
+}
+
+/* the daemon is done with the frame;  the next one starts from here */
+void ufb_snapshot_vblank(struct ufb_dev *dev)
+{
+	if (!ACCESS_ONCE(dev->snapshot))
+		return;
+
+	mutex_lock(&dev->snapshot_lock);
+
+	ufb_snapshot_end(dev);
+
+	if (dev->snapshot_armed && dev->snapshot_npages) {
+		dev->snapshot_armed = 0;
+		dev->snapshot_kept = 1;
+		ufb_vmem_zap(dev, 0, 0, 0);
+	}
+
+	mutex_unlock(&dev->snapshot_lock);
+}
+
+/* SNAPSHOT, with one of UFB_SNAPSHOT_* */
+int ufb_snapshot_enable(struct ufb_dev *dev, u32 enable)
+{
+	unsigned int npages;
+	int err = 0;
+
+	if (enable > UFB_SNAPSHOT_ARM)
+		return -EINVAL;
+
+	mutex_lock(&dev->snapshot_lock);
+
+	if (enable == UFB_SNAPSHOT_OFF) {
+		if (dev->snapshot_npages) {
+			dev->snapshot = 0;
+			dev->snapshot_armed = 0;
+			ufb_snapshot_end(dev);
+			ufb_snapshot_free_pages(dev);
+		}
+		goto out;
+	}
+
+	if (dev->snapshot_npages)
+		goto arm;
+
+	if (!dev->vmem) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	/* room for all vmem can grow to, so a resize needn't know */
+	npages = ufb_vmem_capacity(dev) >> PAGE_SHIFT;
+
+	dev->snapshot_pages = vzalloc(npages * sizeof(*dev->snapshot_pages));
+	dev->snapshot_copied = vzalloc(BITS_TO_LONGS(npages) *
+	                               sizeof(unsigned long));
+	if (!dev->snapshot_pages || !dev->snapshot_copied) {
+		vfree(dev->snapshot_pages);
+		vfree(dev->snapshot_copied);
+		dev->snapshot_pages = NULL;
+		dev->snapshot_copied = NULL;
+		err = -ENOMEM;
+		goto out;
+	}
+
+	dev->snapshot_npages = npages;
+	dev->snapshot = 1;
+
+arm:
+	if (enable == UFB_SNAPSHOT_ARM)
+		dev->snapshot_armed = 1;
+
+out:
+	mutex_unlock(&dev->snapshot_lock);
+	return err;
+}
+
+/* as vmem goes, after every mapping of it was zapped */
+void ufb_snapshot_free(struct ufb_dev *dev)
+{
+	mutex_lock(&dev->snapshot_lock);
+	dev->snapshot = 0;
+	dev->snapshot_armed = 0;
+	dev->snapshot_kept = 0;
+	ufb_snapshot_free_pages(dev);
+	mutex_unlock(&dev->snapshot_lock);
+}
@@ -3,10 +3,14 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <linux/fb.h>
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 /* this is a test program that opens the mmap_drv.
@@ -24,11 +28,244 @@
      'mknod node c 254 0'
 */
 
-#define UFB_IOCTL_ALLOC_VMEM (_IOW('U',0,uint32_t*))
+#include "ufb_ioctl.h"
+
+/* well below the console's cursor, so its blinking stays out of the way */
+#define DAMAGE_ROW 200
+
+/*
+ * pwrite()s len bytes at offset of /dev/fbN and checks GET_DAMAGE has
+ * exactly the rectangle expected for them.
+ */
+int check_write_damage(int fd, int fb, off_t offset, size_t len,
+                       const struct ufb_damage_rect *expect)
+{
+	struct ufb_damage damage;
+	ssize_t written;
+	char *buf;
+	uint32_t i;
+
+	if( !(buf = malloc(len)) ) {
+		return 0;
+	}
+	memset(buf, 0x5a, len);
+
+	/* whatever was pending before doesn't count */
+	ioctl(fd, UFB_IOCTL_GET_DAMAGE, &damage);
+
+	written = pwrite(fb, buf, len, offset);
+	free(buf);
+
+	if( (ssize_t)len != written ) {
+		perror("pwrite");
+		return 0;
+	}
+
+	if( -1 == ioctl(fd, UFB_IOCTL_GET_DAMAGE, &damage) ) {
+		perror("get_damage");
+		return 0;
+	}
+
+	for( i = 0; i < damage.count; i++ ) {
+		if( !memcmp(&damage.rects[i], expect, sizeof(*expect)) ) {
+			return 1;
+		}
+	}
+
+	fprintf(stderr, "write of %zu bytes at %lld:  no %ux%u+%u+%u among "
+	        "%u damage rects\n", len, (long long)offset, expect->width,
+	        expect->height, expect->x, expect->y, damage.count);
+	for( i = 0; i < damage.count; i++ ) {
+		fprintf(stderr, "  %ux%u+%u+%u\n", damage.rects[i].width,
+		        damage.rects[i].height, damage.rects[i].x,
+		        damage.rects[i].y);
+	}
+
+	return 0;
+}
+
+/* creates the framebuffer and opens its /dev/fbN */
+int open_fb(int fd)
+{
+	struct ufb_info info;
+	char fb_filename[32];
+	int fb;
+
+	if( -1 == ioctl(fd, UFB_IOCTL_CREATE_FB) ) {
+		perror("create_fb");
+		return -1;
+	}
+
+	if( -1 == ioctl(fd, UFB_IOCTL_GET_INFO, &info) || info.fb_node < 0 ) {
+		perror("get_info");
+		return -1;
+	}
+
+	snprintf(fb_filename, sizeof(fb_filename), "/dev/fb%d", info.fb_node);
+	if( (fb = open(fb_filename, O_RDWR)) < 0 ) {
+		perror(fb_filename);
+		return -1;
+	}
+
+	return fb;
+}
+
+/* a write within one row damages just its pixels, one over rows whole rows */
+int test_write_damage(int fd, int fb)
+{
+	struct fb_var_screeninfo var;
+	struct fb_fix_screeninfo fix;
+	struct ufb_damage_rect expect;
+	size_t bytes_pp;
+	off_t row;
+	int ok = 1;
+
+	if( -1 == ioctl(fb, FBIOGET_VSCREENINFO, &var) ||
+	    -1 == ioctl(fb, FBIOGET_FSCREENINFO, &fix) ) {
+		perror("get screeninfo");
+		return 0;
+	}
+
+	bytes_pp = var.bits_per_pixel / 8;
+	row = (off_t)DAMAGE_ROW * fix.line_length;
+
+	expect.x = 10;
+	expect.y = DAMAGE_ROW;
+	expect.width = 5;
+	expect.height = 1;
+	ok &= check_write_damage(fd, fb, row + 10 * bytes_pp, 5 * bytes_pp,
+	                         &expect);
+
+	/* from partway along one row to partway along the third */
+	expect.x = 0;
+	expect.y = DAMAGE_ROW + 10;
+	expect.width = var.xres_virtual;
+	expect.height = 3;
+	ok &= check_write_damage(fd, fb, row + 10 * fix.line_length + bytes_pp,
+	                         2 * fix.line_length, &expect);
+
+	return ok;
+}
+
+/* clients find the YUV modes through the fbdev FOURCC API */
+int test_fourcc_caps(int fb)
+{
+	struct fb_fix_screeninfo fix;
+
+	if( -1 == ioctl(fb, FBIOGET_FSCREENINFO, &fix) ) {
+		perror("get fscreeninfo");
+		return 0;
+	}
+
+	if( !(fix.capabilities & FB_CAP_FOURCC) ) {
+		fprintf(stderr, "FB_CAP_FOURCC not set:  capabilities %#x\n",
+		        fix.capabilities);
+		return 0;
+	}
+
+	return 1;
+}
+
+uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+struct present_waiter {
+	int fb;
+	struct ufb_fb_present present;
+	int ret;
+};
+
+void *present_wait_thread(void *arg)
+{
+	struct present_waiter *w = arg;
+
+	w->ret = ioctl(w->fb, UFB_FBIO_PRESENT_WAIT, &w->present);
+
+	return NULL;
+}
+
+/*
+ * A client thread sits in PRESENT_WAIT while the daemon latches, asks
+ * for the scanout and acks, as sdlfb does every frame.  None of that
+ * may wait on the client, so the wait ends with the ack, well before
+ * its timeout.
+ */
+int test_present_wait(int fd, int fb)
+{
+	struct present_waiter w;
+	struct ufb_scanout scanout;
+	struct ufb_present latch;
+	pthread_t thread;
+	uint64_t start, scanout_ms, wait_ms;
+
+	memset(&w, 0, sizeof(w));
+	w.fb = fb;
+
+	if( -1 == ioctl(fb, UFB_FBIO_PRESENT_MARK, &w.present) ) {
+		perror("present_mark");
+		return 0;
+	}
+
+	start = now_ms();
+	w.present.timeout_ms = 1000;
+	if( pthread_create(&thread, NULL, present_wait_thread, &w) ) {
+		fprintf(stderr, "pthread_create failed\n");
+		return 0;
+	}
+
+	/* let it get to sleep */
+	usleep(50000);
+
+	if( -1 == ioctl(fd, UFB_IOCTL_PRESENT_LATCH, &latch) ) {
+		perror("present_latch");
+		pthread_join(thread, NULL);
+		return 0;
+	}
+
+	scanout_ms = now_ms();
+	if( -1 == ioctl(fd, UFB_IOCTL_GET_SCANOUT, &scanout) ) {
+		perror("get_scanout");
+		pthread_join(thread, NULL);
+		return 0;
+	}
+	scanout_ms = now_ms() - scanout_ms;
+
+	latch.timestamp = 0;
+	if( -1 == ioctl(fd, UFB_IOCTL_PRESENT_ACK, &latch) ) {
+		perror("present_ack");
+		pthread_join(thread, NULL);
+		return 0;
+	}
+
+	pthread_join(thread, NULL);
+	wait_ms = now_ms() - start;
+
+	if( w.ret || w.present.presented < w.present.seq ) {
+		fprintf(stderr, "present_wait for %llu:  %d, presented %llu\n",
+		        (unsigned long long)w.present.seq, w.ret,
+		        (unsigned long long)w.present.presented);
+		return 0;
+	}
+
+	if( scanout_ms > 50 || wait_ms > 500 ) {
+		fprintf(stderr, "present_wait held the daemon up:  get_scanout "
+		        "took %llu ms, the wait %llu ms\n",
+		        (unsigned long long)scanout_ms,
+		        (unsigned long long)wait_ms);
+		return 0;
+	}
+
+	return 1;
+}
 
 int main(int argc, char **argv)
 {
-	int fd;
+	int fd, fb;
 	unsigned int *vadr;
 	char *device_filename;
 	uint32_t vmem_size = 2 * 1024 * 1024;
@@ -57,6 +294,17 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	if( (fb = open_fb(fd)) < 0 ) {
+		return 1;
+	}
+
+	if( !test_write_damage(fd, fb) || !test_fourcc_caps(fb) ||
+	    !test_present_wait(fd, fb) ) {
+		return 1;
+	}
+
+	close(fb);
+
 	close(fd);
 
 	printf( "Success\n" );
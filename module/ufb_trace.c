@@ -0,0 +1,456 @@
+#include "ufb_drv.h"
+
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+
+#define UFB_TRACE_MAX_SIZE (256 * 1024 * 1024)
+
+/*
+ *  Records are written by whoever touches the framebuffer (possibly fbcon
+ *  in atomic context) under dev->trace_lock, and read by the daemon under
+ *  dev->trace_mutex.  Writers never overwrite unread data, they drop the
+ *  record and count it as lost instead, so the reader can copy straight
+ *  out of the ring without holding the spinlock.
+ */
+struct ufb_trace {
+	u8 *buf;
+	u32 size;	/* power of two */
+	u32 head;
+	u32 tail;
+	u32 lost;
+
+	/* vmem as of the last recorded change, to find writes through mmap */
+	u8 *shadow;
+	size_t shadow_len;
+};
+
+static void ufb_trace_copy_in(struct ufb_trace *trace, u32 pos,
+                              const void *src, u32 len)
+{
+	u32 off = pos & (trace->size - 1);
+	u32 first = min(len, trace->size - off);
+
+	memcpy(trace->buf + off, src, first);
+	memcpy(trace->buf, (const u8 *)src + first, len - first);
+}
+
+static void ufb_trace_copy_out(struct ufb_trace *trace, u32 pos,
+                               void *dst, u32 len)
+{
+	u32 off = pos & (trace->size - 1);
+	u32 first = min(len, trace->size - off);
+
+	memcpy(dst, trace->buf + off, first);
+	memcpy((u8 *)dst + first, trace->buf, len - first);
+}
+
+static void ufb_trace_add(struct ufb_dev *dev, u16 type,
+                          const void *payload, u32 payload_len,
+                          const void *data, u32 data_len)
+{
+	struct ufb_trace *trace;
+	struct ufb_trace_record rec;
+	unsigned long flags;
+	u32 total;
+
+	rec.type = type;
+	rec.reserved = 0;
+	rec.size = payload_len + data_len;
+	rec.timestamp = ktime_to_ns(ktime_get());
+
+	total = ALIGN(sizeof(rec) + rec.size, UFB_TRACE_ALIGN);
+
+	spin_lock_irqsave(&dev->trace_lock, flags);
+
+	trace = dev->trace;
+	if (!trace)
+		goto out;
+
+	if (trace->size - (trace->head - ACCESS_ONCE(trace->tail)) < total) {
+		trace->lost++;
+		goto out;
+	}
+
+	ufb_trace_copy_in(trace, trace->head, &rec, sizeof(rec));
+	ufb_trace_copy_in(trace, trace->head + sizeof(rec),
+	                  payload, payload_len);
+	ufb_trace_copy_in(trace, trace->head + sizeof(rec) + payload_len,
+	                  data, data_len);
+
+	/* publish the record only once it is complete */
+	smp_wmb();
+	trace->head += total;
+
+out:
+	spin_unlock_irqrestore(&dev->trace_lock, flags);
+}
+
+/* keep the shadow in step with a change we recorded some other way */
+static void ufb_trace_sync_shadow(struct ufb_dev *dev, size_t offset,
+                                  size_t len)
+{
+	struct ufb_trace *trace;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->trace_lock, flags);
+
+	trace = dev->trace;
+	if (trace && trace->shadow && offset < trace->shadow_len) {
+		len = min(len, trace->shadow_len - offset);
+		memcpy(trace->shadow + offset, (u8 *)dev->vmem + offset, len);
+	}
+
+	spin_unlock_irqrestore(&dev->trace_lock, flags);
+}
+
+static void ufb_trace_rows_changed(struct ufb_dev *dev, struct fb_info *info,
+                                   u32 dy, u32 height)
+{
+	ufb_trace_sync_shadow(dev, (size_t)dy * info->fix.line_length,
+	                      (size_t)height * info->fix.line_length);
+}
+
+void ufb_trace_var(struct ufb_dev *dev, u16 type, struct fb_info *info)
+{
+	struct ufb_trace_mode mode;
+
+	if (!ufb_tracing(dev))
+		return;
+
+	mode.xres           = info->var.xres;
+	mode.yres           = info->var.yres;
+	mode.xres_virtual   = info->var.xres_virtual;
+	mode.yres_virtual   = info->var.yres_virtual;
+	mode.xoffset        = info->var.xoffset;
+	mode.yoffset        = info->var.yoffset;
+	mode.bits_per_pixel = info->var.bits_per_pixel;
+	mode.grayscale      = info->var.grayscale;
+	mode.vmode          = info->var.vmode;
+	mode.line_length    = info->fix.line_length;
+
+	ufb_trace_add(dev, type, &mode, sizeof(mode), NULL, 0);
+}
+
+void ufb_trace_write(struct ufb_dev *dev, size_t offset, size_t len)
+{
+	struct ufb_trace_write write;
+
+	if (!ufb_tracing(dev))
+		return;
+
+	write.offset = offset;
+	write.length = len;
+
+	ufb_trace_add(dev, UFB_TRACE_WRITE, &write, sizeof(write),
+	              (u8 *)dev->vmem + offset, len);
+	ufb_trace_sync_shadow(dev, offset, len);
+}
+
+void ufb_trace_pan(struct ufb_dev *dev, struct fb_var_screeninfo *var)
+{
+	struct ufb_trace_pan pan;
+
+	if (!ufb_tracing(dev))
+		return;
+
+	pan.xoffset = var->xoffset;
+	pan.yoffset = var->yoffset;
+	pan.vmode   = var->vmode;
+
+	ufb_trace_add(dev, UFB_TRACE_PAN, &pan, sizeof(pan), NULL, 0);
+}
+
+void ufb_trace_event(struct ufb_dev *dev, u16 type)
+{
+	if (!ufb_tracing(dev))
+		return;
+
+	ufb_trace_add(dev, type, NULL, 0, NULL, 0);
+}
+
+void ufb_trace_fillrect(struct ufb_dev *dev, struct fb_info *info,
+                        const struct fb_fillrect *rect)
+{
+	struct ufb_trace_fillrect fill;
+
+	if (!ufb_tracing(dev))
+		return;
+
+	fill.dx     = rect->dx;
+	fill.dy     = rect->dy;
+	fill.width  = rect->width;
+	fill.height = rect->height;
+	fill.color  = ufb_fb_pixel(info, rect->color);
+	fill.rop    = rect->rop;
+
+	ufb_trace_add(dev, UFB_TRACE_FILLRECT, &fill, sizeof(fill), NULL, 0);
+	ufb_trace_rows_changed(dev, info, rect->dy, rect->height);
+}
+
+void ufb_trace_copyarea(struct ufb_dev *dev, struct fb_info *info,
+                        const struct fb_copyarea *area)
+{
+	struct ufb_trace_copyarea copy;
+
+	if (!ufb_tracing(dev))
+		return;
+
+	copy.dx     = area->dx;
+	copy.dy     = area->dy;
+	copy.width  = area->width;
+	copy.height = area->height;
+	copy.sx     = area->sx;
+	copy.sy     = area->sy;
+
+	ufb_trace_add(dev, UFB_TRACE_COPYAREA, &copy, sizeof(copy), NULL, 0);
+	ufb_trace_rows_changed(dev, info, area->dy, area->height);
+}
+
+void ufb_trace_imageblit(struct ufb_dev *dev, struct fb_info *info,
+                         const struct fb_image *image)
+{
+	struct ufb_trace_imageblit blit;
+
+	if (!ufb_tracing(dev))
+		return;
+
+	blit.dx       = image->dx;
+	blit.dy       = image->dy;
+	blit.width    = image->width;
+	blit.height   = image->height;
+	blit.depth    = image->depth;
+	if (image->depth == 1) {
+		blit.fg_color = ufb_fb_pixel(info, image->fg_color);
+		blit.bg_color = ufb_fb_pixel(info, image->bg_color);
+		blit.length   = DIV_ROUND_UP(image->width, 8) * image->height;
+	} else {
+		blit.fg_color = 0;
+		blit.bg_color = 0;
+		blit.length   = DIV_ROUND_UP(image->width * image->depth, 8) *
+		                image->height;
+	}
+
+	ufb_trace_add(dev, UFB_TRACE_IMAGEBLIT, &blit, sizeof(blit),
+	              image->data, blit.length);
+	ufb_trace_rows_changed(dev, info, image->dy, image->height);
+}
+
+/*
+ *  Called at each vblank.  Anything that changed since the shadow was last
+ *  synced was written through an mmap, so record it line run by line run.
+ */
+void ufb_trace_frame(struct ufb_dev *dev)
+{
+	struct ufb_trace *trace;
+	struct fb_info *info = dev->fb_info;
+	struct ufb_trace_write write;
+	size_t line_length, lines, y, start;
+	u8 *vmem = (u8 *)dev->vmem;
+
+	mutex_lock(&dev->trace_mutex);
+
+	trace = dev->trace;
+	if (!trace || !trace->shadow || !info)
+		goto out;
+
+	line_length = info->fix.line_length;
+	if (!line_length)
+		goto out;
+	lines = min((size_t)info->var.yres_virtual,
+	            trace->shadow_len / line_length);
+
+	for (y = 0; y < lines; y = start) {
+		for (start = y; start < lines; start++) {
+			if (memcmp(vmem + start * line_length,
+			           trace->shadow + start * line_length,
+			           line_length))
+				break;
+		}
+		if (start == lines)
+			break;
+
+		for (y = start + 1; y < lines; y++) {
+			if (!memcmp(vmem + y * line_length,
+			            trace->shadow + y * line_length,
+			            line_length))
+				break;
+		}
+
+		write.offset = start * line_length;
+		write.length = (y - start) * line_length;
+
+		ufb_trace_add(dev, UFB_TRACE_MMAP_WRITE, &write, sizeof(write),
+		              vmem + write.offset, write.length);
+		ufb_trace_sync_shadow(dev, write.offset, write.length);
+
+		start = y;
+	}
+
+	ufb_trace_add(dev, UFB_TRACE_VBLANK, NULL, 0, NULL, 0);
+
+out:
+	mutex_unlock(&dev->trace_mutex);
+}
+
+int ufb_trace_start(struct ufb_dev *dev, u32 size)
+{
+	struct ufb_trace *trace;
+	struct ufb_trace_write write;
+	unsigned long flags;
+	int err = 0;
+
+	mutex_lock(&dev->trace_mutex);
+
+	if (dev->trace) {
+		err = -EBUSY;
+		goto out;
+	}
+
+	trace = kzalloc(sizeof(*trace), GFP_KERNEL);
+	if (!trace) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	trace->size = roundup_pow_of_two(clamp_t(u32, size, PAGE_SIZE,
+	                                         UFB_TRACE_MAX_SIZE));
+	trace->buf = vmalloc(trace->size);
+	if (!trace->buf) {
+		err = -ENOMEM;
+		goto err_free;
+	}
+
+	if (dev->vmem) {
+		trace->shadow_len = dev->vmem_size;
+		trace->shadow = vmalloc(trace->shadow_len);
+		if (!trace->shadow) {
+			err = -ENOMEM;
+			goto err_free_buf;
+		}
+
+		/* held until tracing, after which nothing is compressed */
+		err = ufb_reclaim_hold(dev);
+		if (err)
+			goto err_free_shadow;
+		memcpy(trace->shadow, dev->vmem, trace->shadow_len);
+	}
+
+	spin_lock_irqsave(&dev->trace_lock, flags);
+	dev->trace = trace;
+	spin_unlock_irqrestore(&dev->trace_lock, flags);
+
+	if (trace->shadow)
+		ufb_reclaim_release(dev);
+
+	/* start with the mode and a key frame so a replay has a baseline */
+	if (dev->fb_info) {
+		ufb_trace_var(dev, UFB_TRACE_MODE, dev->fb_info);
+
+		write.offset = 0;
+		write.length = min_t(size_t, trace->shadow_len,
+		                     dev->fb_info->fix.line_length *
+		                     dev->fb_info->var.yres_virtual);
+		ufb_trace_add(dev, UFB_TRACE_MMAP_WRITE, &write, sizeof(write),
+		              trace->shadow, write.length);
+	}
+
+	goto out;
+
+err_free_shadow:
+	vfree(trace->shadow);
+err_free_buf:
+	vfree(trace->buf);
+err_free:
+	kfree(trace);
+out:
+	mutex_unlock(&dev->trace_mutex);
+	return err;
+}
+
+void ufb_trace_stop(struct ufb_dev *dev)
+{
+	struct ufb_trace *trace;
+	unsigned long flags;
+
+	mutex_lock(&dev->trace_mutex);
+
+	spin_lock_irqsave(&dev->trace_lock, flags);
+	trace = dev->trace;
+	dev->trace = NULL;
+	spin_unlock_irqrestore(&dev->trace_lock, flags);
+
+	if (trace) {
+		vfree(trace->shadow);
+		vfree(trace->buf);
+		kfree(trace);
+	}
+
+	mutex_unlock(&dev->trace_mutex);
+}
+
+/*
+ *  Copy out as many whole records as fit in req->len.  Returns the number
+ *  of bytes copied.
+ */
+int ufb_trace_read(struct ufb_dev *dev, struct ufb_trace_read *req)
+{
+	struct ufb_trace *trace;
+	struct ufb_trace_record rec;
+	u8 __user *buf = (u8 __user *)(unsigned long)req->buf;
+	unsigned long flags;
+	u32 head, pos, len, off, first;
+	int err;
+
+	mutex_lock(&dev->trace_mutex);
+
+	trace = dev->trace;
+	if (!trace) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	head = ACCESS_ONCE(trace->head);
+	smp_rmb();
+
+	for (pos = trace->tail; pos != head; pos += len) {
+		ufb_trace_copy_out(trace, pos, &rec, sizeof(rec));
+		len = ALIGN(sizeof(rec) + rec.size, UFB_TRACE_ALIGN);
+		if (pos - trace->tail + len > req->len)
+			break;
+	}
+
+	len = pos - trace->tail;
+	if (!len && pos != head) {
+		/* the next record does not fit in the caller's buffer */
+		err = -EMSGSIZE;
+		goto out;
+	}
+
+	off = trace->tail & (trace->size - 1);
+	first = min(len, trace->size - off);
+	if (copy_to_user(buf, trace->buf + off, first) ||
+	    copy_to_user(buf + first, trace->buf, len - first)) {
+		err = -EFAULT;
+		goto out;
+	}
+
+	/* done reading before writers may reuse the space */
+	smp_mb();
+	trace->tail = pos;
+
+	spin_lock_irqsave(&dev->trace_lock, flags);
+	req->lost = trace->lost;
+	trace->lost = 0;
+	spin_unlock_irqrestore(&dev->trace_lock, flags);
+
+	err = len;
+
+out:
+	mutex_unlock(&dev->trace_mutex);
+	return err;
+}
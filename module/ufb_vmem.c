@@ -0,0 +1,707 @@
+#include "ufb_drv.h"
+
+#include <linux/file.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/nodemask.h>
+#include <linux/numa.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+static unsigned long vmem_reserve = 64 * 1024 * 1024;
+module_param(vmem_reserve, ulong, 0444);
+MODULE_PARM_DESC(vmem_reserve, "How far each vmem can grow with RESIZE, "
+                 "in bytes");
+
+/*
+ *  vmem is an array of pages, which the kernel sees through a vmap() of
+ *  them all.  Growing or shrinking maps the new set and moves
+ *  screen_base over to it with resize_sem held for write and the console
+ *  locked, which between them keep out read(), write() and fbcon.
+ *
+ *  Userspace mappings (the daemon's through /dev/ufb and clients' through
+ *  /dev/fbN) are filled in page by page on fault rather than up front.
+ *  That keeps them valid across a resize:  pages past the end are
+ *  zapped when vmem shrinks and simply fault in again once it has grown.
+ *  Faults insert raw pfns, which works the same for our own pages and
+ *  for pinned memfd pages, hugetlb ones included.
+ */
+
+/*
+ *  Shrinking zaps pages through each address_space vmem is mapped from:
+ *  the daemon's /dev/ufb and clients' /dev/fbN.  Entries live as long as
+ *  some vma maps them;  each vma also holds a reference on dev, so a
+ *  client still mapping the framebuffer after the daemon exits only sees
+ *  SIGBUS rather than freed memory.
+ */
+struct ufb_mapping {
+	struct list_head list;
+	struct address_space *mapping;
+	unsigned int vmas;
+	int daemon;
+};
+
+/*
+ *  A client's vma is untracked until its process reports damage with
+ *  UFB_FBIO_DAMAGE, and then gets ufb_tracked_vm_ops:  until every one
+ *  is, the daemon can't trust GET_DAMAGE to cover the screen.
+ */
+static const struct vm_operations_struct ufb_vm_ops;
+static const struct vm_operations_struct ufb_tracked_vm_ops;
+
+/* pages a fault may map, called with pages_lock held */
+static unsigned int ufb_vmem_pages(struct ufb_dev *dev)
+{
+	return min_t(unsigned int, dev->npages,
+	             DIV_ROUND_UP(dev->vmem_size, PAGE_SIZE));
+}
+
+/* called with mappings_lock held */
+static struct ufb_mapping *ufb_mapping_find(struct ufb_dev *dev,
+                                            struct address_space *mapping)
+{
+	struct ufb_mapping *entry;
+
+	list_for_each_entry(entry, &dev->mappings, list) {
+		if (entry->mapping == mapping)
+			return entry;
+	}
+
+	return NULL;
+}
+
+/* forks and splits of a vma we already track */
+static void ufb_vm_open(struct vm_area_struct *vma)
+{
+	struct ufb_dev *dev = vma->vm_private_data;
+	struct ufb_mapping *entry;
+
+	mutex_lock(&dev->mappings_lock);
+	entry = ufb_mapping_find(dev, vma->vm_file->f_mapping);
+	if (entry)
+		entry->vmas++;
+	if (vma->vm_ops == &ufb_vm_ops)
+		dev->untracked++;
+	mutex_unlock(&dev->mappings_lock);
+
+	kref_get(&dev->ref);
+	__module_get(THIS_MODULE);
+}
+
+static void ufb_vm_close(struct vm_area_struct *vma)
+{
+	struct ufb_dev *dev = vma->vm_private_data;
+	struct ufb_mapping *entry;
+
+	mutex_lock(&dev->mappings_lock);
+	entry = ufb_mapping_find(dev, vma->vm_file->f_mapping);
+	if (entry && !--entry->vmas) {
+		list_del(&entry->list);
+		kfree(entry);
+	}
+	if (vma->vm_ops == &ufb_vm_ops)
+		dev->untracked--;
+	mutex_unlock(&dev->mappings_lock);
+
+	ufb_dev_put(dev);
+
+	/* our vm_ops are in use until the last vma goes */
+	module_put(THIS_MODULE);
+}
+
+static const struct vm_operations_struct ufb_daemon_vm_ops;
+
+int ufb_vmem_insert(struct vm_area_struct *vma, unsigned long addr,
+                    unsigned long pfn)
+{
+	int err = vm_insert_pfn(vma, addr, pfn);
+
+	if (err == -ENOMEM)
+		return VM_FAULT_OOM;
+	if (err && err != -EBUSY)
+		return VM_FAULT_SIGBUS;
+
+	return VM_FAULT_NOPAGE;
+}
+
+static int ufb_vm_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct ufb_dev *dev = vma->vm_private_data;
+	unsigned long addr = (unsigned long)vmf->virtual_address;
+	struct page *page;
+	int compressed;
+	int ret;
+
+	ufb_reclaim_touch(dev);
+
+	for (;;) {
+		page = NULL;
+		compressed = 0;
+		ret = VM_FAULT_SIGBUS;
+
+		/*
+		 *  Shrinking waits for faults already past this point before
+		 *  it zaps and frees, and later faults see the new size.
+		 *  Compressing a page waits the same way.
+		 */
+		ufb_count_in(&dev->faults);
+
+		spin_lock(&dev->pages_lock);
+		if (vmf->pgoff < ufb_vmem_pages(dev)) {
+			page = dev->pages[vmf->pgoff];
+			compressed = !page;
+		}
+		spin_unlock(&dev->pages_lock);
+
+		if (page && ACCESS_ONCE(dev->snapshot_kept))
+			ret = ufb_snapshot_fault(dev, vma, addr, vmf->pgoff, page,
+			                         vma->vm_ops == &ufb_daemon_vm_ops);
+		else if (page)
+			ret = ufb_vmem_insert(vma, addr, page_to_pfn(page));
+
+		if (atomic_dec_and_test(&dev->faults))
+			wake_up(&dev->fault_wait);
+
+		/* bring it back, outside the count compressing waits on */
+		if (!compressed)
+			break;
+		ret = ufb_reclaim_restore(dev, vmf->pgoff, 1);
+		if (ret)
+			return ret == -ENOMEM ? VM_FAULT_OOM : VM_FAULT_SIGBUS;
+	}
+
+	return ret;
+}
+
+static const struct vm_operations_struct ufb_vm_ops = {
+	.open  = ufb_vm_open,
+	.close = ufb_vm_close,
+	.fault = ufb_vm_fault,
+};
+
+/* the same, told apart for snapshots, see ufb_snapshot.c */
+static const struct vm_operations_struct ufb_daemon_vm_ops = {
+	.open  = ufb_vm_open,
+	.close = ufb_vm_close,
+	.fault = ufb_vm_fault,
+};
+
+/* and for the daemon knowing the client reports its damage */
+static const struct vm_operations_struct ufb_tracked_vm_ops = {
+	.open  = ufb_vm_open,
+	.close = ufb_vm_close,
+	.fault = ufb_vm_fault,
+};
+
+/*
+ *  The calling process reports its damage, so its mappings of vmem stop
+ *  keeping the daemon from relying on it.  Forks inherit that.
+ */
+void ufb_vmem_track(struct ufb_dev *dev)
+{
+	struct mm_struct *mm = current->mm;
+	struct vm_area_struct *vma;
+
+	if (!ACCESS_ONCE(dev->untracked) || !mm)
+		return;
+
+	down_write(&mm->mmap_sem);
+	mutex_lock(&dev->mappings_lock);
+
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		if (vma->vm_ops == &ufb_vm_ops && vma->vm_private_data == dev) {
+			vma->vm_ops = &ufb_tracked_vm_ops;
+			dev->untracked--;
+		}
+	}
+
+	mutex_unlock(&dev->mappings_lock);
+	up_write(&mm->mmap_sem);
+}
+
+/*
+ *  Zaps count pages from first (0 for all of them) in the daemon's
+ *  mappings or in clients', to be faulted in again.
+ */
+void ufb_vmem_zap(struct ufb_dev *dev, int daemon, unsigned int first,
+                  unsigned int count)
+{
+	struct ufb_mapping *entry;
+
+	mutex_lock(&dev->mappings_lock);
+	list_for_each_entry(entry, &dev->mappings, list) {
+		if (entry->daemon == daemon)
+			unmap_mapping_range(entry->mapping,
+			                    (loff_t)first << PAGE_SHIFT,
+			                    (loff_t)count << PAGE_SHIFT, 1);
+	}
+	mutex_unlock(&dev->mappings_lock);
+}
+
+/*
+ *  Maps up to the capacity vmem can grow to, however big vmem is right
+ *  now.  daemon says it's the daemon's own mapping rather than a client's.
+ *  vmem is set and cleared under mappings_lock, so mmap() of /dev/ufb
+ *  and /dev/fbN can look at it without the setup lock, which mmap_sem
+ *  mustn't be taken under.
+ */
+int ufb_vmem_mmap(struct ufb_dev *dev, struct vm_area_struct *vma, int daemon)
+{
+	struct ufb_mapping *entry;
+	size_t size = vma->vm_end - vma->vm_start;
+	size_t offset = vma->vm_pgoff << PAGE_SHIFT;
+	size_t limit;
+
+	/* pfn mappings can't be copied on write */
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	if (vma->vm_pgoff > (~0UL >> PAGE_SHIFT))
+		return -EINVAL;
+
+	mutex_lock(&dev->mappings_lock);
+
+	limit = ufb_vmem_capacity(dev);
+	if (!dev->vmem || size > limit || offset > limit - size) {
+		mutex_unlock(&dev->mappings_lock);
+		return -EINVAL;
+	}
+
+	entry = ufb_mapping_find(dev, vma->vm_file->f_mapping);
+	if (!entry) {
+		entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+		if (!entry) {
+			mutex_unlock(&dev->mappings_lock);
+			return -ENOMEM;
+		}
+		entry->mapping = vma->vm_file->f_mapping;
+		entry->daemon = daemon;
+		list_add(&entry->list, &dev->mappings);
+	}
+	entry->vmas++;
+	if (!daemon)
+		dev->untracked++;
+	mutex_unlock(&dev->mappings_lock);
+
+	kref_get(&dev->ref);
+	__module_get(THIS_MODULE);
+
+	vma->vm_flags |= VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_ops = daemon ? &ufb_daemon_vm_ops : &ufb_vm_ops;
+	vma->vm_private_data = dev;
+
+	return 0;
+}
+
+/* vmem can grow up to this many bytes */
+size_t ufb_vmem_capacity(struct ufb_dev *dev)
+{
+	return (size_t)dev->max_pages << PAGE_SHIFT;
+}
+
+/* called with resize_sem held for write, or before vmem is set up */
+static void ufb_vmem_switch(struct ufb_dev *dev, void *vmem)
+{
+	void *old = dev->vmem;
+
+	if (old) {
+		ufb_fb_set_base(dev, vmem);
+		vunmap(old);
+	} else {
+		mutex_lock(&dev->mappings_lock);
+		dev->vmem = vmem;
+		mutex_unlock(&dev->mappings_lock);
+	}
+}
+
+/*
+ *  Drops the kernel's mapping before a page is compressed and freed.
+ *  Called with reclaim_lock held and nobody using vmem, see
+ *  ufb_reclaim_enter();  dev->vmem stays as it was, to say vmem is there.
+ */
+void ufb_vmem_unmap(struct ufb_dev *dev)
+{
+	if (dev->unmapped)
+		return;
+
+	dev->unmapped = 1;
+	vunmap(dev->vmem);
+}
+
+/*
+ *  Maps vmem for the kernel again once nothing is compressed, called with
+ *  reclaim_lock held.  Nobody uses screen_base until unmapped is clear,
+ *  so it's moved without the console lock.
+ */
+int ufb_vmem_remap(struct ufb_dev *dev)
+{
+	struct fb_info *info = dev->fb_info;
+	void *vmem;
+
+	if (!dev->unmapped || !dev->vmem)
+		return 0;
+
+	vmem = vmap(dev->pages, dev->npages, VM_MAP, PAGE_KERNEL);
+	if (!vmem)
+		return -ENOMEM;
+
+	if (info) {
+		info->screen_base = (char __iomem *)vmem;
+		info->fix.smem_start = (unsigned long)vmem;
+	}
+	dev->vmem = vmem;
+
+	smp_wmb();
+	dev->unmapped = 0;
+
+	return 0;
+}
+
+static int ufb_vmem_grow(struct ufb_dev *dev, unsigned int npages)
+{
+	void *vmem;
+	unsigned int i;
+
+	for (i = dev->npages; i < npages; i++) {
+		dev->pages[i] = alloc_pages_node(dev->node,
+		                                 GFP_KERNEL | __GFP_ZERO, 0);
+		if (!dev->pages[i])
+			goto err;
+	}
+
+	vmem = vmap(dev->pages, npages, VM_MAP, PAGE_KERNEL);
+	if (!vmem)
+		goto err;
+
+	spin_lock(&dev->pages_lock);
+	dev->npages = npages;
+	spin_unlock(&dev->pages_lock);
+
+	ufb_vmem_switch(dev, vmem);
+
+	return 0;
+
+err:
+	while (i-- > dev->npages) {
+		__free_page(dev->pages[i]);
+		dev->pages[i] = NULL;
+	}
+	return -ENOMEM;
+}
+
+/*
+ *  Cuts vmem down to size:  userspace mappings past it are zapped and, for
+ *  our own pages, the pages freed.  Faults that already looked up a page
+ *  are let finish first, so nothing is left mapping a freed page.  If the
+ *  kernel can't map the fewer pages, they're all kept.
+ */
+static void ufb_vmem_truncate(struct ufb_dev *dev, size_t size)
+{
+	struct ufb_mapping *entry;
+	unsigned int old = dev->npages;
+	unsigned int npages = old;
+	void *vmem = NULL;
+
+	if (!dev->memfd)
+		npages = min(old, (unsigned int)(PAGE_ALIGN(size) >> PAGE_SHIFT));
+
+	if (npages < old && dev->vmem) {
+		vmem = vmap(dev->pages, npages, VM_MAP, PAGE_KERNEL);
+		if (!vmem)
+			npages = old;
+	}
+
+	spin_lock(&dev->pages_lock);
+	dev->vmem_size = size;
+	dev->npages = npages;
+	spin_unlock(&dev->pages_lock);
+
+	smp_mb();
+	wait_event(dev->fault_wait, atomic_read(&dev->faults) == 0);
+
+	mutex_lock(&dev->mappings_lock);
+	list_for_each_entry(entry, &dev->mappings, list)
+		unmap_mapping_range(entry->mapping, PAGE_ALIGN(size), 0, 1);
+	mutex_unlock(&dev->mappings_lock);
+
+	if (npages == old)
+		return;
+
+	if (vmem)
+		ufb_vmem_switch(dev, vmem);
+
+	/* slots compressed away are empty, see ufb_reclaim.c */
+	while (old > npages) {
+		if (dev->pages[--old])
+			__free_page(dev->pages[old]);
+		dev->pages[old] = NULL;
+	}
+}
+
+/*
+ *  vmem is scanned in full every frame by the daemon, so it goes on the
+ *  daemon's node unless asked otherwise.
+ */
+int ufb_vmem_alloc(struct ufb_dev *dev, size_t vmem_size, int node)
+{
+	size_t reserve;
+	int err;
+
+	if (dev->vmem)
+		return -EBUSY;
+
+	if (node == NUMA_NO_NODE)
+		node = numa_node_id();
+	else if (node < 0 || node >= nr_node_ids || !node_online(node))
+		return -EINVAL;
+
+	if (!vmem_size)
+		return -EINVAL;
+
+	reserve = max(PAGE_ALIGN(vmem_size), PAGE_ALIGN(vmem_reserve));
+
+	dev->pages = vzalloc((reserve >> PAGE_SHIFT) * sizeof(*dev->pages));
+	if (!dev->pages)
+		return -ENOMEM;
+
+	dev->max_pages = reserve >> PAGE_SHIFT;
+	dev->npages = 0;
+	dev->node = node;
+	dev->vmem_size = vmem_size;
+
+	/* sets vmem, and so lets mmap() in */
+	err = ufb_vmem_grow(dev, PAGE_ALIGN(vmem_size) >> PAGE_SHIFT);
+	if (err) {
+		vfree(dev->pages);
+		dev->pages = NULL;
+		dev->vmem_size = 0;
+		dev->node = NUMA_NO_NODE;
+	}
+
+	return err;
+}
+
+/* the node most of the pages are on;  the daemon decided where they went */
+static int ufb_pages_node(struct page **pages, unsigned int npages)
+{
+	unsigned int *counts;
+	unsigned int i;
+	int node, best = page_to_nid(pages[0]);
+
+	counts = kcalloc(nr_node_ids, sizeof(*counts), GFP_KERNEL);
+	if (!counts)
+		return best;
+
+	for (i = 0; i < npages; i++)
+		counts[page_to_nid(pages[i])]++;
+
+	for (node = 0; node < nr_node_ids; node++) {
+		if (counts[node] > counts[best])
+			best = node;
+	}
+
+	kfree(counts);
+
+	return best;
+}
+
+static void ufb_free_memfd_pages(struct page **pages, unsigned int npages)
+{
+	unsigned int i;
+
+	for (i = 0; i < npages; i++) {
+		set_page_dirty_lock(pages[i]);
+		put_page(pages[i]);
+	}
+}
+
+/*
+ *  Use the daemon's memfd pages as vmem.  The pages are pinned through the
+ *  daemon's own mapping of the memfd, which works the same for shmem and
+ *  hugetlbfs backed memfds, and then vmapped so the rest of the driver
+ *  (fb_sys_*, sys_fillrect and friends, the mmap paths) sees an ordinary
+ *  vmalloc range.  The pin keeps the pages alive even if the daemon breaks
+ *  its promise and truncates the memfd.  The memfd is sealed, so vmem can
+ *  only be resized within it.
+ */
+int ufb_vmem_alloc_memfd(struct ufb_dev *dev, struct ufb_memfd *req)
+{
+	struct vm_area_struct *vma;
+	struct file *memfd;
+	struct page **pages;
+	void *vmem;
+	unsigned long addr = req->addr;
+	size_t size = PAGE_ALIGN(req->size);
+	unsigned int npages = size >> PAGE_SHIFT;
+	int pinned = 0;
+	int err = 0;
+
+	if (dev->vmem)
+		return -EBUSY;
+
+	if (!npages || (addr & ~PAGE_MASK))
+		return -EINVAL;
+
+	memfd = fget(req->fd);
+	if (!memfd)
+		return -EBADF;
+
+	if (i_size_read(file_inode(memfd)) < size) {
+		err = -EINVAL;
+		goto err_fput;
+	}
+
+	/* addr must really be a shared mapping of this memfd from offset 0 */
+	down_read(&current->mm->mmap_sem);
+	vma = find_vma(current->mm, addr);
+	if (!vma || vma->vm_start > addr || vma->vm_end < addr + size ||
+	    !vma->vm_file || vma->vm_file->f_mapping != memfd->f_mapping ||
+	    !(vma->vm_flags & VM_SHARED) ||
+	    vma->vm_pgoff + ((addr - vma->vm_start) >> PAGE_SHIFT) != 0) {
+		err = -EINVAL;
+	}
+	up_read(&current->mm->mmap_sem);
+
+	if (err)
+		goto err_fput;
+
+	pages = kcalloc(npages, sizeof(*pages), GFP_KERNEL);
+	if (!pages) {
+		err = -ENOMEM;
+		goto err_fput;
+	}
+
+	pinned = get_user_pages_fast(addr, npages, 1, pages);
+	if (pinned != npages) {
+		err = pinned < 0 ? pinned : -EFAULT;
+		goto err_unpin;
+	}
+
+	vmem = vmap(pages, npages, VM_MAP, PAGE_KERNEL);
+	if (!vmem) {
+		err = -ENOMEM;
+		goto err_unpin;
+	}
+
+	mutex_lock(&dev->mappings_lock);
+	dev->vmem_size = size;
+	dev->memfd = memfd;
+	dev->pages = pages;
+	dev->npages = npages;
+	dev->max_pages = npages;
+	dev->node = ufb_pages_node(pages, npages);
+	dev->vmem = vmem;
+	mutex_unlock(&dev->mappings_lock);
+
+	return 0;
+
+err_unpin:
+	if (pinned > 0)
+		ufb_free_memfd_pages(pages, pinned);
+	kfree(pages);
+err_fput:
+	fput(memfd);
+	return err;
+}
+
+void ufb_vmem_free(struct ufb_dev *dev)
+{
+	void *vmem = dev->vmem;
+
+	if (vmem == NULL)
+		return;
+
+	/* clients may outlive us;  their mappings just stop working */
+	mutex_lock(&dev->reclaim_lock);
+	mutex_lock(&dev->mappings_lock);
+	dev->vmem = NULL;
+	mutex_unlock(&dev->mappings_lock);
+
+	if (!dev->unmapped)
+		vunmap(vmem);
+	dev->unmapped = 0;
+	mutex_unlock(&dev->reclaim_lock);
+
+	ufb_vmem_truncate(dev, 0);
+	ufb_snapshot_free(dev);
+
+	if (dev->memfd) {
+		ufb_free_memfd_pages(dev->pages, dev->npages);
+		kfree(dev->pages);
+		fput(dev->memfd);
+
+		dev->memfd = NULL;
+	} else {
+		vfree(dev->pages);
+	}
+
+	dev->pages = NULL;
+	dev->npages = 0;
+	dev->max_pages = 0;
+	dev->node = NUMA_NO_NODE;
+}
+
+/*
+ *  Resizes vmem in place, switching mode along with it, without the
+ *  daemon or fb clients having to remap anything.  vmem grows before the
+ *  mode change and shrinks after, so the mode always fits.
+ */
+int ufb_vmem_resize(struct ufb_dev *dev, struct ufb_resize *req)
+{
+	struct ufb_event event;
+	size_t old_size = dev->vmem_size;
+	size_t size = req->vmem_size;
+	unsigned int npages = PAGE_ALIGN(size) >> PAGE_SHIFT;
+	int err = 0;
+
+	if (!dev->vmem || !size)
+		return -EINVAL;
+
+	if (PAGE_ALIGN(size) > ufb_vmem_capacity(dev))
+		return -ENOSPC;
+
+	down_write(&dev->resize_sem);
+
+	/* growing and shrinking only know resident pages */
+	err = ufb_reclaim_restore(dev, 0, UINT_MAX);
+	if (err)
+		goto out;
+
+	if (size > old_size) {
+		if (npages > dev->npages) {
+			err = ufb_vmem_grow(dev, npages);
+			if (err)
+				goto out;
+		}
+
+		spin_lock(&dev->pages_lock);
+		dev->vmem_size = size;
+		spin_unlock(&dev->pages_lock);
+	}
+
+	err = ufb_fb_resize(dev, size, req->xres, req->yres,
+	                    req->bits_per_pixel);
+	if (err)
+		size = old_size;
+
+	if (size < dev->vmem_size)
+		ufb_vmem_truncate(dev, size);
+
+	if (err)
+		goto out;
+
+	memset(&event, 0, sizeof(event));
+	event.type = UFB_EV_RESIZE;
+	event.u.resize.vmem_size = dev->vmem_size;
+	ufb_fb_get_mode(dev, &event.u.resize.xres, &event.u.resize.yres,
+	                &event.u.resize.bits_per_pixel);
+	ufb_queue_event(dev, &event);
+
+out:
+	up_write(&dev->resize_sem);
+	return err;
+}
@@ -0,0 +1,112 @@
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+
+#include "ufb.hpp"
+
+/*
+ * fbtest's gradient and meander, drawn through ufb.hpp:  the mode is
+ * looked at once, to pick the format, and each frame is then a loop of
+ * plain stores per row.  Runs as the daemon of a new framebuffer, or of
+ * the persistent instance named with -i.
+ */
+
+const char *instance = nullptr;
+int frames = 1;
+
+/* 256x256 of red across, green down, over some blue;  at x, y on screen */
+template<class Format>
+void gradient( const ufb::view<Format> &screen, int x, int y )
+{
+	ufb::view<Format> square = screen.sub(ufb::rect{ x, y, 256, 256 });
+	int i, j;
+
+	for( j = 0; j < square.height(); j++ ) {
+		typename Format::pixel_type *row = square.row(j);
+
+		for( i = 0; i < square.width(); i++ ) {
+			row[i] = Format::pack(i, j, 100);
+		}
+	}
+}
+
+/* bounces the gradient around the visible screen, a frame per step */
+template<class Format>
+void meander( ufb::context &context )
+{
+	ufb_scanout_t s = context.scanout();
+	int x = 100, y = 100;
+	int x_inc = 1, y_inc = 1;
+	int n;
+
+	for( n = 0; n < frames; n++ ) {
+		ufb::frame<Format> frame = context.begin_frame<Format>();
+
+		frame.screen().sub(ufb::rect{ s.xoffset, s.yoffset, s.width,
+		                              s.height }).fill(Format::pack(0, 0, 0));
+		gradient(frame.screen(), s.xoffset + x, s.yoffset + y);
+
+		if( s.width <= 256 || s.height <= 256 ) {
+			continue;
+		}
+
+		x += x_inc;
+		y += y_inc;
+
+		if( x == 0 || x == s.width - 256 ) {
+			x_inc = -x_inc;
+		}
+		if( y == 0 || y == s.height - 256 ) {
+			y_inc = -y_inc;
+		}
+	}
+}
+
+int main( int argc, char **argv )
+{
+	ufb_params_t params;
+	int opt;
+
+	while( -1 != (opt = getopt(argc, argv, "i:n:")) ) {
+		switch( opt ) {
+			case 'i': instance = optarg; break;
+			case 'n': frames = atoi(optarg); break;
+			default: goto usage;
+		}
+	}
+
+	if( argc != optind || frames < 1 ) {
+		goto usage;
+	}
+
+	ufb_params_init(&params, 640, 480, 640 * 480 * 4);
+	if( instance ) {
+		params.instance = instance;
+		params.flags |= UFB_INIT_CREATE;
+	}
+
+	try {
+		ufb::context context(params);
+		ufb_pixel_layout_t layout = context.pixel_layout();
+
+		if( ufb::rgba8888::matches(layout) ) {
+			meander<ufb::rgba8888>(context);
+		} else if( ufb::rgb565::matches(layout) ) {
+			meander<ufb::rgb565>(context);
+		} else {
+			fprintf(stderr, "no gradient for %dbpp\n", layout.bpp);
+			return 1;
+		}
+	} catch( const ufb::error &e ) {
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+
+usage:
+	printf("Usage:  %s [-i INSTANCE] [-n FRAMES]\n", argv[0]);
+	printf("  -i  draw on the persistent instance INSTANCE, made if need be\n");
+	printf("  -n  frames to meander for (default 1)\n");
+	return 1;
+}
@@ -0,0 +1,379 @@
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <linux/fb.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ufb_ioctl.h"
+
+/* replays a trace recorded with ufb_trace_start() against a framebuffer */
+
+#define NUM_TRACE_TYPES (UFB_TRACE_VBLANK + 1)
+
+int fbfd = -1;
+uint8_t *fbp = NULL;
+size_t fb_len = 0;
+struct fb_var_screeninfo vinfo;
+struct fb_fix_screeninfo finfo;
+
+int max_speed = 0;
+
+unsigned long counts[NUM_TRACE_TYPES];
+unsigned long long bytes[NUM_TRACE_TYPES];
+unsigned long skipped = 0;
+
+static const char *type_names[NUM_TRACE_TYPES] = {
+	[UFB_TRACE_MODE]       = "mode",
+	[UFB_TRACE_SET_VAR]    = "set_var",
+	[UFB_TRACE_WRITE]      = "write",
+	[UFB_TRACE_MMAP_WRITE] = "mmap_write",
+	[UFB_TRACE_PAN]        = "pan",
+	[UFB_TRACE_VSYNC_WAIT] = "vsync_wait",
+	[UFB_TRACE_FILLRECT]   = "fillrect",
+	[UFB_TRACE_COPYAREA]   = "copyarea",
+	[UFB_TRACE_IMAGEBLIT]  = "imageblit",
+	[UFB_TRACE_VBLANK]     = "vblank",
+};
+
+uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void sleep_until(uint64_t ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / 1000000000ull;
+	ts.tv_nsec = ns % 1000000000ull;
+
+	while( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ) {
+	}
+}
+
+void map_fb(void)
+{
+	if( fbp ) {
+		munmap(fbp, fb_len);
+		fbp = NULL;
+	}
+
+	if( ioctl(fbfd, FBIOGET_FSCREENINFO, &finfo) ||
+	    ioctl(fbfd, FBIOGET_VSCREENINFO, &vinfo) ) {
+		perror("Error reading screen information");
+		exit(3);
+	}
+
+	fb_len = finfo.smem_len;
+	fbp = mmap(0, fb_len, PROT_READ | PROT_WRITE, MAP_SHARED, fbfd, 0);
+	if( fbp == MAP_FAILED ) {
+		perror("Error mapping framebuffer");
+		exit(4);
+	}
+}
+
+void set_mode(const struct ufb_trace_mode *mode)
+{
+	vinfo.xres = mode->xres;
+	vinfo.yres = mode->yres;
+	vinfo.xres_virtual = mode->xres_virtual;
+	vinfo.yres_virtual = mode->yres_virtual;
+	vinfo.xoffset = mode->xoffset;
+	vinfo.yoffset = mode->yoffset;
+	vinfo.bits_per_pixel = mode->bits_per_pixel;
+	vinfo.grayscale = mode->grayscale;
+	vinfo.vmode = mode->vmode;
+	vinfo.activate = FB_ACTIVATE_NOW;
+
+	if( ioctl(fbfd, FBIOPUT_VSCREENINFO, &vinfo) ) {
+		perror("FBIOPUT_VSCREENINFO");
+	}
+
+	map_fb();
+}
+
+/* returns a pointer to pixel x, y if the whole span of w pixels is mapped */
+uint8_t *pixel(uint32_t x, uint32_t y, uint32_t w)
+{
+	size_t bpp = vinfo.bits_per_pixel / 8;
+	size_t offset = (size_t)y * finfo.line_length + x * bpp;
+
+	if( !bpp || offset + w * bpp > fb_len ) {
+		return NULL;
+	}
+
+	return fbp + offset;
+}
+
+void put_pixels(uint8_t *p, uint32_t color, uint32_t count, int xor)
+{
+	size_t bpp = vinfo.bits_per_pixel / 8;
+	uint32_t i;
+	size_t b;
+
+	for( i = 0; i < count; i++, p += bpp ) {
+		for( b = 0; b < bpp; b++ ) {
+			uint8_t v = color >> (8 * b);
+			p[b] = xor ? p[b] ^ v : v;
+		}
+	}
+}
+
+void fillrect(const struct ufb_trace_fillrect *fill)
+{
+	uint32_t y;
+	uint8_t *p;
+
+	for( y = fill->dy; y < fill->dy + fill->height; y++ ) {
+		if( !(p = pixel(fill->dx, y, fill->width)) ) {
+			skipped++;
+			return;
+		}
+		put_pixels(p, fill->color, fill->width, fill->rop == ROP_XOR);
+	}
+}
+
+void copyarea(const struct ufb_trace_copyarea *copy)
+{
+	size_t len = copy->width * (vinfo.bits_per_pixel / 8);
+	uint32_t i;
+
+	for( i = 0; i < copy->height; i++ ) {
+		/* walk bottom up when moving down so rows aren't clobbered */
+		uint32_t row = copy->dy > copy->sy ? copy->height - 1 - i : i;
+		uint8_t *dst = pixel(copy->dx, copy->dy + row, copy->width);
+		uint8_t *src = pixel(copy->sx, copy->sy + row, copy->width);
+
+		if( !dst || !src ) {
+			skipped++;
+			return;
+		}
+		memmove(dst, src, len);
+	}
+}
+
+void imageblit(const struct ufb_trace_imageblit *blit, const uint8_t *data)
+{
+	size_t bpp = vinfo.bits_per_pixel / 8;
+	size_t pitch;
+	uint32_t x, y;
+	uint8_t *p;
+
+	if( blit->depth == 1 ) {
+		pitch = (blit->width + 7) / 8;
+		for( y = 0; y < blit->height; y++ ) {
+			if( !(p = pixel(blit->dx, blit->dy + y, blit->width)) ) {
+				skipped++;
+				return;
+			}
+			for( x = 0; x < blit->width; x++, p += bpp ) {
+				int bit = data[y * pitch + x / 8] & (0x80 >> (x % 8));
+				put_pixels(p, bit ? blit->fg_color : blit->bg_color, 1, 0);
+			}
+		}
+	} else if( blit->depth == vinfo.bits_per_pixel ) {
+		pitch = blit->width * bpp;
+		for( y = 0; y < blit->height; y++ ) {
+			if( !(p = pixel(blit->dx, blit->dy + y, blit->width)) ) {
+				skipped++;
+				return;
+			}
+			memcpy(p, data + y * pitch, pitch);
+		}
+	} else {
+		skipped++;
+	}
+}
+
+void replay(const struct ufb_trace_record *rec, const uint8_t *payload)
+{
+	switch( rec->type ) {
+		case UFB_TRACE_MODE:
+		case UFB_TRACE_SET_VAR:
+			set_mode((const struct ufb_trace_mode *)payload);
+			break;
+
+		case UFB_TRACE_WRITE: {
+			const struct ufb_trace_write *w = (const void *)payload;
+			if( pwrite(fbfd, payload + sizeof(*w), w->length, w->offset) < 0 ) {
+				skipped++;
+			}
+		}
+		break;
+
+		case UFB_TRACE_MMAP_WRITE: {
+			const struct ufb_trace_write *w = (const void *)payload;
+			if( w->offset + (size_t)w->length <= fb_len ) {
+				memcpy(fbp + w->offset, payload + sizeof(*w), w->length);
+			} else {
+				skipped++;
+			}
+		}
+		break;
+
+		case UFB_TRACE_PAN: {
+			const struct ufb_trace_pan *pan = (const void *)payload;
+			vinfo.xoffset = pan->xoffset;
+			vinfo.yoffset = pan->yoffset;
+			vinfo.vmode = pan->vmode;
+			if( ioctl(fbfd, FBIOPAN_DISPLAY, &vinfo) ) {
+				skipped++;
+			}
+		}
+		break;
+
+		case UFB_TRACE_VSYNC_WAIT: {
+			uint32_t crtc = 0;
+			ioctl(fbfd, FBIO_WAITFORVSYNC, &crtc);
+		}
+		break;
+
+		case UFB_TRACE_FILLRECT:
+			fillrect((const struct ufb_trace_fillrect *)payload);
+			break;
+
+		case UFB_TRACE_COPYAREA:
+			copyarea((const struct ufb_trace_copyarea *)payload);
+			break;
+
+		case UFB_TRACE_IMAGEBLIT:
+			imageblit((const struct ufb_trace_imageblit *)payload,
+			          payload + sizeof(struct ufb_trace_imageblit));
+			break;
+
+		case UFB_TRACE_VBLANK:
+			/* the recording daemon presented here, nothing to drive */
+			break;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const struct ufb_trace_file_header *header;
+	const uint8_t *trace, *pos, *end;
+	struct stat st;
+	uint64_t first_ts = 0, last_ts = 0, start, lag, max_lag = 0;
+	unsigned long total = 0;
+	int tracefd;
+	int opt;
+	int i;
+
+	while( -1 != (opt = getopt(argc, argv, "m")) ) {
+		switch( opt ) {
+			case 'm':
+				max_speed = 1;
+				break;
+			default:
+				goto usage;
+		}
+	}
+
+	if( argc - optind != 2 ) {
+		goto usage;
+	}
+
+	if( -1 == (fbfd = open(argv[optind], O_RDWR)) ) {
+		perror("Error: cannot open framebuffer device");
+		exit(2);
+	}
+
+	if( -1 == (tracefd = open(argv[optind + 1], O_RDONLY)) || 
+	    fstat(tracefd, &st) ) {
+		perror("Error: cannot open trace file");
+		exit(2);
+	}
+
+	trace = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, 
+	             tracefd, 0);
+	if( trace == MAP_FAILED || st.st_size < (off_t)sizeof(*header) ) {
+		printf("Error: cannot read trace file.\n");
+		exit(2);
+	}
+
+	header = (const void *)trace;
+	if( header->magic != UFB_TRACE_MAGIC || 
+	    header->version != UFB_TRACE_VERSION ) {
+		printf("Error: not a ufb trace, or an unsupported version.\n");
+		exit(2);
+	}
+
+	map_fb();
+
+	pos = trace + sizeof(*header);
+	end = trace + st.st_size;
+	start = now_ns();
+
+	while( end - pos >= (long)sizeof(struct ufb_trace_record) ) {
+		const struct ufb_trace_record *rec = (const void *)pos;
+		size_t len = sizeof(*rec) + rec->size;
+
+		len = (len + UFB_TRACE_ALIGN - 1) & ~(size_t)(UFB_TRACE_ALIGN - 1);
+		if( sizeof(*rec) + rec->size > (size_t)(end - pos) ) {
+			printf("Warning: trace is truncated.\n");
+			break;
+		}
+
+		if( !total ) {
+			first_ts = rec->timestamp;
+		}
+		last_ts = rec->timestamp;
+
+		if( !max_speed ) {
+			uint64_t target = start + (rec->timestamp - first_ts);
+
+			if( now_ns() < target ) {
+				sleep_until(target);
+			}
+			lag = now_ns() - target;
+			if( lag > max_lag ) {
+				max_lag = lag;
+			}
+		}
+
+		replay(rec, pos + sizeof(*rec));
+
+		if( rec->type < NUM_TRACE_TYPES ) {
+			counts[rec->type]++;
+			bytes[rec->type] += rec->size;
+		}
+		total++;
+
+		pos += len;
+	}
+
+	printf("Replayed %lu records in %.3f s (trace spans %.3f s)\n", total,
+	       (now_ns() - start) / 1e9, (last_ts - first_ts) / 1e9);
+	for( i = 1; i < NUM_TRACE_TYPES; i++ ) {
+		if( counts[i] ) {
+			printf("  %-12s %10lu  %12llu bytes\n", type_names[i], counts[i],
+			       bytes[i]);
+		}
+	}
+	if( !max_speed ) {
+		printf("Max lag behind original timing:  %.3f ms\n", max_lag / 1e6);
+	}
+	if( skipped ) {
+		printf("Skipped %lu operations that did not fit the mode\n", skipped);
+	}
+
+	munmap((void *)trace, st.st_size);
+	munmap(fbp, fb_len);
+	close(tracefd);
+	close(fbfd);
+	return 0;
+
+usage:
+	printf("Usage:  %s [-m] DEVICE_FILE TRACE_FILE\n", argv[0]);
+	printf("  -m  replay at maximum speed instead of the recorded timing\n");
+	return 1;
+}
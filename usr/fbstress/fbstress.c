@@ -0,0 +1,622 @@
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <linux/fb.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "ufb.h"
+#include "ufb_ioctl.h"
+#include "ufb_loop.h"
+
+/*
+ * Density benchmark for the driver, not a test.  Brings up any number of
+ * instances at once, each with client threads drawing into its /dev/fbN
+ * and waiting for their frames to be shown, then tears them all down
+ * again.  One daemon loop presents all of them at a fixed rate, the way
+ * a host running hundreds would:  their vblanks go out together through
+ * ufb_loop, on io_uring unless -e asks for epoll.  Reports how long setup
+ * and teardown took per instance, and how evenly frames and client
+ * latency were spread across instances:  one instance's overhead
+ * shouldn't depend on the others.
+ */
+
+/* log2 buckets of microseconds */
+#define HIST_BUCKETS 32
+
+struct hist {
+	unsigned long count;
+	double sum;
+	double max;
+	unsigned long buckets[HIST_BUCKETS];
+};
+
+struct instance;
+
+struct client {
+	pthread_t thread;
+	struct instance *instance;
+	int id;
+
+	unsigned long frames;
+	unsigned long errors;
+	struct hist latency;
+	volatile int finished;
+};
+
+struct instance {
+	pthread_t thread;
+	int id;
+	ufb_context_t *context;
+	int driver_id;
+	int fb_node;
+
+	double setup_time;
+	double teardown_time;
+	unsigned long frames;
+	unsigned long events;
+	int failed;
+	int stopped;
+
+	struct client *clients;
+};
+
+int num_instances = 100;
+int num_clients = 2;
+int duration = 10;
+int width = 640;
+int height = 480;
+int fps = 60;
+int use_vsync = 0;
+int use_epoll = 0;
+const char *prefix = NULL;
+
+pthread_barrier_t ready;
+pthread_barrier_t done;
+volatile int running = 1;
+
+double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void sleep_until(double t)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)t;
+	ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+
+	while( EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ) {
+	}
+}
+
+void hist_add(struct hist *h, double seconds)
+{
+	unsigned long us = (unsigned long)(seconds * 1e6);
+	int b = 0;
+
+	while( us > 1 && b < HIST_BUCKETS - 1 ) {
+		us >>= 1;
+		b++;
+	}
+
+	h->buckets[b]++;
+	h->count++;
+	h->sum += seconds;
+	if( seconds > h->max ) {
+		h->max = seconds;
+	}
+}
+
+void hist_merge(struct hist *to, const struct hist *from)
+{
+	int b;
+
+	for( b = 0; b < HIST_BUCKETS; b++ ) {
+		to->buckets[b] += from->buckets[b];
+	}
+	to->count += from->count;
+	to->sum += from->sum;
+	if( from->max > to->max ) {
+		to->max = from->max;
+	}
+}
+
+/* upper bound of the bucket the fraction q of samples fall within, in ms */
+double hist_quantile(const struct hist *h, double q)
+{
+	unsigned long want = (unsigned long)(h->count * q);
+	unsigned long seen = 0;
+	int b;
+
+	for( b = 0; b < HIST_BUCKETS; b++ ) {
+		seen += h->buckets[b];
+		if( seen > want ) {
+			break;
+		}
+	}
+
+	return (double)(2UL << b) / 1e3;
+}
+
+void hist_print(const char *name, const struct hist *h)
+{
+	if( !h->count ) {
+		printf("%-18s no samples\n", name);
+		return;
+	}
+
+	printf("%-18s avg %8.3f ms  p50 < %8.3f  p99 < %8.3f  max %8.3f  (%lu)\n",
+	       name, h->sum / h->count * 1e3, hist_quantile(h, 0.5),
+	       hist_quantile(h, 0.99), h->max * 1e3, h->count);
+}
+
+/*
+ * Draws a band down the screen each frame, marks the frame and waits for
+ * the daemon to show it, or just waits for vsync with -v.
+ */
+void *client_main(void *arg)
+{
+	struct client *c = arg;
+	struct fb_var_screeninfo var;
+	struct fb_fix_screeninfo fix;
+	char path[32];
+	uint8_t *fb;
+	size_t size;
+	uint32_t y = 0;
+	uint32_t band;
+	int fd = -1;
+
+	if( c->instance->failed ) {
+		goto out;
+	}
+
+	snprintf(path, sizeof(path), "/dev/fb%d", c->instance->fb_node);
+	fd = open(path, O_RDWR);
+	if( fd < 0 ) {
+		perror(path);
+		goto fail;
+	}
+
+	if( ioctl(fd, FBIOGET_VSCREENINFO, &var) ||
+	    ioctl(fd, FBIOGET_FSCREENINFO, &fix) ) {
+		perror("FBIOGET_*SCREENINFO");
+		goto fail;
+	}
+
+	size = (size_t)fix.line_length * var.yres;
+	fb = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if( fb == MAP_FAILED ) {
+		perror("mmap");
+		goto fail;
+	}
+
+	band = var.yres / 16 ? var.yres / 16 : 1;
+
+	pthread_barrier_wait(&ready);
+
+	while( running ) {
+		double start;
+
+		memset(fb + (size_t)y * fix.line_length, c->frames & 0xff,
+		       (size_t)band * fix.line_length);
+		y = y + 2 * band <= var.yres ? y + band : 0;
+
+		start = now();
+
+		if( use_vsync ) {
+			uint32_t crtc = 0;
+
+			if( ioctl(fd, FBIO_WAITFORVSYNC, &crtc) ) {
+				c->errors++;
+				continue;
+			}
+		} else {
+			struct ufb_fb_present present;
+
+			if( ioctl(fd, UFB_FBIO_PRESENT_MARK, &present) ) {
+				c->errors++;
+				continue;
+			}
+
+			present.timeout_ms = 1000;
+			if( ioctl(fd, UFB_FBIO_PRESENT_WAIT, &present) ) {
+				c->errors++;
+				continue;
+			}
+		}
+
+		hist_add(&c->latency, now() - start);
+		c->frames++;
+	}
+
+	munmap(fb, size);
+	close(fd);
+	c->finished = 1;
+
+	return NULL;
+
+fail:
+	c->errors++;
+	if( fd >= 0 ) {
+		close(fd);
+	}
+out:
+	pthread_barrier_wait(&ready);
+	c->finished = 1;
+	return NULL;
+}
+
+/* the daemon keeps presenting until its clients have seen their last frame */
+int clients_running(const struct instance *inst)
+{
+	int i;
+
+	for( i = 0; i < num_clients; i++ ) {
+		if( !inst->clients[i].finished ) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* reads what a frame would show, a word per cache line */
+uint32_t present(ufb_context_t *context)
+{
+	ufb_scanout_t scanout;
+	const uint8_t *vmem = ufb_get_vmem(context);
+	uint32_t sum = 0;
+	size_t i, len;
+
+	if( UFB_OK != ufb_get_scanout(context, &scanout) ) {
+		return 0;
+	}
+
+	len = scanout.pitch * scanout.height;
+	for( i = 0; i < len; i += 64 ) {
+		sum += vmem[i];
+	}
+
+	return sum;
+}
+
+/*
+ * Sets the instance up, then leaves presenting to the daemon loop until
+ * its clients are done, and tears it down with the others.
+ */
+void *instance_main(void *arg)
+{
+	struct instance *inst = arg;
+	ufb_params_t params;
+	char name[32];
+	double start;
+	ufb_err_t err;
+	int i;
+
+	ufb_params_init(&params, width, height, (size_t)width * height * 4);
+	if( prefix ) {
+		snprintf(name, sizeof(name), "%s%d", prefix, inst->id);
+		params.instance = name;
+		params.flags |= UFB_INIT_CREATE;
+	}
+
+	start = now();
+	err = ufb_init_params(&inst->context, &params);
+	inst->setup_time = now() - start;
+
+	if( UFB_OK != err ) {
+		fprintf(stderr, "instance %d:  %s\n", inst->id, ufb_strerror(err));
+		inst->failed = 1;
+	} else {
+		inst->driver_id = ufb_get_id(inst->context);
+		inst->fb_node = ufb_get_fb_node(inst->context);
+		if( inst->fb_node < 0 ) {
+			fprintf(stderr, "instance %d:  driver doesn't say which /dev/fbN\n",
+			        inst->id);
+			inst->failed = 1;
+			ufb_free(inst->context);
+		}
+	}
+
+	/* started either way, so everybody meets at ready */
+	for( i = 0; i < num_clients; i++ ) {
+		struct client *c = &inst->clients[i];
+
+		c->instance = inst;
+		c->id = i;
+		pthread_create(&c->thread, NULL, client_main, c);
+	}
+
+	pthread_barrier_wait(&ready);
+
+	for( i = 0; i < num_clients; i++ ) {
+		pthread_join(inst->clients[i].thread, NULL);
+	}
+
+	/* everybody's done drawing, and the daemon loop with us */
+	pthread_barrier_wait(&done);
+
+	if( inst->failed ) {
+		return NULL;
+	}
+
+	start = now();
+	if( prefix ) {
+		ufb_drop_instance(inst->context);
+	}
+	ufb_free(inst->context);
+	inst->teardown_time = now() - start;
+
+	return NULL;
+}
+
+void on_events(ufb_context_t *context, void *user)
+{
+	struct instance *inst = user;
+	ufb_event_t event;
+
+	while( ufb_poll_event(context, &event) ) {
+		inst->events++;
+	}
+}
+
+/*
+ * Presents every instance each frame, and sends their vblanks in one go
+ * at the ufb_loop_run() that then waits for the next frame, handling
+ * driver events meanwhile.  Until all clients have seen their last frame.
+ */
+int run_daemon(struct instance *instances)
+{
+	ufb_loop_t *loop;
+	volatile uint32_t sink = 0;
+	double next, left;
+	int live = 0;
+	int i;
+
+	if( UFB_OK != ufb_loop_create(&loop, use_epoll ? UFB_LOOP_EPOLL : 0) ) {
+		fprintf(stderr, "can't make the daemon loop\n");
+		return -1;
+	}
+
+	for( i = 0; i < num_instances; i++ ) {
+		if( !instances[i].failed ) {
+			ufb_loop_add_context(loop, instances[i].context, on_events,
+			                     &instances[i]);
+			live++;
+		}
+	}
+
+	printf("daemon loop on %s\n", ufb_loop_backend(loop));
+
+	next = now();
+	while( live ) {
+		for( i = 0; i < num_instances; i++ ) {
+			struct instance *inst = &instances[i];
+			uint64_t seq = 0;
+
+			if( inst->failed || inst->stopped ) {
+				continue;
+			}
+
+			if( !running && !clients_running(inst) ) {
+				ufb_loop_remove_context(loop, inst->context);
+				inst->stopped = 1;
+				live--;
+				continue;
+			}
+
+			ufb_present_latch(inst->context, &seq);
+			sink += present(inst->context);
+			if( seq ) {
+				ufb_present_ack(inst->context, seq, 0);
+			}
+			ufb_loop_vblank(loop, inst->context);
+
+			if( running ) {
+				inst->frames++;
+			}
+		}
+
+		next += 1.0 / fps;
+		do {
+			left = next - now();
+			if( -1 == ufb_loop_run(loop, left > 0 ? (int)(left * 1e3) : 0) ) {
+				perror("ufb_loop_run");
+				ufb_loop_free(loop);
+				return -1;
+			}
+		} while( left > 1e-3 );
+	}
+
+	/* what's still queued, and the watches removed above */
+	ufb_loop_run(loop, 0);
+	ufb_loop_free(loop);
+
+	return 0;
+}
+
+/* spread of a per instance figure, as min/avg/max */
+void spread_print(const char *name, const double *values, int n)
+{
+	double min = 0, max = 0, sum = 0;
+	int i;
+
+	for( i = 0; i < n; i++ ) {
+		if( !i || values[i] < min ) {
+			min = values[i];
+		}
+		if( !i || values[i] > max ) {
+			max = values[i];
+		}
+		sum += values[i];
+	}
+
+	printf("%-18s min %10.3f  avg %10.3f  max %10.3f\n", name, min,
+	       n ? sum / n : 0, max);
+}
+
+/* ends the run after duration, while the daemon loop keeps us busy */
+void *timer_main(void *arg)
+{
+	(void)arg;
+
+	sleep_until(now() + duration);
+	running = 0;
+
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct instance *instances;
+	struct hist latency;
+	double *values;
+	unsigned long client_errors = 0;
+	pthread_t timer;
+	int daemon_failed = 0;
+	int failed = 0;
+	int opt;
+	int i, j, n;
+
+	while( -1 != (opt = getopt(argc, argv, "n:c:t:s:f:vep:")) ) {
+		switch( opt ) {
+			case 'n': num_instances = atoi(optarg); break;
+			case 'c': num_clients = atoi(optarg); break;
+			case 't': duration = atoi(optarg); break;
+			case 's':
+				if( 2 != sscanf(optarg, "%dx%d", &width, &height) ) {
+					goto usage;
+				}
+				break;
+			case 'f': fps = atoi(optarg); break;
+			case 'v': use_vsync = 1; break;
+			case 'e': use_epoll = 1; break;
+			case 'p': prefix = optarg; break;
+			default: goto usage;
+		}
+	}
+
+	if( argc != optind || num_instances < 1 || num_clients < 0 ||
+	    duration < 1 || fps < 1 || width < 1 || height < 1 ) {
+		goto usage;
+	}
+
+	instances = calloc(num_instances, sizeof(*instances));
+	values = calloc(num_instances, sizeof(*values));
+	for( i = 0; i < num_instances; i++ ) {
+		instances[i].clients = calloc(num_clients, sizeof(struct client));
+	}
+
+	/* every instance and client thread, and us */
+	pthread_barrier_init(&ready, NULL, num_instances * (1 + num_clients) + 1);
+	pthread_barrier_init(&done, NULL, num_instances + 1);
+
+	for( i = 0; i < num_instances; i++ ) {
+		instances[i].id = i;
+		pthread_create(&instances[i].thread, NULL, instance_main, &instances[i]);
+	}
+
+	pthread_barrier_wait(&ready);
+	printf("%d instances up, %d clients each, running for %d s\n",
+	       num_instances, num_clients, duration);
+
+	pthread_create(&timer, NULL, timer_main, NULL);
+	if( run_daemon(instances) ) {
+		daemon_failed = 1;
+		running = 0;
+		pthread_cancel(timer);
+	}
+	pthread_join(timer, NULL);
+
+	pthread_barrier_wait(&done);
+
+	for( i = 0; i < num_instances; i++ ) {
+		pthread_join(instances[i].thread, NULL);
+	}
+
+	memset(&latency, 0, sizeof(latency));
+	for( i = 0; i < num_instances; i++ ) {
+		failed += instances[i].failed;
+		for( j = 0; j < num_clients; j++ ) {
+			hist_merge(&latency, &instances[i].clients[j].latency);
+			client_errors += instances[i].clients[j].errors;
+		}
+	}
+
+	printf("instances:  %d up, %d failed\n", num_instances - failed, failed);
+
+	for( i = 0, n = 0; i < num_instances; i++ ) {
+		if( !instances[i].failed ) {
+			values[n++] = instances[i].setup_time * 1e3;
+		}
+	}
+	spread_print("setup ms", values, n);
+
+	for( i = 0, n = 0; i < num_instances; i++ ) {
+		if( !instances[i].failed ) {
+			values[n++] = instances[i].teardown_time * 1e3;
+		}
+	}
+	spread_print("teardown ms", values, n);
+
+	for( i = 0, n = 0; i < num_instances; i++ ) {
+		if( !instances[i].failed ) {
+			values[n++] = instances[i].frames / (double)duration;
+		}
+	}
+	spread_print("daemon fps", values, n);
+
+	for( i = 0, j = -1; i < num_instances; i++ ) {
+		if( !instances[i].failed &&
+		    (j < 0 || instances[i].frames < instances[j].frames) ) {
+			j = i;
+		}
+	}
+	if( j >= 0 ) {
+		printf("%-18s instance %d, driver id %d, /dev/fb%d\n", "slowest daemon",
+		       j, instances[j].driver_id, instances[j].fb_node);
+	}
+
+	for( i = 0, n = 0; i < num_instances; i++ ) {
+		unsigned long frames = 0;
+
+		if( instances[i].failed ) {
+			continue;
+		}
+		for( j = 0; j < num_clients; j++ ) {
+			frames += instances[i].clients[j].frames;
+		}
+		values[n++] = frames / (double)duration;
+	}
+	spread_print("client frames/s", values, n);
+
+	hist_print(use_vsync ? "vsync wait" : "present wait", &latency);
+	printf("client errors:  %lu\n", client_errors);
+
+	return failed || client_errors || daemon_failed ? 1 : 0;
+
+usage:
+	printf("Usage:  %s [-n INSTANCES] [-c CLIENTS] [-t SECONDS] [-s WxH] [-f FPS] [-v] [-e] [-p PREFIX]\n",
+	       argv[0]);
+	printf("  -n  instances to run at once (default 100)\n");
+	printf("  -c  client threads per instance (default 2)\n");
+	printf("  -t  how long to run (default 10)\n");
+	printf("  -s  mode of each instance (default 640x480)\n");
+	printf("  -f  frames per second the daemon presents each instance at (default 60)\n");
+	printf("  -v  clients wait with FBIO_WAITFORVSYNC rather than present marks\n");
+	printf("  -e  run the daemon loop on epoll, not io_uring\n");
+	printf("  -p  make persistent instances named PREFIXn, dropped at the end\n");
+	return 1;
+}
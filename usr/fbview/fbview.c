@@ -0,0 +1,378 @@
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "ufb_view.h"
+
+/*
+ * Stand-in viewer for the ufb view server.  Runs any number of viewers
+ * against one socket, optionally slowed down, applies every update to a
+ * local copy of the screen and reports what each one received.
+ */
+
+struct viewer {
+	pthread_t thread;
+	int id;
+	int fd;
+
+	uint32_t *fb;
+	uint32_t width;
+	uint32_t height;
+
+	unsigned long frames;
+	unsigned long rects[UFB_VIEW_ENC_COPY + 1];
+	unsigned long long bytes;
+	int failed;
+};
+
+const char *socket_path;
+int num_viewers = 1;
+int delay_ms = 0;
+int duration = 10;
+int compress = 0;
+const char *output = NULL;
+
+static const char *encoding_names[UFB_VIEW_ENC_COPY + 1] = {
+	[UFB_VIEW_ENC_RAW]   = "raw",
+	[UFB_VIEW_ENC_SOLID] = "solid",
+	[UFB_VIEW_ENC_RLE]   = "rle",
+	[UFB_VIEW_ENC_COPY]  = "copy",
+};
+
+double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int read_all(int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+	ssize_t ret;
+
+	while( len ) {
+		ret = read(fd, p, len);
+		if( ret <= 0 ) {
+			if( ret < 0 && errno == EINTR ) {
+				continue;
+			}
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+int send_msg(int fd, uint32_t type, const void *body, uint32_t length)
+{
+	uint8_t buf[sizeof(ufb_view_msg_t) + 64];
+	ufb_view_msg_t msg;
+
+	msg.type = type;
+	msg.length = length;
+	memcpy(buf, &msg, sizeof(msg));
+	memcpy(buf + sizeof(msg), body, length);
+
+	return write(fd, buf, sizeof(msg) + length) == 
+	       (ssize_t)(sizeof(msg) + length) ? 0 : -1;
+}
+
+int apply_rect(struct viewer *v, const ufb_view_rect_t *rect, 
+               const uint8_t *data)
+{
+	uint32_t x, y;
+
+	if( rect->x + rect->w > v->width || rect->y + rect->h > v->height ) {
+		return -1;
+	}
+
+	switch( rect->encoding ) {
+		case UFB_VIEW_ENC_RAW:
+			if( rect->length != (uint32_t)rect->w * rect->h * 4 ) {
+				return -1;
+			}
+			for( y = 0; y < rect->h; y++ ) {
+				memcpy(v->fb + (rect->y + y) * v->width + rect->x,
+				       data + y * rect->w * 4, rect->w * 4);
+			}
+			break;
+
+		case UFB_VIEW_ENC_SOLID: {
+			uint32_t color;
+
+			memcpy(&color, data, sizeof(color));
+			for( y = 0; y < rect->h; y++ ) {
+				for( x = 0; x < rect->w; x++ ) {
+					v->fb[(rect->y + y) * v->width + rect->x + x] = color;
+				}
+			}
+		}
+		break;
+
+		case UFB_VIEW_ENC_RLE: {
+			const ufb_view_run_t *run = (const void *)data;
+			const ufb_view_run_t *end = run + rect->length / sizeof(*run);
+			uint32_t left = 0;
+
+			for( y = 0; y < rect->h; y++ ) {
+				for( x = 0; x < rect->w; x++ ) {
+					if( !left ) {
+						if( run == end ) {
+							return -1;
+						}
+						left = run->count;
+						run++;
+					}
+					v->fb[(rect->y + y) * v->width + rect->x + x] = run[-1].color;
+					left--;
+				}
+			}
+		}
+		break;
+
+		case UFB_VIEW_ENC_COPY: {
+			const ufb_view_copy_t *copy = (const void *)data;
+
+			if( copy->sx + rect->w > v->width || 
+			    copy->sy + rect->h > v->height ) {
+				return -1;
+			}
+			for( y = 0; y < rect->h; y++ ) {
+				/* bottom up when moving down so rows aren't clobbered */
+				uint32_t row = rect->y > copy->sy ? rect->h - 1 - y : y;
+
+				memmove(v->fb + (rect->y + row) * v->width + rect->x,
+				        v->fb + (copy->sy + row) * v->width + copy->sx,
+				        rect->w * 4);
+			}
+		}
+		break;
+
+		default:
+			return -1;
+	}
+
+	v->rects[rect->encoding]++;
+
+	return 0;
+}
+
+int handle_frame(struct viewer *v, const uint8_t *body, uint32_t length)
+{
+	ufb_view_frame_t frame;
+	const uint8_t *p = body + sizeof(frame);
+	const uint8_t *end = body + length;
+	uint32_t i;
+
+	if( length < sizeof(frame) || !v->fb ) {
+		return -1;
+	}
+	memcpy(&frame, body, sizeof(frame));
+
+	for( i = 0; i < frame.rects; i++ ) {
+		ufb_view_rect_t rect;
+
+		if( end - p < (long)sizeof(rect) ) {
+			return -1;
+		}
+		memcpy(&rect, p, sizeof(rect));
+		p += sizeof(rect);
+
+		if( end - p < (long)rect.length || apply_rect(v, &rect, p) ) {
+			return -1;
+		}
+		p += rect.length;
+	}
+
+	v->frames++;
+
+	return 0;
+}
+
+void *viewer_main(void *arg)
+{
+	struct viewer *v = arg;
+	struct sockaddr_un addr;
+	ufb_view_hello_t hello;
+	ufb_view_request_t request;
+	uint8_t *body = NULL;
+	size_t body_cap = 0;
+	double deadline = now() + duration;
+
+	v->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+
+	if( v->fd < 0 || connect(v->fd, (struct sockaddr *)&addr, sizeof(addr)) ) {
+		perror("connect");
+		v->failed = 1;
+		return NULL;
+	}
+
+	hello.version = UFB_VIEW_VERSION;
+	hello.flags = compress ? UFB_VIEW_COMPRESS : 0;
+	request.incremental = 0;
+
+	if( send_msg(v->fd, UFB_VIEW_HELLO, &hello, sizeof(hello)) ||
+	    send_msg(v->fd, UFB_VIEW_REQUEST, &request, sizeof(request)) ) {
+		v->failed = 1;
+		return NULL;
+	}
+
+	while( now() < deadline ) {
+		ufb_view_msg_t msg;
+
+		if( read_all(v->fd, &msg, sizeof(msg)) ) {
+			v->failed = 1;
+			break;
+		}
+
+		if( msg.length > body_cap ) {
+			body_cap = msg.length;
+			body = realloc(body, body_cap);
+		}
+		if( read_all(v->fd, body, msg.length) ) {
+			v->failed = 1;
+			break;
+		}
+		v->bytes += sizeof(msg) + msg.length;
+
+		if( msg.type == UFB_VIEW_INIT ) {
+			ufb_view_init_t init;
+
+			memcpy(&init, body, sizeof(init));
+			v->width = init.width;
+			v->height = init.height;
+			free(v->fb);
+			v->fb = calloc((size_t)v->width * v->height, 4);
+		} else if( msg.type == UFB_VIEW_FRAME ) {
+			if( handle_frame(v, body, msg.length) ) {
+				fprintf(stderr, "viewer %d:  bad frame\n", v->id);
+				v->failed = 1;
+				break;
+			}
+
+			if( delay_ms ) {
+				usleep(delay_ms * 1000);
+			}
+
+			request.incremental = 1;
+			if( send_msg(v->fd, UFB_VIEW_REQUEST, &request, 
+			             sizeof(request)) ) {
+				v->failed = 1;
+				break;
+			}
+		}
+	}
+
+	free(body);
+	close(v->fd);
+
+	return NULL;
+}
+
+void write_ppm(const struct viewer *v, const char *filename)
+{
+	FILE *f = fopen(filename, "wb");
+	uint32_t i;
+
+	if( !f ) {
+		perror(filename);
+		return;
+	}
+
+	fprintf(f, "P6\n%u %u\n255\n", v->width, v->height);
+	for( i = 0; i < v->width * v->height; i++ ) {
+		uint8_t rgb[3] = { v->fb[i] >> 16, v->fb[i] >> 8, v->fb[i] };
+		fwrite(rgb, 3, 1, f);
+	}
+
+	fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+	struct viewer *viewers;
+	unsigned long long total_bytes = 0;
+	unsigned long total_frames = 0;
+	int opt;
+	int i, e;
+
+	while( -1 != (opt = getopt(argc, argv, "n:d:t:co:")) ) {
+		switch( opt ) {
+			case 'n': num_viewers = atoi(optarg); break;
+			case 'd': delay_ms = atoi(optarg); break;
+			case 't': duration = atoi(optarg); break;
+			case 'c': compress = 1; break;
+			case 'o': output = optarg; break;
+			default: goto usage;
+		}
+	}
+
+	if( argc - optind != 1 || num_viewers < 1 ) {
+		goto usage;
+	}
+	socket_path = argv[optind];
+
+	signal(SIGPIPE, SIG_IGN);
+
+	viewers = calloc(num_viewers, sizeof(*viewers));
+
+	for( i = 0; i < num_viewers; i++ ) {
+		viewers[i].id = i;
+		pthread_create(&viewers[i].thread, NULL, viewer_main, &viewers[i]);
+	}
+
+	for( i = 0; i < num_viewers; i++ ) {
+		struct viewer *v = &viewers[i];
+
+		pthread_join(v->thread, NULL);
+
+		printf("viewer %3d:  %6lu frames  %6.1f fps  %12llu bytes%s\n", i,
+		       v->frames, v->frames / (double)duration, v->bytes,
+		       v->failed ? "  (disconnected)" : "");
+		for( e = 0; e <= UFB_VIEW_ENC_COPY; e++ ) {
+			if( v->rects[e] ) {
+				printf("              %-6s %10lu rects\n", encoding_names[e], 
+				       v->rects[e]);
+			}
+		}
+
+		total_frames += v->frames;
+		total_bytes += v->bytes;
+	}
+
+	printf("total:  %lu frames, %.1f MB/s across %d viewers\n", total_frames,
+	       total_bytes / 1e6 / duration, num_viewers);
+
+	if( output && viewers[0].fb ) {
+		write_ppm(&viewers[0], output);
+	}
+
+	return 0;
+
+usage:
+	printf("Usage:  %s [-n VIEWERS] [-d DELAY_MS] [-t SECONDS] [-c] [-o FILE.ppm] SOCKET\n",
+	       argv[0]);
+	printf("  -n  number of concurrent viewers (default 1)\n");
+	printf("  -d  delay before each update request, to simulate slow viewers\n");
+	printf("  -t  how long to run (default 10)\n");
+	printf("  -c  ask for compressed tiles\n");
+	printf("  -o  write the first viewer's final screen to a PPM file\n");
+	return 1;
+}
@@ -1,7 +1,13 @@
 #ifndef UFB_H
 #define UFB_H
 
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 struct ufb_context;
 typedef struct ufb_context ufb_context_t;
@@ -14,18 +20,423 @@ typedef enum {
 	UFB_ERR_ALLOC_VMEM,
 	UFB_ERR_MMAP,
 	UFB_ERR_CREATE_FB,
+	UFB_ERR_MEMFD,
+	UFB_ERR_IOCTL,
+	UFB_ERR_TRACE_FILE,
+	UFB_ERR_BUSY,
+	UFB_ERR_UNSUPPORTED,
+	UFB_ERR_CANCELLED,
+	UFB_ERR_SOCKET,
+	UFB_ERR_FILE,
 } ufb_err_t;
 
+/* back vmem with a sealed memfd owned by the daemon */
+#define UFB_INIT_MEMFD   (1 << 0)
+/* with UFB_INIT_MEMFD, use hugetlb pages for the memfd */
+#define UFB_INIT_HUGETLB (1 << 1)
+/* with an instance name, create the instance if there's none yet */
+#define UFB_INIT_CREATE  (1 << 2)
+
+/* ufb_params_t.node:  allocate vmem on the calling thread's node */
+#define UFB_NODE_LOCAL (-1)
+
+/*
+ * instance names a persistent framebuffer, which outlives the context:
+ * vmem and /dev/fbN stay when it's freed, or the daemon dies, for the
+ * next ufb_init_params() with the same name to pick up where it was left.
+ * Clients don't notice.  What's already set up is kept as it is and the
+ * rest of params ignored for it;  a UFB_EVENT_DAMAGE for the whole
+ * screen follows.  Names are up to 31 characters.
+ */
+typedef struct {
+	int width;
+	int height;
+	size_t vmem_size;
+	unsigned int flags;
+	int node;               /* NUMA node for vmem, or UFB_NODE_LOCAL */
+	const char *instance;   /* NULL for one that goes with the context */
+} ufb_params_t;
+
+extern void ufb_params_init(ufb_params_t *params, int width, int height,
+                            size_t vmem_size);
+
+extern ufb_err_t ufb_init_params(ufb_context_t **context,
+                                 const ufb_params_t *params);
+
 extern ufb_err_t ufb_init(ufb_context_t **context, int width, int height, 
                           size_t vmem_size);
 
 extern void* ufb_get_vmem(ufb_context_t *context);
 
+/* vmem's current size, which ufb_resize() changes */
+extern size_t ufb_get_vmem_size(ufb_context_t *context);
+
+/*
+ * Resizes vmem and switches to a width x height mode at the current depth,
+ * in one step, without vmem moving:  the pointer from ufb_get_vmem() and
+ * clients' mappings stay valid.  width and height 0 keep the mode,
+ * vmem_size 0 keeps the size.  memfd backed vmem can't grow past the
+ * size it was created with.  UFB_EVENT_RESIZE follows.
+ */
+extern ufb_err_t ufb_resize(ufb_context_t *context, int width, int height,
+                            size_t vmem_size);
+
+/*
+ * Stops the context's instance persisting, so it goes away at ufb_free()
+ * like an anonymous one.
+ */
+extern ufb_err_t ufb_drop_instance(ufb_context_t *context);
+
+/* memfd backing vmem, or -1 if the driver owns vmem */
+extern int ufb_get_vmem_fd(ufb_context_t *context);
+
+/* NUMA node most of vmem is on, -1 if the driver can't tell */
+extern int ufb_get_node(ufb_context_t *context);
+
+/*
+ * The instance's number among those the driver has, as
+ * <debugfs>/ufb/instances lists them, or 0 if the driver doesn't number
+ * them.
+ */
+extern int ufb_get_id(ufb_context_t *context);
+
+/* N of the context's /dev/fbN, -1 if the driver can't tell */
+extern int ufb_get_fb_node(ufb_context_t *context);
+
+/*
+ * Restricts thread to the CPUs of vmem's node, so presenting (which reads
+ * all of vmem every frame) doesn't cross the interconnect.
+ */
+extern ufb_err_t ufb_pin_thread(ufb_context_t *context, pthread_t thread);
+
+/* the part of vmem clients have panned/wrapped to */
+typedef struct {
+	int width;
+	int height;
+	int virtual_width;
+	int virtual_height;
+	int xoffset;
+	int yoffset;
+	size_t pitch;
+	int bpp;
+	int ywrap;
+	uint32_t fourcc;    /* YUV mode, see ufb_ioctl.h;  0 for RGB */
+	int untracked;      /* a client draws through a mapping unreported */
+} ufb_scanout_t;
+
+/* a run of screen lines stored contiguously in vmem */
+typedef struct {
+	size_t offset;
+	int y;
+	int height;
+} ufb_region_t;
+
+extern ufb_err_t ufb_get_scanout(ufb_context_t *context,
+                                 ufb_scanout_t *scanout);
+
+/*
+ * Nonzero when the mode uses a colormap (pseudocolor, directcolor gamma
+ * ramps or grayscale) or is YUV, so vmem can't be shown as is and has to
+ * go through ufb_convert_rows() or ufb_convert_scanout() when presenting.
+ */
+extern int ufb_needs_conversion(ufb_context_t *context);
+
+/*
+ * Where the mode keeps each channel in a pixel, as its
+ * fb_var_screeninfo bitfields say.  Lengths are 0 for FOURCC modes.
+ */
+typedef struct {
+	int bpp;
+	int red_offset;
+	int red_length;
+	int green_offset;
+	int green_length;
+	int blue_offset;
+	int blue_length;
+} ufb_pixel_layout_t;
+
+extern ufb_err_t ufb_get_pixel_layout(ufb_context_t *context,
+                                      ufb_pixel_layout_t *layout);
+
+/*
+ * Converts height rows of width pixels from vmem to ARGB8888.  Planar YUV
+ * modes (NV12, I420) keep their chroma away from the rows, so only the
+ * luma shows;  use ufb_convert_scanout() for those.
+ */
+extern void ufb_convert_rows(ufb_context_t *context, const void *src,
+                             size_t src_pitch, uint32_t *dst,
+                             size_t dst_pitch, int width, int height);
+
+/* converts the whole visible screen, width by height, to ARGB8888 */
+extern void ufb_convert_scanout(ufb_context_t *context,
+                                const ufb_scanout_t *scanout, uint32_t *dst,
+                                size_t dst_pitch);
+
+/*
+ * Splits the visible screen into the regions of vmem holding it:  one
+ * normally, two when yoffset wraps around the end of the virtual screen.
+ * Returns the number of regions filled in.
+ */
+extern int ufb_scanout_regions(const ufb_scanout_t *scanout,
+                               ufb_region_t regions[2]);
+
+typedef enum {
+	UFB_EVENT_BLANK = 1,
+	UFB_EVENT_CLIENT,
+	UFB_EVENT_CURSOR,
+	UFB_EVENT_CMAP,
+	UFB_EVENT_RESIZE,
+	UFB_EVENT_DAMAGE,
+	UFB_EVENT_PRESENT,
+} ufb_event_type_t;
+
+typedef struct {
+	int type;
+	uint64_t timestamp;
+	int level;      /* FB_BLANK_*, 0 when unblanked */
+} ufb_blank_event_t;
+
+/*
+ * What one process did with the framebuffer.  Counters are totals since
+ * it first touched the device;  pid 0 is work done by kernel threads.
+ */
+typedef struct {
+	int type;
+	uint64_t timestamp;
+	int pid;
+	char comm[16];
+	uint64_t write_bytes;   /* via write() */
+	uint64_t damage;        /* pixels drawn by write() and console blits */
+	uint32_t pans;
+	uint32_t vsync_waits;
+	uint32_t mmaps;
+} ufb_client_event_t;
+
+/*
+ * Console cursor state, only sent after ufb_cursor_plane().  x and y are
+ * in virtual screen coordinates;  fetch the image with
+ * ufb_get_cursor_image() when image_seq changes.
+ */
+typedef struct {
+	int type;
+	uint64_t timestamp;
+	int enable;
+	int x;
+	int y;
+	int hot_x;
+	int hot_y;
+	int width;
+	int height;
+	uint32_t image_seq;
+} ufb_cursor_event_t;
+
+/*
+ * The colormap changed.  It has already been picked up by the time the
+ * event is returned;  it means vmem may look different without having
+ * been written, so the whole screen should be presented again.
+ */
+typedef struct {
+	int type;
+	uint64_t timestamp;
+} ufb_cmap_event_t;
+
+/* vmem and the mode were changed by ufb_resize() */
+typedef struct {
+	int type;
+	uint64_t timestamp;
+	int width;
+	int height;
+	int bpp;
+	size_t vmem_size;
+} ufb_resize_event_t;
+
+/*
+ * Part of the virtual screen needs presenting again even if it looks
+ * unchanged:  all of it after attaching to a persistent instance, or
+ * what a client wrote or reported drawing.  Sent once, with the bounds
+ * of the first damage, until ufb_get_damage() takes what's pending.
+ */
+typedef struct {
+	int type;
+	uint64_t timestamp;
+	int x;
+	int y;
+	int width;
+	int height;
+} ufb_damage_event_t;
+
+/*
+ * A client marked a frame it wants to know is shown, see
+ * ufb_present_latch().  Sent once until the next latch.
+ */
+typedef struct {
+	int type;
+	uint64_t timestamp;
+	uint64_t seq;
+} ufb_present_event_t;
+
+typedef union {
+	int type;
+	ufb_blank_event_t blank;
+	ufb_client_event_t client;
+	ufb_cursor_event_t cursor;
+	ufb_cmap_event_t cmap;
+	ufb_resize_event_t resize;
+	ufb_damage_event_t damage;
+	ufb_present_event_t present;
+} ufb_event_t;
+
+/* fd to poll() for readability when waiting on events */
+extern int ufb_get_fd(ufb_context_t *context);
+
+/* returns 1 and fills in event if one is pending, 0 otherwise */
+extern int ufb_poll_event(ufb_context_t *context, ufb_event_t *event);
+
+/* waits up to timeout_ms (-1 forever) for an event to become pending */
+extern int ufb_wait_event(ufb_context_t *context, int timeout_ms);
+
+/* nonzero while clients have the screen blanked; presenting is wasted */
+extern int ufb_is_blanked(ufb_context_t *context);
+
+/*
+ * Asks for a UFB_EVENT_CLIENT per active process at most every
+ * interval_ms, sent from ufb_signal_vblank().  0 turns them off.  The
+ * same counters are always available in debugfs as ufb/fbN_clients.
+ */
+extern ufb_err_t ufb_client_events(ufb_context_t *context,
+                                   unsigned int interval_ms);
+
+#define UFB_MAX_DAMAGE_RECTS 16
+
+typedef struct {
+	int x;
+	int y;
+	int width;
+	int height;
+} ufb_rect_t;
+
+/*
+ * Takes the damage pending since the last call, as up to
+ * UFB_MAX_DAMAGE_RECTS rectangles of the virtual screen.  Only write()s
+ * to /dev/fbN, console drawing and clients reporting their drawing
+ * (UFB_FBIO_DAMAGE) add to it;  while the scanout says untracked, what's
+ * drawn through a mapping still has to be found out, or presented whole.
+ */
+extern ufb_err_t ufb_get_damage(ufb_context_t *context,
+                                ufb_rect_t rects[UFB_MAX_DAMAGE_RECTS],
+                                int *count);
+
+#define UFB_CURSOR_MAX_SIZE 64
+
+/*
+ * Sets aside what the driver needs to keep frames stable, or frees it.
+ * Nothing is kept until a frame is armed.
+ */
+extern ufb_err_t ufb_snapshot(ufb_context_t *context, int enable);
+
+/*
+ * Has the driver keep vmem, as the daemon's mapping sees it, the way it
+ * was at the next ufb_signal_vblank() while clients draw the frame after,
+ * so nothing tears without clients page flipping.  Costs clients a fault
+ * per page they touch in that frame, and a copy of it;  arm every frame
+ * to present each one stable, at that cost every frame.
+ */
+extern ufb_err_t ufb_snapshot_arm(ufb_context_t *context);
+
+/*
+ * Takes over drawing the console cursor:  instead of drawing it into vmem
+ * the driver sends UFB_EVENT_CURSOR and the daemon composites it when
+ * presenting.
+ */
+extern ufb_err_t ufb_cursor_plane(ufb_context_t *context, int enable);
+
+/*
+ * pixels must hold UFB_CURSOR_MAX_SIZE^2 values, returned in the
+ * framebuffer's pixel format, row major, width pixels per row.
+ */
+extern ufb_err_t ufb_get_cursor_image(ufb_context_t *context,
+                                      uint32_t *pixels, int *width,
+                                      int *height, uint32_t *image_seq);
+
+/*
+ * Records client activity (writes, pans, mode sets, vsync waits, fbcon
+ * drawing and, at each vblank, changes made through mmap) into a trace
+ * file that fbreplay can play back against another instance.
+ * buffer_size is the in-kernel buffer between flushes.
+ */
+extern ufb_err_t ufb_trace_start(ufb_context_t *context, const char *filename,
+                                 size_t buffer_size);
+
+/* move everything recorded so far into the trace file */
+extern ufb_err_t ufb_trace_flush(ufb_context_t *context);
+
+extern void ufb_trace_stop(ufb_context_t *context);
+
+/* raw access to the record stream, see ufb_ioctl.h for its format */
+extern ufb_err_t ufb_trace_read(ufb_context_t *context, void *buf, size_t len,
+                                size_t *read_len, unsigned int *lost);
+
+typedef enum {
+	UFB_IMAGE_RAW,   /* packed rows of pixels in the framebuffer's format */
+	UFB_IMAGE_QOI,
+	UFB_IMAGE_PNG,
+} ufb_image_format_t;
+
+typedef struct {
+	ufb_err_t status;
+	ufb_image_format_t format;
+	int width;
+	int height;
+	int bpp;
+	uint64_t timestamp;  /* ns, CLOCK_MONOTONIC, of the vblank captured */
+	const void *data;    /* the encoded image, valid during the callback */
+	size_t size;
+} ufb_screenshot_t;
+
+/* called on an encoder thread once the screenshot is encoded or failed */
+typedef void (*ufb_screenshot_cb)(const ufb_screenshot_t *screenshot,
+                                  void *user);
+
+/*
+ * Requests a screenshot of the next presented frame.  Returns at once;
+ * the frame is copied at the next ufb_signal_vblank() and encoded on a
+ * shared pool of low priority threads.  UFB_ERR_BUSY means the request
+ * was rate limited or the pool is saturated, try again later.
+ */
+extern ufb_err_t ufb_screenshot(ufb_context_t *context, 
+                                ufb_image_format_t format,
+                                ufb_screenshot_cb callback, void *user);
+
+/* at most max_per_second screenshots of this context, 0 for no limit */
+extern void ufb_screenshot_set_rate(ufb_context_t *context,
+                                    double max_per_second);
+
+/*
+ * Sizes the encoder pool shared by all contexts.  Only takes effect
+ * before the first screenshot; defaults to 2 threads and 8 queued frames.
+ */
+extern ufb_err_t ufb_screenshot_pool_config(int threads, int max_queued);
+
+/*
+ * Client present feedback.  Before reading vmem for a frame, latch the
+ * latest frame clients marked (UFB_FBIO_PRESENT_MARK on /dev/fbN);  once
+ * that frame is on screen, ack seq with when it got there (ns,
+ * CLOCK_MONOTONIC, 0 for now).  Clients waiting on it are woken.  Until
+ * a daemon latches, ufb_signal_vblank() stands in for the ack.
+ */
+extern ufb_err_t ufb_present_latch(ufb_context_t *context, uint64_t *seq);
+extern ufb_err_t ufb_present_ack(ufb_context_t *context, uint64_t seq,
+                                 uint64_t timestamp);
+
 extern ufb_err_t ufb_signal_vblank(ufb_context_t *context);
 
 extern void ufb_free(ufb_context_t *context);
 
 extern const char* ufb_strerror(ufb_err_t);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif //UFB_H
 
@@ -0,0 +1,424 @@
+#ifndef UFB_HPP
+#define UFB_HPP
+
+/*
+ * Header only C++ layer over libufb.
+ *
+ * context owns a ufb_context_t.  view<Format> is a typed window onto vmem
+ * for a pixel format fixed at compile time:  the mode's layout is checked
+ * once when the view is made, and from then on drawing is plain stores
+ * into contiguous rows, which the compiler can vectorize.  frame is a
+ * move only handle for presenting what was drawn.  See fbgradient for
+ * an example.
+ *
+ * Errors are thrown as ufb::error, which carries the ufb_err_t.
+ */
+
+#include "ufb.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+namespace ufb {
+
+class error : public std::runtime_error {
+public:
+	explicit error( ufb_err_t code )
+		: std::runtime_error(ufb_strerror(code)), code_(code) {}
+
+	ufb_err_t code() const { return code_; }
+
+private:
+	ufb_err_t code_;
+};
+
+inline void check( ufb_err_t code )
+{
+	if( UFB_OK != code ) {
+		throw error(code);
+	}
+}
+
+/*
+ * A packed RGB format:  each channel at offset, length bits long, as in
+ * fb_var_screeninfo, and alpha (if any) always opaque.  Names the type of
+ * one pixel, its depth and how to go to and from 8 bit channels.
+ */
+template<class Pixel, int Bpp, int RedOffset, int RedLength,
+         int GreenOffset, int GreenLength, int BlueOffset, int BlueLength,
+         int AlphaOffset = 0, int AlphaLength = 0>
+struct bitfield_format {
+	typedef Pixel pixel_type;
+	static constexpr int bpp = Bpp;
+
+	static constexpr uint32_t field( uint8_t v, int offset, int length ) {
+		return (uint32_t)(v >> (8 - length)) << offset;
+	}
+
+	static constexpr uint8_t channel( pixel_type p, int offset, int length ) {
+		return (uint8_t)((p >> offset & ((1u << length) - 1)) * 255 /
+		                 ((1u << length) - 1));
+	}
+
+	static constexpr pixel_type pack( uint8_t r, uint8_t g, uint8_t b ) {
+		return (pixel_type)(field(r, RedOffset, RedLength) |
+		                    field(g, GreenOffset, GreenLength) |
+		                    field(b, BlueOffset, BlueLength) |
+		                    field(0xff, AlphaOffset, AlphaLength));
+	}
+
+	static constexpr uint8_t red( pixel_type p ) { return channel(p, RedOffset, RedLength); }
+	static constexpr uint8_t green( pixel_type p ) { return channel(p, GreenOffset, GreenLength); }
+	static constexpr uint8_t blue( pixel_type p ) { return channel(p, BlueOffset, BlueLength); }
+
+	/* whether the mode described by layout is this format */
+	static bool matches( const ufb_pixel_layout_t &layout ) {
+		return layout.bpp == Bpp &&
+		       layout.red_offset == RedOffset && layout.red_length == RedLength &&
+		       layout.green_offset == GreenOffset && layout.green_length == GreenLength &&
+		       layout.blue_offset == BlueOffset && layout.blue_length == BlueLength;
+	}
+};
+
+/* the driver's 16 and 32bpp modes, as ufb_fb_check_var() lays them out */
+struct rgb565 : bitfield_format<uint16_t, 16, 0, 5, 5, 6, 11, 5> {};
+struct rgba8888 : bitfield_format<uint32_t, 32, 0, 8, 8, 8, 16, 8, 24, 8> {};
+
+/* palette index, see ufb_convert_rows() */
+struct index8 {
+	typedef uint8_t pixel_type;
+	static constexpr int bpp = 8;
+
+	static bool matches( const ufb_pixel_layout_t &layout ) {
+		return layout.bpp == bpp;
+	}
+};
+
+struct rect {
+	int x;
+	int y;
+	int width;
+	int height;
+
+	bool empty() const { return width <= 0 || height <= 0; }
+};
+
+/* smallest rect covering both */
+inline rect unite( const rect &a, const rect &b )
+{
+	int x0, y0, x1, y1;
+
+	if( a.empty() ) {
+		return b;
+	}
+	if( b.empty() ) {
+		return a;
+	}
+
+	x0 = std::min(a.x, b.x);
+	y0 = std::min(a.y, b.y);
+	x1 = std::max(a.x + a.width, b.x + b.width);
+	y1 = std::max(a.y + a.height, b.y + b.height);
+
+	return rect{ x0, y0, x1 - x0, y1 - y0 };
+}
+
+inline rect intersect( const rect &a, const rect &b )
+{
+	int x0 = std::max(a.x, b.x);
+	int y0 = std::max(a.y, b.y);
+	int x1 = std::min(a.x + a.width, b.x + b.width);
+	int y1 = std::min(a.y + a.height, b.y + b.height);
+
+	if( x1 <= x0 || y1 <= y0 ) {
+		return rect{ 0, 0, 0, 0 };
+	}
+
+	return rect{ x0, y0, x1 - x0, y1 - y0 };
+}
+
+/* one row of a view:  width contiguous pixels */
+template<class Format>
+class row_span {
+public:
+	typedef typename Format::pixel_type pixel_type;
+
+	row_span( pixel_type *data, int width ) : data_(data), width_(width) {}
+
+	pixel_type *begin() const { return data_; }
+	pixel_type *end() const { return data_ + width_; }
+	pixel_type *data() const { return data_; }
+	int size() const { return width_; }
+
+	pixel_type &operator[]( int x ) const { return data_[x]; }
+
+	void fill( pixel_type value ) const { std::fill(begin(), end(), value); }
+
+private:
+	pixel_type *data_;
+	int width_;
+};
+
+/* walks the rows of a view, pitch bytes apart */
+template<class Format>
+class row_iterator {
+public:
+	typedef typename Format::pixel_type pixel_type;
+
+	row_iterator( uint8_t *row, int width, std::ptrdiff_t pitch )
+		: row_(row), width_(width), pitch_(pitch) {}
+
+	row_span<Format> operator*() const {
+		return row_span<Format>(reinterpret_cast<pixel_type *>(row_), width_);
+	}
+
+	row_iterator &operator++() {
+		row_ += pitch_;
+		return *this;
+	}
+
+	bool operator==( const row_iterator &other ) const { return row_ == other.row_; }
+	bool operator!=( const row_iterator &other ) const { return row_ != other.row_; }
+
+private:
+	uint8_t *row_;
+	int width_;
+	std::ptrdiff_t pitch_;
+};
+
+template<class Format>
+class row_range {
+public:
+	row_range( row_iterator<Format> first, row_iterator<Format> last )
+		: first_(first), last_(last) {}
+
+	row_iterator<Format> begin() const { return first_; }
+	row_iterator<Format> end() const { return last_; }
+
+private:
+	row_iterator<Format> first_;
+	row_iterator<Format> last_;
+};
+
+/*
+ * width x height pixels of Format, rows pitch bytes apart.  Doesn't own
+ * the memory;  a view of vmem stays valid as long as the context does,
+ * ufb_resize() included, though it doesn't follow the new mode.
+ */
+template<class Format>
+class view {
+public:
+	typedef Format format;
+	typedef typename Format::pixel_type pixel_type;
+
+	view() : data_(nullptr), width_(0), height_(0), pitch_(0) {}
+
+	view( void *data, int width, int height, std::size_t pitch )
+		: data_(static_cast<uint8_t *>(data)), width_(width),
+		  height_(height), pitch_(pitch) {}
+
+	int width() const { return width_; }
+	int height() const { return height_; }
+	std::size_t pitch() const { return pitch_; }
+	bool empty() const { return !data_ || width_ <= 0 || height_ <= 0; }
+	rect bounds() const { return rect{ 0, 0, width_, height_ }; }
+
+	pixel_type *row( int y ) const {
+		return reinterpret_cast<pixel_type *>(data_ + (std::ptrdiff_t)y * pitch_);
+	}
+
+	pixel_type &operator()( int x, int y ) const { return row(y)[x]; }
+
+	row_range<Format> rows() const {
+		return row_range<Format>(
+			row_iterator<Format>(data_, width_, pitch_),
+			row_iterator<Format>(data_ + (std::ptrdiff_t)height_ * pitch_,
+			                     width_, pitch_));
+	}
+
+	/* the part of r inside this view, in the same coordinates as r */
+	view sub( const rect &r ) const {
+		rect clipped = intersect(r, bounds());
+
+		if( clipped.empty() ) {
+			return view();
+		}
+
+		return view(data_ + (std::ptrdiff_t)clipped.y * pitch_ +
+		            clipped.x * sizeof(pixel_type),
+		            clipped.width, clipped.height, pitch_);
+	}
+
+	void fill( pixel_type value ) const {
+		for( row_span<Format> r : rows() ) {
+			r.fill(value);
+		}
+	}
+
+	/* copies src's top left corner in, as much as fits */
+	void copy_from( const view &src ) const {
+		int w = std::min(width_, src.width_);
+		int h = std::min(height_, src.height_);
+		int y;
+
+		for( y = 0; y < h; y++ ) {
+			std::memmove(row(y), src.row(y), w * sizeof(pixel_type));
+		}
+	}
+
+private:
+	uint8_t *data_;
+	int width_;
+	int height_;
+	std::size_t pitch_;
+};
+
+/*
+ * One frame of drawing into the virtual screen, presented when it goes
+ * away or by present().
+ */
+template<class Format>
+class frame {
+public:
+	frame( frame &&other ) noexcept
+		: context_(other.context_), screen_(other.screen_) {
+		other.context_ = nullptr;
+	}
+
+	frame &operator=( frame &&other ) noexcept {
+		std::swap(context_, other.context_);
+		std::swap(screen_, other.screen_);
+		return *this;
+	}
+
+	frame( const frame & ) = delete;
+	frame &operator=( const frame & ) = delete;
+
+	~frame() {
+		if( context_ ) {
+			ufb_signal_vblank(context_);
+		}
+	}
+
+	const view<Format> &screen() const { return screen_; }
+
+	/* the part of r on the virtual screen, to draw into */
+	view<Format> draw( const rect &r ) const { return screen_.sub(r); }
+
+	void present() {
+		ufb_context_t *context = context_;
+
+		context_ = nullptr;
+		if( context ) {
+			check(ufb_signal_vblank(context));
+		}
+	}
+
+private:
+	friend class context;
+
+	frame( ufb_context_t *context, const view<Format> &screen )
+		: context_(context), screen_(screen) {}
+
+	ufb_context_t *context_;
+	view<Format> screen_;
+};
+
+class context {
+public:
+	context( int width, int height, std::size_t vmem_size ) : context_(nullptr) {
+		check(ufb_init(&context_, width, height, vmem_size));
+	}
+
+	explicit context( const ufb_params_t &params ) : context_(nullptr) {
+		check(ufb_init_params(&context_, &params));
+	}
+
+	context( context &&other ) noexcept : context_(other.context_) {
+		other.context_ = nullptr;
+	}
+
+	context &operator=( context &&other ) noexcept {
+		std::swap(context_, other.context_);
+		return *this;
+	}
+
+	context( const context & ) = delete;
+	context &operator=( const context & ) = delete;
+
+	~context() {
+		if( context_ ) {
+			ufb_free(context_);
+		}
+	}
+
+	ufb_context_t *get() const { return context_; }
+
+	void *vmem() const { return ufb_get_vmem(context_); }
+	std::size_t vmem_size() const { return ufb_get_vmem_size(context_); }
+	int fd() const { return ufb_get_fd(context_); }
+
+	ufb_scanout_t scanout() const {
+		ufb_scanout_t scanout;
+
+		check(ufb_get_scanout(context_, &scanout));
+		return scanout;
+	}
+
+	ufb_pixel_layout_t pixel_layout() const {
+		ufb_pixel_layout_t layout;
+
+		check(ufb_get_pixel_layout(context_, &layout));
+		return layout;
+	}
+
+	/*
+	 * The whole virtual screen;  what's shown is the scanout window into
+	 * it.  Throws UFB_ERR_UNSUPPORTED unless the mode is Format.
+	 */
+	template<class Format>
+	view<Format> screen() const {
+		ufb_scanout_t s = scanout();
+
+		if( !Format::matches(pixel_layout()) ) {
+			throw error(UFB_ERR_UNSUPPORTED);
+		}
+
+		return view<Format>(vmem(), s.virtual_width, s.virtual_height,
+		                    s.pitch);
+	}
+
+	template<class Format>
+	frame<Format> begin_frame() {
+		return frame<Format>(context_, screen<Format>());
+	}
+
+	void resize( int width, int height, std::size_t vmem_size = 0 ) {
+		check(ufb_resize(context_, width, height, vmem_size));
+	}
+
+	void drop_instance() { check(ufb_drop_instance(context_)); }
+
+	bool poll_event( ufb_event_t &event ) {
+		return ufb_poll_event(context_, &event) != 0;
+	}
+
+	bool wait_event( int timeout_ms = -1 ) {
+		return ufb_wait_event(context_, timeout_ms) != 0;
+	}
+
+	bool blanked() const { return ufb_is_blanked(context_) != 0; }
+
+	void signal_vblank() { check(ufb_signal_vblank(context_)); }
+
+private:
+	ufb_context_t *context_;
+};
+
+} // namespace ufb
+
+#endif //UFB_HPP
@@ -0,0 +1,77 @@
+#ifndef UFB_LOOP_H
+#define UFB_LOOP_H
+
+#include "ufb.h"
+
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Event loop for daemons driving one or more framebuffers.
+ *
+ * Vblank signals and writes to backends are queued during a frame and
+ * go out together with the wait for driver events and other fds at the
+ * next ufb_loop_run(), in a single io_uring_enter() where io_uring is
+ * available.  Otherwise the same interface runs on epoll, with a
+ * syscall per operation.
+ */
+
+typedef struct ufb_loop ufb_loop_t;
+
+/* don't try io_uring, go straight to epoll */
+#define UFB_LOOP_EPOLL (1 << 0)
+
+/* context has events pending;  drain them with ufb_poll_event() */
+typedef void (*ufb_loop_event_cb)(ufb_context_t *context, void *user);
+
+/* fd is readable */
+typedef void (*ufb_loop_fd_cb)(int fd, void *user);
+
+/* a queued write finished;  result is bytes written or -errno */
+typedef void (*ufb_loop_write_cb)(int fd, ssize_t result, void *user);
+
+extern ufb_err_t ufb_loop_create(ufb_loop_t **loop, unsigned int flags);
+
+extern void ufb_loop_free(ufb_loop_t *loop);
+
+/* "io_uring" or "epoll" */
+extern const char *ufb_loop_backend(ufb_loop_t *loop);
+
+extern ufb_err_t ufb_loop_add_context(ufb_loop_t *loop,
+                                      ufb_context_t *context,
+                                      ufb_loop_event_cb callback, void *user);
+
+extern void ufb_loop_remove_context(ufb_loop_t *loop, ufb_context_t *context);
+
+/* watches any pollable fd, an eventfd or a socket, for readability */
+extern ufb_err_t ufb_loop_add_fd(ufb_loop_t *loop, int fd,
+                                 ufb_loop_fd_cb callback, void *user);
+
+extern void ufb_loop_remove_fd(ufb_loop_t *loop, int fd);
+
+/* queues ufb_signal_vblank() for context */
+extern ufb_err_t ufb_loop_vblank(ufb_loop_t *loop, ufb_context_t *context);
+
+/*
+ * Queues a write of len bytes to fd, a socket, pipe or device.  buf must
+ * stay valid until callback (which may be NULL) is called.
+ */
+extern ufb_err_t ufb_loop_write(ufb_loop_t *loop, int fd, const void *buf,
+                                size_t len, ufb_loop_write_cb callback,
+                                void *user);
+
+/*
+ * Sends everything queued, then waits up to timeout_ms (-1 forever, 0 not
+ * at all) for something to happen and calls the callbacks for whatever
+ * did.  Returns the number of callbacks made, or -1 on error.
+ */
+extern int ufb_loop_run(ufb_loop_t *loop, int timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //UFB_LOOP_H
@@ -0,0 +1,86 @@
+#ifndef UFB_METRICS_H
+#define UFB_METRICS_H
+
+#include "ufb.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Daemon performance metrics in Prometheus text format.
+ *
+ * Each thread recording into a ufb_metrics_t gets its own set of
+ * histograms and counters, updated without locks or atomic
+ * read-modify-writes, so recording costs a few plain stores on the
+ * presenting thread.  Exporting adds the threads' sets up as they stand.
+ * Histogram buckets are powers of two, of nanoseconds (exported as
+ * seconds) or bytes.
+ *
+ * Metrics can be scraped from a unix socket, which answers each
+ * connection with an HTTP response (curl --unix-socket works), or
+ * written to a file for node_exporter's textfile collector.
+ */
+
+typedef struct ufb_metrics ufb_metrics_t;
+
+typedef enum {
+	UFB_HISTOGRAM_FRAME_TIME,      /* ns between presented frames */
+	UFB_HISTOGRAM_CONVERT_TIME,    /* ns per frame in ufb_convert_rows() */
+	UFB_HISTOGRAM_UPLOAD_TIME,     /* ns per frame getting vmem to the backend */
+	UFB_HISTOGRAM_PRESENT_TIME,    /* ns per frame in the backend's present */
+	UFB_HISTOGRAM_VBLANK_LATENCY,  /* ns from presenting to vblank signalled */
+	UFB_HISTOGRAM_UPLOAD_BYTES,    /* bytes per frame sent to the backend */
+	UFB_HISTOGRAM_COUNT
+} ufb_histogram_t;
+
+typedef enum {
+	UFB_COUNTER_FRAMES,            /* frames presented */
+	UFB_COUNTER_FRAMES_SKIPPED,    /* frames not presented, e.g. blanked */
+	UFB_COUNTER_FRAMES_COALESCED,  /* updates folded into another frame */
+	UFB_COUNTER_COUNT
+} ufb_counter_t;
+
+/* name, if not NULL, labels every metric as framebuffer="name" */
+extern ufb_err_t ufb_metrics_create(ufb_metrics_t **metrics, const char *name);
+
+extern void ufb_metrics_free(ufb_metrics_t *metrics);
+
+/* ns, CLOCK_MONOTONIC, for timing with ufb_metrics_time() */
+extern uint64_t ufb_metrics_clock(void);
+
+/*
+ * Recording functions do nothing when metrics is NULL, so a daemon can
+ * leave them in place with metrics turned off.
+ */
+extern void ufb_metrics_observe(ufb_metrics_t *metrics,
+                                ufb_histogram_t histogram, uint64_t value);
+
+/* observes the ns since start;  returns now, to start the next one */
+extern uint64_t ufb_metrics_time(ufb_metrics_t *metrics,
+                                 ufb_histogram_t histogram, uint64_t start);
+
+extern void ufb_metrics_count(ufb_metrics_t *metrics, ufb_counter_t counter,
+                              uint64_t n);
+
+/* the current values, in Prometheus text format */
+extern ufb_err_t ufb_metrics_write(ufb_metrics_t *metrics, FILE *file);
+
+/* replaces path, atomically, with the current values */
+extern ufb_err_t ufb_metrics_write_file(ufb_metrics_t *metrics,
+                                        const char *path);
+
+/* listens for scrapes on a unix socket at path */
+extern ufb_err_t ufb_metrics_serve(ufb_metrics_t *metrics, const char *path);
+
+/* answers pending scrapes.  Never blocks;  call once per frame. */
+extern void ufb_metrics_update(ufb_metrics_t *metrics);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //UFB_METRICS_H
@@ -0,0 +1,145 @@
+#ifndef UFB_PYRAMID_H
+#define UFB_PYRAMID_H
+
+#include "ufb.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Thumbnails of the screen for overview walls showing many framebuffers
+ * at once.
+ *
+ * Level n is the visible screen at 1/2^n of its size each way, every
+ * pixel the average of the 2x2 below it, rounded;  level 0 is the screen
+ * itself.  The daemon keeps levels 1 to max_level up to date, and only
+ * recomputes what lies under the damage it was told of, so keeping them
+ * costs a fraction of reading vmem each frame.  Level 1 is made from
+ * vmem, each further level from the one before it.
+ *
+ * Levels can be published in a POSIX shared memory object, so viewers
+ * in other processes read the small levels of hundreds of framebuffers
+ * without asking any of the daemons.  Level 0 costs a full copy of the
+ * screen per update, so it's only published while some viewer asks for
+ * it with ufb_pyramid_want().
+ */
+
+/* 1/32 each way */
+#define UFB_PYRAMID_MAX_LEVEL 5
+
+typedef struct ufb_pyramid ufb_pyramid_t;
+
+/*
+ * Keeps levels 1 to max_level for context's screen, published as
+ * shm_name (e.g. "/ufb-console-12") if it isn't NULL.  Everything is
+ * damaged to begin with.
+ */
+extern ufb_err_t ufb_pyramid_create(ufb_pyramid_t **pyramid,
+                                    ufb_context_t *context, int max_level,
+                                    const char *shm_name);
+
+/*
+ * Marks a rectangle of the virtual screen as changed, as ufb_get_damage()
+ * returns them.  Drawing through a mapping isn't reported to the driver;
+ * damage it all or set a refresh interval to pick it up.  A new colormap
+ * (UFB_EVENT_CMAP) changes every pixel too;  panning and resizing are
+ * noticed by ufb_pyramid_update() itself.
+ */
+extern void ufb_pyramid_damage(ufb_pyramid_t *pyramid, const ufb_rect_t *rect);
+
+extern void ufb_pyramid_damage_all(ufb_pyramid_t *pyramid);
+
+/* damages it all at least every interval_ms, 0 (the default) for never */
+extern void ufb_pyramid_set_refresh(ufb_pyramid_t *pyramid, int interval_ms);
+
+/* brings the levels up to date with the damage since the last call */
+extern ufb_err_t ufb_pyramid_update(ufb_pyramid_t *pyramid);
+
+/*
+ * A level as of the last ufb_pyramid_update(), packed ARGB8888 with a
+ * pitch of width * 4, valid until the next one.  NULL for level 0 or
+ * one past max_level.
+ */
+extern const uint32_t *ufb_pyramid_level(ufb_pyramid_t *pyramid, int level,
+                                         int *width, int *height);
+
+extern void ufb_pyramid_free(ufb_pyramid_t *pyramid);
+
+/*
+ * Viewers.  A level is copied out whole, and only if the daemon didn't
+ * touch it meanwhile;  UFB_ERR_BUSY means it kept changing, try again
+ * later.  UFB_ERR_UNSUPPORTED means the level isn't published (yet).
+ */
+typedef struct ufb_pyramid_view ufb_pyramid_view_t;
+
+extern ufb_err_t ufb_pyramid_open(ufb_pyramid_view_t **view,
+                                  const char *shm_name);
+
+/* the size of level as it's published now */
+extern ufb_err_t ufb_pyramid_size(ufb_pyramid_view_t *view, int level,
+                                  int *width, int *height);
+
+/*
+ * Copies level into dst, which has room for at least dst_width by
+ * dst_height pixels;  UFB_ERR_NO_MEM if the level is bigger than that,
+ * with its size in width and height.  seq, if not NULL, gets the level's
+ * update count, which ufb_pyramid_seq() can be compared against to skip
+ * copying a level that hasn't changed.
+ */
+extern ufb_err_t ufb_pyramid_read(ufb_pyramid_view_t *view, int level,
+                                  uint32_t *dst, size_t dst_pitch,
+                                  int dst_width, int dst_height,
+                                  int *width, int *height, uint64_t *seq);
+
+extern uint64_t ufb_pyramid_seq(ufb_pyramid_view_t *view, int level);
+
+/*
+ * Asks for level 0 to be published for the next two seconds;  call again
+ * to keep it coming.  It shows up at the daemon's next update.  Needs
+ * the object opened for writing.
+ */
+extern void ufb_pyramid_want(ufb_pyramid_view_t *view);
+
+extern void ufb_pyramid_close(ufb_pyramid_view_t *view);
+
+/*
+ * Layout of the shared memory object.  Native byte order, as both ends
+ * share a host.  Each level is guarded by a sequence lock:  seq is odd
+ * while the daemon writes it, and goes up by two with every update.
+ * Readers copy between two reads of an even seq and retry if it moved.
+ * The object only ever grows, as the screen does;  a level's offset
+ * past the end of a reader's mapping means it has to map again.
+ */
+#define UFB_PYRAMID_MAGIC   0x50424655u  /* "UFBP" */
+#define UFB_PYRAMID_VERSION 1
+
+/* the level holds the current screen, not just stale pixels */
+#define UFB_PYRAMID_VALID (1 << 0)
+
+typedef struct {
+	uint32_t seq;
+	uint32_t flags;
+	uint32_t width;
+	uint32_t height;
+	uint64_t offset;       /* of the pixels, pitch width * 4 */
+	uint64_t want_until;   /* ns, CLOCK_MONOTONIC, set by viewers */
+} ufb_pyramid_shm_level_t;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;
+	uint32_t max_level;
+	uint32_t reserved;
+	ufb_pyramid_shm_level_t levels[UFB_PYRAMID_MAX_LEVEL + 1];
+} ufb_pyramid_shm_t;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //UFB_PYRAMID_H
@@ -0,0 +1,150 @@
+#ifndef UFB_VIEW_H
+#define UFB_VIEW_H
+
+#include "ufb.h"
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Serves a ufb framebuffer to local viewers over a unix domain socket.
+ *
+ * The screen is cut into tiles and only tiles that changed are sent;
+ * vertical scrolls are sent as a single copy.  Viewers pull updates:
+ * each UFB_VIEW_REQUEST earns exactly one UFB_VIEW_FRAME, so a slow
+ * viewer gets its changes coalesced into its next frame instead of
+ * queueing up every frame it couldn't keep up with.
+ */
+
+typedef struct ufb_view_server ufb_view_server_t;
+
+typedef enum {
+	UFB_VIEW_INPUT_KEY,
+	UFB_VIEW_INPUT_POINTER,
+} ufb_view_input_type_t;
+
+typedef struct {
+	ufb_view_input_type_t type;
+	uint32_t keysym;
+	int down;
+	int x;
+	int y;
+	uint32_t buttons;
+} ufb_view_input_t;
+
+typedef void (*ufb_view_input_cb)(const ufb_view_input_t *input, void *user);
+
+extern ufb_err_t ufb_view_server_create(ufb_view_server_t **server,
+                                        ufb_context_t *context,
+                                        const char *path);
+
+/*
+ * Accepts viewers, handles their requests and sends them whatever changed.
+ * Never blocks; call once per presented frame.
+ */
+extern void ufb_view_server_update(ufb_view_server_t *server);
+
+extern void ufb_view_server_set_input_callback(ufb_view_server_t *server,
+                                               ufb_view_input_cb callback,
+                                               void *user);
+
+extern int ufb_view_server_viewer_count(ufb_view_server_t *server);
+
+extern void ufb_view_server_free(ufb_view_server_t *server);
+
+/*
+ * Wire protocol.  Native byte order, as both ends share a host.  Every
+ * message is a ufb_view_msg_t followed by length bytes of body.
+ */
+
+#define UFB_VIEW_VERSION   1
+#define UFB_VIEW_TILE_SIZE 64
+
+/* ufb_view_hello_t.flags:  viewer accepts UFB_VIEW_ENC_RLE */
+#define UFB_VIEW_COMPRESS (1 << 0)
+
+enum {
+	/* viewer to server */
+	UFB_VIEW_HELLO = 1,    /* ufb_view_hello_t */
+	UFB_VIEW_REQUEST,      /* ufb_view_request_t */
+	UFB_VIEW_KEY,          /* ufb_view_key_t */
+	UFB_VIEW_POINTER,      /* ufb_view_pointer_t */
+
+	/* server to viewer */
+	UFB_VIEW_INIT = 16,    /* ufb_view_init_t, also sent on resize */
+	UFB_VIEW_FRAME,        /* ufb_view_frame_t, then rects */
+};
+
+enum {
+	UFB_VIEW_ENC_RAW,      /* w * h ARGB8888 pixels */
+	UFB_VIEW_ENC_SOLID,    /* one uint32_t color */
+	UFB_VIEW_ENC_RLE,      /* ufb_view_run_t runs, row major */
+	UFB_VIEW_ENC_COPY,     /* ufb_view_copy_t, source position */
+};
+
+typedef struct {
+	uint32_t type;
+	uint32_t length;
+} ufb_view_msg_t;
+
+typedef struct {
+	uint32_t version;
+	uint32_t flags;
+} ufb_view_hello_t;
+
+typedef struct {
+	uint32_t incremental;  /* 0 asks for the whole screen */
+} ufb_view_request_t;
+
+typedef struct {
+	uint32_t keysym;
+	uint32_t down;
+} ufb_view_key_t;
+
+typedef struct {
+	int32_t x;
+	int32_t y;
+	uint32_t buttons;
+} ufb_view_pointer_t;
+
+typedef struct {
+	uint32_t width;
+	uint32_t height;
+	uint32_t bpp;
+	uint32_t tile_size;
+} ufb_view_init_t;
+
+typedef struct {
+	uint64_t seq;
+	uint32_t rects;
+	uint32_t reserved;
+} ufb_view_frame_t;
+
+typedef struct {
+	uint16_t encoding;
+	uint16_t reserved;
+	uint16_t x;
+	uint16_t y;
+	uint16_t w;
+	uint16_t h;
+	uint32_t length;
+} ufb_view_rect_t;
+
+typedef struct {
+	uint32_t color;
+	uint32_t count;
+} ufb_view_run_t;
+
+typedef struct {
+	uint16_t sx;
+	uint16_t sy;
+} ufb_view_copy_t;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //UFB_VIEW_H
@@ -1,35 +1,55 @@
+#define _GNU_SOURCE
+
 #include "ufb.h"
+#include "ufb_internal.h"
 
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
-struct ufb_context {
-	int width;
-	int height;
-	void *vmem;
-	size_t vmem_size;
-	int fd;
-};
-
-#define UFB_IOCTL_ALLOC_VMEM    (_IOW('U',0,uint32_t*))
-#define UFB_IOCTL_CREATE_FB     (_IO('U',1))
-#define UFB_IOCTL_SIGNAL_VBLANK (_IO('U',2))
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC       0x0001U
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB       0x0004U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS       (1024 + 9)
+#define F_SEAL_SEAL       0x0001
+#define F_SEAL_SHRINK     0x0002
+#define F_SEAL_GROW       0x0004
+#endif
 
 #define DEVICE_FILENAME ("/dev/ufb")
 
-static ufb_err_t _ufb_alloc_vmem(ufb_context_t *context)
+#define DEFAULT_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+static ufb_err_t _ufb_alloc_vmem(ufb_context_t *context, int node)
 {
+	struct ufb_alloc_vmem req;
 	int ret;
 
-	ret = ioctl(context->fd, UFB_IOCTL_ALLOC_VMEM, &context->vmem_size);
+	/* the driver defaults to our node;  older ones don't know about nodes */
+	if( UFB_NODE_LOCAL == node ) {
+		ret = ioctl(context->fd, UFB_IOCTL_ALLOC_VMEM, &context->vmem_size);
+	} else {
+		req.size = context->vmem_size;
+		req.node = node;
+		ret = ioctl(context->fd, UFB_IOCTL_ALLOC_VMEM_NODE, &req);
+	}
 
 	if( -1 == ret ) {
 		return UFB_ERR_ALLOC_VMEM;
@@ -38,9 +58,82 @@ static ufb_err_t _ufb_alloc_vmem(ufb_context_t *context)
 	return UFB_OK;
 }
 
+/* all zero from drivers without GET_INFO */
+static void _ufb_query_info(ufb_context_t *context, struct ufb_info *info)
+{
+	if( -1 == ioctl(context->fd, UFB_IOCTL_GET_INFO, info) ) {
+		memset(info, 0, sizeof(*info));
+	}
+}
+
+static ufb_err_t _ufb_attach(ufb_context_t *context, const char *name,
+                             unsigned int flags)
+{
+	struct ufb_attach req;
+
+	if( strlen(name) >= sizeof(req.name) ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	memset(&req, 0, sizeof(req));
+	strcpy(req.name, name);
+	if( flags & UFB_INIT_CREATE ) {
+		req.flags |= UFB_ATTACH_CREATE;
+	}
+
+	if( -1 == ioctl(context->fd, UFB_IOCTL_ATTACH, &req) ) {
+		return EBUSY == errno ? UFB_ERR_BUSY : UFB_ERR_IOCTL;
+	}
+
+	return UFB_OK;
+}
+
+/* the mode an earlier daemon left a persistent instance in */
+static void _ufb_query_mode(ufb_context_t *context)
+{
+	ufb_scanout_t scanout;
+
+	if( UFB_OK == ufb_get_scanout(context, &scanout) ) {
+		context->width = scanout.width;
+		context->height = scanout.height;
+	}
+}
+
+static int _ufb_query_node(ufb_context_t *context)
+{
+	struct ufb_info info;
+
+	if( -1 == ioctl(context->fd, UFB_IOCTL_GET_INFO, &info) ) {
+		return -1;
+	}
+
+	return info.node;
+}
+
+/* how far vmem can be resized, 0 if the driver can't */
+static size_t _ufb_query_capacity(ufb_context_t *context)
+{
+	struct ufb_info info;
+
+	if( -1 == ioctl(context->fd, UFB_IOCTL_GET_INFO, &info) ) {
+		return 0;
+	}
+
+	return info.vmem_capacity;
+}
+
+/*
+ * Maps all vmem can grow to, so ufb_resize() never moves it;  the driver
+ * only backs what's currently allocated.
+ */
 static ufb_err_t _ufb_map_vmem(ufb_context_t *context)
 {
-	context->vmem = mmap(NULL, context->vmem_size, PROT_READ|PROT_WRITE, 
+	context->map_size = _ufb_query_capacity(context);
+	if( context->map_size < context->vmem_size ) {
+		context->map_size = context->vmem_size;
+	}
+
+	context->vmem = mmap(NULL, context->map_size, PROT_READ|PROT_WRITE, 
 	                     MAP_SHARED, context->fd, 0);
 
 	if( MAP_FAILED == context->vmem ) {
@@ -52,6 +145,111 @@ static ufb_err_t _ufb_map_vmem(ufb_context_t *context)
 	return UFB_OK;
 }
 
+static size_t _ufb_hugepage_size(void)
+{
+	FILE *meminfo;
+	char line[128];
+	size_t kb = 0;
+
+	if( !(meminfo = fopen("/proc/meminfo", "r")) ) {
+		return DEFAULT_HUGEPAGE_SIZE;
+	}
+
+	while( fgets(line, sizeof(line), meminfo) ) {
+		if( 1 == sscanf(line, "Hugepagesize: %zu kB", &kb) ) {
+			break;
+		}
+	}
+
+	fclose(meminfo);
+
+	return kb ? kb * 1024 : DEFAULT_HUGEPAGE_SIZE;
+}
+
+/*
+ * Creates a sealed memfd, maps it and hands the mapping to the driver to
+ * use as vmem.  The daemon keeps the only writable reference to the size,
+ * so the pages can be shared with other processes by passing the fd on.
+ */
+static ufb_err_t _ufb_alloc_vmem_memfd(ufb_context_t *context, int hugetlb,
+                                       int node)
+{
+	struct ufb_memfd req;
+	size_t page_size = getpagesize();
+	size_t offset;
+	unsigned int flags = MFD_CLOEXEC | MFD_ALLOW_SEALING;
+
+	if( hugetlb ) {
+		page_size = _ufb_hugepage_size();
+
+		flags |= MFD_HUGETLB;
+		context->vmem_size = (context->vmem_size + page_size - 1) & 
+		                     ~(page_size - 1);
+	}
+
+	context->memfd = syscall(SYS_memfd_create, "ufb", flags);
+	if( -1 == context->memfd ) {
+		return UFB_ERR_MEMFD;
+	}
+
+	/* sealed, so vmem can only ever be resized within it */
+	context->map_size = context->vmem_size;
+
+	if( -1 == ftruncate(context->memfd, context->vmem_size) ) {
+		goto error;
+	}
+
+	if( -1 == fcntl(context->memfd, F_ADD_SEALS, 
+	                F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) ) {
+		goto error;
+	}
+
+	/*
+	 * Pages land on the node of whoever faults them in first, which is
+	 * us, unless they're bound elsewhere before being touched.
+	 */
+	context->vmem = mmap(NULL, context->vmem_size, PROT_READ|PROT_WRITE,
+	                     MAP_SHARED | (UFB_NODE_LOCAL == node ? MAP_POPULATE : 0),
+	                     context->memfd, 0);
+	if( MAP_FAILED == context->vmem ) {
+		context->vmem = NULL;
+		goto error;
+	}
+
+	if( UFB_NODE_LOCAL != node ) {
+		if( UFB_OK != ufb_bind_node(context->vmem, context->vmem_size, node) ) {
+			munmap(context->vmem, context->vmem_size);
+			context->vmem = NULL;
+			goto error;
+		}
+
+		for( offset = 0; offset < context->vmem_size; offset += page_size ) {
+			((volatile uint8_t *)context->vmem)[offset] = 0;
+		}
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.fd = context->memfd;
+	req.size = context->vmem_size;
+	req.addr = (uintptr_t)context->vmem;
+
+	if( -1 == ioctl(context->fd, UFB_IOCTL_ALLOC_VMEM_MEMFD, &req) ) {
+		munmap(context->vmem, context->vmem_size);
+		context->vmem = NULL;
+		close(context->memfd);
+		context->memfd = -1;
+		return UFB_ERR_ALLOC_VMEM;
+	}
+
+	return UFB_OK;
+
+error:
+	perror("UFB");
+	close(context->memfd);
+	context->memfd = -1;
+	return UFB_ERR_MEMFD;
+}
+
 static ufb_err_t _ufb_create_fb(ufb_context_t *context)
 {
 	int ret;
@@ -65,13 +263,35 @@ static ufb_err_t _ufb_create_fb(ufb_context_t *context)
 	return UFB_OK;
 }
 
+void ufb_params_init(ufb_params_t *params, int width, int height,
+                     size_t vmem_size)
+{
+	memset(params, 0, sizeof(*params));
+
+	params->width = width;
+	params->height = height;
+	params->vmem_size = vmem_size;
+	params->node = UFB_NODE_LOCAL;
+}
+
 ufb_err_t ufb_init(ufb_context_t **context_ptr, int width, int height, 
                    size_t vmem_size )
 {
+	ufb_params_t params;
+
+	ufb_params_init(&params, width, height, vmem_size);
+
+	return ufb_init_params(context_ptr, &params);
+}
+
+ufb_err_t ufb_init_params(ufb_context_t **context_ptr,
+                          const ufb_params_t *params)
+{
+	struct ufb_info info;
 	ufb_err_t err = UFB_OK;
 	ufb_context_t *context;
 
-	if( !context_ptr ) {
+	if( !context_ptr || !params ) {
 		return UFB_ERR_INVALID_PARAM;
 	}
 
@@ -83,34 +303,80 @@ ufb_err_t ufb_init(ufb_context_t **context_ptr, int width, int height,
 		goto error_base;
 	}
 
-	context->width = width;
-	context->height = height;
+	context->width = params->width;
+	context->height = params->height;
 	context->vmem = NULL;
-	context->vmem_size = vmem_size;
-
-	context->fd = open("/dev/ufb", O_RDWR|O_SYNC);
+	context->vmem_size = params->vmem_size;
+	context->map_size = 0;
+	context->memfd = -1;
+	context->node = -1;
+	context->blank = 0;
+	context->event_count = 0;
+	context->event_index = 0;
+	context->trace_file = NULL;
+	context->trace_buf = NULL;
+	context->screenshot_count = 0;
+	context->screenshot_interval = 0;
+	context->screenshot_last = 0;
+
+	context->fd = open(DEVICE_FILENAME, O_RDWR|O_SYNC|O_NONBLOCK);
 
 	if( -1 == context->fd ) {
 		err = UFB_ERR_OPENING_DEVICE;
 		goto error_free;
 	}
 
-	if( UFB_OK != (err = _ufb_alloc_vmem(context)) ) {
+	if( params->instance &&
+	    UFB_OK != (err = _ufb_attach(context, params->instance, params->flags)) ) {
 		goto error_close;
 	}
 
-	if( UFB_OK != (err = _ufb_map_vmem(context)) ) {
-		goto error_close;
+	/* a persistent instance may have been set up by an earlier daemon */
+	_ufb_query_info(context, &info);
+
+	if( info.vmem_size ) {
+		context->vmem_size = info.vmem_size;
+
+		if( UFB_OK != (err = _ufb_map_vmem(context)) ) {
+			goto error_close;
+		}
+	} else if( params->flags & UFB_INIT_MEMFD ) {
+		err = _ufb_alloc_vmem_memfd(context, 
+		                            params->flags & UFB_INIT_HUGETLB,
+		                            params->node);
+		if( UFB_OK != err ) {
+			goto error_close;
+		}
+	} else {
+		if( UFB_OK != (err = _ufb_alloc_vmem(context, params->node)) ) {
+			goto error_close;
+		}
+
+		if( UFB_OK != (err = _ufb_map_vmem(context)) ) {
+			goto error_close;
+		}
 	}
 
-	if( UFB_OK != (err = _ufb_create_fb(context)) ) {
-		goto error_close;
+	if( info.flags & UFB_INFO_FB ) {
+		_ufb_query_mode(context);
+	} else if( UFB_OK != (err = _ufb_create_fb(context)) ) {
+		goto error_unmap;
 	}
 
+	/* older drivers have no colormap to fetch;  present vmem as is */
+	ufb_cmap_update(context);
+
+	context->node = _ufb_query_node(context);
+
 	*context_ptr = context;
 
 	return err;
 
+error_unmap:
+	munmap(context->vmem, context->map_size);
+	if( -1 != context->memfd ) {
+		close(context->memfd);
+	}
 error_close:
 	close(context->fd);
 error_free:
@@ -124,12 +390,432 @@ void* ufb_get_vmem(ufb_context_t *context)
 	return context->vmem;
 }
 
+ufb_err_t ufb_drop_instance(ufb_context_t *context)
+{
+	if( -1 == ioctl(context->fd, UFB_IOCTL_DESTROY) ) {
+		return UFB_ERR_IOCTL;
+	}
+
+	return UFB_OK;
+}
+
+int ufb_get_vmem_fd(ufb_context_t *context)
+{
+	return context->memfd;
+}
+
+int ufb_get_id(ufb_context_t *context)
+{
+	struct ufb_info info;
+
+	_ufb_query_info(context, &info);
+
+	return info.id;
+}
+
+/* drivers that number instances say;  older ones leave it all zero */
+int ufb_get_fb_node(ufb_context_t *context)
+{
+	struct ufb_info info;
+
+	_ufb_query_info(context, &info);
+
+	return info.id ? info.fb_node : -1;
+}
+
+ufb_err_t ufb_get_scanout(ufb_context_t *context, ufb_scanout_t *scanout)
+{
+	struct ufb_scanout req;
+
+	if( !context || !scanout ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	/* older drivers don't fill in fourcc */
+	memset(&req, 0, sizeof(req));
+
+	if( -1 == ioctl(context->fd, UFB_IOCTL_GET_SCANOUT, &req) ) {
+		return UFB_ERR_IOCTL;
+	}
+
+	scanout->width = req.xres;
+	scanout->height = req.yres;
+	scanout->virtual_width = req.xres_virtual;
+	scanout->virtual_height = req.yres_virtual;
+	scanout->xoffset = req.xoffset;
+	scanout->yoffset = req.yoffset;
+	scanout->pitch = req.line_length;
+	scanout->bpp = req.bits_per_pixel;
+	scanout->ywrap = !!(req.flags & UFB_SCANOUT_YWRAP);
+	scanout->fourcc = req.fourcc;
+	scanout->untracked = !!(req.flags & UFB_SCANOUT_UNTRACKED);
+
+	return UFB_OK;
+}
+
+ufb_err_t ufb_resize(ufb_context_t *context, int width, int height,
+                     size_t vmem_size)
+{
+	struct ufb_resize req;
+
+	if( width < 0 || height < 0 || (!width != !height) ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.vmem_size = vmem_size ? vmem_size : context->vmem_size;
+	req.xres = width;
+	req.yres = height;
+
+	if( -1 == ioctl(context->fd, UFB_IOCTL_RESIZE, &req) ) {
+		return (ENOSPC == errno || ENOMEM == errno) ? UFB_ERR_NO_MEM :
+		                                             UFB_ERR_IOCTL;
+	}
+
+	context->vmem_size = req.vmem_size;
+	if( width ) {
+		context->width = width;
+		context->height = height;
+	}
+
+	return UFB_OK;
+}
+
+size_t ufb_get_vmem_size(ufb_context_t *context)
+{
+	return context->vmem_size;
+}
+
+int ufb_scanout_regions(const ufb_scanout_t *scanout, ufb_region_t regions[2])
+{
+	size_t x_bytes = (size_t)scanout->xoffset * scanout->bpp / 8;
+	int first;
+
+	if( !scanout->ywrap ||
+	    scanout->yoffset + scanout->height <= scanout->virtual_height ) {
+		regions[0].offset = scanout->yoffset * scanout->pitch + x_bytes;
+		regions[0].y = 0;
+		regions[0].height = scanout->height;
+		return 1;
+	}
+
+	first = scanout->virtual_height - scanout->yoffset;
+
+	regions[0].offset = scanout->yoffset * scanout->pitch;
+	regions[0].y = 0;
+	regions[0].height = first;
+
+	regions[1].offset = 0;
+	regions[1].y = first;
+	regions[1].height = scanout->height - first;
+
+	return 2;
+}
+
+uint64_t ufb_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int ufb_get_fd(ufb_context_t *context)
+{
+	return context->fd;
+}
+
+static void _ufb_translate_event(ufb_context_t *context, 
+                                 const struct ufb_event *in, ufb_event_t *out)
+{
+	memset(out, 0, sizeof(*out));
+
+	switch( in->type ) {
+		case UFB_EV_BLANK:
+			context->blank = in->u.blank.level;
+
+			out->blank.type = UFB_EVENT_BLANK;
+			out->blank.timestamp = in->timestamp;
+			out->blank.level = in->u.blank.level;
+			break;
+
+		case UFB_EV_CLIENT:
+			out->client.type = UFB_EVENT_CLIENT;
+			out->client.timestamp = in->timestamp;
+			out->client.pid = in->u.client.pid;
+			memcpy(out->client.comm, in->u.client.comm, 
+			       sizeof(out->client.comm));
+			out->client.comm[sizeof(out->client.comm) - 1] = '\0';
+			out->client.write_bytes = in->u.client.write_bytes;
+			out->client.damage = in->u.client.damage;
+			out->client.pans = in->u.client.pans;
+			out->client.vsync_waits = in->u.client.vsync_waits;
+			out->client.mmaps = in->u.client.mmaps;
+			break;
+
+		case UFB_EV_CURSOR:
+			out->cursor.type = UFB_EVENT_CURSOR;
+			out->cursor.timestamp = in->timestamp;
+			out->cursor.enable = in->u.cursor.enable;
+			out->cursor.x = in->u.cursor.x;
+			out->cursor.y = in->u.cursor.y;
+			out->cursor.hot_x = in->u.cursor.hot_x;
+			out->cursor.hot_y = in->u.cursor.hot_y;
+			out->cursor.width = in->u.cursor.width;
+			out->cursor.height = in->u.cursor.height;
+			out->cursor.image_seq = in->u.cursor.image_seq;
+			break;
+
+		case UFB_EV_CMAP:
+			ufb_cmap_update(context);
+
+			out->cmap.type = UFB_EVENT_CMAP;
+			out->cmap.timestamp = in->timestamp;
+			break;
+
+		case UFB_EV_RESIZE:
+			context->vmem_size = in->u.resize.vmem_size;
+			if( in->u.resize.xres ) {
+				context->width = in->u.resize.xres;
+				context->height = in->u.resize.yres;
+			}
+
+			out->resize.type = UFB_EVENT_RESIZE;
+			out->resize.timestamp = in->timestamp;
+			out->resize.width = in->u.resize.xres;
+			out->resize.height = in->u.resize.yres;
+			out->resize.bpp = in->u.resize.bits_per_pixel;
+			out->resize.vmem_size = in->u.resize.vmem_size;
+			break;
+
+		case UFB_EV_DAMAGE:
+			out->damage.type = UFB_EVENT_DAMAGE;
+			out->damage.timestamp = in->timestamp;
+			out->damage.x = in->u.damage.x;
+			out->damage.y = in->u.damage.y;
+			out->damage.width = in->u.damage.width;
+			out->damage.height = in->u.damage.height;
+			break;
+
+		case UFB_EV_PRESENT:
+			out->present.type = UFB_EVENT_PRESENT;
+			out->present.timestamp = in->timestamp;
+			out->present.seq = in->u.present.seq;
+			break;
+	}
+}
+
+int ufb_poll_event(ufb_context_t *context, ufb_event_t *event)
+{
+	ssize_t ret;
+
+	while( 1 ) {
+		while( context->event_index < context->event_count ) {
+			_ufb_translate_event(context, 
+			                     &context->events[context->event_index++],
+			                     event);
+			if( event->type ) {
+				return 1;
+			}
+		}
+
+		ret = read(context->fd, context->events, sizeof(context->events));
+		if( ret <= 0 ) {
+			return 0;
+		}
+
+		context->event_count = ret / sizeof(context->events[0]);
+		context->event_index = 0;
+	}
+}
+
+int ufb_wait_event(ufb_context_t *context, int timeout_ms)
+{
+	struct pollfd pfd;
+	int ret;
+
+	if( context->event_index < context->event_count ) {
+		return 1;
+	}
+
+	pfd.fd = context->fd;
+	pfd.events = POLLIN;
+
+	do {
+		ret = poll(&pfd, 1, timeout_ms);
+	} while( -1 == ret && EINTR == errno );
+
+	return ret > 0;
+}
+
+int ufb_is_blanked(ufb_context_t *context)
+{
+	return context->blank != 0;
+}
+
+ufb_err_t ufb_client_events(ufb_context_t *context, unsigned int interval_ms)
+{
+	uint32_t interval = interval_ms;
+
+	if( !context ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	if( 0 != ioctl(context->fd, UFB_IOCTL_CLIENT_EVENTS, &interval) ) {
+		return UFB_ERR_IOCTL;
+	}
+
+	return UFB_OK;
+}
+
+#if UFB_CURSOR_MAX_SIZE != UFB_CURSOR_MAX
+#error "UFB_CURSOR_MAX_SIZE must match the driver's UFB_CURSOR_MAX"
+#endif
+
+static ufb_err_t _ufb_snapshot(ufb_context_t *context, uint32_t value)
+{
+	if( !context ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	if( 0 != ioctl(context->fd, UFB_IOCTL_SNAPSHOT, &value) ) {
+		return UFB_ERR_IOCTL;
+	}
+
+	return UFB_OK;
+}
+
+ufb_err_t ufb_snapshot(ufb_context_t *context, int enable)
+{
+	return _ufb_snapshot(context, enable ? UFB_SNAPSHOT_ON : UFB_SNAPSHOT_OFF);
+}
+
+ufb_err_t ufb_snapshot_arm(ufb_context_t *context)
+{
+	return _ufb_snapshot(context, UFB_SNAPSHOT_ARM);
+}
+
+ufb_err_t ufb_cursor_plane(ufb_context_t *context, int enable)
+{
+	uint32_t value = enable != 0;
+
+	if( !context ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	if( 0 != ioctl(context->fd, UFB_IOCTL_CURSOR_PLANE, &value) ) {
+		return UFB_ERR_IOCTL;
+	}
+
+	return UFB_OK;
+}
+
+ufb_err_t ufb_get_cursor_image(ufb_context_t *context, uint32_t *pixels,
+                               int *width, int *height, uint32_t *image_seq)
+{
+	struct ufb_cursor_image req;
+
+	if( !context || !pixels ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.buf = (uintptr_t)pixels;
+	req.len = UFB_CURSOR_MAX_SIZE * UFB_CURSOR_MAX_SIZE * sizeof(uint32_t);
+
+	if( 0 != ioctl(context->fd, UFB_IOCTL_GET_CURSOR, &req) ) {
+		return UFB_ERR_IOCTL;
+	}
+
+	if( width ) {
+		*width = req.width;
+	}
+	if( height ) {
+		*height = req.height;
+	}
+	if( image_seq ) {
+		*image_seq = req.image_seq;
+	}
+
+	return UFB_OK;
+}
+
+ufb_err_t ufb_get_damage(ufb_context_t *context,
+                         ufb_rect_t rects[UFB_MAX_DAMAGE_RECTS], int *count)
+{
+	struct ufb_damage req;
+	uint32_t i;
+
+	if( !context || !rects || !count ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	*count = 0;
+
+	if( 0 != ioctl(context->fd, UFB_IOCTL_GET_DAMAGE, &req) ) {
+		return UFB_ERR_IOCTL;
+	}
+
+	for( i = 0; i < req.count && i < UFB_MAX_DAMAGE_RECTS; i++ ) {
+		rects[i].x = req.rects[i].x;
+		rects[i].y = req.rects[i].y;
+		rects[i].width = req.rects[i].width;
+		rects[i].height = req.rects[i].height;
+	}
+	*count = i;
+
+	return UFB_OK;
+}
+
+ufb_err_t ufb_present_latch(ufb_context_t *context, uint64_t *seq)
+{
+	struct ufb_present req;
+
+	if( !context || !seq ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	*seq = 0;
+
+	if( 0 != ioctl(context->fd, UFB_IOCTL_PRESENT_LATCH, &req) ) {
+		return UFB_ERR_IOCTL;
+	}
+
+	*seq = req.seq;
+
+	return UFB_OK;
+}
+
+ufb_err_t ufb_present_ack(ufb_context_t *context, uint64_t seq,
+                          uint64_t timestamp)
+{
+	struct ufb_present req;
+
+	if( !context ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	req.seq = seq;
+	req.timestamp = timestamp;
+
+	if( 0 != ioctl(context->fd, UFB_IOCTL_PRESENT_ACK, &req) ) {
+		return UFB_ERR_IOCTL;
+	}
+
+	return UFB_OK;
+}
+
 ufb_err_t ufb_signal_vblank(ufb_context_t *context)
 {
 	if( !context ) {
 		return UFB_ERR_INVALID_PARAM;
 	}
 
+	if( context->screenshot_count ) {
+		ufb_screenshot_vblank(context);
+	}
+
 	ioctl(context->fd, UFB_IOCTL_SIGNAL_VBLANK);
 
 	return UFB_OK;
@@ -138,6 +824,12 @@ ufb_err_t ufb_signal_vblank(ufb_context_t *context)
 void ufb_free(ufb_context_t *context)
 {
 	if( context ) {
+		ufb_trace_stop(context);
+		ufb_screenshot_cancel(context);
+		munmap(context->vmem, context->map_size);
+		if( -1 != context->memfd ) {
+			close(context->memfd);
+		}
 		close(context->fd);
 		free(context);
 	}
@@ -153,6 +845,14 @@ const char* ufb_strerror(ufb_err_t err)
 		case UFB_ERR_ALLOC_VMEM:     return "Could Not Allocate Vmem";
 		case UFB_ERR_MMAP:           return "Could Not mmap Vmem";
 		case UFB_ERR_CREATE_FB:      return "CREATE_FB ioctl Failed";
+		case UFB_ERR_MEMFD:          return "Could Not Create Vmem memfd";
+		case UFB_ERR_IOCTL:          return "ioctl Failed";
+		case UFB_ERR_TRACE_FILE:     return "Could Not Write Trace File";
+		case UFB_ERR_BUSY:           return "Busy, Try Again Later";
+		case UFB_ERR_UNSUPPORTED:    return "Unsupported";
+		case UFB_ERR_CANCELLED:      return "Cancelled";
+		case UFB_ERR_SOCKET:         return "Could Not Create Socket";
+		case UFB_ERR_FILE:           return "Could Not Write File";
 		default:                     return "Unknown Error";
 	}
 }
@@ -0,0 +1,349 @@
+#include "ufb_internal.h"
+
+#include <linux/fb.h>
+#include <sys/ioctl.h>
+#include <string.h>
+
+#ifndef FB_VISUAL_FOURCC
+#define FB_VISUAL_FOURCC 6
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define UFB_HAVE_AVX2_PATHS
+#endif
+
+/*
+ * Colormap translation at present time.  Pseudocolor pixels index a
+ * palette; directcolor pixels index one ramp per channel; grayscale mixes
+ * the channels down.  All of them reduce to table lookups, built here
+ * whenever the driver reports a new colormap, so a palette animation or
+ * gamma ramp costs one ioctl instead of clients rewriting every pixel.
+ * Output is ARGB8888, the way 32bpp vmem is shown.  YUV modes are
+ * converted too, see ufb_yuv.c.
+ */
+
+enum {
+	UFB_CMAP_NONE,      /* truecolor, present vmem as is */
+	UFB_CMAP_PALETTE,   /* 8bpp index into palette */
+	UFB_CMAP_CHANNELS,  /* per channel ramps, summed */
+	UFB_CMAP_FOURCC,    /* YUV, code in cmap.grayscale */
+};
+
+static void _ufb_cmap_build_channel(const struct ufb_cmap *cmap,
+                                    const uint16_t *ramp, uint32_t length,
+                                    uint32_t shift, uint32_t weight,
+                                    uint32_t *table)
+{
+	uint32_t max = length ? (1u << length) - 1 : 0;
+	uint32_t x, v;
+
+	memset(table, 0, 256 * sizeof(*table));
+
+	if( !length ) {
+		return;
+	}
+
+	for( x = 0; x <= max && x < 256; x++ ) {
+		if( cmap->visual == FB_VISUAL_DIRECTCOLOR ) {
+			v = ramp[x] >> 8;
+		} else {
+			v = x * 255 / max;
+		}
+
+		table[x] = weight ? v * weight : v << shift;
+	}
+}
+
+ufb_err_t ufb_cmap_update(ufb_context_t *context)
+{
+	struct ufb_cmap *cmap = &context->cmap;
+	int i;
+
+	if( -1 == ioctl(context->fd, UFB_IOCTL_GET_CMAP, cmap) ) {
+		context->cmap_mode = UFB_CMAP_NONE;
+		return UFB_ERR_IOCTL;
+	}
+
+	if( cmap->visual == FB_VISUAL_FOURCC ) {
+		context->cmap_mode = UFB_CMAP_FOURCC;
+	} else if( cmap->bits_per_pixel == 8 ) {
+		for( i = 0; i < 256; i++ ) {
+			context->palette[i] = 0xff000000u |
+			                      (uint32_t)(cmap->red[i] >> 8) << 16 |
+			                      (uint32_t)(cmap->green[i] >> 8) << 8 |
+			                      (uint32_t)(cmap->blue[i] >> 8);
+		}
+		context->cmap_mode = UFB_CMAP_PALETTE;
+	} else if( (cmap->bits_per_pixel == 16 || cmap->bits_per_pixel == 24 ||
+	            cmap->bits_per_pixel == 32) &&
+	           (cmap->visual == FB_VISUAL_DIRECTCOLOR || cmap->grayscale) &&
+	           cmap->red_length <= 8 && cmap->green_length <= 8 &&
+	           cmap->blue_length <= 8 ) {
+		/* grayscale = 0.30*R + 0.59*G + 0.11*B, as the driver does it */
+		int gray = cmap->grayscale != 0;
+
+		_ufb_cmap_build_channel(cmap, cmap->red, cmap->red_length,
+		                        16, gray ? 77 : 0, context->lut[0]);
+		_ufb_cmap_build_channel(cmap, cmap->green, cmap->green_length,
+		                        8, gray ? 151 : 0, context->lut[1]);
+		_ufb_cmap_build_channel(cmap, cmap->blue, cmap->blue_length,
+		                        0, gray ? 28 : 0, context->lut[2]);
+		context->cmap_gray = gray;
+		context->cmap_mode = UFB_CMAP_CHANNELS;
+	} else {
+		context->cmap_mode = UFB_CMAP_NONE;
+	}
+
+	return UFB_OK;
+}
+
+int ufb_needs_conversion(ufb_context_t *context)
+{
+	return context->cmap_mode != UFB_CMAP_NONE;
+}
+
+/* asks the driver, as the cached colormap may be behind a mode change */
+ufb_err_t ufb_get_pixel_layout(ufb_context_t *context,
+                               ufb_pixel_layout_t *layout)
+{
+	struct ufb_cmap cmap;
+
+	if( !context || !layout ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	if( -1 == ioctl(context->fd, UFB_IOCTL_GET_CMAP, &cmap) ) {
+		return UFB_ERR_IOCTL;
+	}
+
+	layout->bpp = cmap.bits_per_pixel;
+	layout->red_offset = cmap.red_offset;
+	layout->red_length = cmap.red_length;
+	layout->green_offset = cmap.green_offset;
+	layout->green_length = cmap.green_length;
+	layout->blue_offset = cmap.blue_offset;
+	layout->blue_length = cmap.blue_length;
+
+	if( cmap.visual == FB_VISUAL_FOURCC ) {
+		layout->red_length = layout->green_length = layout->blue_length = 0;
+	}
+
+	return UFB_OK;
+}
+
+static void _ufb_convert_palette(const uint32_t *palette, const uint8_t *src,
+                                 uint32_t *dst, int width)
+{
+	int x;
+
+	for( x = 0; x < width; x++ ) {
+		dst[x] = palette[src[x]];
+	}
+}
+
+static inline uint32_t _ufb_channels_pixel(const ufb_context_t *context,
+                                           uint32_t p)
+{
+	const struct ufb_cmap *cmap = &context->cmap;
+	uint32_t sum;
+
+	sum = context->lut[0][(p >> cmap->red_offset) & 0xff & ((1u << cmap->red_length) - 1)] +
+	      context->lut[1][(p >> cmap->green_offset) & 0xff & ((1u << cmap->green_length) - 1)] +
+	      context->lut[2][(p >> cmap->blue_offset) & 0xff & ((1u << cmap->blue_length) - 1)];
+
+	if( context->cmap_gray ) {
+		return 0xff000000u | (sum >> 8) * 0x010101u;
+	}
+
+	return 0xff000000u | sum;
+}
+
+static void _ufb_convert_channels(const ufb_context_t *context,
+                                  const uint8_t *src, uint32_t *dst,
+                                  int width)
+{
+	int x;
+
+	switch( context->cmap.bits_per_pixel ) {
+		case 32:
+			for( x = 0; x < width; x++ ) {
+				uint32_t p;
+
+				memcpy(&p, src + x * 4, sizeof(p));
+				dst[x] = _ufb_channels_pixel(context, p);
+			}
+			break;
+
+		case 24:
+			for( x = 0; x < width; x++ ) {
+				const uint8_t *s = src + x * 3;
+
+				dst[x] = _ufb_channels_pixel(context, s[0] | s[1] << 8 |
+				                                      s[2] << 16);
+			}
+			break;
+
+		case 16:
+			for( x = 0; x < width; x++ ) {
+				uint16_t p;
+
+				memcpy(&p, src + x * 2, sizeof(p));
+				dst[x] = _ufb_channels_pixel(context, p);
+			}
+			break;
+	}
+}
+
+#ifdef UFB_HAVE_AVX2_PATHS
+
+/* eight palette lookups per gather */
+__attribute__((target("avx2")))
+static int _ufb_convert_palette_avx2(const uint32_t *palette,
+                                     const uint8_t *src, uint32_t *dst,
+                                     int width)
+{
+	int x;
+
+	for( x = 0; x + 8 <= width; x += 8 ) {
+		__m128i idx8 = _mm_loadl_epi64((const __m128i *)(src + x));
+		__m256i idx = _mm256_cvtepu8_epi32(idx8);
+		__m256i px = _mm256_i32gather_epi32((const int *)palette, idx, 4);
+
+		_mm256_storeu_si256((__m256i *)(dst + x), px);
+	}
+
+	return x;
+}
+
+/* 32bpp only:  extract the three fields, gather from each ramp and sum */
+__attribute__((target("avx2")))
+static int _ufb_convert_channels_avx2(const ufb_context_t *context,
+                                      const uint8_t *src, uint32_t *dst,
+                                      int width)
+{
+	const struct ufb_cmap *cmap = &context->cmap;
+	const __m128i rs = _mm_cvtsi32_si128(cmap->red_offset);
+	const __m128i gs = _mm_cvtsi32_si128(cmap->green_offset);
+	const __m128i bs = _mm_cvtsi32_si128(cmap->blue_offset);
+	const __m256i rm = _mm256_set1_epi32(((1u << cmap->red_length) - 1) & 0xff);
+	const __m256i gm = _mm256_set1_epi32(((1u << cmap->green_length) - 1) & 0xff);
+	const __m256i bm = _mm256_set1_epi32(((1u << cmap->blue_length) - 1) & 0xff);
+	const __m256i alpha = _mm256_set1_epi32(0xff000000u);
+	const __m256i spread = _mm256_set1_epi32(0x010101);
+	int x;
+
+	for( x = 0; x + 8 <= width; x += 8 ) {
+		__m256i p = _mm256_loadu_si256((const __m256i *)(src + x * 4));
+		__m256i r = _mm256_and_si256(_mm256_srl_epi32(p, rs), rm);
+		__m256i g = _mm256_and_si256(_mm256_srl_epi32(p, gs), gm);
+		__m256i b = _mm256_and_si256(_mm256_srl_epi32(p, bs), bm);
+		__m256i sum;
+
+		sum = _mm256_add_epi32(
+		        _mm256_i32gather_epi32((const int *)context->lut[0], r, 4),
+		        _mm256_add_epi32(
+		          _mm256_i32gather_epi32((const int *)context->lut[1], g, 4),
+		          _mm256_i32gather_epi32((const int *)context->lut[2], b, 4)));
+
+		if( context->cmap_gray ) {
+			sum = _mm256_mullo_epi32(_mm256_srli_epi32(sum, 8), spread);
+		}
+
+		_mm256_storeu_si256((__m256i *)(dst + x), _mm256_or_si256(sum, alpha));
+	}
+
+	return x;
+}
+
+int ufb_have_avx2(void)
+{
+	static int have = -1;
+
+	if( have < 0 ) {
+		__builtin_cpu_init();
+		have = __builtin_cpu_supports("avx2") != 0;
+	}
+
+	return have;
+}
+
+#endif
+
+void ufb_convert_rows(ufb_context_t *context, const void *src,
+                      size_t src_pitch, uint32_t *dst, size_t dst_pitch,
+                      int width, int height)
+{
+	const uint8_t *s = src;
+	int bytes = context->cmap.bits_per_pixel / 8;
+	int y, done;
+
+	for( y = 0; y < height; y++, s += src_pitch,
+	     dst = (uint32_t *)((uint8_t *)dst + dst_pitch) ) {
+		done = 0;
+
+		switch( context->cmap_mode ) {
+			case UFB_CMAP_PALETTE:
+#ifdef UFB_HAVE_AVX2_PATHS
+				if( ufb_have_avx2() ) {
+					done = _ufb_convert_palette_avx2(context->palette, s, dst,
+					                                 width);
+				}
+#endif
+				_ufb_convert_palette(context->palette, s + done, dst + done,
+				                     width - done);
+				break;
+
+			case UFB_CMAP_CHANNELS:
+#ifdef UFB_HAVE_AVX2_PATHS
+				if( bytes == 4 && ufb_have_avx2() ) {
+					done = _ufb_convert_channels_avx2(context, s, dst, width);
+				}
+#endif
+				_ufb_convert_channels(context, s + done * bytes, dst + done,
+				                      width - done);
+				break;
+
+			case UFB_CMAP_FOURCC:
+				ufb_yuv_convert_row(context->cmap.grayscale, s, dst, width);
+				break;
+
+			default:
+				memcpy(dst, s, width * sizeof(*dst));
+				break;
+		}
+	}
+}
+
+void ufb_convert_scanout(ufb_context_t *context, const ufb_scanout_t *scanout,
+                         uint32_t *dst, size_t dst_pitch)
+{
+	ufb_region_t regions[2];
+	int count, i;
+
+	if( scanout->fourcc == UFB_FOURCC_NV12 ||
+	    scanout->fourcc == UFB_FOURCC_I420 ) {
+		ufb_yuv_convert_planes(scanout, context->vmem, dst, dst_pitch);
+		return;
+	}
+
+	count = ufb_scanout_regions(scanout, regions);
+
+	for( i = 0; i < count; i++ ) {
+		const uint8_t *s = (const uint8_t *)context->vmem + regions[i].offset;
+		uint32_t *d = (uint32_t *)((uint8_t *)dst + dst_pitch * regions[i].y);
+		int y;
+
+		if( !scanout->fourcc ) {
+			ufb_convert_rows(context, s, scanout->pitch, d, dst_pitch,
+			                 scanout->width, regions[i].height);
+			continue;
+		}
+
+		/* packed YUV, which goes by the scanout rather than the colormap */
+		for( y = 0; y < regions[i].height; y++, s += scanout->pitch,
+		     d = (uint32_t *)((uint8_t *)d + dst_pitch) ) {
+			ufb_yuv_convert_row(scanout->fourcc, s, d, scanout->width);
+		}
+	}
+}
@@ -0,0 +1,225 @@
+#include "ufb_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef UFB_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+/*
+ * Pixels are interpreted the way sdlfb shows them:  32bpp as ARGB8888 and
+ * 16bpp as RGB565, both little endian.
+ */
+ufb_err_t ufb_image_to_rgb(const uint8_t *src, size_t pitch, int width,
+                           int height, int bpp, uint8_t *rgb)
+{
+	int x, y;
+
+	for( y = 0; y < height; y++, src += pitch ) {
+		if( bpp == 32 ) {
+			const uint8_t *p = src;
+
+			for( x = 0; x < width; x++, p += 4, rgb += 3 ) {
+				rgb[0] = p[2];
+				rgb[1] = p[1];
+				rgb[2] = p[0];
+			}
+		} else if( bpp == 16 ) {
+			const uint16_t *p = (const uint16_t *)src;
+
+			for( x = 0; x < width; x++, rgb += 3 ) {
+				uint16_t v = p[x];
+
+				rgb[0] = ((v >> 11) & 0x1f) * 255 / 31;
+				rgb[1] = ((v >> 5) & 0x3f) * 255 / 63;
+				rgb[2] = (v & 0x1f) * 255 / 31;
+			}
+		} else {
+			return UFB_ERR_UNSUPPORTED;
+		}
+	}
+
+	return UFB_OK;
+}
+
+static uint8_t *_ufb_put32be(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+	return p + 4;
+}
+
+/* "The Quite OK Image Format", https://qoiformat.org/qoi-specification.pdf */
+ufb_err_t ufb_encode_qoi(const uint8_t *rgb, int width, int height,
+                         uint8_t **out, size_t *size)
+{
+	static const uint8_t padding[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+	uint8_t index[64][3];
+	uint8_t prev[3] = { 0, 0, 0 };
+	size_t pixels = (size_t)width * height;
+	size_t i;
+	uint8_t *buf, *p;
+	int run = 0;
+
+	/* worst case every pixel is a QOI_OP_RGB */
+	if( !(buf = malloc(14 + pixels * 4 + sizeof(padding))) ) {
+		return UFB_ERR_NO_MEM;
+	}
+
+	memset(index, 0, sizeof(index));
+
+	p = buf;
+	*p++ = 'q'; *p++ = 'o'; *p++ = 'i'; *p++ = 'f';
+	p = _ufb_put32be(p, width);
+	p = _ufb_put32be(p, height);
+	*p++ = 3;
+	*p++ = 0;
+
+	for( i = 0; i < pixels; i++, rgb += 3 ) {
+		int hash;
+
+		if( rgb[0] == prev[0] && rgb[1] == prev[1] && rgb[2] == prev[2] ) {
+			if( ++run == 62 || i == pixels - 1 ) {
+				*p++ = 0xc0 | (run - 1);
+				run = 0;
+			}
+			continue;
+		}
+
+		if( run ) {
+			*p++ = 0xc0 | (run - 1);
+			run = 0;
+		}
+
+		/* alpha is always 255, which contributes 255 * 11 to the hash */
+		hash = (rgb[0] * 3 + rgb[1] * 5 + rgb[2] * 7 + 255 * 11) % 64;
+
+		if( !memcmp(index[hash], rgb, 3) ) {
+			*p++ = hash;
+		} else {
+			int dr = (int8_t)(rgb[0] - prev[0]);
+			int dg = (int8_t)(rgb[1] - prev[1]);
+			int db = (int8_t)(rgb[2] - prev[2]);
+			int dr_dg = dr - dg;
+			int db_dg = db - dg;
+
+			memcpy(index[hash], rgb, 3);
+
+			if( dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && 
+			    db >= -2 && db <= 1 ) {
+				*p++ = 0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+			} else if( dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 &&
+			           db_dg >= -8 && db_dg <= 7 ) {
+				*p++ = 0x80 | (dg + 32);
+				*p++ = (dr_dg + 8) << 4 | (db_dg + 8);
+			} else {
+				*p++ = 0xfe;
+				*p++ = rgb[0];
+				*p++ = rgb[1];
+				*p++ = rgb[2];
+			}
+		}
+
+		memcpy(prev, rgb, 3);
+	}
+
+	memcpy(p, padding, sizeof(padding));
+	p += sizeof(padding);
+
+	*out = buf;
+	*size = p - buf;
+
+	return UFB_OK;
+}
+
+#ifdef UFB_HAVE_ZLIB
+static uint8_t *_ufb_png_chunk(uint8_t *p, const char *type, 
+                               const uint8_t *data, uint32_t len)
+{
+	uint32_t crc;
+
+	p = _ufb_put32be(p, len);
+	memcpy(p, type, 4);
+	if( len ) {
+		memcpy(p + 4, data, len);
+	}
+
+	crc = crc32(0, p, len + 4);
+	p += len + 4;
+
+	return _ufb_put32be(p, crc);
+}
+
+ufb_err_t ufb_encode_png(const uint8_t *rgb, int width, int height,
+                         uint8_t **out, size_t *size)
+{
+	static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 
+	                                      0x1a, '\n' };
+	size_t row = (size_t)width * 3;
+	size_t raw_len = (row + 1) * height;
+	uLongf z_len = compressBound(raw_len);
+	uint8_t ihdr[13];
+	uint8_t *raw, *z, *buf, *p;
+	int y;
+
+	raw = malloc(raw_len);
+	z = malloc(z_len);
+	buf = malloc(sizeof(signature) + 3 * 12 + sizeof(ihdr) + z_len);
+	if( !raw || !z || !buf ) {
+		free(raw);
+		free(z);
+		free(buf);
+		return UFB_ERR_NO_MEM;
+	}
+
+	/* filter type 0 on every line; speed matters more than size here */
+	for( y = 0; y < height; y++ ) {
+		raw[y * (row + 1)] = 0;
+		memcpy(raw + y * (row + 1) + 1, rgb + y * row, row);
+	}
+
+	if( Z_OK != compress2(z, &z_len, raw, raw_len, Z_BEST_SPEED) ) {
+		free(raw);
+		free(z);
+		free(buf);
+		return UFB_ERR_NO_MEM;
+	}
+
+	_ufb_put32be(ihdr, width);
+	_ufb_put32be(ihdr + 4, height);
+	ihdr[8] = 8;   /* bit depth */
+	ihdr[9] = 2;   /* truecolor */
+	ihdr[10] = 0;
+	ihdr[11] = 0;
+	ihdr[12] = 0;
+
+	memcpy(buf, signature, sizeof(signature));
+	p = buf + sizeof(signature);
+	p = _ufb_png_chunk(p, "IHDR", ihdr, sizeof(ihdr));
+	p = _ufb_png_chunk(p, "IDAT", z, z_len);
+	p = _ufb_png_chunk(p, "IEND", NULL, 0);
+
+	free(raw);
+	free(z);
+
+	*out = buf;
+	*size = p - buf;
+
+	return UFB_OK;
+}
+#else
+ufb_err_t ufb_encode_png(const uint8_t *rgb, int width, int height,
+                         uint8_t **out, size_t *size)
+{
+	(void)rgb;
+	(void)width;
+	(void)height;
+	(void)out;
+	(void)size;
+
+	return UFB_ERR_UNSUPPORTED;
+}
+#endif
@@ -0,0 +1,78 @@
+#ifndef UFB_INTERNAL_H
+#define UFB_INTERNAL_H
+
+#include "ufb.h"
+#include "ufb_ioctl.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define UFB_MAX_PENDING_SCREENSHOTS 4
+
+struct ufb_screenshot_request {
+	ufb_image_format_t format;
+	ufb_screenshot_cb callback;
+	void *user;
+};
+
+struct ufb_context {
+	int width;
+	int height;
+	void *vmem;
+	size_t vmem_size;
+	size_t map_size;        /* vmem's mapping, covers what it can grow to */
+	int fd;
+	int memfd;
+	int node;
+
+	int blank;
+
+	struct ufb_event events[16];
+	int event_count;
+	int event_index;
+
+	FILE *trace_file;
+	void *trace_buf;
+
+	struct ufb_screenshot_request screenshots[UFB_MAX_PENDING_SCREENSHOTS];
+	int screenshot_count;
+	uint64_t screenshot_interval;
+	uint64_t screenshot_last;
+
+	/* colormap translation, see ufb_cmap.c */
+	struct ufb_cmap cmap;
+	int cmap_mode;
+	int cmap_gray;
+	uint32_t palette[256];
+	uint32_t lut[3][256];
+};
+
+extern void ufb_screenshot_vblank(ufb_context_t *context);
+extern void ufb_screenshot_cancel(ufb_context_t *context);
+
+extern uint64_t ufb_now_ns(void);
+
+extern ufb_err_t ufb_cmap_update(ufb_context_t *context);
+
+/* runtime check for the AVX2 conversion paths */
+extern int ufb_have_avx2(void);
+
+/* YUV conversion, see ufb_yuv.c */
+extern void ufb_yuv_convert_row(uint32_t fourcc, const uint8_t *src,
+                                uint32_t *dst, int width);
+extern void ufb_yuv_convert_planes(const ufb_scanout_t *scanout,
+                                   const uint8_t *vmem, uint32_t *dst,
+                                   size_t dst_pitch);
+
+/* mbind()s addr to prefer node, before its pages are touched */
+extern ufb_err_t ufb_bind_node(void *addr, size_t len, int node);
+
+/* image encoders, see ufb_image.c;  rgb is packed RGB888 */
+extern ufb_err_t ufb_image_to_rgb(const uint8_t *src, size_t pitch, int width,
+                                  int height, int bpp, uint8_t *rgb);
+extern ufb_err_t ufb_encode_qoi(const uint8_t *rgb, int width, int height,
+                                uint8_t **out, size_t *size);
+extern ufb_err_t ufb_encode_png(const uint8_t *rgb, int width, int height,
+                                uint8_t **out, size_t *size);
+
+#endif //UFB_INTERNAL_H
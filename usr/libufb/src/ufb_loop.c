@@ -0,0 +1,749 @@
+#define _GNU_SOURCE
+
+#include "ufb_loop.h"
+#include "ufb_internal.h"
+
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__NR_io_uring_setup) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define UFB_HAVE_IO_URING
+#endif
+#endif
+
+#define UFB_LOOP_ENTRIES 128
+#define UFB_LOOP_MAX_EVENTS 64
+
+enum {
+	UFB_LOOP_OP_CONTEXT,   /* watching a context's fd for driver events */
+	UFB_LOOP_OP_FD,        /* watching some other fd */
+	UFB_LOOP_OP_WRITE,
+	UFB_LOOP_OP_VBLANK,
+	UFB_LOOP_OP_TIMEOUT,
+};
+
+/*
+ * Watches live on loop->watches until removed;  queued writes on
+ * loop->writes until sent.  With io_uring an op may still be in the ring
+ * after it's removed or its fd is gone, so it's only freed once the
+ * kernel hands it back.
+ */
+struct ufb_loop_op {
+	struct ufb_loop_op *next;
+	int kind;
+	int fd;
+	ufb_context_t *context;
+	ufb_loop_event_cb on_event;
+	ufb_loop_fd_cb on_ready;
+	ufb_loop_write_cb on_written;
+	void *user;
+	struct iovec iov;
+
+	int in_ring;
+	int removed;
+	int cancel_sent;
+};
+
+#ifdef UFB_HAVE_IO_URING
+struct ufb_uring {
+	int fd;
+	unsigned int entries;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int sq_local_tail;
+	unsigned int to_submit;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+
+	struct __kernel_timespec timeout;
+};
+#endif
+
+struct ufb_loop {
+	int use_uring;
+#ifdef UFB_HAVE_IO_URING
+	struct ufb_uring ring;
+#endif
+	int epoll_fd;
+
+	struct ufb_loop_op *watches;
+	struct ufb_loop_op *writes;
+	struct ufb_loop_op **writes_tail;
+	struct ufb_loop_op *free_ops;
+	struct ufb_loop_op timeout;
+};
+
+static const char _ufb_vblank_byte;
+
+static struct ufb_loop_op *_ufb_loop_op_alloc(ufb_loop_t *loop, int kind)
+{
+	struct ufb_loop_op *op = loop->free_ops;
+
+	if( op ) {
+		loop->free_ops = op->next;
+	} else if( !(op = malloc(sizeof(*op))) ) {
+		return NULL;
+	}
+
+	memset(op, 0, sizeof(*op));
+	op->kind = kind;
+	op->fd = -1;
+
+	return op;
+}
+
+static void _ufb_loop_op_free(ufb_loop_t *loop, struct ufb_loop_op *op)
+{
+	op->next = loop->free_ops;
+	loop->free_ops = op;
+}
+
+#ifdef UFB_HAVE_IO_URING
+
+static int _ufb_uring_enter(struct ufb_uring *ring, unsigned int to_submit,
+                            unsigned int min_complete)
+{
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete,
+		              min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while( -1 == ret && EINTR == errno );
+
+	return ret;
+}
+
+static void _ufb_uring_unmap(struct ufb_uring *ring)
+{
+	if( ring->sqes ) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	if( ring->cq_ring && ring->cq_ring != ring->sq_ring ) {
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	}
+	if( ring->sq_ring ) {
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	}
+	if( -1 != ring->fd ) {
+		close(ring->fd);
+	}
+}
+
+/* io_uring_setup() and the three mmaps, no liburing needed */
+static int _ufb_uring_setup(struct ufb_uring *ring)
+{
+	struct io_uring_params params;
+	uint8_t *sq, *cq;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&params, 0, sizeof(params));
+
+	ring->fd = syscall(__NR_io_uring_setup, UFB_LOOP_ENTRIES, &params);
+	if( -1 == ring->fd ) {
+		return -1;
+	}
+
+	ring->entries = params.sq_entries;
+	ring->sq_ring_size = params.sq_off.array +
+	                     params.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = params.cq_off.cqes +
+	                     params.cq_entries * sizeof(struct io_uring_cqe);
+
+	if( params.features & IORING_FEAT_SINGLE_MMAP ) {
+		if( ring->cq_ring_size > ring->sq_ring_size ) {
+			ring->sq_ring_size = ring->cq_ring_size;
+		}
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+	                     MAP_SHARED | MAP_POPULATE, ring->fd,
+	                     IORING_OFF_SQ_RING);
+	if( MAP_FAILED == ring->sq_ring ) {
+		ring->sq_ring = NULL;
+		goto error;
+	}
+
+	if( params.features & IORING_FEAT_SINGLE_MMAP ) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+		                     MAP_SHARED | MAP_POPULATE, ring->fd,
+		                     IORING_OFF_CQ_RING);
+		if( MAP_FAILED == ring->cq_ring ) {
+			ring->cq_ring = NULL;
+			goto error;
+		}
+	}
+
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+	                  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if( MAP_FAILED == ring->sqes ) {
+		ring->sqes = NULL;
+		goto error;
+	}
+
+	sq = ring->sq_ring;
+	ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+	ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+	ring->sq_local_tail = *ring->sq_tail;
+
+	cq = ring->cq_ring;
+	ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	return 0;
+
+error:
+	_ufb_uring_unmap(ring);
+	ring->fd = -1;
+	return -1;
+}
+
+/* hands queued SQEs to the kernel, waiting for min_complete completions */
+static int _ufb_uring_submit(struct ufb_uring *ring, unsigned int min_complete)
+{
+	unsigned int to_submit = ring->to_submit;
+	int ret;
+
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+	if( !to_submit && !min_complete ) {
+		return 0;
+	}
+
+	ret = _ufb_uring_enter(ring, to_submit, min_complete);
+	if( ret >= 0 ) {
+		ring->to_submit -= (unsigned int)ret < to_submit ? (unsigned int)ret :
+		                                                   to_submit;
+	}
+
+	return ret;
+}
+
+static struct io_uring_sqe *_ufb_uring_get_sqe(struct ufb_uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int head, index;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if( ring->sq_local_tail - head >= ring->entries ) {
+		/* full:  make room by submitting what's there */
+		if( _ufb_uring_submit(ring, 0) < 0 ) {
+			return NULL;
+		}
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if( ring->sq_local_tail - head >= ring->entries ) {
+			return NULL;
+		}
+	}
+
+	index = ring->sq_local_tail & *ring->sq_mask;
+	ring->sq_array[index] = index;
+	ring->sq_local_tail++;
+	ring->to_submit++;
+
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+
+	return sqe;
+}
+
+static int _ufb_uring_queue(ufb_loop_t *loop, struct ufb_loop_op *op)
+{
+	struct io_uring_sqe *sqe;
+
+	if( !(sqe = _ufb_uring_get_sqe(&loop->ring)) ) {
+		return -1;
+	}
+
+	sqe->user_data = (uintptr_t)op;
+	sqe->fd = op->fd;
+
+	switch( op->kind ) {
+		case UFB_LOOP_OP_CONTEXT:
+		case UFB_LOOP_OP_FD:
+			sqe->opcode = IORING_OP_POLL_ADD;
+			sqe->poll_events = POLLIN;
+			break;
+
+		case UFB_LOOP_OP_WRITE:
+		case UFB_LOOP_OP_VBLANK:
+			/* writev rather than write, which needs 5.6 */
+			sqe->opcode = IORING_OP_WRITEV;
+			sqe->addr = (uintptr_t)&op->iov;
+			sqe->len = 1;
+			sqe->off = (uint64_t)-1;
+			break;
+
+		case UFB_LOOP_OP_TIMEOUT:
+			/* ends the wait at the first other completion too */
+			sqe->opcode = IORING_OP_TIMEOUT;
+			sqe->fd = -1;
+			sqe->addr = (uintptr_t)&loop->ring.timeout;
+			sqe->len = 1;
+			sqe->off = 1;
+			break;
+	}
+
+	op->in_ring = 1;
+
+	return 0;
+}
+
+static int _ufb_uring_cancel(ufb_loop_t *loop, struct ufb_loop_op *op)
+{
+	struct io_uring_sqe *sqe;
+
+	if( !(sqe = _ufb_uring_get_sqe(&loop->ring)) ) {
+		return -1;
+	}
+
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t)op;
+	sqe->user_data = 0;
+
+	op->cancel_sent = 1;
+
+	return 0;
+}
+
+#endif
+
+static void _ufb_loop_finish_write(struct ufb_loop_op *op, ssize_t result)
+{
+	if( UFB_LOOP_OP_VBLANK == op->kind ) {
+		/* drivers without write() still take the ioctl */
+		if( result < 0 ) {
+			ioctl(op->fd, UFB_IOCTL_SIGNAL_VBLANK);
+		}
+		return;
+	}
+
+	if( op->on_written ) {
+		op->on_written(op->fd, result, op->user);
+	}
+}
+
+static int _ufb_loop_dispatch(struct ufb_loop_op *op)
+{
+	if( op->removed ) {
+		return 0;
+	}
+
+	switch( op->kind ) {
+		case UFB_LOOP_OP_CONTEXT:
+			op->on_event(op->context, op->user);
+			return 1;
+
+		case UFB_LOOP_OP_FD:
+			op->on_ready(op->fd, op->user);
+			return 1;
+	}
+
+	return 0;
+}
+
+ufb_err_t ufb_loop_create(ufb_loop_t **loop_ptr, unsigned int flags)
+{
+	ufb_loop_t *loop;
+
+	if( !loop_ptr ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	*loop_ptr = NULL;
+
+	if( !(loop = calloc(1, sizeof(*loop))) ) {
+		return UFB_ERR_NO_MEM;
+	}
+
+	loop->epoll_fd = -1;
+	loop->writes_tail = &loop->writes;
+	loop->timeout.kind = UFB_LOOP_OP_TIMEOUT;
+
+#ifdef UFB_HAVE_IO_URING
+	/* seccomp or an old kernel may say no;  epoll does the same job */
+	if( !(flags & UFB_LOOP_EPOLL) && 0 == _ufb_uring_setup(&loop->ring) ) {
+		loop->use_uring = 1;
+	}
+#else
+	(void)flags;
+#endif
+
+	if( !loop->use_uring ) {
+		loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if( -1 == loop->epoll_fd ) {
+			free(loop);
+			return UFB_ERR_UNSUPPORTED;
+		}
+	}
+
+	*loop_ptr = loop;
+
+	return UFB_OK;
+}
+
+static void _ufb_loop_free_list(struct ufb_loop_op *op)
+{
+	struct ufb_loop_op *next;
+
+	for( ; op; op = next ) {
+		next = op->next;
+		free(op);
+	}
+}
+
+void ufb_loop_free(ufb_loop_t *loop)
+{
+	if( !loop ) {
+		return;
+	}
+
+#ifdef UFB_HAVE_IO_URING
+	/* closing the ring cancels whatever is still in it */
+	if( loop->use_uring ) {
+		_ufb_uring_unmap(&loop->ring);
+	}
+#endif
+	if( -1 != loop->epoll_fd ) {
+		close(loop->epoll_fd);
+	}
+
+	_ufb_loop_free_list(loop->watches);
+	_ufb_loop_free_list(loop->writes);
+	_ufb_loop_free_list(loop->free_ops);
+	free(loop);
+}
+
+const char *ufb_loop_backend(ufb_loop_t *loop)
+{
+	return loop->use_uring ? "io_uring" : "epoll";
+}
+
+static ufb_err_t _ufb_loop_watch(ufb_loop_t *loop, struct ufb_loop_op *op)
+{
+	struct epoll_event ev;
+
+	if( !loop->use_uring ) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = op;
+
+		if( -1 == epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, op->fd, &ev) ) {
+			_ufb_loop_op_free(loop, op);
+			return UFB_ERR_INVALID_PARAM;
+		}
+	}
+
+	/* io_uring polls are armed at the next ufb_loop_run() */
+	op->next = loop->watches;
+	loop->watches = op;
+
+	return UFB_OK;
+}
+
+ufb_err_t ufb_loop_add_context(ufb_loop_t *loop, ufb_context_t *context,
+                               ufb_loop_event_cb callback, void *user)
+{
+	struct ufb_loop_op *op;
+
+	if( !loop || !context || !callback ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	if( !(op = _ufb_loop_op_alloc(loop, UFB_LOOP_OP_CONTEXT)) ) {
+		return UFB_ERR_NO_MEM;
+	}
+
+	op->fd = context->fd;
+	op->context = context;
+	op->on_event = callback;
+	op->user = user;
+
+	return _ufb_loop_watch(loop, op);
+}
+
+ufb_err_t ufb_loop_add_fd(ufb_loop_t *loop, int fd, ufb_loop_fd_cb callback,
+                          void *user)
+{
+	struct ufb_loop_op *op;
+
+	if( !loop || fd < 0 || !callback ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	if( !(op = _ufb_loop_op_alloc(loop, UFB_LOOP_OP_FD)) ) {
+		return UFB_ERR_NO_MEM;
+	}
+
+	op->fd = fd;
+	op->on_ready = callback;
+	op->user = user;
+
+	return _ufb_loop_watch(loop, op);
+}
+
+/* the op stays on the list until the next ufb_loop_run() can free it */
+static void _ufb_loop_unwatch(ufb_loop_t *loop, int kind, int fd)
+{
+	struct ufb_loop_op *op;
+
+	for( op = loop->watches; op; op = op->next ) {
+		if( op->kind == kind && op->fd == fd && !op->removed ) {
+			op->removed = 1;
+			if( !loop->use_uring ) {
+				epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+			}
+			return;
+		}
+	}
+}
+
+void ufb_loop_remove_context(ufb_loop_t *loop, ufb_context_t *context)
+{
+	_ufb_loop_unwatch(loop, UFB_LOOP_OP_CONTEXT, context->fd);
+}
+
+void ufb_loop_remove_fd(ufb_loop_t *loop, int fd)
+{
+	_ufb_loop_unwatch(loop, UFB_LOOP_OP_FD, fd);
+}
+
+static void _ufb_loop_queue_write(ufb_loop_t *loop, struct ufb_loop_op *op)
+{
+	op->next = NULL;
+	*loop->writes_tail = op;
+	loop->writes_tail = &op->next;
+}
+
+ufb_err_t ufb_loop_vblank(ufb_loop_t *loop, ufb_context_t *context)
+{
+	struct ufb_loop_op *op;
+
+	if( !loop || !context ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	if( !(op = _ufb_loop_op_alloc(loop, UFB_LOOP_OP_VBLANK)) ) {
+		return UFB_ERR_NO_MEM;
+	}
+
+	/* the screenshot copy has to happen before clients draw again */
+	if( context->screenshot_count ) {
+		ufb_screenshot_vblank(context);
+	}
+
+	op->fd = context->fd;
+	op->iov.iov_base = (void *)&_ufb_vblank_byte;
+	op->iov.iov_len = 1;
+
+	_ufb_loop_queue_write(loop, op);
+
+	return UFB_OK;
+}
+
+ufb_err_t ufb_loop_write(ufb_loop_t *loop, int fd, const void *buf,
+                         size_t len, ufb_loop_write_cb callback, void *user)
+{
+	struct ufb_loop_op *op;
+
+	if( !loop || fd < 0 || (!buf && len) ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	if( !(op = _ufb_loop_op_alloc(loop, UFB_LOOP_OP_WRITE)) ) {
+		return UFB_ERR_NO_MEM;
+	}
+
+	op->fd = fd;
+	op->iov.iov_base = (void *)buf;
+	op->iov.iov_len = len;
+	op->on_written = callback;
+	op->user = user;
+
+	_ufb_loop_queue_write(loop, op);
+
+	return UFB_OK;
+}
+
+/* frees removed watches nothing refers to any more */
+static void _ufb_loop_sweep(ufb_loop_t *loop)
+{
+	struct ufb_loop_op **link = &loop->watches;
+	struct ufb_loop_op *op;
+
+	while( (op = *link) ) {
+		if( op->removed && !op->in_ring ) {
+			*link = op->next;
+			_ufb_loop_op_free(loop, op);
+		} else {
+			link = &op->next;
+		}
+	}
+}
+
+static int _ufb_loop_run_epoll(ufb_loop_t *loop, int timeout_ms)
+{
+	struct epoll_event events[UFB_LOOP_MAX_EVENTS];
+	struct ufb_loop_op *op;
+	ssize_t ret;
+	int count, i, dispatched = 0;
+
+	while( (op = loop->writes) ) {
+		loop->writes = op->next;
+		if( !loop->writes ) {
+			loop->writes_tail = &loop->writes;
+		}
+
+		ret = write(op->fd, op->iov.iov_base, op->iov.iov_len);
+		_ufb_loop_finish_write(op, ret < 0 ? -errno : ret);
+		_ufb_loop_op_free(loop, op);
+	}
+
+	do {
+		count = epoll_wait(loop->epoll_fd, events, UFB_LOOP_MAX_EVENTS,
+		                   timeout_ms);
+	} while( -1 == count && EINTR == errno );
+
+	for( i = 0; i < count; i++ ) {
+		dispatched += _ufb_loop_dispatch(events[i].data.ptr);
+	}
+
+	_ufb_loop_sweep(loop);
+
+	return count < 0 ? -1 : dispatched;
+}
+
+#ifdef UFB_HAVE_IO_URING
+static int _ufb_loop_run_uring(ufb_loop_t *loop, int timeout_ms)
+{
+	struct ufb_uring *ring = &loop->ring;
+	struct ufb_loop_op *op;
+	unsigned int head, tail;
+	int dispatched = 0;
+	int ret;
+
+	/* this frame's writes, in order, then any polls that need arming */
+	while( (op = loop->writes) ) {
+		if( _ufb_uring_queue(loop, op) ) {
+			return -1;
+		}
+		loop->writes = op->next;
+		if( !loop->writes ) {
+			loop->writes_tail = &loop->writes;
+		}
+	}
+
+	for( op = loop->watches; op; op = op->next ) {
+		if( op->removed ) {
+			if( op->in_ring && !op->cancel_sent && _ufb_uring_cancel(loop, op) ) {
+				return -1;
+			}
+		} else if( !op->in_ring && _ufb_uring_queue(loop, op) ) {
+			return -1;
+		}
+	}
+
+	if( timeout_ms > 0 && !loop->timeout.in_ring ) {
+		ring->timeout.tv_sec = timeout_ms / 1000;
+		ring->timeout.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+		if( _ufb_uring_queue(loop, &loop->timeout) ) {
+			return -1;
+		}
+	}
+
+	ret = _ufb_uring_submit(ring, timeout_ms ? 1 : 0);
+	if( ret < 0 && EBUSY != errno ) {
+		return -1;
+	}
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	for( ; head != tail; head++ ) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+
+		op = (struct ufb_loop_op *)(uintptr_t)cqe->user_data;
+		if( !op ) {
+			continue;
+		}
+
+		op->in_ring = 0;
+
+		switch( op->kind ) {
+			case UFB_LOOP_OP_WRITE:
+			case UFB_LOOP_OP_VBLANK:
+				_ufb_loop_finish_write(op, cqe->res);
+				_ufb_loop_op_free(loop, op);
+				break;
+
+			case UFB_LOOP_OP_CONTEXT:
+			case UFB_LOOP_OP_FD:
+				if( cqe->res >= 0 ) {
+					dispatched += _ufb_loop_dispatch(op);
+				}
+				break;
+
+			case UFB_LOOP_OP_TIMEOUT:
+				/*
+				 * -ETIME when it ran out, 0 when another completion
+				 * ended the wait first;  either way the next wait
+				 * queues a fresh one.
+				 */
+				break;
+		}
+	}
+
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	_ufb_loop_sweep(loop);
+
+	return dispatched;
+}
+#endif
+
+int ufb_loop_run(ufb_loop_t *loop, int timeout_ms)
+{
+	if( !loop ) {
+		return -1;
+	}
+
+#ifdef UFB_HAVE_IO_URING
+	if( loop->use_uring ) {
+		return _ufb_loop_run_uring(loop, timeout_ms);
+	}
+#endif
+
+	return _ufb_loop_run_epoll(loop, timeout_ms);
+}
@@ -0,0 +1,534 @@
+#define _GNU_SOURCE
+
+#include "ufb_internal.h"
+#include "ufb_metrics.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* bucket b holds values of bit length b, so 0 and everything < 2^b */
+#define UFB_METRICS_BUCKETS 65
+
+#define UFB_METRICS_MAX_SCRAPERS 16
+#define UFB_METRICS_REQUEST_MAX  1024
+
+/*
+ * One thread's metrics.  Only that thread writes them, with relaxed
+ * atomic stores so exporting from another thread reads whole values;
+ * the totals may be a moment apart from each other, never torn.
+ */
+struct ufb_metrics_shard {
+	struct ufb_metrics_shard *next;
+	uint64_t buckets[UFB_HISTOGRAM_COUNT][UFB_METRICS_BUCKETS];
+	uint64_t sums[UFB_HISTOGRAM_COUNT];
+	uint64_t counters[UFB_COUNTER_COUNT];
+};
+
+/* a connection waiting for the end of its request to be answered */
+struct ufb_metrics_scraper {
+	struct ufb_metrics_scraper *next;
+	int fd;
+	char request[UFB_METRICS_REQUEST_MAX];
+	size_t request_len;
+};
+
+struct ufb_metrics {
+	char *label;
+	pthread_key_t key;
+	struct ufb_metrics_shard *shards;
+
+	int listen_fd;
+	struct sockaddr_un addr;
+	struct ufb_metrics_scraper *scrapers;
+	int scraper_count;
+};
+
+static const struct {
+	const char *name;
+	const char *help;
+	int first;   /* exported buckets, as powers of two */
+	int last;
+	int ns;
+} _ufb_histograms[UFB_HISTOGRAM_COUNT] = {
+	[UFB_HISTOGRAM_FRAME_TIME] =
+		{ "ufb_frame_seconds", "Time between presented frames.", 16, 34, 1 },
+	[UFB_HISTOGRAM_CONVERT_TIME] =
+		{ "ufb_convert_seconds", "Time per frame converting pixels for the "
+		  "backend.", 10, 30, 1 },
+	[UFB_HISTOGRAM_UPLOAD_TIME] =
+		{ "ufb_upload_seconds", "Time per frame getting vmem to the backend.",
+		  10, 30, 1 },
+	[UFB_HISTOGRAM_PRESENT_TIME] =
+		{ "ufb_present_seconds", "Time per frame in the backend's present.",
+		  10, 30, 1 },
+	[UFB_HISTOGRAM_VBLANK_LATENCY] =
+		{ "ufb_vblank_latency_seconds", "Time from presenting a frame to "
+		  "signalling the vblank.", 8, 28, 1 },
+	[UFB_HISTOGRAM_UPLOAD_BYTES] =
+		{ "ufb_upload_bytes", "Bytes per frame sent to the backend.", 10, 30, 0 },
+};
+
+static const struct {
+	const char *name;
+	const char *help;
+} _ufb_counters[UFB_COUNTER_COUNT] = {
+	[UFB_COUNTER_FRAMES] =
+		{ "ufb_frames_total", "Frames presented." },
+	[UFB_COUNTER_FRAMES_SKIPPED] =
+		{ "ufb_frames_skipped_total", "Frames not presented." },
+	[UFB_COUNTER_FRAMES_COALESCED] =
+		{ "ufb_frames_coalesced_total", "Updates folded into another frame." },
+};
+
+#define _ufb_metrics_load(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+
+/* single writer, so no locked instruction needed */
+static inline void _ufb_metrics_add(uint64_t *p, uint64_t n)
+{
+	__atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n,
+	                 __ATOMIC_RELAXED);
+}
+
+/* the calling thread's shard, made on first use */
+static struct ufb_metrics_shard *_ufb_metrics_shard(ufb_metrics_t *metrics)
+{
+	struct ufb_metrics_shard *shard = pthread_getspecific(metrics->key);
+
+	if( shard ) {
+		return shard;
+	}
+
+	if( !(shard = calloc(1, sizeof(*shard))) ) {
+		return NULL;
+	}
+
+	shard->next = __atomic_load_n(&metrics->shards, __ATOMIC_RELAXED);
+	while( !__atomic_compare_exchange_n(&metrics->shards, &shard->next, shard,
+	                                    1, __ATOMIC_RELEASE,
+	                                    __ATOMIC_RELAXED) ) {
+	}
+
+	pthread_setspecific(metrics->key, shard);
+
+	return shard;
+}
+
+ufb_err_t ufb_metrics_create(ufb_metrics_t **metrics_ptr, const char *name)
+{
+	ufb_metrics_t *metrics;
+
+	if( !metrics_ptr ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	*metrics_ptr = NULL;
+
+	if( !(metrics = calloc(1, sizeof(*metrics))) ) {
+		return UFB_ERR_NO_MEM;
+	}
+
+	metrics->listen_fd = -1;
+
+	/* escaped once here rather than on every export */
+	if( name ) {
+		size_t len = strlen(name);
+		char *out;
+
+		if( !(metrics->label = out = malloc(len * 2 + 1)) ) {
+			free(metrics);
+			return UFB_ERR_NO_MEM;
+		}
+
+		for( ; *name; name++ ) {
+			if( '\\' == *name || '"' == *name ) {
+				*out++ = '\\';
+				*out++ = *name;
+			} else if( '\n' == *name ) {
+				*out++ = '\\';
+				*out++ = 'n';
+			} else {
+				*out++ = *name;
+			}
+		}
+		*out = '\0';
+	}
+
+	if( 0 != pthread_key_create(&metrics->key, NULL) ) {
+		free(metrics->label);
+		free(metrics);
+		return UFB_ERR_NO_MEM;
+	}
+
+	*metrics_ptr = metrics;
+
+	return UFB_OK;
+}
+
+static void _ufb_metrics_drop_scraper(ufb_metrics_t *metrics,
+                                      struct ufb_metrics_scraper *scraper)
+{
+	struct ufb_metrics_scraper **link;
+
+	for( link = &metrics->scrapers; *link; link = &(*link)->next ) {
+		if( *link == scraper ) {
+			*link = scraper->next;
+			break;
+		}
+	}
+
+	close(scraper->fd);
+	free(scraper);
+
+	metrics->scraper_count--;
+}
+
+void ufb_metrics_free(ufb_metrics_t *metrics)
+{
+	struct ufb_metrics_shard *shard, *next;
+
+	if( !metrics ) {
+		return;
+	}
+
+	while( metrics->scrapers ) {
+		_ufb_metrics_drop_scraper(metrics, metrics->scrapers);
+	}
+
+	if( -1 != metrics->listen_fd ) {
+		close(metrics->listen_fd);
+		unlink(metrics->addr.sun_path);
+	}
+
+	for( shard = metrics->shards; shard; shard = next ) {
+		next = shard->next;
+		free(shard);
+	}
+
+	pthread_key_delete(metrics->key);
+	free(metrics->label);
+	free(metrics);
+}
+
+uint64_t ufb_metrics_clock(void)
+{
+	return ufb_now_ns();
+}
+
+void ufb_metrics_observe(ufb_metrics_t *metrics, ufb_histogram_t histogram,
+                         uint64_t value)
+{
+	struct ufb_metrics_shard *shard;
+	int bucket;
+
+	if( !metrics || (unsigned)histogram >= UFB_HISTOGRAM_COUNT ||
+	    !(shard = _ufb_metrics_shard(metrics)) ) {
+		return;
+	}
+
+	bucket = value ? 64 - __builtin_clzll(value) : 0;
+
+	_ufb_metrics_add(&shard->buckets[histogram][bucket], 1);
+	_ufb_metrics_add(&shard->sums[histogram], value);
+}
+
+uint64_t ufb_metrics_time(ufb_metrics_t *metrics, ufb_histogram_t histogram,
+                          uint64_t start)
+{
+	uint64_t now;
+
+	if( !metrics ) {
+		return 0;
+	}
+
+	now = ufb_now_ns();
+	ufb_metrics_observe(metrics, histogram, now - start);
+
+	return now;
+}
+
+void ufb_metrics_count(ufb_metrics_t *metrics, ufb_counter_t counter,
+                       uint64_t n)
+{
+	struct ufb_metrics_shard *shard;
+
+	if( !metrics || (unsigned)counter >= UFB_COUNTER_COUNT ||
+	    !(shard = _ufb_metrics_shard(metrics)) ) {
+		return;
+	}
+
+	_ufb_metrics_add(&shard->counters[counter], n);
+}
+
+/* {framebuffer="name",extra} or {extra}, or nothing */
+static void _ufb_metrics_labels(ufb_metrics_t *metrics, FILE *file,
+                                const char *extra)
+{
+	if( !metrics->label && !extra ) {
+		return;
+	}
+
+	fputc('{', file);
+	if( metrics->label ) {
+		fprintf(file, "framebuffer=\"%s\"%s", metrics->label, extra ? "," : "");
+	}
+	if( extra ) {
+		fputs(extra, file);
+	}
+	fputc('}', file);
+}
+
+static void _ufb_metrics_write_histogram(ufb_metrics_t *metrics, FILE *file,
+                                         int h)
+{
+	struct ufb_metrics_shard *shard;
+	uint64_t buckets[UFB_METRICS_BUCKETS];
+	uint64_t sum = 0, count = 0, below;
+	const char *name = _ufb_histograms[h].name;
+	double scale = _ufb_histograms[h].ns ? 1e-9 : 1.0;
+	char le[48];
+	int b;
+
+	memset(buckets, 0, sizeof(buckets));
+
+	for( shard = __atomic_load_n(&metrics->shards, __ATOMIC_ACQUIRE); shard;
+	     shard = shard->next ) {
+		for( b = 0; b < UFB_METRICS_BUCKETS; b++ ) {
+			buckets[b] += _ufb_metrics_load(&shard->buckets[h][b]);
+		}
+		sum += _ufb_metrics_load(&shard->sums[h]);
+	}
+
+	fprintf(file, "# HELP %s %s\n", name, _ufb_histograms[h].help);
+	fprintf(file, "# TYPE %s histogram\n", name);
+
+	/* everything less than 2^b is in buckets 0 to b */
+	below = 0;
+	for( b = 0; b < UFB_METRICS_BUCKETS; b++ ) {
+		below += buckets[b];
+
+		if( b < _ufb_histograms[h].first || b > _ufb_histograms[h].last ) {
+			continue;
+		}
+
+		snprintf(le, sizeof(le), "le=\"%.9g\"", (double)(1ull << b) * scale);
+		fprintf(file, "%s_bucket", name);
+		_ufb_metrics_labels(metrics, file, le);
+		fprintf(file, " %llu\n", (unsigned long long)below);
+	}
+	count = below;
+
+	fprintf(file, "%s_bucket", name);
+	_ufb_metrics_labels(metrics, file, "le=\"+Inf\"");
+	fprintf(file, " %llu\n", (unsigned long long)count);
+
+	fprintf(file, "%s_sum", name);
+	_ufb_metrics_labels(metrics, file, NULL);
+	fprintf(file, " %.9g\n", (double)sum * scale);
+
+	fprintf(file, "%s_count", name);
+	_ufb_metrics_labels(metrics, file, NULL);
+	fprintf(file, " %llu\n", (unsigned long long)count);
+}
+
+ufb_err_t ufb_metrics_write(ufb_metrics_t *metrics, FILE *file)
+{
+	struct ufb_metrics_shard *shard;
+	uint64_t total;
+	int i;
+
+	if( !metrics || !file ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	for( i = 0; i < UFB_HISTOGRAM_COUNT; i++ ) {
+		_ufb_metrics_write_histogram(metrics, file, i);
+	}
+
+	for( i = 0; i < UFB_COUNTER_COUNT; i++ ) {
+		total = 0;
+		for( shard = __atomic_load_n(&metrics->shards, __ATOMIC_ACQUIRE);
+		     shard; shard = shard->next ) {
+			total += _ufb_metrics_load(&shard->counters[i]);
+		}
+
+		fprintf(file, "# HELP %s %s\n", _ufb_counters[i].name,
+		        _ufb_counters[i].help);
+		fprintf(file, "# TYPE %s counter\n", _ufb_counters[i].name);
+		fputs(_ufb_counters[i].name, file);
+		_ufb_metrics_labels(metrics, file, NULL);
+		fprintf(file, " %llu\n", (unsigned long long)total);
+	}
+
+	return ferror(file) ? UFB_ERR_FILE : UFB_OK;
+}
+
+/* written next to path and renamed over it, so readers never see half */
+ufb_err_t ufb_metrics_write_file(ufb_metrics_t *metrics, const char *path)
+{
+	ufb_err_t err;
+	char *tmp;
+	FILE *file;
+
+	if( !metrics || !path ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	if( -1 == asprintf(&tmp, "%s.tmp", path) ) {
+		return UFB_ERR_NO_MEM;
+	}
+
+	if( !(file = fopen(tmp, "w")) ) {
+		free(tmp);
+		return UFB_ERR_FILE;
+	}
+
+	err = ufb_metrics_write(metrics, file);
+	if( 0 != fclose(file) && UFB_OK == err ) {
+		err = UFB_ERR_FILE;
+	}
+
+	if( UFB_OK == err && -1 == rename(tmp, path) ) {
+		err = UFB_ERR_FILE;
+	}
+
+	if( UFB_OK != err ) {
+		unlink(tmp);
+	}
+
+	free(tmp);
+
+	return err;
+}
+
+ufb_err_t ufb_metrics_serve(ufb_metrics_t *metrics, const char *path)
+{
+	if( !metrics || !path || -1 != metrics->listen_fd ||
+	    strlen(path) >= sizeof(metrics->addr.sun_path) ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	metrics->addr.sun_family = AF_UNIX;
+	strcpy(metrics->addr.sun_path, path);
+
+	metrics->listen_fd = socket(AF_UNIX,
+	                            SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if( -1 == metrics->listen_fd ) {
+		goto error;
+	}
+
+	unlink(path);
+
+	if( -1 == bind(metrics->listen_fd, (struct sockaddr *)&metrics->addr,
+	               sizeof(metrics->addr)) ||
+	    -1 == listen(metrics->listen_fd, UFB_METRICS_MAX_SCRAPERS) ) {
+		close(metrics->listen_fd);
+		metrics->listen_fd = -1;
+		goto error;
+	}
+
+	return UFB_OK;
+
+error:
+	perror("UFB");
+	return UFB_ERR_SOCKET;
+}
+
+/*
+ * The whole response goes out in one write:  a few kB into an empty
+ * socket buffer.  A scraper that can't take it is simply dropped.
+ */
+static void _ufb_metrics_answer(ufb_metrics_t *metrics,
+                                struct ufb_metrics_scraper *scraper)
+{
+	static const char header[] =
+		"HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Connection: close\r\n\r\n";
+	char *body = NULL;
+	size_t len = 0;
+	FILE *file;
+
+	if( !(file = open_memstream(&body, &len)) ) {
+		return;
+	}
+
+	/* plain clients (nc, socat) that sent no HTTP get just the metrics */
+	if( 0 == strncmp(scraper->request, "GET ", 4) ) {
+		fputs(header, file);
+	}
+
+	ufb_metrics_write(metrics, file);
+	fclose(file);
+
+	if( body ) {
+		send(scraper->fd, body, len, MSG_NOSIGNAL);
+		free(body);
+	}
+}
+
+/* 1 once the request is complete:  a blank line, or the client done */
+static int _ufb_metrics_read(struct ufb_metrics_scraper *scraper)
+{
+	ssize_t ret;
+
+	while( scraper->request_len < sizeof(scraper->request) - 1 ) {
+		ret = read(scraper->fd, scraper->request + scraper->request_len,
+		           sizeof(scraper->request) - 1 - scraper->request_len);
+		if( 0 == ret ) {
+			return 1;
+		}
+		if( ret < 0 ) {
+			return EAGAIN != errno && EINTR != errno;
+		}
+
+		scraper->request_len += ret;
+		scraper->request[scraper->request_len] = '\0';
+
+		if( strstr(scraper->request, "\r\n\r\n") ||
+		    strstr(scraper->request, "\n\n") ) {
+			return 1;
+		}
+	}
+
+	/* more request than any scrape needs */
+	return 1;
+}
+
+void ufb_metrics_update(ufb_metrics_t *metrics)
+{
+	struct ufb_metrics_scraper *scraper, *next;
+	int fd;
+
+	if( !metrics || -1 == metrics->listen_fd ) {
+		return;
+	}
+
+	while( -1 != (fd = accept4(metrics->listen_fd, NULL, NULL,
+	                           SOCK_NONBLOCK | SOCK_CLOEXEC)) ) {
+		if( metrics->scraper_count >= UFB_METRICS_MAX_SCRAPERS ||
+		    !(scraper = calloc(1, sizeof(*scraper))) ) {
+			close(fd);
+			continue;
+		}
+
+		scraper->fd = fd;
+		scraper->next = metrics->scrapers;
+		metrics->scrapers = scraper;
+		metrics->scraper_count++;
+	}
+
+	for( scraper = metrics->scrapers; scraper; scraper = next ) {
+		next = scraper->next;
+
+		if( _ufb_metrics_read(scraper) ) {
+			_ufb_metrics_answer(metrics, scraper);
+			_ufb_metrics_drop_scraper(metrics, scraper);
+		}
+	}
+}
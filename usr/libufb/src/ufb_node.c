@@ -0,0 +1,117 @@
+#define _GNU_SOURCE
+
+#include "ufb_internal.h"
+
+#include <sys/syscall.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+#define ULONG_BITS (8 * sizeof(unsigned long))
+#define MAX_NODES  1024
+
+/*
+ * NUMA placement without libnuma:  the driver puts vmem on the node we
+ * ask for, or we place memfd pages ourselves with mbind() before they're
+ * first touched.  Presentation reads all of vmem every frame, so the
+ * threads doing it want to run on that node too.
+ */
+ufb_err_t ufb_bind_node(void *addr, size_t len, int node)
+{
+	unsigned long mask[MAX_NODES / ULONG_BITS];
+
+	if( node < 0 || node >= MAX_NODES ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	memset(mask, 0, sizeof(mask));
+	mask[node / ULONG_BITS] = 1ul << (node % ULONG_BITS);
+
+	/* the kernel drops the last bit of maxnode */
+	if( 0 != syscall(SYS_mbind, addr, len, MPOL_PREFERRED, mask,
+	                 sizeof(mask) * 8 + 1, 0) ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	return UFB_OK;
+}
+
+int ufb_get_node(ufb_context_t *context)
+{
+	return context->node;
+}
+
+/* parses a sysfs cpulist, "0-3,8-11" */
+static int _ufb_parse_cpulist(const char *list, cpu_set_t *cpus)
+{
+	const char *p = list;
+	int count = 0;
+	int first, last, n;
+
+	CPU_ZERO(cpus);
+
+	while( 1 == sscanf(p, "%d%n", &first, &n) ) {
+		p += n;
+		last = first;
+		if( '-' == *p && 1 == sscanf(p + 1, "%d%n", &last, &n) ) {
+			p += 1 + n;
+		}
+
+		for( ; first <= last && first < CPU_SETSIZE; first++ ) {
+			CPU_SET(first, cpus);
+			count++;
+		}
+
+		if( ',' != *p ) {
+			break;
+		}
+		p++;
+	}
+
+	return count;
+}
+
+ufb_err_t ufb_pin_thread(ufb_context_t *context, pthread_t thread)
+{
+	char path[64];
+	char list[1024];
+	cpu_set_t cpus;
+	FILE *file;
+
+	if( !context ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	if( context->node < 0 ) {
+		return UFB_ERR_UNSUPPORTED;
+	}
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+	         context->node);
+
+	if( !(file = fopen(path, "r")) ) {
+		return UFB_ERR_UNSUPPORTED;
+	}
+
+	if( !fgets(list, sizeof(list), file) ) {
+		list[0] = '\0';
+	}
+	fclose(file);
+
+	if( !_ufb_parse_cpulist(list, &cpus) ) {
+		return UFB_ERR_UNSUPPORTED;
+	}
+
+	if( 0 != pthread_setaffinity_np(thread, sizeof(cpus), &cpus) ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	return UFB_OK;
+}
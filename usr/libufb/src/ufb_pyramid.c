@@ -0,0 +1,895 @@
+#define _GNU_SOURCE
+
+#include "ufb_internal.h"
+#include "ufb_pyramid.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define UFB_HAVE_AVX2_PATHS
+#endif
+
+/*
+ * Damage is kept as blocks of the screen big enough that each one maps
+ * to whole pixels at every level, so a block is recomputed level by level
+ * without looking at its neighbours.
+ */
+#define UFB_PYRAMID_BLOCK (1 << UFB_PYRAMID_MAX_LEVEL)
+
+#define UFB_PYRAMID_MAX_RECTS 64
+
+#define UFB_PYRAMID_WANT_NS 2000000000ull
+
+#define UFB_PYRAMID_READ_TRIES 16
+
+struct ufb_pyramid {
+	ufb_context_t *context;
+	int max_level;
+
+	/* the shared object, or a malloc()ed block laid out the same way */
+	char *shm_name;
+	int shm_fd;
+	ufb_pyramid_shm_t *shm;
+	size_t shm_size;
+
+	/* the screen the levels were laid out for */
+	ufb_scanout_t scanout;
+	int laid_out;
+
+	/* damage in virtual screen coordinates, until it can be placed */
+	ufb_rect_t rects[UFB_PYRAMID_MAX_RECTS];
+	int rect_count;
+	int all_dirty;
+
+	uint8_t *dirty;
+	int blocks_x;
+	int blocks_y;
+
+	uint64_t refresh_interval;
+	uint64_t refreshed;
+
+	/* source rows converted to ARGB8888, and planar YUV frames whole */
+	uint32_t *rows[2];
+	uint32_t *frame;
+};
+
+struct ufb_pyramid_view {
+	int fd;
+	int writable;
+	ufb_pyramid_shm_t *shm;
+	size_t size;
+};
+
+static inline size_t _ufb_pyramid_align(size_t n, size_t align)
+{
+	return (n + align - 1) & ~(align - 1);
+}
+
+static inline uint32_t *_ufb_pyramid_pixels(ufb_pyramid_shm_t *shm, int level)
+{
+	return (uint32_t *)((char *)shm + shm->levels[level].offset);
+}
+
+/* 2x2 box filter, rounded, done on two channels at a time */
+static inline uint32_t _ufb_pyramid_average(uint32_t a, uint32_t b, uint32_t c,
+                                            uint32_t d)
+{
+	uint32_t rb = (a & 0x00ff00ff) + (b & 0x00ff00ff) + (c & 0x00ff00ff) +
+	              (d & 0x00ff00ff) + 0x00020002;
+	uint32_t g = ((a >> 8) & 0xff) + ((b >> 8) & 0xff) + ((c >> 8) & 0xff) +
+	             ((d >> 8) & 0xff) + 2;
+
+	return 0xff000000 | ((rb >> 2) & 0x00ff00ff) | ((g >> 2) << 8);
+}
+
+#ifdef UFB_HAVE_AVX2_PATHS
+
+/*
+ * 8 pixels from 16 columns of two rows:  the bytes of each pair of
+ * columns are interleaved so one multiply-add per row sums them across,
+ * the rows are added, and the 16 bit sums packed back down.
+ */
+__attribute__((target("avx2")))
+static int _ufb_pyramid_reduce_avx2(const uint32_t *a, const uint32_t *b,
+                                    uint32_t *dst, int pairs)
+{
+	const __m256i pair = _mm256_setr_epi8(0, 4, 1, 5, 2, 6, 3, 7,
+	                                      8, 12, 9, 13, 10, 14, 11, 15,
+	                                      0, 4, 1, 5, 2, 6, 3, 7,
+	                                      8, 12, 9, 13, 10, 14, 11, 15);
+	const __m256i ones = _mm256_set1_epi8(1);
+	const __m256i round = _mm256_set1_epi16(2);
+	const __m256i alpha = _mm256_set1_epi32((int)0xff000000);
+	int x;
+
+	for( x = 0; x + 8 <= pairs; x += 8 ) {
+		__m256i a0 = _mm256_loadu_si256((const __m256i *)(a + 2 * x));
+		__m256i a1 = _mm256_loadu_si256((const __m256i *)(a + 2 * x + 8));
+		__m256i b0 = _mm256_loadu_si256((const __m256i *)(b + 2 * x));
+		__m256i b1 = _mm256_loadu_si256((const __m256i *)(b + 2 * x + 8));
+		__m256i s0, s1, r;
+
+		s0 = _mm256_add_epi16(
+		         _mm256_maddubs_epi16(_mm256_shuffle_epi8(a0, pair), ones),
+		         _mm256_maddubs_epi16(_mm256_shuffle_epi8(b0, pair), ones));
+		s1 = _mm256_add_epi16(
+		         _mm256_maddubs_epi16(_mm256_shuffle_epi8(a1, pair), ones),
+		         _mm256_maddubs_epi16(_mm256_shuffle_epi8(b1, pair), ones));
+
+		s0 = _mm256_srli_epi16(_mm256_add_epi16(s0, round), 2);
+		s1 = _mm256_srli_epi16(_mm256_add_epi16(s1, round), 2);
+
+		/* packing works per lane, which leaves the quarters out of order */
+		r = _mm256_permute4x64_epi64(_mm256_packus_epi16(s0, s1),
+		                             _MM_SHUFFLE(3, 1, 2, 0));
+
+		_mm256_storeu_si256((__m256i *)(dst + x), _mm256_or_si256(r, alpha));
+	}
+
+	return x;
+}
+
+#endif
+
+/*
+ * Halves width pixels of rows a and b into dst;  an odd last column is
+ * averaged with itself.
+ */
+static void _ufb_pyramid_reduce(const uint32_t *a, const uint32_t *b,
+                                uint32_t *dst, int width)
+{
+	int pairs = width / 2;
+	int x = 0;
+
+#ifdef UFB_HAVE_AVX2_PATHS
+	if( ufb_have_avx2() ) {
+		x = _ufb_pyramid_reduce_avx2(a, b, dst, pairs);
+	}
+#endif
+
+	for( ; x < pairs; x++ ) {
+		dst[x] = _ufb_pyramid_average(a[2 * x], a[2 * x + 1],
+		                              b[2 * x], b[2 * x + 1]);
+	}
+
+	if( width & 1 ) {
+		dst[x] = _ufb_pyramid_average(a[2 * x], a[2 * x], b[2 * x], b[2 * x]);
+	}
+}
+
+static void _ufb_pyramid_begin(ufb_pyramid_shm_level_t *level)
+{
+	__atomic_store_n(&level->seq, level->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void _ufb_pyramid_end(ufb_pyramid_shm_level_t *level, uint32_t flags)
+{
+	level->flags = flags;
+	__atomic_store_n(&level->seq, level->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* grows the object to size, without ever shrinking it under readers */
+static ufb_err_t _ufb_pyramid_reserve(ufb_pyramid_t *pyramid, size_t size)
+{
+	ufb_pyramid_shm_t *shm;
+
+	if( size <= pyramid->shm_size ) {
+		return UFB_OK;
+	}
+
+	if( pyramid->shm_fd < 0 ) {
+		shm = realloc(pyramid->shm, size);
+		if( !shm ) {
+			return UFB_ERR_NO_MEM;
+		}
+		if( !pyramid->shm ) {
+			memset(shm, 0, sizeof(*shm));
+		}
+	} else {
+		if( -1 == ftruncate(pyramid->shm_fd, size) ) {
+			return UFB_ERR_FILE;
+		}
+
+		shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		           pyramid->shm_fd, 0);
+		if( shm == MAP_FAILED ) {
+			return UFB_ERR_MMAP;
+		}
+
+		if( pyramid->shm ) {
+			munmap(pyramid->shm, pyramid->shm_size);
+		}
+	}
+
+	pyramid->shm = shm;
+	pyramid->shm_size = size;
+	__atomic_store_n(&shm->size, size, __ATOMIC_RELEASE);
+
+	return UFB_OK;
+}
+
+/*
+ * Places every level for the screen in scanout.  Levels 1 and up are
+ * packed after the header, level 0 goes last on pages of its own, so
+ * they can be given back while nobody wants it.
+ */
+static ufb_err_t _ufb_pyramid_layout(ufb_pyramid_t *pyramid,
+                                     const ufb_scanout_t *scanout)
+{
+	ufb_pyramid_shm_t *shm;
+	uint32_t width[UFB_PYRAMID_MAX_LEVEL + 1];
+	uint32_t height[UFB_PYRAMID_MAX_LEVEL + 1];
+	uint64_t offset[UFB_PYRAMID_MAX_LEVEL + 1];
+	size_t size, page = sysconf(_SC_PAGESIZE);
+	int planar = scanout->fourcc == UFB_FOURCC_NV12 ||
+	             scanout->fourcc == UFB_FOURCC_I420;
+	int n, blocks_x, blocks_y;
+	ufb_err_t status;
+
+	width[0] = scanout->width;
+	height[0] = scanout->height;
+	size = _ufb_pyramid_align(sizeof(ufb_pyramid_shm_t), 64);
+
+	for( n = 1; n <= pyramid->max_level; n++ ) {
+		width[n] = (width[n - 1] + 1) / 2;
+		height[n] = (height[n - 1] + 1) / 2;
+		offset[n] = size;
+		size += _ufb_pyramid_align((size_t)width[n] * height[n] * 4, 64);
+	}
+
+	offset[0] = 0;
+	if( pyramid->shm_fd >= 0 ) {
+		offset[0] = _ufb_pyramid_align(size, page);
+		size = _ufb_pyramid_align(offset[0] + (size_t)width[0] * height[0] * 4,
+		                          page);
+	}
+
+	if( UFB_OK != (status = _ufb_pyramid_reserve(pyramid, size)) ) {
+		return status;
+	}
+
+	blocks_x = (scanout->width + UFB_PYRAMID_BLOCK - 1) / UFB_PYRAMID_BLOCK;
+	blocks_y = (scanout->height + UFB_PYRAMID_BLOCK - 1) / UFB_PYRAMID_BLOCK;
+
+	free(pyramid->dirty);
+	free(pyramid->rows[0]);
+	free(pyramid->rows[1]);
+	free(pyramid->frame);
+	pyramid->rows[0] = malloc(scanout->width * 4);
+	pyramid->rows[1] = malloc(scanout->width * 4);
+	pyramid->dirty = calloc(blocks_x * blocks_y, 1);
+	pyramid->frame = planar ?
+	                 malloc((size_t)scanout->width * scanout->height * 4) : NULL;
+
+	if( !pyramid->rows[0] || !pyramid->rows[1] || !pyramid->dirty ||
+	    (planar && !pyramid->frame) ) {
+		pyramid->laid_out = 0;
+		return UFB_ERR_NO_MEM;
+	}
+
+	shm = pyramid->shm;
+
+	for( n = 0; n <= pyramid->max_level; n++ ) {
+		_ufb_pyramid_begin(&shm->levels[n]);
+		shm->levels[n].width = n || pyramid->shm_fd >= 0 ? width[n] : 0;
+		shm->levels[n].height = n || pyramid->shm_fd >= 0 ? height[n] : 0;
+		shm->levels[n].offset = offset[n];
+		_ufb_pyramid_end(&shm->levels[n], 0);
+	}
+
+	pyramid->blocks_x = blocks_x;
+	pyramid->blocks_y = blocks_y;
+	pyramid->scanout = *scanout;
+	pyramid->laid_out = 1;
+	pyramid->all_dirty = 1;
+
+	return UFB_OK;
+}
+
+ufb_err_t ufb_pyramid_create(ufb_pyramid_t **pyramid, ufb_context_t *context,
+                             int max_level, const char *shm_name)
+{
+	ufb_pyramid_t *p;
+	struct stat st;
+
+	if( !pyramid || !context || max_level < 1 ||
+	    max_level > UFB_PYRAMID_MAX_LEVEL ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	p = calloc(1, sizeof(*p));
+	if( !p ) {
+		return UFB_ERR_NO_MEM;
+	}
+
+	p->context = context;
+	p->max_level = max_level;
+	p->shm_fd = -1;
+	p->all_dirty = 1;
+
+	if( shm_name ) {
+		if( !(p->shm_name = strdup(shm_name)) ) {
+			ufb_pyramid_free(p);
+			return UFB_ERR_NO_MEM;
+		}
+
+		p->shm_fd = shm_open(shm_name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if( p->shm_fd < 0 ) {
+			ufb_pyramid_free(p);
+			return UFB_ERR_FILE;
+		}
+
+		/* left by an earlier daemon, perhaps still mapped by viewers */
+		if( 0 == fstat(p->shm_fd, &st) && st.st_size > 0 ) {
+			p->shm_size = st.st_size;
+			p->shm = mmap(NULL, p->shm_size, PROT_READ | PROT_WRITE,
+			              MAP_SHARED, p->shm_fd, 0);
+			if( p->shm == MAP_FAILED ) {
+				p->shm = NULL;
+				p->shm_size = 0;
+			}
+		}
+	}
+
+	if( UFB_OK != _ufb_pyramid_reserve(p, sizeof(ufb_pyramid_shm_t)) ) {
+		ufb_pyramid_free(p);
+		return UFB_ERR_MMAP;
+	}
+
+	p->shm->version = UFB_PYRAMID_VERSION;
+	p->shm->max_level = max_level;
+	__atomic_store_n(&p->shm->magic, UFB_PYRAMID_MAGIC, __ATOMIC_RELEASE);
+
+	*pyramid = p;
+
+	return UFB_OK;
+}
+
+void ufb_pyramid_damage(ufb_pyramid_t *pyramid, const ufb_rect_t *rect)
+{
+	if( pyramid->rect_count == UFB_PYRAMID_MAX_RECTS ) {
+		pyramid->all_dirty = 1;
+		return;
+	}
+
+	pyramid->rects[pyramid->rect_count++] = *rect;
+}
+
+void ufb_pyramid_damage_all(ufb_pyramid_t *pyramid)
+{
+	pyramid->all_dirty = 1;
+}
+
+void ufb_pyramid_set_refresh(ufb_pyramid_t *pyramid, int interval_ms)
+{
+	pyramid->refresh_interval = interval_ms > 0 ?
+	                            (uint64_t)interval_ms * 1000000ull : 0;
+}
+
+static void _ufb_pyramid_mark(ufb_pyramid_t *pyramid, int x, int y, int width,
+                              int height)
+{
+	const ufb_scanout_t *scanout = &pyramid->scanout;
+	int bx, by, bx1, by1;
+
+	if( x < 0 ) {
+		width += x;
+		x = 0;
+	}
+	if( y < 0 ) {
+		height += y;
+		y = 0;
+	}
+	if( x + width > scanout->width ) {
+		width = scanout->width - x;
+	}
+	if( y + height > scanout->height ) {
+		height = scanout->height - y;
+	}
+	if( width <= 0 || height <= 0 ) {
+		return;
+	}
+
+	bx1 = (x + width - 1) / UFB_PYRAMID_BLOCK;
+	by1 = (y + height - 1) / UFB_PYRAMID_BLOCK;
+
+	for( by = y / UFB_PYRAMID_BLOCK; by <= by1; by++ ) {
+		for( bx = x / UFB_PYRAMID_BLOCK; bx <= bx1; bx++ ) {
+			pyramid->dirty[by * pyramid->blocks_x + bx] = 1;
+		}
+	}
+}
+
+/* moves the rects onto the visible screen, as it's panned and wrapped now */
+static void _ufb_pyramid_place_rects(ufb_pyramid_t *pyramid)
+{
+	const ufb_scanout_t *scanout = &pyramid->scanout;
+	int i;
+
+	for( i = 0; i < pyramid->rect_count; i++ ) {
+		const ufb_rect_t *r = &pyramid->rects[i];
+		int x = r->x - scanout->xoffset;
+		int y = r->y - scanout->yoffset;
+
+		_ufb_pyramid_mark(pyramid, x, y, r->width, r->height);
+
+		if( scanout->ywrap ) {
+			_ufb_pyramid_mark(pyramid, x, y + scanout->virtual_height,
+			                  r->width, r->height);
+		}
+	}
+
+	pyramid->rect_count = 0;
+}
+
+/*
+ * Screen row y, columns x0 to x1, as ARGB8888:  straight out of vmem if
+ * it's that already, otherwise converted into rows[slot].
+ */
+static const uint32_t *_ufb_pyramid_row(ufb_pyramid_t *pyramid,
+                                        const ufb_region_t *regions, int count,
+                                        int y, int x0, int x1, int slot)
+{
+	ufb_context_t *context = pyramid->context;
+	const ufb_scanout_t *scanout = &pyramid->scanout;
+	uint32_t *dst = pyramid->rows[slot];
+	const uint8_t *src;
+	int i, x;
+
+	if( pyramid->frame ) {
+		return pyramid->frame + (size_t)y * scanout->width + x0;
+	}
+
+	for( i = 0; i < count - 1 && y >= regions[i + 1].y; i++ ) {
+	}
+
+	src = (const uint8_t *)context->vmem + regions[i].offset +
+	      (size_t)(y - regions[i].y) * scanout->pitch +
+	      (size_t)x0 * scanout->bpp / 8;
+
+	if( ufb_needs_conversion(context) ) {
+		ufb_convert_rows(context, src, scanout->pitch, dst, 0, x1 - x0, 1);
+		return dst;
+	}
+
+	if( scanout->bpp == 32 ) {
+		return (const uint32_t *)src;
+	}
+
+	for( x = 0; x < x1 - x0; x++ ) {
+		uint16_t p = ((const uint16_t *)src)[x];
+		uint32_t r = (p >> 11) & 0x1f;
+		uint32_t g = (p >> 5) & 0x3f;
+		uint32_t b = p & 0x1f;
+
+		dst[x] = 0xff000000 | (r * 255 / 31) << 16 | (g * 255 / 63) << 8 |
+		         (b * 255 / 31);
+	}
+
+	return dst;
+}
+
+/*
+ * Recomputes the screen's x0..x1, y0..y1 (block aligned, or reaching the
+ * edge) at every level, level 0 too when it's published.
+ */
+static void _ufb_pyramid_update_rect(ufb_pyramid_t *pyramid,
+                                     const ufb_region_t *regions, int count,
+                                     int x0, int y0, int x1, int y1,
+                                     int publish)
+{
+	ufb_pyramid_shm_t *shm = pyramid->shm;
+	const ufb_pyramid_shm_level_t *level;
+	const uint32_t *a, *b;
+	uint32_t *src, *dst;
+	int n, y, sx0, sx1, sy1;
+
+	if( publish ) {
+		dst = _ufb_pyramid_pixels(shm, 0);
+		for( y = y0; y < y1; y++ ) {
+			memcpy(dst + (size_t)y * pyramid->scanout.width + x0,
+			       _ufb_pyramid_row(pyramid, regions, count, y, x0, x1, 0),
+			       (x1 - x0) * 4);
+		}
+	}
+
+	level = &shm->levels[1];
+	dst = _ufb_pyramid_pixels(shm, 1);
+
+	for( y = y0 / 2; y < (y1 + 1) / 2; y++ ) {
+		a = _ufb_pyramid_row(pyramid, regions, count, 2 * y, x0, x1, 0);
+		b = _ufb_pyramid_row(pyramid, regions, count,
+		                     2 * y + 1 < y1 ? 2 * y + 1 : y1 - 1, x0, x1, 1);
+		_ufb_pyramid_reduce(a, b, dst + (size_t)y * level->width + x0 / 2,
+		                    x1 - x0);
+	}
+
+	for( n = 2; n <= pyramid->max_level; n++ ) {
+		level = &shm->levels[n];
+		src = _ufb_pyramid_pixels(shm, n - 1);
+		dst = _ufb_pyramid_pixels(shm, n);
+
+		sx0 = x0 >> (n - 1);
+		sx1 = (x1 + (1 << (n - 1)) - 1) >> (n - 1);
+		sy1 = (y1 + (1 << (n - 1)) - 1) >> (n - 1);
+
+		for( y = y0 >> n; y < (y1 + (1 << n) - 1) >> n; y++ ) {
+			a = src + (size_t)(2 * y) * shm->levels[n - 1].width + sx0;
+			b = src + (size_t)(2 * y + 1 < sy1 ? 2 * y + 1 : sy1 - 1) *
+			    shm->levels[n - 1].width + sx0;
+			_ufb_pyramid_reduce(a, b, dst + (size_t)y * level->width + sx0 / 2,
+			                    sx1 - sx0);
+		}
+	}
+}
+
+ufb_err_t ufb_pyramid_update(ufb_pyramid_t *pyramid)
+{
+	ufb_context_t *context = pyramid->context;
+	ufb_pyramid_shm_t *shm;
+	ufb_pyramid_shm_level_t *level0;
+	ufb_scanout_t scanout;
+	ufb_region_t regions[2];
+	uint64_t now = ufb_now_ns();
+	int count, publish, n, i, bx, by, bx1, any = 0;
+	ufb_err_t status;
+
+	if( UFB_OK != ufb_get_scanout(context, &scanout) ) {
+		memset(&scanout, 0, sizeof(scanout));
+		scanout.width = scanout.virtual_width = context->width;
+		scanout.height = scanout.virtual_height = context->height;
+		scanout.bpp = 32;
+		scanout.pitch = context->width * 4;
+	}
+
+	if( scanout.width <= 0 || scanout.height <= 0 ) {
+		return UFB_OK;
+	}
+
+	if( !scanout.fourcc && !ufb_needs_conversion(context) &&
+	    scanout.bpp != 32 && scanout.bpp != 16 ) {
+		return UFB_ERR_UNSUPPORTED;
+	}
+
+	if( !pyramid->laid_out || scanout.width != pyramid->scanout.width ||
+	    scanout.height != pyramid->scanout.height ||
+	    scanout.bpp != pyramid->scanout.bpp ||
+	    scanout.fourcc != pyramid->scanout.fourcc ) {
+		if( UFB_OK != (status = _ufb_pyramid_layout(pyramid, &scanout)) ) {
+			return status;
+		}
+	} else if( scanout.xoffset != pyramid->scanout.xoffset ||
+	           scanout.yoffset != pyramid->scanout.yoffset ||
+	           scanout.pitch != pyramid->scanout.pitch ) {
+		pyramid->all_dirty = 1;
+	}
+
+	pyramid->scanout = scanout;
+	shm = pyramid->shm;
+	level0 = &shm->levels[0];
+
+	publish = pyramid->shm_fd >= 0 &&
+	          now < __atomic_load_n(&level0->want_until, __ATOMIC_RELAXED);
+
+	if( publish && !(level0->flags & UFB_PYRAMID_VALID) ) {
+		pyramid->all_dirty = 1;
+	} else if( !publish && (level0->flags & UFB_PYRAMID_VALID) ) {
+		_ufb_pyramid_begin(level0);
+		_ufb_pyramid_end(level0, 0);
+		madvise(_ufb_pyramid_pixels(shm, 0),
+		        _ufb_pyramid_align((size_t)level0->width * level0->height * 4,
+		                           sysconf(_SC_PAGESIZE)), MADV_REMOVE);
+	}
+
+	if( pyramid->refresh_interval &&
+	    now - pyramid->refreshed >= pyramid->refresh_interval ) {
+		pyramid->all_dirty = 1;
+	}
+
+	if( pyramid->all_dirty ) {
+		memset(pyramid->dirty, 1, pyramid->blocks_x * pyramid->blocks_y);
+		pyramid->rect_count = 0;
+		pyramid->all_dirty = 0;
+		pyramid->refreshed = now;
+	} else {
+		_ufb_pyramid_place_rects(pyramid);
+	}
+
+	for( i = 0; i < pyramid->blocks_x * pyramid->blocks_y && !any; i++ ) {
+		any = pyramid->dirty[i];
+	}
+
+	if( !any ) {
+		return UFB_OK;
+	}
+
+	if( pyramid->frame ) {
+		ufb_convert_scanout(context, &scanout, pyramid->frame,
+		                    scanout.width * 4);
+	}
+
+	count = ufb_scanout_regions(&scanout, regions);
+
+	for( n = publish ? 0 : 1; n <= pyramid->max_level; n++ ) {
+		_ufb_pyramid_begin(&shm->levels[n]);
+	}
+
+	/* each run of dirty blocks in a row of them at a time */
+	for( by = 0; by < pyramid->blocks_y; by++ ) {
+		uint8_t *dirty = pyramid->dirty + by * pyramid->blocks_x;
+
+		for( bx = 0; bx < pyramid->blocks_x; bx = bx1 ) {
+			if( !dirty[bx] ) {
+				bx1 = bx + 1;
+				continue;
+			}
+
+			for( bx1 = bx; bx1 < pyramid->blocks_x && dirty[bx1]; bx1++ ) {
+				dirty[bx1] = 0;
+			}
+
+			_ufb_pyramid_update_rect(pyramid, regions, count,
+			                         bx * UFB_PYRAMID_BLOCK,
+			                         by * UFB_PYRAMID_BLOCK,
+			                         bx1 * UFB_PYRAMID_BLOCK < scanout.width ?
+			                         bx1 * UFB_PYRAMID_BLOCK : scanout.width,
+			                         (by + 1) * UFB_PYRAMID_BLOCK < scanout.height ?
+			                         (by + 1) * UFB_PYRAMID_BLOCK : scanout.height,
+			                         publish);
+		}
+	}
+
+	for( n = publish ? 0 : 1; n <= pyramid->max_level; n++ ) {
+		_ufb_pyramid_end(&shm->levels[n], UFB_PYRAMID_VALID);
+	}
+
+	return UFB_OK;
+}
+
+const uint32_t *ufb_pyramid_level(ufb_pyramid_t *pyramid, int level,
+                                  int *width, int *height)
+{
+	if( level < 1 || level > pyramid->max_level || !pyramid->laid_out ) {
+		return NULL;
+	}
+
+	if( width ) {
+		*width = pyramid->shm->levels[level].width;
+	}
+	if( height ) {
+		*height = pyramid->shm->levels[level].height;
+	}
+
+	return _ufb_pyramid_pixels(pyramid->shm, level);
+}
+
+void ufb_pyramid_free(ufb_pyramid_t *pyramid)
+{
+	int n;
+
+	if( !pyramid ) {
+		return;
+	}
+
+	if( pyramid->shm_fd >= 0 ) {
+		/* so viewers holding on to it see it's gone stale */
+		if( pyramid->shm ) {
+			for( n = 0; n <= pyramid->max_level; n++ ) {
+				_ufb_pyramid_begin(&pyramid->shm->levels[n]);
+				_ufb_pyramid_end(&pyramid->shm->levels[n], 0);
+			}
+			munmap(pyramid->shm, pyramid->shm_size);
+		}
+		shm_unlink(pyramid->shm_name);
+		close(pyramid->shm_fd);
+	} else {
+		free(pyramid->shm);
+	}
+
+	free(pyramid->shm_name);
+	free(pyramid->dirty);
+	free(pyramid->rows[0]);
+	free(pyramid->rows[1]);
+	free(pyramid->frame);
+	free(pyramid);
+}
+
+ufb_err_t ufb_pyramid_open(ufb_pyramid_view_t **view, const char *shm_name)
+{
+	ufb_pyramid_view_t *v;
+	struct stat st;
+
+	if( !view || !shm_name ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	v = calloc(1, sizeof(*v));
+	if( !v ) {
+		return UFB_ERR_NO_MEM;
+	}
+
+	/* without write access it's still readable, just not asked for level 0 */
+	v->writable = 1;
+	v->fd = shm_open(shm_name, O_RDWR | O_CLOEXEC, 0);
+	if( v->fd < 0 ) {
+		v->writable = 0;
+		v->fd = shm_open(shm_name, O_RDONLY | O_CLOEXEC, 0);
+	}
+
+	if( v->fd < 0 || -1 == fstat(v->fd, &st) ||
+	    st.st_size < (off_t)sizeof(ufb_pyramid_shm_t) ) {
+		ufb_pyramid_close(v);
+		return UFB_ERR_FILE;
+	}
+
+	v->size = st.st_size;
+	v->shm = mmap(NULL, v->size, PROT_READ | (v->writable ? PROT_WRITE : 0),
+	              MAP_SHARED, v->fd, 0);
+	if( v->shm == MAP_FAILED ) {
+		v->shm = NULL;
+		ufb_pyramid_close(v);
+		return UFB_ERR_MMAP;
+	}
+
+	if( __atomic_load_n(&v->shm->magic, __ATOMIC_ACQUIRE) != UFB_PYRAMID_MAGIC ||
+	    v->shm->version != UFB_PYRAMID_VERSION ) {
+		ufb_pyramid_close(v);
+		return UFB_ERR_UNSUPPORTED;
+	}
+
+	*view = v;
+
+	return UFB_OK;
+}
+
+/* the daemon grew the object past our mapping */
+static ufb_err_t _ufb_pyramid_view_remap(ufb_pyramid_view_t *view, size_t end)
+{
+	size_t size = __atomic_load_n(&view->shm->size, __ATOMIC_ACQUIRE);
+	ufb_pyramid_shm_t *shm;
+
+	if( end > size ) {
+		return UFB_ERR_BUSY;
+	}
+
+	shm = mmap(NULL, size, PROT_READ | (view->writable ? PROT_WRITE : 0),
+	           MAP_SHARED, view->fd, 0);
+	if( shm == MAP_FAILED ) {
+		return UFB_ERR_MMAP;
+	}
+
+	munmap(view->shm, view->size);
+	view->shm = shm;
+	view->size = size;
+
+	return UFB_OK;
+}
+
+ufb_err_t ufb_pyramid_size(ufb_pyramid_view_t *view, int level, int *width,
+                           int *height)
+{
+	return ufb_pyramid_read(view, level, NULL, 0, 0, 0, width, height, NULL);
+}
+
+ufb_err_t ufb_pyramid_read(ufb_pyramid_view_t *view, int level, uint32_t *dst,
+                           size_t dst_pitch, int dst_width, int dst_height,
+                           int *width, int *height, uint64_t *seq)
+{
+	ufb_pyramid_shm_level_t *l;
+	uint32_t start, flags, w, h;
+	uint64_t offset;
+	const uint8_t *src;
+	ufb_err_t status;
+	int tries, y;
+
+	if( !view || level < 0 || level > UFB_PYRAMID_MAX_LEVEL ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	for( tries = 0; tries < UFB_PYRAMID_READ_TRIES; tries++ ) {
+		l = &view->shm->levels[level];
+		start = __atomic_load_n(&l->seq, __ATOMIC_ACQUIRE);
+		if( start & 1 ) {
+			usleep(100);
+			continue;
+		}
+
+		flags = __atomic_load_n(&l->flags, __ATOMIC_RELAXED);
+		w = __atomic_load_n(&l->width, __ATOMIC_RELAXED);
+		h = __atomic_load_n(&l->height, __ATOMIC_RELAXED);
+		offset = __atomic_load_n(&l->offset, __ATOMIC_RELAXED);
+
+		if( !(flags & UFB_PYRAMID_VALID) ) {
+			if( __atomic_load_n(&l->seq, __ATOMIC_ACQUIRE) != start ) {
+				continue;
+			}
+			return UFB_ERR_UNSUPPORTED;
+		}
+
+		if( offset + (uint64_t)w * h * 4 > view->size ) {
+			status = _ufb_pyramid_view_remap(view, offset + (uint64_t)w * h * 4);
+			if( status == UFB_ERR_MMAP ) {
+				return status;
+			}
+			continue;
+		}
+
+		if( dst && ((int)w > dst_width || (int)h > dst_height) ) {
+			if( width ) {
+				*width = w;
+			}
+			if( height ) {
+				*height = h;
+			}
+			return UFB_ERR_NO_MEM;
+		}
+
+		src = (const uint8_t *)view->shm + offset;
+		for( y = 0; dst && y < (int)h; y++ ) {
+			memcpy((uint8_t *)dst + y * dst_pitch, src + (size_t)y * w * 4,
+			       (size_t)w * 4);
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if( __atomic_load_n(&l->seq, __ATOMIC_RELAXED) != start ) {
+			continue;
+		}
+
+		if( width ) {
+			*width = w;
+		}
+		if( height ) {
+			*height = h;
+		}
+		if( seq ) {
+			*seq = start / 2;
+		}
+
+		return UFB_OK;
+	}
+
+	return UFB_ERR_BUSY;
+}
+
+uint64_t ufb_pyramid_seq(ufb_pyramid_view_t *view, int level)
+{
+	if( level < 0 || level > UFB_PYRAMID_MAX_LEVEL ) {
+		return 0;
+	}
+
+	return __atomic_load_n(&view->shm->levels[level].seq, __ATOMIC_ACQUIRE) / 2;
+}
+
+void ufb_pyramid_want(ufb_pyramid_view_t *view)
+{
+	if( !view->writable ) {
+		return;
+	}
+
+	__atomic_store_n(&view->shm->levels[0].want_until,
+	                 ufb_now_ns() + UFB_PYRAMID_WANT_NS, __ATOMIC_RELAXED);
+}
+
+void ufb_pyramid_close(ufb_pyramid_view_t *view)
+{
+	if( !view ) {
+		return;
+	}
+
+	if( view->shm ) {
+		munmap(view->shm, view->size);
+	}
+	if( view->fd >= 0 ) {
+		close(view->fd);
+	}
+
+	free(view);
+}
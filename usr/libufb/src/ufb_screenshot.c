@@ -0,0 +1,327 @@
+#define _GNU_SOURCE
+
+#include "ufb_internal.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Frames are copied on the presenting thread at vblank, which is the only
+ * point where what's in vmem is known to be what was shown, and everything
+ * else (conversion, encoding, the callback) happens on a small shared pool
+ * of SCHED_IDLE threads so capture never competes with presentation.
+ */
+
+struct ufb_screenshot_job {
+	struct ufb_screenshot_job *next;
+	struct ufb_screenshot_request request;
+	int width;
+	int height;
+	int bpp;
+	size_t pitch;
+	uint64_t timestamp;
+	uint8_t *pixels;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int started;
+	int threads;
+	int max_queued;
+	/* requests accepted and not yet finished, pending or encoding */
+	int reserved;
+	struct ufb_screenshot_job *head;
+	struct ufb_screenshot_job *tail;
+} pool = {
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	0, 2, 8, 0, NULL, NULL
+};
+
+static void _ufb_screenshot_release(void)
+{
+	pthread_mutex_lock(&pool.lock);
+	pool.reserved--;
+	pthread_mutex_unlock(&pool.lock);
+}
+
+static void _ufb_screenshot_encode(struct ufb_screenshot_job *job)
+{
+	ufb_screenshot_t shot;
+	uint8_t *rgb = NULL;
+	uint8_t *encoded = NULL;
+
+	memset(&shot, 0, sizeof(shot));
+	shot.status = UFB_OK;
+	shot.format = job->request.format;
+	shot.width = job->width;
+	shot.height = job->height;
+	shot.bpp = job->bpp;
+	shot.timestamp = job->timestamp;
+
+	if( job->request.format == UFB_IMAGE_RAW ) {
+		shot.data = job->pixels;
+		shot.size = job->pitch * job->height;
+	} else if( !(rgb = malloc((size_t)job->width * job->height * 3)) ) {
+		shot.status = UFB_ERR_NO_MEM;
+	} else if( UFB_OK == (shot.status = ufb_image_to_rgb(job->pixels, 
+	                                    job->pitch, job->width, job->height,
+	                                    job->bpp, rgb)) ) {
+		if( job->request.format == UFB_IMAGE_QOI ) {
+			shot.status = ufb_encode_qoi(rgb, job->width, job->height,
+			                             &encoded, &shot.size);
+		} else {
+			shot.status = ufb_encode_png(rgb, job->width, job->height,
+			                             &encoded, &shot.size);
+		}
+		shot.data = encoded;
+	}
+
+	job->request.callback(&shot, job->request.user);
+
+	free(encoded);
+	free(rgb);
+}
+
+static void *_ufb_screenshot_worker(void *arg)
+{
+	struct sched_param param;
+	struct ufb_screenshot_job *job;
+
+	(void)arg;
+
+	memset(&param, 0, sizeof(param));
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+	while( 1 ) {
+		pthread_mutex_lock(&pool.lock);
+		while( !pool.head ) {
+			pthread_cond_wait(&pool.cond, &pool.lock);
+		}
+		job = pool.head;
+		pool.head = job->next;
+		if( !pool.head ) {
+			pool.tail = NULL;
+		}
+		pthread_mutex_unlock(&pool.lock);
+
+		_ufb_screenshot_encode(job);
+
+		free(job->pixels);
+		free(job);
+
+		_ufb_screenshot_release();
+	}
+
+	return NULL;
+}
+
+/* called with pool.lock held */
+static ufb_err_t _ufb_screenshot_start_pool(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int i;
+
+	if( pool.started ) {
+		return UFB_OK;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	for( i = 0; i < pool.threads; i++ ) {
+		if( pthread_create(&thread, &attr, _ufb_screenshot_worker, NULL) ) {
+			break;
+		}
+	}
+
+	pthread_attr_destroy(&attr);
+
+	if( !i ) {
+		return UFB_ERR_NO_MEM;
+	}
+
+	pool.started = 1;
+
+	return UFB_OK;
+}
+
+ufb_err_t ufb_screenshot_pool_config(int threads, int max_queued)
+{
+	ufb_err_t err = UFB_OK;
+
+	if( threads < 1 || max_queued < 1 ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	if( pool.started ) {
+		err = UFB_ERR_BUSY;
+	} else {
+		pool.threads = threads;
+		pool.max_queued = max_queued;
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	return err;
+}
+
+void ufb_screenshot_set_rate(ufb_context_t *context, double max_per_second)
+{
+	if( max_per_second > 0 ) {
+		context->screenshot_interval = 1e9 / max_per_second;
+	} else {
+		context->screenshot_interval = 0;
+	}
+}
+
+ufb_err_t ufb_screenshot(ufb_context_t *context, ufb_image_format_t format,
+                         ufb_screenshot_cb callback, void *user)
+{
+	struct ufb_screenshot_request *request;
+	ufb_err_t err;
+
+	if( !context || !callback || format > UFB_IMAGE_PNG ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	if( context->screenshot_count == UFB_MAX_PENDING_SCREENSHOTS ) {
+		return UFB_ERR_BUSY;
+	}
+
+	if( context->screenshot_interval && context->screenshot_last &&
+	    ufb_now_ns() - context->screenshot_last < 
+	    context->screenshot_interval ) {
+		return UFB_ERR_BUSY;
+	}
+
+	/* reserve room in the pool now so a vblank never has to drop a frame */
+	pthread_mutex_lock(&pool.lock);
+	if( UFB_OK != (err = _ufb_screenshot_start_pool()) ) {
+		pthread_mutex_unlock(&pool.lock);
+		return err;
+	}
+	if( pool.reserved >= pool.max_queued ) {
+		pthread_mutex_unlock(&pool.lock);
+		return UFB_ERR_BUSY;
+	}
+	pool.reserved++;
+	pthread_mutex_unlock(&pool.lock);
+
+	request = &context->screenshots[context->screenshot_count++];
+	request->format = format;
+	request->callback = callback;
+	request->user = user;
+
+	return UFB_OK;
+}
+
+static uint8_t *_ufb_screenshot_copy(ufb_context_t *context, 
+                                     const ufb_scanout_t *scanout,
+                                     size_t pitch)
+{
+	ufb_region_t regions[2];
+	uint8_t *pixels;
+	int count, i, y;
+
+	if( !(pixels = malloc(pitch * scanout->height)) ) {
+		return NULL;
+	}
+
+	count = ufb_scanout_regions(scanout, regions);
+
+	for( i = 0; i < count; i++ ) {
+		const uint8_t *src = (const uint8_t *)context->vmem + 
+		                     regions[i].offset;
+
+		for( y = 0; y < regions[i].height; y++, src += scanout->pitch ) {
+			memcpy(pixels + (regions[i].y + y) * pitch, src, pitch);
+		}
+	}
+
+	return pixels;
+}
+
+void ufb_screenshot_vblank(ufb_context_t *context)
+{
+	struct ufb_screenshot_job *job;
+	ufb_scanout_t scanout;
+	size_t pitch;
+	int i;
+
+	if( UFB_OK != ufb_get_scanout(context, &scanout) ) {
+		memset(&scanout, 0, sizeof(scanout));
+		scanout.width = scanout.virtual_width = context->width;
+		scanout.height = scanout.virtual_height = context->height;
+		scanout.bpp = 32;
+		scanout.pitch = context->width * 4;
+	}
+
+	pitch = (size_t)scanout.width * scanout.bpp / 8;
+
+	for( i = 0; i < context->screenshot_count; i++ ) {
+		struct ufb_screenshot_request *request = &context->screenshots[i];
+
+		job = malloc(sizeof(*job));
+		if( job && !(job->pixels = _ufb_screenshot_copy(context, &scanout, 
+		                                                pitch)) ) {
+			free(job);
+			job = NULL;
+		}
+
+		if( !job ) {
+			ufb_screenshot_t shot;
+
+			memset(&shot, 0, sizeof(shot));
+			shot.status = UFB_ERR_NO_MEM;
+			shot.format = request->format;
+			request->callback(&shot, request->user);
+			_ufb_screenshot_release();
+			continue;
+		}
+
+		job->next = NULL;
+		job->request = *request;
+		job->width = scanout.width;
+		job->height = scanout.height;
+		job->bpp = scanout.bpp;
+		job->pitch = pitch;
+		job->timestamp = ufb_now_ns();
+
+		pthread_mutex_lock(&pool.lock);
+		if( pool.tail ) {
+			pool.tail->next = job;
+		} else {
+			pool.head = job;
+		}
+		pool.tail = job;
+		pthread_cond_signal(&pool.cond);
+		pthread_mutex_unlock(&pool.lock);
+	}
+
+	context->screenshot_count = 0;
+	context->screenshot_last = ufb_now_ns();
+}
+
+void ufb_screenshot_cancel(ufb_context_t *context)
+{
+	ufb_screenshot_t shot;
+	int i;
+
+	for( i = 0; i < context->screenshot_count; i++ ) {
+		struct ufb_screenshot_request *request = &context->screenshots[i];
+
+		memset(&shot, 0, sizeof(shot));
+		shot.status = UFB_ERR_CANCELLED;
+		shot.format = request->format;
+		request->callback(&shot, request->user);
+
+		_ufb_screenshot_release();
+	}
+
+	context->screenshot_count = 0;
+}
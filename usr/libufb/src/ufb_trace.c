@@ -0,0 +1,126 @@
+#include "ufb_internal.h"
+
+#include <sys/ioctl.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define TRACE_READ_SIZE (1024 * 1024)
+
+ufb_err_t ufb_trace_read(ufb_context_t *context, void *buf, size_t len,
+                         size_t *read_len, unsigned int *lost)
+{
+	struct ufb_trace_read req;
+	int ret;
+
+	if( !context || !buf || !read_len ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	req.buf = (uintptr_t)buf;
+	req.len = len;
+	req.lost = 0;
+
+	if( -1 == (ret = ioctl(context->fd, UFB_IOCTL_TRACE_READ, &req)) ) {
+		return UFB_ERR_IOCTL;
+	}
+
+	*read_len = ret;
+	if( lost ) {
+		*lost = req.lost;
+	}
+
+	return UFB_OK;
+}
+
+ufb_err_t ufb_trace_start(ufb_context_t *context, const char *filename,
+                          size_t buffer_size)
+{
+	struct ufb_trace_file_header header;
+	uint32_t size = buffer_size;
+
+	if( !context || !filename || context->trace_file ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	if( !(context->trace_buf = malloc(TRACE_READ_SIZE)) ) {
+		return UFB_ERR_NO_MEM;
+	}
+
+	if( !(context->trace_file = fopen(filename, "wb")) ) {
+		goto error_free;
+	}
+
+	header.magic = UFB_TRACE_MAGIC;
+	header.version = UFB_TRACE_VERSION;
+
+	if( 1 != fwrite(&header, sizeof(header), 1, context->trace_file) ) {
+		goto error_close;
+	}
+
+	if( -1 == ioctl(context->fd, UFB_IOCTL_TRACE_START, &size) ) {
+		fclose(context->trace_file);
+		context->trace_file = NULL;
+		free(context->trace_buf);
+		context->trace_buf = NULL;
+		return UFB_ERR_IOCTL;
+	}
+
+	return UFB_OK;
+
+error_close:
+	fclose(context->trace_file);
+	context->trace_file = NULL;
+error_free:
+	perror("UFB");
+	free(context->trace_buf);
+	context->trace_buf = NULL;
+	return UFB_ERR_TRACE_FILE;
+}
+
+ufb_err_t ufb_trace_flush(ufb_context_t *context)
+{
+	ufb_err_t err;
+	size_t len;
+	unsigned int lost;
+
+	if( !context || !context->trace_file ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	do {
+		err = ufb_trace_read(context, context->trace_buf, TRACE_READ_SIZE,
+		                     &len, &lost);
+		if( UFB_OK != err ) {
+			return err;
+		}
+
+		if( lost ) {
+			fprintf(stderr, "UFB:  trace buffer overflowed, %u records lost\n",
+			        lost);
+		}
+
+		if( len && 1 != fwrite(context->trace_buf, len, 1, 
+		                       context->trace_file) ) {
+			return UFB_ERR_TRACE_FILE;
+		}
+	} while( len );
+
+	return UFB_OK;
+}
+
+void ufb_trace_stop(ufb_context_t *context)
+{
+	if( !context || !context->trace_file ) {
+		return;
+	}
+
+	ufb_trace_flush(context);
+
+	ioctl(context->fd, UFB_IOCTL_TRACE_STOP);
+
+	fclose(context->trace_file);
+	context->trace_file = NULL;
+	free(context->trace_buf);
+	context->trace_buf = NULL;
+}
@@ -0,0 +1,897 @@
+#define _GNU_SOURCE
+
+#include "ufb_internal.h"
+#include "ufb_view.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_SCROLL_CANDIDATES 8
+#define MAX_MSG_BODY 64
+
+struct ufb_view_client {
+	struct ufb_view_client *next;
+	int fd;
+	int hello;
+	uint32_t flags;
+
+	/* an update was requested and not yet sent */
+	int requested;
+	int send_init;
+
+	/*
+	 * What the viewer is missing relative to the server's current frame:
+	 * the viewer's screen moved up by scroll lines, then the tiles marked
+	 * in dirty changed.
+	 */
+	int scroll;
+	uint8_t *dirty;
+
+	uint8_t in[sizeof(ufb_view_msg_t) + MAX_MSG_BODY];
+	size_t in_len;
+
+	uint8_t *out;
+	size_t out_len;
+	size_t out_pos;
+	size_t out_cap;
+};
+
+struct ufb_view_server {
+	ufb_context_t *context;
+	int listen_fd;
+	struct sockaddr_un addr;
+
+	int width;
+	int height;
+	int tiles_x;
+	int tiles_y;
+
+	uint32_t *cur;
+	uint32_t *prev;
+	uint64_t *cur_hash;
+	uint64_t *prev_hash;
+	int have_prev;
+
+	/* tiles that changed between prev and cur, after the scroll */
+	uint8_t *changed;
+	uint8_t *scratch;
+
+	uint64_t seq;
+
+	struct ufb_view_client *clients;
+	int client_count;
+
+	ufb_view_input_cb input_callback;
+	void *input_user;
+};
+
+static uint64_t _ufb_view_hash_row(const uint32_t *row, int width)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	int x;
+
+	for( x = 0; x < width; x++ ) {
+		hash = (hash ^ row[x]) * 0x100000001b3ull;
+	}
+
+	return hash;
+}
+
+static int _ufb_view_resize(ufb_view_server_t *server, int width, int height)
+{
+	size_t pixels = (size_t)width * height;
+	struct ufb_view_client *client;
+	int tiles;
+
+	free(server->cur);
+	free(server->prev);
+	free(server->cur_hash);
+	free(server->prev_hash);
+	free(server->changed);
+	free(server->scratch);
+
+	server->width = width;
+	server->height = height;
+	server->tiles_x = (width + UFB_VIEW_TILE_SIZE - 1) / UFB_VIEW_TILE_SIZE;
+	server->tiles_y = (height + UFB_VIEW_TILE_SIZE - 1) / UFB_VIEW_TILE_SIZE;
+	server->have_prev = 0;
+
+	tiles = server->tiles_x * server->tiles_y;
+
+	server->cur = malloc(pixels * 4);
+	server->prev = malloc(pixels * 4);
+	server->cur_hash = malloc(height * sizeof(uint64_t));
+	server->prev_hash = malloc(height * sizeof(uint64_t));
+	server->changed = malloc(tiles);
+	server->scratch = malloc(tiles);
+
+	for( client = server->clients; client; client = client->next ) {
+		free(client->dirty);
+		client->dirty = malloc(tiles);
+		if( client->dirty ) {
+			memset(client->dirty, 1, tiles);
+		}
+		client->scroll = 0;
+		client->send_init = 1;
+	}
+
+	return server->cur && server->prev && server->cur_hash &&
+	       server->prev_hash && server->changed && server->scratch;
+}
+
+/* copies the visible screen out of vmem as packed ARGB8888 */
+static int _ufb_view_capture(ufb_view_server_t *server)
+{
+	ufb_context_t *context = server->context;
+	ufb_scanout_t scanout;
+	ufb_region_t regions[2];
+	int count, i, x, y;
+
+	if( UFB_OK != ufb_get_scanout(context, &scanout) ) {
+		memset(&scanout, 0, sizeof(scanout));
+		scanout.width = scanout.virtual_width = context->width;
+		scanout.height = scanout.virtual_height = context->height;
+		scanout.bpp = 32;
+		scanout.pitch = context->width * 4;
+	}
+
+	if( scanout.bpp != 32 && scanout.bpp != 16 ) {
+		return 0;
+	}
+
+	if( scanout.width != server->width || scanout.height != server->height ) {
+		if( !_ufb_view_resize(server, scanout.width, scanout.height) ) {
+			return 0;
+		}
+	}
+
+	count = ufb_scanout_regions(&scanout, regions);
+
+	for( i = 0; i < count; i++ ) {
+		const uint8_t *src = (const uint8_t *)context->vmem +
+		                     regions[i].offset;
+
+		for( y = 0; y < regions[i].height; y++, src += scanout.pitch ) {
+			uint32_t *dst = server->cur +
+			                (size_t)(regions[i].y + y) * server->width;
+
+			if( scanout.bpp == 32 ) {
+				memcpy(dst, src, server->width * 4);
+			} else {
+				const uint16_t *p = (const uint16_t *)src;
+
+				for( x = 0; x < server->width; x++ ) {
+					uint32_t r = (p[x] >> 11) & 0x1f;
+					uint32_t g = (p[x] >> 5) & 0x3f;
+					uint32_t b = p[x] & 0x1f;
+
+					dst[x] = 0xff000000 | (r * 255 / 31) << 16 |
+					         (g * 255 / 63) << 8 | (b * 255 / 31);
+				}
+			}
+		}
+	}
+
+	for( y = 0; y < server->height; y++ ) {
+		server->cur_hash[y] = _ufb_view_hash_row(server->cur +
+		                      (size_t)y * server->width, server->width);
+	}
+
+	return 1;
+}
+
+static int _ufb_view_scroll_matches(ufb_view_server_t *server, int d)
+{
+	int matches = 0;
+	int y;
+
+	for( y = 0; y < server->height; y++ ) {
+		if( y + d >= 0 && y + d < server->height &&
+		    server->cur_hash[y] == server->prev_hash[y + d] ) {
+			matches++;
+		}
+	}
+
+	return matches;
+}
+
+/*
+ * Finds d such that most rows satisfy cur[y] == prev[y + d], i.e. the
+ * screen scrolled up by d lines (down if negative).  Candidates come from
+ * where the first changed row's content can be found in the last frame.
+ */
+static int _ufb_view_detect_scroll(ufb_view_server_t *server)
+{
+	int h = server->height;
+	int y0, y, tried;
+	int best = 0;
+	int best_matches;
+
+	for( y0 = 0; y0 < h; y0++ ) {
+		if( server->cur_hash[y0] != server->prev_hash[y0] ) {
+			break;
+		}
+	}
+	if( y0 == h ) {
+		return 0;
+	}
+
+	best_matches = _ufb_view_scroll_matches(server, 0);
+
+	for( y = y0 + 1, tried = 0;
+	     y < h && y - y0 <= h / 2 && tried < MAX_SCROLL_CANDIDATES; y++ ) {
+		if( server->prev_hash[y] == server->cur_hash[y0] ) {
+			int matches = _ufb_view_scroll_matches(server, y - y0);
+
+			if( matches > best_matches ) {
+				best = y - y0;
+				best_matches = matches;
+			}
+			tried++;
+		}
+	}
+
+	for( y = y0 - 1, tried = 0;
+	     y >= 0 && y0 - y <= h / 2 && tried < MAX_SCROLL_CANDIDATES; y-- ) {
+		if( server->prev_hash[y] == server->cur_hash[y0] ) {
+			int matches = _ufb_view_scroll_matches(server, y - y0);
+
+			if( matches > best_matches ) {
+				best = y - y0;
+				best_matches = matches;
+			}
+			tried++;
+		}
+	}
+
+	/* only worth a copy if it explains most of the screen */
+	if( best_matches < h / 2 ) {
+		return 0;
+	}
+
+	return best;
+}
+
+/* marks tiles of cur that differ from prev shifted by d */
+static void _ufb_view_find_changes(ufb_view_server_t *server, int d)
+{
+	int T = UFB_VIEW_TILE_SIZE;
+	int tx, y;
+
+	memset(server->changed, 0, server->tiles_x * server->tiles_y);
+
+	for( y = 0; y < server->height; y++ ) {
+		uint8_t *changed = server->changed + (y / T) * server->tiles_x;
+		const uint32_t *cur = server->cur + (size_t)y * server->width;
+		const uint32_t *prev;
+
+		if( y + d < 0 || y + d >= server->height ) {
+			memset(changed, 1, server->tiles_x);
+			continue;
+		}
+
+		prev = server->prev + (size_t)(y + d) * server->width;
+
+		if( server->cur_hash[y] == server->prev_hash[y + d] &&
+		    !memcmp(cur, prev, server->width * 4) ) {
+			continue;
+		}
+
+		for( tx = 0; tx < server->tiles_x; tx++ ) {
+			int x = tx * T;
+			int w = server->width - x < T ? server->width - x : T;
+
+			if( !changed[tx] && memcmp(cur + x, prev + x, w * 4) ) {
+				changed[tx] = 1;
+			}
+		}
+	}
+}
+
+/* folds this frame's scroll d and changes into what the viewer is missing */
+static void _ufb_view_accumulate(ufb_view_server_t *server,
+                                 struct ufb_view_client *client, int d)
+{
+	int T = UFB_VIEW_TILE_SIZE;
+	int tiles = server->tiles_x * server->tiles_y;
+	int ty, tx, i;
+
+	if( d ) {
+		uint8_t *shifted = server->scratch;
+
+		memcpy(shifted, server->changed, tiles);
+
+		/* old dirty tiles move up by d, touching up to two tile rows */
+		for( ty = 0; ty < server->tiles_y; ty++ ) {
+			int top = ty * T - d;
+			int bottom = top + T - 1;
+			int t0 = top < 0 ? 0 : top / T;
+			int t1 = bottom >= server->height ? server->tiles_y - 1 :
+			         bottom / T;
+
+			if( bottom < 0 || top >= server->height ) {
+				continue;
+			}
+
+			for( tx = 0; tx < server->tiles_x; tx++ ) {
+				if( client->dirty[ty * server->tiles_x + tx] ) {
+					for( i = t0; i <= t1; i++ ) {
+						shifted[i * server->tiles_x + tx] = 1;
+					}
+				}
+			}
+		}
+
+		memcpy(client->dirty, shifted, tiles);
+
+		client->scroll += d;
+		if( client->scroll >= server->height ||
+		    -client->scroll >= server->height ) {
+			client->scroll = 0;
+			memset(client->dirty, 1, tiles);
+		}
+	} else {
+		for( i = 0; i < tiles; i++ ) {
+			client->dirty[i] |= server->changed[i];
+		}
+	}
+}
+
+static int _ufb_view_reserve(struct ufb_view_client *client, size_t len)
+{
+	uint8_t *out;
+	size_t cap;
+
+	if( client->out_len + len <= client->out_cap ) {
+		return 1;
+	}
+
+	cap = client->out_cap ? client->out_cap : 64 * 1024;
+	while( cap < client->out_len + len ) {
+		cap *= 2;
+	}
+
+	if( !(out = realloc(client->out, cap)) ) {
+		return 0;
+	}
+
+	client->out = out;
+	client->out_cap = cap;
+
+	return 1;
+}
+
+static void _ufb_view_append(struct ufb_view_client *client, const void *data,
+                             size_t len)
+{
+	memcpy(client->out + client->out_len, data, len);
+	client->out_len += len;
+}
+
+static int _ufb_view_send_init(ufb_view_server_t *server,
+                               struct ufb_view_client *client)
+{
+	ufb_view_msg_t msg;
+	ufb_view_init_t init;
+
+	if( !_ufb_view_reserve(client, sizeof(msg) + sizeof(init)) ) {
+		return 0;
+	}
+
+	msg.type = UFB_VIEW_INIT;
+	msg.length = sizeof(init);
+	init.width = server->width;
+	init.height = server->height;
+	init.bpp = 32;
+	init.tile_size = UFB_VIEW_TILE_SIZE;
+
+	_ufb_view_append(client, &msg, sizeof(msg));
+	_ufb_view_append(client, &init, sizeof(init));
+
+	client->send_init = 0;
+
+	return 1;
+}
+
+static int _ufb_view_encode_tile(ufb_view_server_t *server,
+                                 struct ufb_view_client *client,
+                                 int x, int y, int w, int h)
+{
+	ufb_view_rect_t rect;
+	const uint32_t *row;
+	uint32_t color = server->cur[(size_t)y * server->width + x];
+	size_t raw_len = (size_t)w * h * 4;
+	size_t runs = 1;
+	int solid = 1;
+	int i, j;
+
+	rect.reserved = 0;
+	rect.x = x;
+	rect.y = y;
+	rect.w = w;
+	rect.h = h;
+
+	for( j = 0; j < h; j++ ) {
+		row = server->cur + (size_t)(y + j) * server->width + x;
+		for( i = 0; i < w; i++ ) {
+			if( row[i] != color ) {
+				solid = 0;
+				runs++;
+				color = row[i];
+			}
+		}
+	}
+
+	if( solid ) {
+		rect.encoding = UFB_VIEW_ENC_SOLID;
+		rect.length = sizeof(color);
+		if( !_ufb_view_reserve(client, sizeof(rect) + rect.length) ) {
+			return 0;
+		}
+		_ufb_view_append(client, &rect, sizeof(rect));
+		_ufb_view_append(client, &color, sizeof(color));
+		return 1;
+	}
+
+	if( (client->flags & UFB_VIEW_COMPRESS) &&
+	    runs * sizeof(ufb_view_run_t) < raw_len ) {
+		ufb_view_run_t run;
+
+		rect.encoding = UFB_VIEW_ENC_RLE;
+		rect.length = runs * sizeof(run);
+		if( !_ufb_view_reserve(client, sizeof(rect) + rect.length) ) {
+			return 0;
+		}
+		_ufb_view_append(client, &rect, sizeof(rect));
+
+		run.color = server->cur[(size_t)y * server->width + x];
+		run.count = 0;
+		for( j = 0; j < h; j++ ) {
+			row = server->cur + (size_t)(y + j) * server->width + x;
+			for( i = 0; i < w; i++ ) {
+				if( row[i] != run.color ) {
+					_ufb_view_append(client, &run, sizeof(run));
+					run.color = row[i];
+					run.count = 0;
+				}
+				run.count++;
+			}
+		}
+		_ufb_view_append(client, &run, sizeof(run));
+		return 1;
+	}
+
+	rect.encoding = UFB_VIEW_ENC_RAW;
+	rect.length = raw_len;
+	if( !_ufb_view_reserve(client, sizeof(rect) + rect.length) ) {
+		return 0;
+	}
+	_ufb_view_append(client, &rect, sizeof(rect));
+	for( j = 0; j < h; j++ ) {
+		row = server->cur + (size_t)(y + j) * server->width + x;
+		_ufb_view_append(client, row, w * 4);
+	}
+
+	return 1;
+}
+
+static int _ufb_view_send_frame(ufb_view_server_t *server,
+                                struct ufb_view_client *client)
+{
+	int T = UFB_VIEW_TILE_SIZE;
+	ufb_view_msg_t msg;
+	ufb_view_frame_t frame;
+	size_t start;
+	int tx, ty;
+
+	if( client->send_init && !_ufb_view_send_init(server, client) ) {
+		return 0;
+	}
+
+	start = client->out_len;
+	if( !_ufb_view_reserve(client, sizeof(msg) + sizeof(frame)) ) {
+		return 0;
+	}
+	client->out_len += sizeof(msg) + sizeof(frame);
+
+	frame.seq = server->seq;
+	frame.rects = 0;
+	frame.reserved = 0;
+
+	if( client->scroll ) {
+		ufb_view_rect_t rect;
+		ufb_view_copy_t copy;
+		int d = client->scroll;
+
+		rect.encoding = UFB_VIEW_ENC_COPY;
+		rect.reserved = 0;
+		rect.length = sizeof(copy);
+		rect.x = 0;
+		rect.w = server->width;
+		rect.h = server->height - (d > 0 ? d : -d);
+		rect.y = d > 0 ? 0 : -d;
+		copy.sx = 0;
+		copy.sy = d > 0 ? d : 0;
+
+		if( !_ufb_view_reserve(client, sizeof(rect) + sizeof(copy)) ) {
+			return 0;
+		}
+		_ufb_view_append(client, &rect, sizeof(rect));
+		_ufb_view_append(client, &copy, sizeof(copy));
+		frame.rects++;
+
+		client->scroll = 0;
+	}
+
+	for( ty = 0; ty < server->tiles_y; ty++ ) {
+		for( tx = 0; tx < server->tiles_x; tx++ ) {
+			int x = tx * T;
+			int y = ty * T;
+			int w = server->width - x < T ? server->width - x : T;
+			int h = server->height - y < T ? server->height - y : T;
+
+			if( !client->dirty[ty * server->tiles_x + tx] ) {
+				continue;
+			}
+
+			if( !_ufb_view_encode_tile(server, client, x, y, w, h) ) {
+				return 0;
+			}
+			frame.rects++;
+			client->dirty[ty * server->tiles_x + tx] = 0;
+		}
+	}
+
+	msg.type = UFB_VIEW_FRAME;
+	msg.length = client->out_len - start - sizeof(msg);
+	memcpy(client->out + start, &msg, sizeof(msg));
+	memcpy(client->out + start + sizeof(msg), &frame, sizeof(frame));
+
+	client->requested = 0;
+
+	return 1;
+}
+
+static void _ufb_view_drop_client(ufb_view_server_t *server,
+                                  struct ufb_view_client *client)
+{
+	struct ufb_view_client **p;
+
+	for( p = &server->clients; *p; p = &(*p)->next ) {
+		if( *p == client ) {
+			*p = client->next;
+			break;
+		}
+	}
+
+	close(client->fd);
+	free(client->dirty);
+	free(client->out);
+	free(client);
+
+	server->client_count--;
+}
+
+static void _ufb_view_accept(ufb_view_server_t *server)
+{
+	struct ufb_view_client *client;
+	int fd;
+
+	while( -1 != (fd = accept4(server->listen_fd, NULL, NULL,
+	                           SOCK_NONBLOCK | SOCK_CLOEXEC)) ) {
+		client = calloc(1, sizeof(*client));
+		if( !client ) {
+			close(fd);
+			continue;
+		}
+
+		client->fd = fd;
+		client->next = server->clients;
+		server->clients = client;
+		server->client_count++;
+	}
+}
+
+static int _ufb_view_handle_msg(ufb_view_server_t *server,
+                                struct ufb_view_client *client,
+                                const ufb_view_msg_t *msg, const void *body)
+{
+	ufb_view_input_t input;
+
+	switch( msg->type ) {
+		case UFB_VIEW_HELLO: {
+			const ufb_view_hello_t *hello = body;
+			int tiles = server->tiles_x * server->tiles_y;
+
+			if( msg->length < sizeof(*hello) ||
+			    hello->version != UFB_VIEW_VERSION || client->hello ) {
+				return 0;
+			}
+
+			client->hello = 1;
+			client->flags = hello->flags;
+			client->send_init = 1;
+			client->scroll = 0;
+			free(client->dirty);
+			client->dirty = NULL;
+			if( tiles ) {
+				if( !(client->dirty = malloc(tiles)) ) {
+					return 0;
+				}
+				memset(client->dirty, 1, tiles);
+			}
+		}
+		break;
+
+		case UFB_VIEW_REQUEST: {
+			const ufb_view_request_t *request = body;
+
+			if( msg->length < sizeof(*request) || !client->hello ) {
+				return 0;
+			}
+
+			if( !request->incremental && client->dirty ) {
+				memset(client->dirty, 1, server->tiles_x * server->tiles_y);
+				client->scroll = 0;
+			}
+
+			client->requested = 1;
+		}
+		break;
+
+		case UFB_VIEW_KEY: {
+			const ufb_view_key_t *key = body;
+
+			if( msg->length < sizeof(*key) ) {
+				return 0;
+			}
+
+			if( server->input_callback ) {
+				memset(&input, 0, sizeof(input));
+				input.type = UFB_VIEW_INPUT_KEY;
+				input.keysym = key->keysym;
+				input.down = key->down;
+				server->input_callback(&input, server->input_user);
+			}
+		}
+		break;
+
+		case UFB_VIEW_POINTER: {
+			const ufb_view_pointer_t *pointer = body;
+
+			if( msg->length < sizeof(*pointer) ) {
+				return 0;
+			}
+
+			if( server->input_callback ) {
+				memset(&input, 0, sizeof(input));
+				input.type = UFB_VIEW_INPUT_POINTER;
+				input.x = pointer->x;
+				input.y = pointer->y;
+				input.buttons = pointer->buttons;
+				server->input_callback(&input, server->input_user);
+			}
+		}
+		break;
+
+		default:
+			return 0;
+	}
+
+	return 1;
+}
+
+/* returns 0 if the client should be dropped */
+static int _ufb_view_read(ufb_view_server_t *server,
+                          struct ufb_view_client *client)
+{
+	ssize_t ret;
+
+	while( 1 ) {
+		ret = recv(client->fd, client->in + client->in_len,
+		           sizeof(client->in) - client->in_len, 0);
+		if( ret == 0 ) {
+			return 0;
+		}
+		if( ret < 0 ) {
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		}
+
+		client->in_len += ret;
+
+		while( client->in_len >= sizeof(ufb_view_msg_t) ) {
+			ufb_view_msg_t msg;
+			size_t len;
+
+			memcpy(&msg, client->in, sizeof(msg));
+			if( msg.length > MAX_MSG_BODY ) {
+				return 0;
+			}
+
+			len = sizeof(msg) + msg.length;
+			if( client->in_len < len ) {
+				break;
+			}
+
+			if( !_ufb_view_handle_msg(server, client, &msg,
+			                          client->in + sizeof(msg)) ) {
+				return 0;
+			}
+
+			memmove(client->in, client->in + len, client->in_len - len);
+			client->in_len -= len;
+		}
+	}
+}
+
+/* returns 0 if the client should be dropped */
+static int _ufb_view_flush(struct ufb_view_client *client)
+{
+	ssize_t ret;
+
+	while( client->out_pos < client->out_len ) {
+		ret = send(client->fd, client->out + client->out_pos,
+		           client->out_len - client->out_pos, MSG_NOSIGNAL);
+		if( ret < 0 ) {
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		}
+		client->out_pos += ret;
+	}
+
+	client->out_pos = 0;
+	client->out_len = 0;
+
+	return 1;
+}
+
+ufb_err_t ufb_view_server_create(ufb_view_server_t **server_ptr,
+                                 ufb_context_t *context, const char *path)
+{
+	ufb_view_server_t *server;
+
+	if( !server_ptr || !context || !path ||
+	    strlen(path) >= sizeof(server->addr.sun_path) ) {
+		return UFB_ERR_INVALID_PARAM;
+	}
+
+	*server_ptr = NULL;
+
+	if( !(server = calloc(1, sizeof(*server))) ) {
+		return UFB_ERR_NO_MEM;
+	}
+
+	server->context = context;
+	server->addr.sun_family = AF_UNIX;
+	strcpy(server->addr.sun_path, path);
+
+	server->listen_fd = socket(AF_UNIX,
+	                           SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if( -1 == server->listen_fd ) {
+		goto error;
+	}
+
+	unlink(path);
+
+	if( -1 == bind(server->listen_fd, (struct sockaddr *)&server->addr,
+	               sizeof(server->addr)) ||
+	    -1 == listen(server->listen_fd, 64) ) {
+		close(server->listen_fd);
+		goto error;
+	}
+
+	*server_ptr = server;
+
+	return UFB_OK;
+
+error:
+	perror("UFB");
+	free(server);
+	return UFB_ERR_SOCKET;
+}
+
+void ufb_view_server_update(ufb_view_server_t *server)
+{
+	struct ufb_view_client *client, *next;
+	int d = 0;
+	void *swap;
+
+	_ufb_view_accept(server);
+
+	for( client = server->clients; client; client = next ) {
+		next = client->next;
+		if( !_ufb_view_read(server, client) ) {
+			_ufb_view_drop_client(server, client);
+		}
+	}
+
+	if( !server->clients ) {
+		/* nobody to diff for, start over when someone connects */
+		server->have_prev = 0;
+		return;
+	}
+
+	if( !_ufb_view_capture(server) ) {
+		return;
+	}
+
+	server->seq++;
+
+	if( server->have_prev ) {
+		d = _ufb_view_detect_scroll(server);
+		_ufb_view_find_changes(server, d);
+	} else {
+		memset(server->changed, 1, server->tiles_x * server->tiles_y);
+	}
+
+	for( client = server->clients; client; client = next ) {
+		next = client->next;
+
+		if( !client->hello || !client->dirty ) {
+			continue;
+		}
+
+		_ufb_view_accumulate(server, client, server->have_prev ? d : 0);
+
+		/* only one frame in flight per viewer, the rest coalesces */
+		if( client->requested && client->out_len == 0 &&
+		    !_ufb_view_send_frame(server, client) ) {
+			_ufb_view_drop_client(server, client);
+			continue;
+		}
+
+		if( !_ufb_view_flush(client) ) {
+			_ufb_view_drop_client(server, client);
+		}
+	}
+
+	swap = server->prev;
+	server->prev = server->cur;
+	server->cur = swap;
+
+	swap = server->prev_hash;
+	server->prev_hash = server->cur_hash;
+	server->cur_hash = swap;
+
+	server->have_prev = 1;
+}
+
+void ufb_view_server_set_input_callback(ufb_view_server_t *server,
+                                        ufb_view_input_cb callback,
+                                        void *user)
+{
+	server->input_callback = callback;
+	server->input_user = user;
+}
+
+int ufb_view_server_viewer_count(ufb_view_server_t *server)
+{
+	return server->client_count;
+}
+
+void ufb_view_server_free(ufb_view_server_t *server)
+{
+	if( !server ) {
+		return;
+	}
+
+	while( server->clients ) {
+		_ufb_view_drop_client(server, server->clients);
+	}
+
+	close(server->listen_fd);
+	unlink(server->addr.sun_path);
+
+	free(server->cur);
+	free(server->prev);
+	free(server->cur_hash);
+	free(server->prev_hash);
+	free(server->changed);
+	free(server->scratch);
+	free(server);
+}
@@ -0,0 +1,239 @@
+#include "ufb_internal.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define UFB_HAVE_AVX2_PATHS
+#endif
+
+/*
+ * YUV to ARGB8888 for FOURCC modes, see ufb_ioctl.h for how the planes
+ * sit in vmem.  BT.601 limited range, in the usual 8 bit fixed point:
+ *
+ *   R = (298 (Y - 16)                 + 409 (V - 128) + 128) >> 8
+ *   G = (298 (Y - 16) - 100 (U - 128) - 208 (V - 128) + 128) >> 8
+ *   B = (298 (Y - 16) + 516 (U - 128)                 + 128) >> 8
+ *
+ * Chroma is shared by each pair of pixels, and for the planar formats
+ * by each pair of lines as well.
+ */
+
+static inline uint32_t _ufb_yuv_clamp(int v)
+{
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static inline uint32_t _ufb_yuv_pixel(int y, int u, int v)
+{
+	int c = 298 * (y - 16) + 128;
+	int d = u - 128;
+	int e = v - 128;
+
+	return 0xff000000u |
+	       _ufb_yuv_clamp((c + 409 * e) >> 8) << 16 |
+	       _ufb_yuv_clamp((c - 100 * d - 208 * e) >> 8) << 8 |
+	       _ufb_yuv_clamp((c + 516 * d) >> 8);
+}
+
+/*
+ * One line, whatever the layout:  luma every y_step bytes, chroma every
+ * c_step bytes for each pair of pixels.
+ */
+static void _ufb_yuv_row(const uint8_t *y, int y_step, const uint8_t *u,
+                         const uint8_t *v, int c_step, uint32_t *dst,
+                         int width)
+{
+	int x;
+
+	for( x = 0; x < width; x++ ) {
+		int c = (x >> 1) * c_step;
+
+		dst[x] = _ufb_yuv_pixel(y[x * y_step], u[c], v[c]);
+	}
+}
+
+static void _ufb_luma_row(const uint8_t *y, uint32_t *dst, int width)
+{
+	int x;
+
+	for( x = 0; x < width; x++ ) {
+		dst[x] = _ufb_yuv_pixel(y[x], 128, 128);
+	}
+}
+
+#ifdef UFB_HAVE_AVX2_PATHS
+
+/* eight pixels, each channel in a 32 bit lane */
+__attribute__((target("avx2")))
+static inline __m256i _ufb_yuv_pixels_avx2(__m256i y, __m256i u, __m256i v)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i max = _mm256_set1_epi32(255);
+	const __m256i bias = _mm256_set1_epi32(128);
+	__m256i c, d, e, r, g, b;
+
+	c = _mm256_add_epi32(_mm256_mullo_epi32(
+	        _mm256_sub_epi32(y, _mm256_set1_epi32(16)),
+	        _mm256_set1_epi32(298)), bias);
+	d = _mm256_sub_epi32(u, bias);
+	e = _mm256_sub_epi32(v, bias);
+
+	r = _mm256_add_epi32(c, _mm256_mullo_epi32(e, _mm256_set1_epi32(409)));
+	g = _mm256_sub_epi32(c, _mm256_add_epi32(
+	        _mm256_mullo_epi32(d, _mm256_set1_epi32(100)),
+	        _mm256_mullo_epi32(e, _mm256_set1_epi32(208))));
+	b = _mm256_add_epi32(c, _mm256_mullo_epi32(d, _mm256_set1_epi32(516)));
+
+	r = _mm256_min_epi32(_mm256_max_epi32(_mm256_srai_epi32(r, 8), zero), max);
+	g = _mm256_min_epi32(_mm256_max_epi32(_mm256_srai_epi32(g, 8), zero), max);
+	b = _mm256_min_epi32(_mm256_max_epi32(_mm256_srai_epi32(b, 8), zero), max);
+
+	return _mm256_or_si256(_mm256_set1_epi32(0xff000000u),
+	         _mm256_or_si256(_mm256_slli_epi32(r, 16),
+	           _mm256_or_si256(_mm256_slli_epi32(g, 8), b)));
+}
+
+/* I420:  four U and four V bytes, each spread over two lanes */
+__attribute__((target("avx2")))
+static int _ufb_convert_i420_avx2(const uint8_t *y, const uint8_t *u,
+                                  const uint8_t *v, uint32_t *dst, int width)
+{
+	const __m256i pairs = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+	int x;
+
+	for( x = 0; x + 8 <= width; x += 8 ) {
+		uint32_t u4, v4;
+		__m256i yy, uu, vv;
+
+		memcpy(&u4, u + x / 2, sizeof(u4));
+		memcpy(&v4, v + x / 2, sizeof(v4));
+
+		yy = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(y + x)));
+		uu = _mm256_permutevar8x32_epi32(
+		       _mm256_cvtepu8_epi32(_mm_cvtsi32_si128(u4)), pairs);
+		vv = _mm256_permutevar8x32_epi32(
+		       _mm256_cvtepu8_epi32(_mm_cvtsi32_si128(v4)), pairs);
+
+		_mm256_storeu_si256((__m256i *)(dst + x),
+		                    _ufb_yuv_pixels_avx2(yy, uu, vv));
+	}
+
+	return x;
+}
+
+/* NV12:  eight bytes of interleaved UV, split into even and odd lanes */
+__attribute__((target("avx2")))
+static int _ufb_convert_nv12_avx2(const uint8_t *y, const uint8_t *uv,
+                                  uint32_t *dst, int width)
+{
+	const __m256i even = _mm256_setr_epi32(0, 0, 2, 2, 4, 4, 6, 6);
+	const __m256i odd = _mm256_setr_epi32(1, 1, 3, 3, 5, 5, 7, 7);
+	int x;
+
+	for( x = 0; x + 8 <= width; x += 8 ) {
+		__m256i yy, c;
+
+		yy = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(y + x)));
+		c = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(uv + x)));
+
+		_mm256_storeu_si256((__m256i *)(dst + x),
+		                    _ufb_yuv_pixels_avx2(yy,
+		                      _mm256_permutevar8x32_epi32(c, even),
+		                      _mm256_permutevar8x32_epi32(c, odd)));
+	}
+
+	return x;
+}
+
+/* YUYV:  each 32 bits is Y0 U Y1 V, for two pixels */
+__attribute__((target("avx2")))
+static int _ufb_convert_yuyv_avx2(const uint8_t *src, uint32_t *dst,
+                                  int width)
+{
+	const __m256i pairs = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+	const __m256i low = _mm256_set1_epi32(0xff);
+	int x;
+
+	for( x = 0; x + 8 <= width; x += 8 ) {
+		__m128i p = _mm_loadu_si128((const __m128i *)(src + x * 2));
+		__m256i yy, c;
+
+		yy = _mm256_cvtepu16_epi32(_mm_and_si128(p, _mm_set1_epi16(0xff)));
+		c = _mm256_permutevar8x32_epi32(_mm256_castsi128_si256(p), pairs);
+
+		_mm256_storeu_si256((__m256i *)(dst + x),
+		                    _ufb_yuv_pixels_avx2(yy,
+		                      _mm256_and_si256(_mm256_srli_epi32(c, 8), low),
+		                      _mm256_srli_epi32(c, 24)));
+	}
+
+	return x;
+}
+
+#endif
+
+/*
+ * A line of vmem as ufb_convert_rows() sees it.  That's all of it for
+ * YUYV;  the planar formats' chroma is elsewhere, so only their luma
+ * shows, in gray.
+ */
+void ufb_yuv_convert_row(uint32_t fourcc, const uint8_t *src, uint32_t *dst,
+                         int width)
+{
+	int done = 0;
+
+	if( fourcc != UFB_FOURCC_YUYV ) {
+		_ufb_luma_row(src, dst, width);
+		return;
+	}
+
+#ifdef UFB_HAVE_AVX2_PATHS
+	if( ufb_have_avx2() ) {
+		done = _ufb_convert_yuyv_avx2(src, dst, width);
+	}
+#endif
+	_ufb_yuv_row(src + done * 2, 2, src + done * 2 + 1, src + done * 2 + 3,
+	             4, dst + done, width - done);
+}
+
+/* the visible screen of a planar mode, which never pans */
+void ufb_yuv_convert_planes(const ufb_scanout_t *scanout, const uint8_t *vmem,
+                            uint32_t *dst, size_t dst_pitch)
+{
+	const uint8_t *chroma = vmem + scanout->pitch * scanout->virtual_height;
+	size_t c_pitch = scanout->pitch;
+	size_t v_offset = 0;
+	int row;
+
+	if( scanout->fourcc == UFB_FOURCC_I420 ) {
+		c_pitch = scanout->pitch / 2;
+		v_offset = c_pitch * (scanout->virtual_height / 2);
+	}
+
+	for( row = 0; row < scanout->height; row++,
+	     dst = (uint32_t *)((uint8_t *)dst + dst_pitch) ) {
+		const uint8_t *y = vmem + scanout->pitch * row;
+		const uint8_t *c = chroma + c_pitch * (row / 2);
+		int done = 0;
+
+		if( scanout->fourcc == UFB_FOURCC_NV12 ) {
+#ifdef UFB_HAVE_AVX2_PATHS
+			if( ufb_have_avx2() ) {
+				done = _ufb_convert_nv12_avx2(y, c, dst, scanout->width);
+			}
+#endif
+			_ufb_yuv_row(y + done, 1, c + done, c + done + 1, 2, dst + done,
+			             scanout->width - done);
+		} else {
+#ifdef UFB_HAVE_AVX2_PATHS
+			if( ufb_have_avx2() ) {
+				done = _ufb_convert_i420_avx2(y, c, c + v_offset, dst,
+				                              scanout->width);
+			}
+#endif
+			_ufb_yuv_row(y + done, 1, c + done / 2, c + v_offset + done / 2,
+			             1, dst + done, scanout->width - done);
+		}
+	}
+}
@@ -1,22 +1,65 @@
 #include <SDL2/SDL.h>
+#include <SDL2/SDL_syswm.h>
 
+#include <errno.h>
+#include <poll.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 #include "ufb.h"
+#include "ufb_metrics.h"
+#include "ufb_pyramid.h"
+#include "ufb_view.h"
 
 #define WIDTH  (640)
 #define HEIGHT (480)
 
-#define SCREEN_SIZE (WIDTH * HEIGHT * sizeof(uint32_t))
-#define SCREEN_PITCH (WIDTH * sizeof(uint32_t))
+#define SCREEN_SIZE (screenWidth * screenHeight * sizeof(uint32_t))
+#define SCREEN_PITCH (screenWidth * sizeof(uint32_t))
 
 #define VMEM_SIZE (10 * 1024 * 1024)
 
+#define TRACE_SIZE (32 * 1024 * 1024)
+
+#define METRICS_FILE_INTERVAL 1000000000ull
+
+/* how often a blanked daemon looks at the window when SDL has no fd */
+#define BLANK_POLL_MS 1000
+
+/* down to 1/8;  mapped drawing isn't reported, so redo it all each second */
+#define PYRAMID_LEVELS 3
+#define PYRAMID_REFRESH_MS 1000
+
 ufb_context_t *ufb;
+ufb_view_server_t *viewServer;
+ufb_pyramid_t *pyramid;
+ufb_metrics_t *metrics;
+
+/* this frame's work, observed once it's presented */
+uint64_t frameConvert;
+uint64_t frameUpload;
+uint64_t frameBytes;
+
+int screenWidth = WIDTH;
+int screenHeight = HEIGHT;
+
+/*
+ * Frames only upload what was damaged, unless the texture has to be
+ * filled in afresh:  to begin with, after a colormap change, resize or
+ * unblank, or when the scanout differs from the one it shows.
+ */
+ufb_scanout_t shownScanout;
+int uploadAll = 1;
+
+/* -s:  vmem as mapped here is the frame at the last vblank */
+int snapshot;
 
 SDL_Texture *texture;
+SDL_Texture *cursorTexture;
+ufb_cursor_event_t cursor;
+uint32_t cursorSeq;
 SDL_Window *displayWindow;
 SDL_Renderer *displayRenderer;
 
@@ -25,21 +68,471 @@ void setData( uint8_t value )
 	memset(ufb_get_vmem(ufb), value, SCREEN_SIZE);
 }
 
+/* somewhere to convert size pixels to */
+uint32_t *convertBuffer( size_t size )
+{
+	static uint32_t *converted;
+	static size_t convertedSize;
+
+	if( size > convertedSize ) {
+		uint32_t *grown = realloc(converted, size * sizeof(*converted));
+
+		if( !grown ) {
+			return NULL;
+		}
+		converted = grown;
+		convertedSize = size;
+	}
+
+	return converted;
+}
+
+/*
+ * Palette and gamma modes need vmem translated on the way to the texture;
+ * truecolor goes straight up.
+ */
+void updateTexture( const SDL_Rect *rect, const uint8_t *pixels, int pitch )
+{
+	uint32_t *converted;
+	size_t size = (size_t)rect->w * rect->h;
+	uint64_t start = ufb_metrics_clock();
+	uint64_t converted_at;
+
+	frameBytes += size * sizeof(uint32_t);
+
+	if( !ufb_needs_conversion(ufb) ) {
+		SDL_UpdateTexture(texture, rect, pixels, pitch);
+		frameUpload += ufb_metrics_clock() - start;
+		return;
+	}
+
+	if( !(converted = convertBuffer(size)) ) {
+		return;
+	}
+
+	ufb_convert_rows(ufb, pixels, pitch, converted, rect->w * sizeof(uint32_t),
+	                 rect->w, rect->h);
+	converted_at = ufb_metrics_clock();
+	SDL_UpdateTexture(texture, rect, converted, rect->w * sizeof(uint32_t));
+
+	frameConvert += converted_at - start;
+	frameUpload += ufb_metrics_clock() - start;
+}
+
+/* YUV planes aren't made of rows, so the whole screen is converted at once */
+void uploadYUV( const ufb_scanout_t *scanout )
+{
+	size_t pitch = (size_t)scanout->width * sizeof(uint32_t);
+	uint32_t *converted = convertBuffer((size_t)scanout->width * scanout->height);
+	uint64_t start = ufb_metrics_clock();
+	uint64_t converted_at;
+	SDL_Rect rect;
+
+	if( !converted ) {
+		return;
+	}
+
+	ufb_convert_scanout(ufb, scanout, converted, pitch);
+	converted_at = ufb_metrics_clock();
+
+	rect.x = 0;
+	rect.y = 0;
+	rect.w = scanout->width < screenWidth ? scanout->width : screenWidth;
+	rect.h = scanout->height < screenHeight ? scanout->height : screenHeight;
+	SDL_UpdateTexture(texture, &rect, converted, pitch);
+
+	frameBytes += (size_t)rect.w * rect.h * sizeof(uint32_t);
+	frameConvert += converted_at - start;
+	frameUpload += ufb_metrics_clock() - start;
+}
+
+int sameScanout( const ufb_scanout_t *a, const ufb_scanout_t *b )
+{
+	return a->width == b->width && a->height == b->height &&
+	       a->virtual_width == b->virtual_width &&
+	       a->virtual_height == b->virtual_height &&
+	       a->xoffset == b->xoffset && a->yoffset == b->yoffset &&
+	       a->pitch == b->pitch && a->bpp == b->bpp &&
+	       a->ywrap == b->ywrap && a->fourcc == b->fourcc;
+}
+
+/* uploads the part of damage, in virtual screen pixels, shown by region */
+void uploadDamage( const ufb_scanout_t *scanout, const ufb_region_t *region,
+                   const ufb_rect_t *damage )
+{
+	uint8_t *vmem = ufb_get_vmem(ufb);
+	int top = scanout->yoffset + region->y;
+	int width = scanout->width < screenWidth ? scanout->width : screenWidth;
+	int x0, x1, y0, y1;
+	SDL_Rect rect;
+
+	if( scanout->ywrap && top >= scanout->virtual_height ) {
+		top -= scanout->virtual_height;
+	}
+
+	x0 = damage->x > scanout->xoffset ? damage->x : scanout->xoffset;
+	x1 = damage->x + damage->width;
+	if( x1 > scanout->xoffset + width ) {
+		x1 = scanout->xoffset + width;
+	}
+
+	y0 = damage->y > top ? damage->y : top;
+	y1 = damage->y + damage->height;
+	if( y1 > top + region->height ) {
+		y1 = top + region->height;
+	}
+
+	rect.x = x0 - scanout->xoffset;
+	rect.y = region->y + y0 - top;
+	rect.w = x1 - x0;
+	rect.h = y1 - y0;
+	if( rect.y + rect.h > screenHeight ) {
+		rect.h = screenHeight - rect.y;
+	}
+
+	if( rect.w <= 0 || rect.h <= 0 ) {
+		return;
+	}
+
+	updateTexture(&rect, vmem + (size_t)y0 * scanout->pitch +
+	                     (size_t)x0 * scanout->bpp / 8, scanout->pitch);
+}
+
+/*
+ * Damage is taken every frame rather than on UFB_EVENT_DAMAGE, so a
+ * dropped event can't leave some behind.  A full list may have merged
+ * away what it covered;  uploading it all is as cheap.
+ */
+void uploadScanout( void )
+{
+	ufb_scanout_t scanout;
+	ufb_region_t regions[2];
+	ufb_rect_t damage[UFB_MAX_DAMAGE_RECTS];
+	uint8_t *vmem = ufb_get_vmem(ufb);
+	int damaged = 0;
+	int count;
+	int i, j;
+
+	if( UFB_OK != ufb_get_damage(ufb, damage, &damaged) ) {
+		damaged = 0;
+		uploadAll = 1;
+	}
+
+	for( i = 0; pyramid && i < damaged; i++ ) {
+		ufb_pyramid_damage(pyramid, &damage[i]);
+	}
+
+	if( UFB_OK != ufb_get_scanout(ufb, &scanout) ) {
+		SDL_UpdateTexture(texture, NULL, vmem, SCREEN_PITCH);
+		frameBytes += SCREEN_SIZE;
+		uploadAll = 1;
+		return;
+	}
+
+	/* the daemon's mapping lags damage by a frame while snapshotting */
+	if( !sameScanout(&scanout, &shownScanout) || scanout.untracked ||
+	    snapshot || damaged == UFB_MAX_DAMAGE_RECTS ) {
+		uploadAll = 1;
+	}
+	shownScanout = scanout;
+
+	if( scanout.fourcc ) {
+		uploadYUV(&scanout);
+		return;
+	}
+
+	count = ufb_scanout_regions(&scanout, regions);
+
+	for( i = 0; i < count; i++ ) {
+		SDL_Rect rect;
+
+		if( regions[i].y >= screenHeight ) {
+			break;
+		}
+
+		if( !uploadAll ) {
+			for( j = 0; j < damaged; j++ ) {
+				uploadDamage(&scanout, &regions[i], &damage[j]);
+			}
+			continue;
+		}
+
+		rect.x = 0;
+		rect.y = regions[i].y;
+		rect.w = scanout.width < screenWidth ? scanout.width : screenWidth;
+		rect.h = regions[i].height;
+		if( rect.y + rect.h > screenHeight ) {
+			rect.h = screenHeight - rect.y;
+		}
+
+		updateTexture(&rect, vmem + regions[i].offset, scanout.pitch);
+	}
+
+	uploadAll = 0;
+}
+
+void updateCursor( const ufb_cursor_event_t *event )
+{
+	static uint32_t pixels[UFB_CURSOR_MAX_SIZE * UFB_CURSOR_MAX_SIZE];
+	int width, height;
+
+	cursor = *event;
+
+	if( cursor.image_seq == cursorSeq || !cursorTexture ) {
+		return;
+	}
+
+	if( UFB_OK == ufb_get_cursor_image(ufb, pixels, &width, &height,
+	                                   &cursorSeq) && width && height ) {
+		SDL_Rect rect = { 0, 0, width, height };
+
+		SDL_UpdateTexture(cursorTexture, &rect, pixels,
+		                  width * sizeof(uint32_t));
+	}
+}
+
+/*
+ * The console cursor lives in its own plane, so blinking and moving it
+ * doesn't touch vmem; it's only drawn here.
+ */
+void presentCursor( void )
+{
+	ufb_scanout_t scanout;
+	SDL_Rect src, dst;
+
+	if( !cursor.enable || !cursor.width || !cursor.height ||
+	    UFB_OK != ufb_get_scanout(ufb, &scanout) ) {
+		return;
+	}
+
+	src.x = 0;
+	src.y = 0;
+	src.w = cursor.width;
+	src.h = cursor.height;
+
+	dst.x = cursor.x - scanout.xoffset;
+	dst.y = cursor.y - scanout.yoffset;
+	if( dst.y < 0 && scanout.ywrap ) {
+		dst.y += scanout.virtual_height;
+	}
+	dst.w = cursor.width;
+	dst.h = cursor.height;
+
+	SDL_RenderCopy(displayRenderer, cursorTexture, &src, &dst);
+}
+
 void writeTexture( void )
 {
-	SDL_UpdateTexture(texture, NULL, ufb_get_vmem(ufb), SCREEN_PITCH);
+	uint64_t start;
+	uint64_t seq;
+
+	frameConvert = frameUpload = frameBytes = 0;
+
+	/* client frames in vmem now are the ones this frame shows */
+	ufb_present_latch(ufb, &seq);
+
+	uploadScanout();
+
+	start = ufb_metrics_clock();
 
 	SDL_RenderClear(displayRenderer);
 	SDL_RenderCopy(displayRenderer, texture, NULL, NULL);
+	presentCursor();
 	SDL_RenderPresent(displayRenderer);
+
+	if( seq ) {
+		ufb_present_ack(ufb, seq, 0);
+	}
+
+	ufb_metrics_time(metrics, UFB_HISTOGRAM_PRESENT_TIME, start);
+	ufb_metrics_observe(metrics, UFB_HISTOGRAM_UPLOAD_TIME, frameUpload);
+	ufb_metrics_observe(metrics, UFB_HISTOGRAM_UPLOAD_BYTES, frameBytes);
+	if( frameConvert ) {
+		ufb_metrics_observe(metrics, UFB_HISTOGRAM_CONVERT_TIME, frameConvert);
+	}
 }
 
-int main()
+void presentBlank( void )
+{
+	SDL_SetRenderDrawColor(displayRenderer, 0, 0, 0, 255);
+	SDL_RenderClear(displayRenderer);
+	SDL_RenderPresent(displayRenderer);
+}
+
+/* the fd the window system's events reach SDL on, -1 if it can't say */
+int sdlEventFd( void )
+{
+#ifdef SDL_VIDEO_DRIVER_X11
+	SDL_SysWMinfo info;
+
+	SDL_VERSION(&info.version);
+	if( SDL_GetWindowWMInfo(displayWindow, &info) &&
+	    info.subsystem == SDL_SYSWM_X11 ) {
+		return ConnectionNumber(info.info.x11.display);
+	}
+#endif
+
+	return -1;
+}
+
+/*
+ * Sleeps until the driver has an event (the unblank among them) or the
+ * window has something for SDL, without any timeout:  the driver's timer
+ * paces vblank waiters meanwhile.
+ */
+void waitBlanked( int sdl_fd )
+{
+	struct pollfd fds[2];
+
+	/* SDL may already have read events off its fd */
+	SDL_PumpEvents();
+	if( SDL_HasEvents(SDL_FIRSTEVENT, SDL_LASTEVENT) ) {
+		return;
+	}
+
+	if( sdl_fd < 0 ) {
+		ufb_wait_event(ufb, BLANK_POLL_MS);
+		return;
+	}
+
+	if( ufb_wait_event(ufb, 0) ) {
+		return;
+	}
+
+	fds[0].fd = ufb_get_fd(ufb);
+	fds[0].events = POLLIN;
+	fds[1].fd = sdl_fd;
+	fds[1].events = POLLIN;
+
+	while( -1 == poll(fds, 2, -1) && EINTR == errno ) {
+	}
+}
+
+/*
+ * Resizing the window resizes the framebuffer to match:  vmem grows or
+ * shrinks in place and the console follows the new mode.  The texture is
+ * only replaced once the driver confirms with UFB_EVENT_RESIZE.
+ */
+void resizeScreen( int width, int height )
+{
+	ufb_err_t status;
+
+	status = ufb_resize(ufb, width, height,
+	                    (size_t)width * height * sizeof(uint32_t));
+	if( UFB_OK != status ) {
+		fprintf(stderr, "Error resizing to %dx%d:  %s\n", width, height,
+		        ufb_strerror(status));
+	}
+}
+
+void recreateTexture( int width, int height )
+{
+	SDL_Texture *resized;
+
+	if( width == screenWidth && height == screenHeight ) {
+		return;
+	}
+
+	resized = SDL_CreateTexture(displayRenderer,
+	                            SDL_PIXELFORMAT_ARGB8888,
+	                            SDL_TEXTUREACCESS_STREAMING,
+	                            width, height);
+	if( !resized ) {
+		return;
+	}
+
+	SDL_DestroyTexture(texture);
+	texture = resized;
+	screenWidth = width;
+	screenHeight = height;
+	uploadAll = 1;
+}
+
+void usage( const char *name )
+{
+	fprintf(stderr, "Usage:  %s [-m] [-H] [-t TRACE_FILE] [-v SOCKET] [-c MS] [-n NODE] [-i NAME]\n"
+	                "        [-M SOCKET] [-F FILE] [-s] [-P NAME]\n", name);
+	fprintf(stderr, "  -m  back vmem with a memfd owned by this process\n");
+	fprintf(stderr, "  -H  use hugetlb pages for the memfd (implies -m)\n");
+	fprintf(stderr, "  -t  record client activity for fbreplay\n");
+	fprintf(stderr, "  -v  serve the screen to local viewers (fbview) on SOCKET\n");
+	fprintf(stderr, "  -c  print what each client process did, every MS\n");
+	fprintf(stderr, "  -n  put vmem on NUMA node NODE and present from its CPUs\n");
+	fprintf(stderr, "  -i  drive persistent instance NAME, creating it if needed;  it\n"
+	                "      and its clients carry on when sdlfb exits or restarts\n");
+	fprintf(stderr, "  -M  serve Prometheus metrics on SOCKET\n");
+	fprintf(stderr, "  -F  write Prometheus metrics to FILE every second\n");
+	fprintf(stderr, "  -s  present each frame as it was at the last vblank, so\n"
+	                "      single buffered clients don't tear, for a fault per\n"
+	                "      page they touch each frame\n");
+	fprintf(stderr, "  -P  publish thumbnails of the screen as shared memory NAME\n");
+}
+
+int main( int argc, char **argv )
 {
 	int iterations = 0;
 	ufb_err_t status;
+	ufb_params_t params;
+	const char *trace_filename = NULL;
+	const char *view_socket = NULL;
+	const char *metrics_socket = NULL;
+	const char *metrics_file = NULL;
+	const char *pyramid_name = NULL;
+	uint64_t frame_start = 0;
+	uint64_t metrics_written = 0;
+	int redraws;
+	ufb_scanout_t scanout;
+	int client_interval = 0;
+	int pin = 0;
+	int sdl_fd;
+	int opt;
+
+	ufb_params_init(&params, WIDTH, HEIGHT, VMEM_SIZE);
 
-	if( UFB_OK != (status = ufb_init(&ufb, WIDTH, HEIGHT, VMEM_SIZE)) ) {
+	while( -1 != (opt = getopt(argc, argv, "mHt:v:c:n:i:M:F:sP:")) ) {
+		switch( opt ) {
+			case 'm':
+				params.flags |= UFB_INIT_MEMFD;
+				break;
+			case 'H':
+				params.flags |= UFB_INIT_MEMFD | UFB_INIT_HUGETLB;
+				break;
+			case 't':
+				trace_filename = optarg;
+				break;
+			case 'v':
+				view_socket = optarg;
+				break;
+			case 'c':
+				client_interval = atoi(optarg);
+				break;
+			case 'n':
+				params.node = atoi(optarg);
+				pin = 1;
+				break;
+			case 'i':
+				params.instance = optarg;
+				params.flags |= UFB_INIT_CREATE;
+				break;
+			case 'M':
+				metrics_socket = optarg;
+				break;
+			case 'F':
+				metrics_file = optarg;
+				break;
+			case 's':
+				snapshot = 1;
+				break;
+			case 'P':
+				pyramid_name = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if( UFB_OK != (status = ufb_init_params(&ufb, &params)) ) {
 		SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR,
 		                         "Error Initializing Device",
 		                         ufb_strerror(status),
@@ -47,11 +540,66 @@ int main()
 		return 1;
 	}
 
+	if( pin && UFB_OK != (status = ufb_pin_thread(ufb, pthread_self())) ) {
+		fprintf(stderr, "Error pinning to node %d:  %s\n", ufb_get_node(ufb),
+		        ufb_strerror(status));
+	}
+
+	if( trace_filename &&
+	    UFB_OK != (status = ufb_trace_start(ufb, trace_filename, TRACE_SIZE)) ) {
+		fprintf(stderr, "Error starting trace:  %s\n", ufb_strerror(status));
+		ufb_free(ufb);
+		return 1;
+	}
+
+	if( view_socket &&
+	    UFB_OK != (status = ufb_view_server_create(&viewServer, ufb, view_socket)) ) {
+		fprintf(stderr, "Error creating view server:  %s\n", ufb_strerror(status));
+		ufb_free(ufb);
+		return 1;
+	}
+
+	if( pyramid_name &&
+	    UFB_OK != (status = ufb_pyramid_create(&pyramid, ufb, PYRAMID_LEVELS,
+	                                           pyramid_name)) ) {
+		fprintf(stderr, "Error publishing thumbnails:  %s\n",
+		        ufb_strerror(status));
+		ufb_free(ufb);
+		return 1;
+	}
+
+	if( pyramid ) {
+		ufb_pyramid_set_refresh(pyramid, PYRAMID_REFRESH_MS);
+	}
+
+	if( (metrics_socket || metrics_file) &&
+	    UFB_OK != (status = ufb_metrics_create(&metrics, params.instance)) ) {
+		fprintf(stderr, "Error creating metrics:  %s\n", ufb_strerror(status));
+		ufb_free(ufb);
+		return 1;
+	}
+
+	if( metrics_socket &&
+	    UFB_OK != (status = ufb_metrics_serve(metrics, metrics_socket)) ) {
+		fprintf(stderr, "Error serving metrics:  %s\n", ufb_strerror(status));
+		ufb_metrics_free(metrics);
+		ufb_free(ufb);
+		return 1;
+	}
+
+	if( client_interval ) {
+		ufb_client_events(ufb, client_interval);
+	}
+
+	if( snapshot && UFB_OK != (status = ufb_snapshot(ufb, 1)) ) {
+		fprintf(stderr, "snapshots:  %s\n", ufb_strerror(status));
+	}
+
 	SDL_Init(SDL_INIT_VIDEO);
 
 	displayWindow = SDL_CreateWindow("usrfb", SDL_WINDOWPOS_UNDEFINED, 
 	                                 SDL_WINDOWPOS_UNDEFINED, WIDTH, HEIGHT,
-	                                 SDL_WINDOW_OPENGL);
+	                                 SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE);
 	displayRenderer = SDL_CreateRenderer(displayWindow, -1, 
 	                                     SDL_RENDERER_ACCELERATED |
 	                                     SDL_RENDERER_PRESENTVSYNC);
@@ -61,23 +609,139 @@ int main()
 	                            SDL_TEXTUREACCESS_STREAMING,
 	                            WIDTH, HEIGHT);
 
+	cursorTexture = SDL_CreateTexture(displayRenderer,
+	                                  SDL_PIXELFORMAT_ARGB8888,
+	                                  SDL_TEXTUREACCESS_STREAMING,
+	                                  UFB_CURSOR_MAX_SIZE, UFB_CURSOR_MAX_SIZE);
+
+	if( cursorTexture ) {
+		ufb_cursor_plane(ufb, 1);
+	}
+
+	sdl_fd = sdlEventFd();
+
+	/* a persistent instance may have been left in another mode */
+	if( UFB_OK == ufb_get_scanout(ufb, &scanout) ) {
+		recreateTexture(scanout.width, scanout.height);
+	}
+
 	while( 1 ) {
 		SDL_Event e;
+		ufb_event_t ue;
+
 		if( SDL_PollEvent(&e) ) {
 			if(e.type == SDL_QUIT) {
 				break;
 			}
+
+			if( e.type == SDL_WINDOWEVENT &&
+			    e.window.event == SDL_WINDOWEVENT_RESIZED ) {
+				resizeScreen(e.window.data1, e.window.data2);
+			}
+		}
+
+		redraws = 0;
+
+		while( ufb_poll_event(ufb, &ue) ) {
+			/* a frame is presented every time round, so these just fold in */
+			if( ue.type == UFB_EVENT_DAMAGE || ue.type == UFB_EVENT_CMAP ||
+			    ue.type == UFB_EVENT_CURSOR || ue.type == UFB_EVENT_PRESENT ) {
+				redraws++;
+			}
+
+			/* every pixel may look different without having been written */
+			if( ue.type == UFB_EVENT_CMAP ) {
+				uploadAll = 1;
+				if( pyramid ) {
+					ufb_pyramid_damage_all(pyramid);
+				}
+			}
+
+			if( ue.type == UFB_EVENT_BLANK && ue.blank.level ) {
+				presentBlank();
+			} else if( ue.type == UFB_EVENT_BLANK ) {
+				uploadAll = 1;
+			} else if( ue.type == UFB_EVENT_RESIZE && ue.resize.width ) {
+				recreateTexture(ue.resize.width, ue.resize.height);
+			} else if( ue.type == UFB_EVENT_CURSOR ) {
+				updateCursor(&ue.cursor);
+			} else if( ue.type == UFB_EVENT_CLIENT ) {
+				fprintf(stderr, "client %d (%s):  %llu bytes written, "
+				        "%llu px damage, %u pans, %u vsync waits, %u mmaps\n",
+				        ue.client.pid, ue.client.comm,
+				        (unsigned long long)ue.client.write_bytes,
+				        (unsigned long long)ue.client.damage,
+				        ue.client.pans, ue.client.vsync_waits, ue.client.mmaps);
+			}
+		}
+
+		if( redraws > 1 ) {
+			ufb_metrics_count(metrics, UFB_COUNTER_FRAMES_COALESCED, redraws - 1);
+		}
+
+		ufb_metrics_update(metrics);
+
+		if( metrics_file &&
+		    ufb_metrics_clock() - metrics_written >= METRICS_FILE_INTERVAL ) {
+			ufb_metrics_write_file(metrics, metrics_file);
+			metrics_written = ufb_metrics_clock();
+		}
+
+		/*
+		 * Nothing to show while blanked; the driver paces vblank waiters
+		 * itself, so just sleep until something changes.
+		 */
+		if( ufb_is_blanked(ufb) ) {
+			ufb_metrics_count(metrics, UFB_COUNTER_FRAMES_SKIPPED, 1);
+			waitBlanked(sdl_fd);
+			frame_start = 0;
+			continue;
 		}
 
 		//setData( iterations );
 
 		writeTexture();
 
+		if( frame_start ) {
+			frame_start = ufb_metrics_time(metrics, UFB_HISTOGRAM_FRAME_TIME,
+			                               frame_start);
+		} else {
+			frame_start = ufb_metrics_clock();
+		}
+
+		/* the frame this vblank starts is kept stable for the next one */
+		if( snapshot ) {
+			ufb_snapshot_arm(ufb);
+		}
+
 		ufb_signal_vblank(ufb);
 
+		ufb_metrics_time(metrics, UFB_HISTOGRAM_VBLANK_LATENCY, frame_start);
+		ufb_metrics_count(metrics, UFB_COUNTER_FRAMES, 1);
+
+		if( viewServer ) {
+			ufb_view_server_update(viewServer);
+		}
+
+		if( pyramid ) {
+			ufb_pyramid_update(pyramid);
+		}
+
+		if( trace_filename ) {
+			ufb_trace_flush(ufb);
+		}
+
 		iterations++;
 	}
 
+	if( viewServer ) {
+		ufb_view_server_free(viewServer);
+	}
+
+	ufb_pyramid_free(pyramid);
+
+	ufb_metrics_free(metrics);
+
 	ufb_free(ufb);
 
 	return 0;